@@ -0,0 +1,622 @@
+#include "asset_baker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+#include "fast_png.hpp"
+#include "hash.hpp"
+#include "job_system.hpp"
+#include "mesh.hpp"
+#include "obj_loader.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const uint32_t MESH_MAGIC = 0x48534d42;     // "BMSH"
+const uint32_t TEXTURE_MAGIC = 0x58455442;  // "BTEX"
+const uint32_t FORMAT_VERSION = 1;  // bump to rebuild every output
+const char* MANIFEST_NAME = "bake_manifest.txt";
+
+using Clock = std::chrono::steady_clock;
+
+double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+}
+
+// hash 0 = missing or unreadable
+struct FileState {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+};
+
+// A texture a model needs: source path relative to the input directory
+struct TextureRef {
+    std::string source;
+    TextureUsage usage;
+
+    bool operator<(const TextureRef& other) const {
+        return std::tie(source, usage) < std::tie(other.source, other.usage);
+    }
+};
+
+struct ModelRecord {
+    uint64_t key = 0;
+    std::vector<std::string> mtls;
+    std::vector<TextureRef> textures;
+};
+
+// Paths are relative to the input directory, with forward slashes
+struct Manifest {
+    std::unordered_map<std::string, FileState> files;
+    std::map<std::string, ModelRecord> models;  // by obj
+    std::map<std::string, uint64_t> textures;   // key by output
+};
+
+const char* usage_name(TextureUsage usage) {
+    switch (usage) {
+        case TextureUsage::Color: return "color";
+        case TextureUsage::Mask: return "mask";
+        case TextureUsage::Height: return "normal";  // baked as a normal map
+        case TextureUsage::Normal: return "normal";
+    }
+    return "?";
+}
+
+std::string mesh_output(const std::string& obj) { return obj + ".mesh"; }
+
+std::string texture_output(const TextureRef& texture) {
+    return texture.source + "." + usage_name(texture.usage) + ".tex";
+}
+
+// Rest of the line after the fields already read, for paths with spaces
+std::string rest_of_line(std::istringstream& fields) {
+    std::string rest;
+    std::getline(fields >> std::ws, rest);
+    return rest;
+}
+
+Manifest read_manifest(const fs::path& path) {
+    Manifest manifest;
+    std::ifstream file(path);
+    std::string line;
+    if (!file.is_open() || !std::getline(file, line) ||
+        line != "bake-manifest " + std::to_string(FORMAT_VERSION)) {
+        return manifest;  // missing or from another version: rebuild all
+    }
+    ModelRecord* model = nullptr;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string type;
+        fields >> type;
+        if (type == "file") {
+            FileState state;
+            fields >> state.size >> state.mtime >> std::hex >> state.hash >>
+                std::dec;
+            manifest.files[rest_of_line(fields)] = state;
+        } else if (type == "model") {
+            uint64_t key;
+            fields >> std::hex >> key >> std::dec;
+            model = &manifest.models[rest_of_line(fields)];
+            model->key = key;
+        } else if (type == "mtl" && model) {
+            model->mtls.push_back(rest_of_line(fields));
+        } else if (type == "texture" && model) {
+            int usage;
+            fields >> usage;
+            model->textures.push_back(
+                {rest_of_line(fields), TextureUsage(usage)});
+        } else if (type == "output") {
+            uint64_t key;
+            fields >> std::hex >> key >> std::dec;
+            manifest.textures[rest_of_line(fields)] = key;
+        }
+    }
+    return manifest;
+}
+
+bool write_manifest(const fs::path& path, const Manifest& manifest) {
+    std::string tmp_path = path.string() + ".tmp";
+    {
+        std::ofstream file(tmp_path);
+        if (!file.is_open()) {
+            return false;
+        }
+        file << "bake-manifest " << FORMAT_VERSION << "\n";
+        // Sorted so unchanged libraries give identical manifests
+        std::map<std::string, FileState> files(manifest.files.begin(),
+                                               manifest.files.end());
+        for (auto& [name, state] : files) {
+            file << "file " << state.size << " " << state.mtime << " "
+                 << std::hex << state.hash << std::dec << " " << name << "\n";
+        }
+        for (auto& [name, model] : manifest.models) {
+            file << "model " << std::hex << model.key << std::dec << " "
+                 << name << "\n";
+            for (auto& mtl : model.mtls) {
+                file << "mtl " << mtl << "\n";
+            }
+            for (auto& texture : model.textures) {
+                file << "texture " << int(texture.usage) << " "
+                     << texture.source << "\n";
+            }
+        }
+        for (auto& [name, key] : manifest.textures) {
+            file << "output " << std::hex << key << std::dec << " " << name
+                 << "\n";
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    return !ec;
+}
+
+// Size and mtime from a stat; contents are only read (and hashed) if they
+// differ from what the manifest saw
+FileState current_state(const fs::path& path, const FileState* previous) {
+    FileState state;
+    std::error_code ec;
+    state.size = fs::file_size(path, ec);
+    if (ec) return {};
+    state.mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    if (ec) return {};
+    if (previous && previous->hash && previous->size == state.size &&
+        previous->mtime == state.mtime) {
+        state.hash = previous->hash;
+        return state;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> contents(state.size);
+    if (!file.read(contents.data(), contents.size())) return {};
+    state.hash = fnv1a(contents.data(), contents.size());
+    state.hash += state.hash == 0;  // 0 means missing
+    return state;
+}
+
+uint64_t model_key(const std::string& obj, const std::vector<std::string>& mtls,
+                   const std::unordered_map<std::string, FileState>& files) {
+    uint64_t key = fnv1a(&FORMAT_VERSION, sizeof(FORMAT_VERSION));
+    for (const std::string* path : {&obj}) {
+        auto found = files.find(*path);
+        if (found == files.end() || !found->second.hash) return 0;
+        key = fnv1a(&found->second.hash, sizeof(uint64_t), key);
+    }
+    for (auto& mtl : mtls) {
+        auto found = files.find(mtl);
+        if (found == files.end() || !found->second.hash) return 0;
+        key = fnv1a(&found->second.hash, sizeof(uint64_t), key);
+    }
+    return key;
+}
+
+uint64_t texture_key(const TextureRef& texture, uint64_t source_hash,
+                     const BakeSettings& settings) {
+    if (!source_hash) return 0;
+    uint64_t key = fnv1a(&FORMAT_VERSION, sizeof(FORMAT_VERSION));
+    key = fnv1a(&source_hash, sizeof(source_hash), key);
+    key = fnv1a(&texture.usage, sizeof(texture.usage), key);
+    if (texture.usage == TextureUsage::Color) {
+        key = fnv1a(&settings.bc7, sizeof(settings.bc7), key);
+    } else if (texture.usage == TextureUsage::Height) {
+        key = fnv1a(&settings.normal_maps.strength,
+                    sizeof(settings.normal_maps.strength), key);
+        key = fnv1a(&settings.normal_maps.sobel,
+                    sizeof(settings.normal_maps.sobel), key);
+    }
+    return key;
+}
+
+// Binary output ----------------------------------------------------------------
+
+struct Writer {
+    std::ofstream file;
+
+    template <typename T>
+    void write(const T& value) {
+        file.write((const char*)&value, sizeof(T));
+    }
+    void write_bytes(const void* data, size_t size) {
+        file.write((const char*)data, size);
+    }
+    void write_string(const std::string& value) {
+        write(uint32_t(value.size()));
+        write_bytes(value.data(), value.size());
+    }
+};
+
+// Writes through a temporary so an interrupted bake never leaves a
+// truncated output that looks up to date
+template <typename Fn>
+void write_output(const fs::path& path, Fn&& fill) {
+    fs::create_directories(path.parent_path());
+    fs::path tmp_path = path.string() + ".tmp";
+    {
+        Writer writer;
+        writer.file.open(tmp_path, std::ios::binary);
+        if (!writer.file.is_open()) {
+            throw std::runtime_error("Could not write " + tmp_path.string());
+        }
+        fill(writer);
+        if (!writer.file) {
+            throw std::runtime_error("Could not write " + tmp_path.string());
+        }
+    }
+    fs::rename(tmp_path, path);
+}
+
+std::string relative_to(const fs::path& root, const std::string& path) {
+    return fs::path(path).lexically_normal().lexically_relative(root).generic_string();
+}
+
+// Parses one model and writes its .mesh; returns its dependencies
+ModelRecord bake_model(const fs::path& input, const fs::path& output,
+                       const std::string& obj) {
+    TRACE_SCOPE("bake_model");
+    ObjLoader loader;
+    loader.decode_textures = false;  // baked in their own jobs
+    loader.parse_obj_file((input / obj).string().c_str());
+    Mesh mesh(loader);
+
+    ModelRecord record;
+    for (auto& mtl : loader.loaded_materials) {
+        record.mtls.push_back(relative_to(input, mtl));
+    }
+    std::sort(record.mtls.begin(), record.mtls.end());
+
+    // Materials in name order so the output doesn't depend on hashing
+    std::map<std::string, Material*> by_name;
+    for (auto& [name, material] : loader.materials) {
+        by_name[name] = material.get();
+    }
+    std::unordered_map<const Material*, int32_t> material_index;
+    for (auto& [name, material] : by_name) {
+        material_index[material] = int32_t(material_index.size());
+    }
+    auto index_of = [&](const Material* material) {
+        return material ? material_index.at(material) : -1;
+    };
+
+    std::vector<size_t> order(mesh.triangles.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return index_of(mesh.triangles[a].material) <
+               index_of(mesh.triangles[b].material);
+    });
+
+    struct Submesh {
+        int32_t material;
+        uint32_t first_index;
+        uint32_t index_count;
+        BoundingBox bounds;
+    };
+    std::vector<Submesh> submeshes;
+    std::vector<uint32_t> indices;
+    indices.reserve(mesh.triangles.size() * 3);
+    for (size_t i : order) {
+        auto& triangle = mesh.triangles[i];
+        int32_t material = index_of(triangle.material);
+        if (submeshes.empty() || submeshes.back().material != material) {
+            submeshes.push_back({material, uint32_t(indices.size()), 0, {}});
+        }
+        for (int v = 0; v < 3; v++) {
+            indices.push_back(triangle.vertices[v]);
+            submeshes.back().bounds.add_point(
+                mesh.positions[triangle.vertices[v]]);
+        }
+        submeshes.back().index_count += 3;
+    }
+
+    // Texture maps are referenced by their baked outputs
+    auto map_output = [&](const std::shared_ptr<TextureMap>& map,
+                          TextureUsage usage) -> std::string {
+        if (!map || map->path.empty()) return "";
+        TextureRef texture{relative_to(input, map->path), usage};
+        record.textures.push_back(texture);
+        return texture_output(texture);
+    };
+
+    write_output(output / mesh_output(obj), [&](Writer& out) {
+        out.write(MESH_MAGIC);
+        out.write(FORMAT_VERSION);
+        out.write(uint32_t(mesh.positions.size()));
+        out.write(uint32_t(indices.size()));
+        out.write(uint32_t(submeshes.size()));
+        out.write(uint32_t(by_name.size()));
+        auto write_vec3 = [&](const glm::vec3& v) {
+            out.write(v.x);
+            out.write(v.y);
+            out.write(v.z);
+        };
+        write_vec3(mesh.bounds.min);
+        write_vec3(mesh.bounds.max);
+
+        for (size_t i = 0; i < mesh.positions.size(); i++) {
+            write_vec3(mesh.positions[i]);
+            write_vec3(mesh.normals[i]);
+            out.write(mesh.texcoords[i].x);
+            out.write(mesh.texcoords[i].y);
+        }
+        out.write_bytes(indices.data(), indices.size() * sizeof(uint32_t));
+
+        for (auto& submesh : submeshes) {
+            out.write(submesh.material);
+            out.write(submesh.first_index);
+            out.write(submesh.index_count);
+            write_vec3(submesh.bounds.min);
+            write_vec3(submesh.bounds.max);
+        }
+
+        for (auto& [name, material] : by_name) {
+            out.write_string(name);
+            write_vec3(material->K_a);
+            write_vec3(material->K_d);
+            write_vec3(material->K_s);
+            out.write(material->shininess);
+            out.write(material->transparency);
+            write_vec3(material->transmission_color);
+            out.write(material->ior);
+            out.write_string(map_output(material->ambient_map_filepath,
+                                        TextureUsage::Color));
+            out.write_string(map_output(material->diffuse_map_filepath,
+                                        TextureUsage::Color));
+            out.write_string(map_output(material->specular_map_filepath,
+                                        TextureUsage::Mask));
+            out.write_string(map_output(material->bump_map_filepath,
+                                        TextureUsage::Height));
+        }
+    });
+
+    std::sort(record.textures.begin(), record.textures.end());
+    record.textures.erase(
+        std::unique(record.textures.begin(), record.textures.end(),
+                    [](const TextureRef& a, const TextureRef& b) {
+                        return !(a < b) && !(b < a);
+                    }),
+        record.textures.end());
+    return record;
+}
+
+void bake_texture(const fs::path& input, const fs::path& output,
+                  const TextureRef& texture, const BakeSettings& settings) {
+    TRACE_SCOPE("bake_texture");
+    std::vector<unsigned char> pixels;
+    unsigned width, height;
+    std::string source = (input / texture.source).string();
+    unsigned error = decode_png_rgba(pixels, width, height, source);
+    if (error) {
+        throw std::runtime_error("Decoder error for " + source + ": " +
+                                 lodepng_error_text(error));
+    }
+
+    CompressedTexture compressed;
+    TextureUsage usage = texture.usage;
+    if (usage == TextureUsage::Height) {
+        NormalMap normal_map = height_to_normal_map(
+            pixels.data(), width, height, settings.normal_maps);
+        compressed = compress_normal_map(normal_map);
+        usage = TextureUsage::Normal;
+    } else {
+        bool has_alpha = false;
+        for (size_t i = 3; i < pixels.size() && !has_alpha; i += 4) {
+            has_alpha = pixels[i] != 255;
+        }
+        BlockFormat format = choose_block_format(usage, has_alpha, settings.bc7);
+        compressed = compress_texture(pixels.data(), width, height, format,
+                                      nullptr, false);
+    }
+
+    write_output(output / texture_output(texture), [&](Writer& out) {
+        out.write(TEXTURE_MAGIC);
+        out.write(FORMAT_VERSION);
+        out.write(uint32_t(compressed.format));
+        out.write(uint32_t(usage));
+        out.write(uint32_t(compressed.levels.size()));
+        for (auto& level : compressed.levels) {
+            out.write(uint32_t(level.width));
+            out.write(uint32_t(level.height));
+            out.write(uint32_t(level.data.size()));
+            out.write_bytes(level.data.data(), level.data.size());
+        }
+    });
+}
+
+struct Timing {
+    std::string name;
+    double ms = 0;
+    std::string error;  // empty on success
+};
+
+}  // namespace
+
+BakeResult bake_assets(const std::string& input_dir,
+                       const std::string& output_dir,
+                       const BakeSettings& settings) {
+    auto start = Clock::now();
+    BakeResult result;
+    fs::path input = fs::path(input_dir).lexically_normal();
+    fs::path output = fs::path(output_dir).lexically_normal();
+    fs::create_directories(output);
+
+    std::vector<std::string> objs;
+    for (auto& entry : fs::recursive_directory_iterator(input)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".obj") {
+            objs.push_back(entry.path().lexically_relative(input).generic_string());
+        }
+    }
+    std::sort(objs.begin(), objs.end());
+    result.models = objs.size();
+
+    Manifest previous;
+    if (!settings.force) {
+        previous = read_manifest(output / MANIFEST_NAME);
+    }
+    Manifest next;
+    JobSystem pool(std::max(settings.jobs - 1, 0));
+
+    // Current state of every input, in parallel: mostly just stats
+    auto refresh = [&](const std::vector<std::string>& paths) {
+        std::vector<FileState> states(paths.size());
+        pool.parallel_for(paths.size(), [&](size_t i) {
+            auto found = previous.files.find(paths[i]);
+            states[i] = current_state(
+                input / paths[i],
+                found == previous.files.end() ? nullptr : &found->second);
+        }, 16);
+        for (size_t i = 0; i < paths.size(); i++) {
+            next.files[paths[i]] = states[i];
+        }
+    };
+    {
+        std::set<std::string> known(objs.begin(), objs.end());
+        for (auto& obj : objs) {
+            auto found = previous.models.find(obj);
+            if (found == previous.models.end()) continue;
+            known.insert(found->second.mtls.begin(), found->second.mtls.end());
+            for (auto& texture : found->second.textures) {
+                known.insert(texture.source);
+            }
+        }
+        refresh(std::vector<std::string>(known.begin(), known.end()));
+    }
+
+    // Models whose obj or mtls changed (or whose output is gone)
+    std::vector<std::string> dirty_models;
+    for (auto& obj : objs) {
+        auto found = previous.models.find(obj);
+        if (found != previous.models.end() && found->second.key &&
+            model_key(obj, found->second.mtls, next.files) == found->second.key &&
+            fs::exists(output / mesh_output(obj))) {
+            next.models[obj] = found->second;
+        } else {
+            dirty_models.push_back(obj);
+        }
+    }
+
+    std::vector<Timing> timings;
+    std::vector<ModelRecord> baked(dirty_models.size());
+    std::vector<Timing> model_timings(dirty_models.size());
+    pool.parallel_for(dirty_models.size(), [&](size_t i) {
+        auto job_start = Clock::now();
+        model_timings[i].name = dirty_models[i];
+        try {
+            baked[i] = bake_model(input, output, dirty_models[i]);
+        } catch (const std::exception& e) {
+            model_timings[i].error = e.what();
+        }
+        model_timings[i].ms = ms_since(job_start);
+    });
+
+    std::vector<std::string> new_dependencies;
+    for (size_t i = 0; i < dirty_models.size(); i++) {
+        if (model_timings[i].error.empty()) {
+            result.rebuilt_models++;
+            for (auto& mtl : baked[i].mtls) new_dependencies.push_back(mtl);
+            for (auto& texture : baked[i].textures) {
+                new_dependencies.push_back(texture.source);
+            }
+        } else {
+            result.failed++;
+        }
+        timings.push_back(std::move(model_timings[i]));
+    }
+    new_dependencies.erase(
+        std::remove_if(new_dependencies.begin(), new_dependencies.end(),
+                       [&](const std::string& path) {
+                           return next.files.contains(path);
+                       }),
+        new_dependencies.end());
+    std::sort(new_dependencies.begin(), new_dependencies.end());
+    new_dependencies.erase(
+        std::unique(new_dependencies.begin(), new_dependencies.end()),
+        new_dependencies.end());
+    refresh(new_dependencies);
+    for (size_t i = 0; i < dirty_models.size(); i++) {
+        if (timings[timings.size() - dirty_models.size() + i].error.empty()) {
+            baked[i].key = model_key(dirty_models[i], baked[i].mtls, next.files);
+            next.models[dirty_models[i]] = std::move(baked[i]);
+        }
+    }
+
+    // Every texture a model uses, shared between models
+    std::set<TextureRef> textures;
+    for (auto& [obj, model] : next.models) {
+        textures.insert(model.textures.begin(), model.textures.end());
+    }
+    result.textures = textures.size();
+    std::vector<std::pair<TextureRef, uint64_t>> dirty_textures;
+    for (auto& texture : textures) {
+        std::string name = texture_output(texture);
+        uint64_t key =
+            texture_key(texture, next.files[texture.source].hash, settings);
+        auto found = previous.textures.find(name);
+        if (key && found != previous.textures.end() && found->second == key &&
+            fs::exists(output / name)) {
+            next.textures[name] = key;
+        } else {
+            dirty_textures.emplace_back(texture, key);
+        }
+    }
+
+    std::vector<Timing> texture_timings(dirty_textures.size());
+    pool.parallel_for(dirty_textures.size(), [&](size_t i) {
+        auto job_start = Clock::now();
+        texture_timings[i].name = texture_output(dirty_textures[i].first);
+        try {
+            bake_texture(input, output, dirty_textures[i].first, settings);
+        } catch (const std::exception& e) {
+            texture_timings[i].error = e.what();
+        }
+        texture_timings[i].ms = ms_since(job_start);
+    });
+    for (size_t i = 0; i < dirty_textures.size(); i++) {
+        if (texture_timings[i].error.empty() && dirty_textures[i].second) {
+            result.rebuilt_textures++;
+            next.textures[texture_timings[i].name] = dirty_textures[i].second;
+        } else {
+            result.failed++;
+        }
+        timings.push_back(std::move(texture_timings[i]));
+    }
+
+    if (!write_manifest(output / MANIFEST_NAME, next)) {
+        fprintf(stderr, "ERROR: could not write %s\n",
+                (output / MANIFEST_NAME).string().c_str());
+    }
+    result.total_ms = ms_since(start);
+
+    std::sort(timings.begin(), timings.end(),
+              [](const Timing& a, const Timing& b) { return a.ms > b.ms; });
+    for (auto& timing : timings) {
+        if (timing.error.empty()) {
+            fprintf(stdout, "%10.1f ms  %s\n", timing.ms, timing.name.c_str());
+        } else {
+            fprintf(stderr, "ERROR: %s: %s", timing.name.c_str(),
+                    timing.error.c_str());
+            if (timing.error.back() != '\n') fprintf(stderr, "\n");
+        }
+    }
+    fprintf(stdout,
+            "Baked %zu/%zu models, %zu/%zu textures (%zu up to date), %zu "
+            "failed, %d jobs: %.1f ms\n",
+            result.rebuilt_models, result.models, result.rebuilt_textures,
+            result.textures,
+            result.models + result.textures - result.rebuilt_models -
+                result.rebuilt_textures - result.failed,
+            result.failed, pool.thread_count(), result.total_ms);
+    return result;
+}
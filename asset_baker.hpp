@@ -0,0 +1,55 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "normal_map.hpp"
+#include "texture_compression.hpp"
+
+// Offline conversion of OBJ/MTL/PNG assets into GPU-ready files, so the
+// viewer doesn't parse and compress them on every launch.
+//
+// Every .obj under the input directory becomes <output>/<path>.mesh:
+//   uint32 magic "BMSH", version
+//   uint32 vertex, index, submesh and material counts
+//   float bounds min[3], max[3]
+//   vertices: position[3], normal[3], texcoord[2] floats (Rasterizer::VertexData)
+//   indices: uint32, grouped by material, one range per submesh
+//   submeshes: int32 material (-1 = none), uint32 first index, index count,
+//              float bounds min[3], max[3]
+//   materials: name, then K_a[3] K_d[3] K_s[3] shininess transparency
+//              transmission_color[3] ior, then the ambient, diffuse,
+//              specular and bump texture outputs relative to <output>
+//              (strings are uint32 length + bytes, empty = no map)
+//
+// Every texture a material uses becomes <output>/<png path>.<usage>.tex:
+//   uint32 magic "BTEX", version, BlockFormat, TextureUsage, level count
+//   per level: uint32 width, height, byte count, then the blocks
+// Bump maps are stored as BC5 normal maps (TextureUsage::Normal).
+//
+// Dependencies (obj -> mtl -> png) and content hashes are recorded in
+// <output>/bake_manifest.txt. Files whose size and modification time are
+// unchanged aren't even read, so a re-run over an unchanged library only
+// stats its inputs; anything whose inputs' contents changed is rebuilt.
+struct BakeSettings {
+    int jobs = std::max<int>(std::thread::hardware_concurrency(), 1);
+    bool force = false;  // ignore the manifest, rebuild everything
+    bool bc7 = false;    // color maps as BC7 instead of BC1/BC3
+    NormalMapSettings normal_maps;
+};
+
+struct BakeResult {
+    size_t models = 0;
+    size_t textures = 0;
+    size_t rebuilt_models = 0;
+    size_t rebuilt_textures = 0;
+    size_t failed = 0;
+    double total_ms = 0;
+};
+
+// Prints a per-asset timing summary of what was rebuilt
+BakeResult bake_assets(const std::string& input_dir,
+                       const std::string& output_dir,
+                       const BakeSettings& settings);
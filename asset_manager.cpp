@@ -0,0 +1,419 @@
+#include "asset_manager.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "fast_png.hpp"
+#include "hash.hpp"
+#include "job_system.hpp"
+#include "memory_tracker.hpp"
+#include "mesh.hpp"
+#include "trace.hpp"
+
+namespace {
+
+// A mesh keeps the material libraries its triangles point into alive
+struct MeshAsset {
+    std::vector<std::shared_ptr<MaterialLibrary>> libraries;
+    Mesh mesh;
+
+    MeshAsset(ObjLoader& obj, JobSystem* jobs)
+        : libraries(obj.material_libraries), mesh(obj, jobs) {}
+};
+
+size_t mesh_bytes(const Mesh& mesh) {
+    return mesh.positions.capacity() * sizeof(mesh.positions[0]) +
+           mesh.normals.capacity() * sizeof(mesh.normals[0]) +
+           mesh.texcoords.capacity() * sizeof(mesh.texcoords[0]) +
+           mesh.triangles.capacity() * sizeof(mesh.triangles[0]);
+}
+
+void decode_png(const std::vector<unsigned char>& contents,
+                const std::string& path, TextureMap* texture) {
+    TRACE_SCOPE("decode_png");
+    unsigned int error =
+        decode_png_rgba(texture->pixels, texture->width, texture->height,
+                        contents.data(), contents.size());
+    if (error) {
+        throw std::runtime_error("Decoder error for " + path + ": " +
+                                 std::string(lodepng_error_text(error)));
+    }
+}
+
+bool read_file(const std::string& path, std::vector<unsigned char>& contents) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    contents.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    return true;
+}
+
+}  // namespace
+
+AssetManager::AssetManager(AssetBudget budget) : budget(budget) {}
+
+AssetManager::Entry* AssetManager::find(const std::string& path, Kind kind,
+                                        std::string& canonical,
+                                        uint64_t& content_hash,
+                                        std::vector<unsigned char>& contents) {
+    if (Entry* entry = find_path(path, kind, canonical)) {
+        return entry;
+    }
+    if (!read_file(canonical, contents)) {
+        throw std::runtime_error("Failed to open file: " + path + "\n");
+    }
+    content_hash = fnv1a(&kind, sizeof(kind));
+    content_hash = fnv1a(contents.data(), contents.size(), content_hash);
+    return find_content(canonical, kind, content_hash);
+}
+
+AssetManager::Entry* AssetManager::find_path(const std::string& path,
+                                             Kind kind,
+                                             std::string& canonical) {
+    std::error_code error;
+    canonical = std::filesystem::weakly_canonical(path, error).string();
+    if (error) {
+        canonical = path;
+    }
+
+    auto by_name = by_path.find(canonical);
+    if (by_name != by_path.end() && by_name->second->kind == kind) {
+        stats_.path_hits++;
+        touch(by_name->second);
+        return by_name->second;
+    }
+    return nullptr;
+}
+
+AssetManager::Entry* AssetManager::find_content(const std::string& canonical,
+                                                Kind kind,
+                                                uint64_t content_hash) {
+    auto by_hash = by_content.find(content_hash);
+    if (by_hash != by_content.end()) {
+        // Same bytes under another name. Meshes and mtl files name other
+        // files relative to themselves, so only share within a directory.
+        Entry* entry = by_hash->second;
+        bool same_dir = std::filesystem::path(entry->path).parent_path() ==
+                        std::filesystem::path(canonical).parent_path();
+        if (kind == Kind::Texture || same_dir) {
+            stats_.content_hits++;
+            by_path[canonical] = entry;
+            touch(entry);
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+AssetManager::Entry* AssetManager::insert(Kind kind,
+                                          const std::string& canonical,
+                                          uint64_t content_hash,
+                                          std::shared_ptr<void> asset,
+                                          const void* handle,
+                                          size_t ram_bytes) {
+    auto entry = std::make_unique<Entry>();
+    entry->kind = kind;
+    entry->path = canonical;
+    entry->content_hash = content_hash;
+    entry->asset = std::move(asset);
+    entry->handle = handle;
+    Entry* added = entry.get();
+    entries.push_back(std::move(entry));
+
+    by_path[canonical] = added;
+    by_content.try_emplace(content_hash, added);
+    by_asset[handle] = added;
+    set_ram_bytes(added, ram_bytes);
+    touch(added);
+    stats_.loads++;
+    return added;
+}
+
+void AssetManager::set_ram_bytes(Entry* entry, size_t bytes) {
+    stats_.ram_bytes = stats_.ram_bytes - entry->ram_bytes + bytes;
+    entry->ram_bytes = bytes;
+}
+
+void AssetManager::remove(Entry* entry) {
+    stats_.ram_bytes -= entry->ram_bytes;
+    stats_.vram_bytes -= entry->vram_bytes;
+    std::erase_if(by_path, [&](auto& item) { return item.second == entry; });
+    auto by_hash = by_content.find(entry->content_hash);
+    if (by_hash != by_content.end() && by_hash->second == entry) {
+        by_content.erase(by_hash);
+    }
+    by_asset.erase(entry->handle);
+    std::erase_if(entries, [&](auto& item) { return item.get() == entry; });
+}
+
+std::shared_ptr<Mesh> AssetManager::mesh(const std::string& path) {
+    auto cached = [](Entry* entry) {
+        auto asset = std::static_pointer_cast<MeshAsset>(entry->asset);
+        return std::shared_ptr<Mesh>(asset, &asset->mesh);
+    };
+    std::string canonical;
+    if (Entry* entry = find_path(path, Kind::Mesh, canonical)) {
+        return cached(entry);
+    }
+
+    // OBJs can be huge, so they're hashed while parsing rather than read
+    // twice. The same file under another name is then parsed for nothing,
+    // but shared all the same.
+    ObjLoader obj;
+    obj.assets = this;
+    obj.jobs = jobs;
+    obj.parse_obj_file(path.c_str());
+    Kind kind = Kind::Mesh;
+    uint64_t hash = fnv1a(&kind, sizeof(kind));
+    hash = fnv1a(&obj.content_hash, sizeof(obj.content_hash), hash);
+    if (Entry* entry = find_content(canonical, kind, hash)) {
+        return cached(entry);
+    }
+    auto asset = std::make_shared<MeshAsset>(obj, jobs);
+    std::shared_ptr<Mesh> mesh(asset, &asset->mesh);
+    insert(Kind::Mesh, canonical, hash, asset, mesh.get(),
+           mesh_bytes(*mesh));
+    enforce_budgets();
+    return mesh;
+}
+
+std::shared_ptr<MaterialLibrary> AssetManager::material_library(
+    const std::string& path) {
+    std::string canonical;
+    uint64_t hash;
+    std::vector<unsigned char> contents;
+    if (Entry* entry =
+            find(path, Kind::MaterialLibrary, canonical, hash, contents)) {
+        return std::static_pointer_cast<MaterialLibrary>(entry->asset);
+    }
+
+    // Texture paths in the mtl file are relative to it
+    std::filesystem::path file(canonical);
+    std::string dir = file.parent_path().string() + "/";
+    ObjLoader obj;
+    obj.assets = this;
+    obj.jobs = jobs;
+    obj.parse_mtl_file(dir, file.filename().string());
+
+    auto library = std::make_shared<MaterialLibrary>(obj.materials.begin(),
+                                                     obj.materials.end());
+    insert(Kind::MaterialLibrary, canonical, hash, library, library.get(),
+           library->size() * sizeof(Material));
+    enforce_budgets();
+    return library;
+}
+
+std::shared_ptr<TextureMap> AssetManager::texture(const std::string& path) {
+    std::string canonical;
+    uint64_t hash;
+    std::vector<unsigned char> contents;
+    if (Entry* entry = find(path, Kind::Texture, canonical, hash, contents)) {
+        return std::static_pointer_cast<TextureMap>(entry->asset);
+    }
+
+    MemoryScope memory_scope(MemoryTag::Texture);
+    auto texture = std::make_shared<TextureMap>();
+    decode_png(contents, path, texture.get());
+    texture->path = canonical;
+    insert(Kind::Texture, canonical, hash, texture, texture.get(),
+           texture->pixels.capacity());
+    enforce_budgets();
+    return texture;
+}
+
+std::vector<std::shared_ptr<TextureMap>> AssetManager::textures(
+    const std::vector<std::string>& paths) {
+    std::vector<std::shared_ptr<TextureMap>> result(paths.size());
+    if (!jobs || jobs->thread_count() == 1 || paths.size() < 2) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            result[i] = texture(paths[i]);
+        }
+        return result;
+    }
+
+    struct Load {
+        size_t index;  // into paths
+        std::string canonical;
+        uint64_t hash;
+        std::vector<unsigned char> contents;
+    };
+    std::vector<Load> loads;
+    std::vector<std::pair<Load, size_t>> repeats;  // and the load it repeats
+    std::unordered_map<uint64_t, size_t> batch;    // hash -> load
+    for (size_t i = 0; i < paths.size(); i++) {
+        Load load{i, {}, 0, {}};
+        if (Entry* entry = find(paths[i], Kind::Texture, load.canonical,
+                                load.hash, load.contents)) {
+            result[i] = std::static_pointer_cast<TextureMap>(entry->asset);
+            continue;
+        }
+        // find() can't see the rest of the batch yet
+        auto [same, inserted] = batch.emplace(load.hash, loads.size());
+        if (!inserted) {
+            stats_.content_hits++;
+            repeats.emplace_back(std::move(load), same->second);
+            continue;
+        }
+        loads.push_back(std::move(load));
+    }
+
+    jobs->parallel_for(loads.size(), [&](size_t i) {
+        MemoryScope memory_scope(MemoryTag::Texture);
+        auto texture = std::make_shared<TextureMap>();
+        decode_png(loads[i].contents, paths[loads[i].index], texture.get());
+        result[loads[i].index] = std::move(texture);
+    });
+
+    for (auto& load : loads) {
+        auto& texture = result[load.index];
+        texture->path = load.canonical;
+        insert(Kind::Texture, load.canonical, load.hash, texture,
+               texture.get(), texture->pixels.capacity());
+    }
+    for (auto& [load, same] : repeats) {
+        result[load.index] = result[loads[same].index];
+        by_path[load.canonical] = by_asset.at(result[load.index].get());
+    }
+    enforce_budgets();
+    return result;
+}
+
+void AssetManager::texture_uploaded(TextureMap* texture, size_t gpu_bytes) {
+    auto found = by_asset.find(texture);
+    if (found == by_asset.end()) {
+        return;  // not ours
+    }
+    Entry* entry = found->second;
+    stats_.vram_bytes = stats_.vram_bytes - entry->vram_bytes + gpu_bytes;
+    entry->vram_bytes = gpu_bytes;
+    touch(entry);
+    if (budget.release_cpu_after_upload) {
+        std::vector<unsigned char>().swap(texture->pixels);
+        set_ram_bytes(entry, 0);
+        stats_.cpu_releases++;
+    }
+    enforce_budgets();
+}
+
+void AssetManager::texture_used(const TextureMap* texture) {
+    auto found = by_asset.find(texture);
+    if (found != by_asset.end()) {
+        touch(found->second);
+    }
+}
+
+bool AssetManager::ensure_pixels(TextureMap* texture) {
+    if (!texture->pixels.empty()) {
+        return true;
+    }
+    auto found = by_asset.find(texture);
+    if (found == by_asset.end()) {
+        return false;
+    }
+    Entry* entry = found->second;
+    MemoryScope memory_scope(MemoryTag::Texture);
+    std::vector<unsigned char> contents;
+    if (!read_file(entry->path, contents)) {
+        fprintf(stderr, "ERROR: could not reload %s\n", entry->path.c_str());
+        return false;
+    }
+    decode_png(contents, entry->path, texture);
+    set_ram_bytes(entry, texture->pixels.capacity());
+    return true;
+}
+
+void AssetManager::mesh_uploaded(Mesh* mesh) {
+    auto found = by_asset.find(mesh);
+    if (found == by_asset.end() || !budget.release_cpu_after_upload) {
+        return;
+    }
+    // Bounds stay, they're all that's needed after upload. Unlike texture
+    // pixels there's no reloading a mesh in place, so it leaves the cache
+    // and the next mesh() parses it again instead of handing out a hollow
+    // one.
+    std::vector<glm::vec3>().swap(mesh->positions);
+    std::vector<glm::vec3>().swap(mesh->normals);
+    std::vector<glm::vec2>().swap(mesh->texcoords);
+    std::vector<Mesh::Triangle>().swap(mesh->triangles);
+    remove(found->second);
+    stats_.cpu_releases++;
+}
+
+// Least recently used first. Each step frees something, so this ends.
+void AssetManager::enforce_budgets() {
+    auto over_ram = [&] {
+        return budget.ram_bytes && stats_.ram_bytes > budget.ram_bytes;
+    };
+    auto over_vram = [&] {
+        return budget.vram_bytes && stats_.vram_bytes > budget.vram_bytes;
+    };
+    auto unreferenced = [](const Entry* entry) {
+        return entry->asset.use_count() == 1;
+    };
+    // GPU-resident textures can drop their pixels, they can be reloaded
+    auto can_release_cpu = [](const Entry* entry) {
+        return entry->kind == Kind::Texture && entry->vram_bytes &&
+               entry->ram_bytes;
+    };
+
+    while (over_ram() || over_vram()) {
+        Entry* victim = nullptr;
+        for (auto& entry : entries) {
+            bool frees =
+                (over_ram() && entry->ram_bytes &&
+                 (unreferenced(entry.get()) || can_release_cpu(entry.get()))) ||
+                (over_vram() && entry->vram_bytes && release_gpu);
+            if (frees && (!victim || entry->last_used < victim->last_used)) {
+                victim = entry.get();
+            }
+        }
+        if (!victim) {
+            break;  // everything left is in use
+        }
+
+        if (victim->kind == Kind::Texture && victim->vram_bytes &&
+            release_gpu && (over_vram() || unreferenced(victim))) {
+            release_gpu(*static_cast<TextureMap*>(victim->asset.get()));
+            stats_.vram_bytes -= victim->vram_bytes;
+            victim->vram_bytes = 0;
+            stats_.gpu_releases++;
+        }
+        if (unreferenced(victim) && !victim->vram_bytes) {
+            remove(victim);
+            stats_.evictions++;
+        } else if (over_ram() && can_release_cpu(victim)) {
+            auto* texture = static_cast<TextureMap*>(victim->asset.get());
+            std::vector<unsigned char>().swap(texture->pixels);
+            set_ram_bytes(victim, 0);
+            stats_.cpu_releases++;
+        }
+    }
+}
+
+void AssetManager::print_stats(FILE* out) const {
+    size_t counts[3] = {};
+    for (auto& entry : entries) {
+        counts[int(entry->kind)]++;
+    }
+    fprintf(out,
+            "Assets: %zu meshes, %zu material libraries, %zu textures\n"
+            "\tRAM %.2f / %s MB, VRAM %.2f / %s MB\n"
+            "\t%zu loads, %zu path hits, %zu content hits\n"
+            "\t%zu evicted, %zu CPU copies released, %zu GPU copies released\n",
+            counts[int(Kind::Mesh)], counts[int(Kind::MaterialLibrary)],
+            counts[int(Kind::Texture)], stats_.ram_bytes / 1048576.0,
+            budget.ram_bytes
+                ? std::to_string(budget.ram_bytes >> 20).c_str()
+                : "-",
+            stats_.vram_bytes / 1048576.0,
+            budget.vram_bytes
+                ? std::to_string(budget.vram_bytes >> 20).c_str()
+                : "-",
+            stats_.loads, stats_.path_hits, stats_.content_hits,
+            stats_.evictions, stats_.cpu_releases, stats_.gpu_releases);
+}
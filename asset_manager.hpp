@@ -0,0 +1,120 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "materials.hpp"
+
+class JobSystem;
+struct Mesh;
+
+// Materials of one .mtl file, by name
+using MaterialLibrary =
+    std::unordered_map<std::string, std::shared_ptr<Material>>;
+
+struct AssetBudget {
+    size_t ram_bytes = 0;   // 0 = unlimited
+    size_t vram_bytes = 0;  // 0 = unlimited
+    // Drop CPU pixels of textures once they are on the GPU (they're
+    // reloaded from disk if the GPU copy is evicted)
+    bool release_cpu_after_upload = false;
+};
+
+// Shared cache of everything loaded from disk: meshes, material libraries
+// and textures. Assets are keyed by canonical path, and by a hash of the
+// file contents so the same file under another path is shared too.
+//
+// Ownership is plain shared_ptr: the cache holds one reference, so an
+// asset nobody else holds (use_count() == 1) can be evicted. Over budget,
+// least recently used assets go first: unreferenced ones are dropped, and
+// GPU-resident textures lose their CPU pixels (RAM) or their GL texture
+// (VRAM, through release_gpu).
+class AssetManager {
+   public:
+    explicit AssetManager(AssetBudget budget = AssetBudget());
+
+    // Loaders throw std::runtime_error like ObjLoader
+    std::shared_ptr<Mesh> mesh(const std::string& path);
+    std::shared_ptr<MaterialLibrary> material_library(const std::string& path);
+    std::shared_ptr<TextureMap> texture(const std::string& path);
+    // Several at once: the files are read and looked up here, and the
+    // ones not cached are decoded in parallel on jobs
+    std::vector<std::shared_ptr<TextureMap>> textures(
+        const std::vector<std::string>& paths);
+
+    // Rasterizer hooks. texture_uploaded may release the CPU copy;
+    // ensure_pixels reloads it before the next upload.
+    void texture_uploaded(TextureMap* texture, size_t gpu_bytes);
+    void texture_used(const TextureMap* texture);
+    bool ensure_pixels(TextureMap* texture);
+    // Deletes the GL texture and clears gpu_id, set by the rasterizer
+    std::function<void(TextureMap&)> release_gpu;
+
+    // Frees the CPU side of a mesh once the GPU has it, if configured. The
+    // hollow mesh leaves the cache, so the next mesh() call reloads it.
+    void mesh_uploaded(Mesh* mesh);
+
+    // Evicts until both budgets are met (or nothing more can go)
+    void enforce_budgets();
+
+    AssetBudget budget;
+    // If set, meshes dedup their vertices and mtl files decode their
+    // textures on it. Loads themselves still happen on the calling thread.
+    JobSystem* jobs = nullptr;
+
+    struct Stats {
+        size_t loads = 0;
+        size_t path_hits = 0;
+        size_t content_hits = 0;  // same bytes under another path
+        size_t evictions = 0;
+        size_t cpu_releases = 0;
+        size_t gpu_releases = 0;
+        size_t ram_bytes = 0;
+        size_t vram_bytes = 0;
+    };
+    const Stats& stats() const { return stats_; }
+    void print_stats(FILE* out = stdout) const;
+
+   private:
+    enum class Kind { Mesh, MaterialLibrary, Texture };
+
+    struct Entry {
+        Kind kind;
+        std::string path;
+        uint64_t content_hash;
+        std::shared_ptr<void> asset;
+        const void* handle;  // pointer handed out (differs for meshes)
+        size_t ram_bytes = 0;
+        size_t vram_bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    std::vector<std::unique_ptr<Entry>> entries;
+    std::unordered_map<std::string, Entry*> by_path;
+    std::unordered_map<uint64_t, Entry*> by_content;
+    std::unordered_map<const void*, Entry*> by_asset;
+    uint64_t clock = 0;
+    Stats stats_;
+
+    // Cached entry for path (either key), or nullptr with the file's
+    // canonical path, content hash and bytes filled in for the load
+    Entry* find(const std::string& path, Kind kind, std::string& canonical,
+                uint64_t& content_hash, std::vector<unsigned char>& contents);
+    // The two halves of find(): by canonical path (filled in), and by the
+    // hash of contents already read
+    Entry* find_path(const std::string& path, Kind kind,
+                     std::string& canonical);
+    Entry* find_content(const std::string& canonical, Kind kind,
+                        uint64_t content_hash);
+    Entry* insert(Kind kind, const std::string& canonical,
+                  uint64_t content_hash, std::shared_ptr<void> asset,
+                  const void* handle, size_t ram_bytes);
+    void touch(Entry* entry) { entry->last_used = ++clock; }
+    void set_ram_bytes(Entry* entry, size_t bytes);
+    void remove(Entry* entry);
+};
@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "../asset_baker.hpp"
+#include "../trace.hpp"
+
+// bake <input_dir> <output_dir>: converts every model under input_dir (and
+// the textures its materials use) to .mesh/.tex files, skipping anything
+// whose inputs haven't changed since the last run
+int main(int argc, char** argv) {
+    const char* input_dir = nullptr;
+    const char* output_dir = nullptr;
+    BakeSettings settings;
+    const char* trace = nullptr;
+    bool ok = true;
+    for (int i = 1; i < argc && ok; i++) {
+        if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            settings.jobs = std::max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--force")) {
+            settings.force = true;
+        } else if (!strcmp(argv[i], "--bc7")) {
+            settings.bc7 = true;
+        } else if (!strcmp(argv[i], "--bump-strength") && i + 1 < argc) {
+            settings.normal_maps.strength = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--bump-central")) {
+            settings.normal_maps.sobel = false;
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (argv[i][0] != '-' && !input_dir) {
+            input_dir = argv[i];
+        } else if (argv[i][0] != '-' && !output_dir) {
+            output_dir = argv[i];
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || !input_dir || !output_dir) {
+        fprintf(stderr,
+                "Usage: %s <input_dir> <output_dir> [--jobs n] [--force]\n"
+                "\t[--bc7] [--bump-strength s] [--bump-central]\n"
+                "\t[--trace file.json]\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (trace) {
+        start_tracing();
+        TRACE_THREAD("main");
+    }
+    try {
+        BakeResult result = bake_assets(input_dir, output_dir, settings);
+        if (trace) write_trace(trace);
+        return result.failed ? 1 : 0;
+    } catch (const std::exception& e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return -1;
+    }
+}
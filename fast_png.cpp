@@ -0,0 +1,688 @@
+#include "fast_png.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FAST_PNG_SSE 1
+#endif
+
+namespace {
+
+// Inflate -------------------------------------------------------------------
+
+// Codes up to FAST_BITS long decode with one table lookup. Literal/length
+// entries can hold two literals whose codes fit in FAST_BITS together, so
+// runs of short literals decode two per lookup. Longer codes fall back to
+// canonical decoding.
+const int FAST_BITS = 11;
+const uint32_t FAST_MASK = (1u << FAST_BITS) - 1;
+
+// Entry: bits 0-3 code bits used, 4-5 symbol count (0 = long code),
+// 6-14 first symbol, 15-22 second symbol (a literal)
+uint32_t entry_bits(uint32_t entry) { return entry & 15; }
+uint32_t entry_count(uint32_t entry) { return entry >> 4 & 3; }
+uint32_t entry_symbol(uint32_t entry) { return entry >> 6 & 511; }
+uint32_t entry_second(uint32_t entry) { return entry >> 15 & 255; }
+
+struct HuffmanTable {
+    uint32_t fast[1 << FAST_BITS];
+    uint16_t counts[16];
+    uint16_t symbols[288];
+
+    bool build(const uint8_t* lengths, int count, bool pair_literals) {
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < count; i++) counts[lengths[i]]++;
+        counts[0] = 0;
+
+        int left = 1;  // reject over-subscribed codes
+        for (int len = 1; len < 16; len++) {
+            left = (left << 1) - counts[len];
+            if (left < 0) return false;
+        }
+
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + counts[len];
+        for (int i = 0; i < count; i++) {
+            if (lengths[i]) symbols[offsets[lengths[i]]++] = i;
+        }
+
+        // Canonical codes in (length, symbol) order, reversed since deflate
+        // sends them most significant bit first
+        memset(fast, 0, sizeof(fast));
+        uint32_t code = 0;
+        int index = 0;
+        for (int len = 1; len < 16; len++) {
+            for (int n = 0; n < counts[len]; n++, code++, index++) {
+                if (len > FAST_BITS) continue;
+                uint32_t reversed = 0;
+                for (int bit = 0; bit < len; bit++) {
+                    reversed |= (code >> bit & 1) << (len - 1 - bit);
+                }
+                uint32_t entry = len | 1 << 4 | uint32_t(symbols[index]) << 6;
+                for (uint32_t i = reversed; i <= FAST_MASK; i += 1 << len) {
+                    fast[i] = entry;
+                }
+            }
+            code <<= 1;
+        }
+
+        if (pair_literals) {
+            static thread_local uint32_t single[1 << FAST_BITS];
+            memcpy(single, fast, sizeof(fast));
+            for (uint32_t i = 0; i <= FAST_MASK; i++) {
+                uint32_t first = single[i];
+                if (entry_count(first) != 1 || entry_symbol(first) >= 256) continue;
+                // The second code must lie entirely within the known bits
+                uint32_t second = single[i >> entry_bits(first)];
+                if (entry_count(second) != 1 || entry_symbol(second) >= 256 ||
+                    entry_bits(first) + entry_bits(second) > FAST_BITS) {
+                    continue;
+                }
+                fast[i] = (entry_bits(first) + entry_bits(second)) | 2 << 4 |
+                          entry_symbol(first) << 6 | entry_symbol(second) << 15;
+            }
+        }
+        return true;
+    }
+};
+
+// 64-bit little-endian bit buffer, refilled 8 bytes at a time
+struct BitReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t bits = 0;
+    int count = 0;
+    size_t padding = 0;  // zero bytes fed past the end
+
+    void refill() {
+        if (end - p >= 8) {
+            uint64_t value;
+            memcpy(&value, p, 8);
+            bits |= value << count;
+            p += (63 - count) >> 3;
+            count |= 56;
+        } else {
+            while (count <= 56) {
+                if (p < end) {
+                    bits |= uint64_t(*p++) << count;
+                } else {
+                    padding++;
+                }
+                count += 8;
+            }
+        }
+    }
+    void consume(int n) {
+        bits >>= n;
+        count -= n;
+    }
+    uint32_t take(int n) {
+        uint32_t value = uint32_t(bits & ((1ull << n) - 1));
+        consume(n);
+        return value;
+    }
+    // Read past the end of the input
+    bool overrun() const { return padding * 8 > size_t(count); }
+};
+
+// Output that grows with realloc, with slack so matches can copy 8 bytes
+// at a time
+struct Output {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    bool reserve(size_t extra) {
+        if (size + extra <= capacity) return true;
+        size_t grown = std::max(capacity * 2, size + extra);
+        auto* bigger = static_cast<uint8_t*>(realloc(data, grown));
+        if (!bigger) return false;
+        data = bigger;
+        capacity = grown;
+        return true;
+    }
+};
+
+const uint16_t LENGTH_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11, 13,
+                                  15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                  2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DIST_BASE[30] = {1,    2,    3,    4,    5,    7,     9,
+                                13,   17,   25,   33,   49,   65,    97,
+                                129,  193,  257,  385,  513,  769,   1025,
+                                1537, 2049, 3073, 4097, 6145, 8193,  12289,
+                                16385, 24577};
+const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Symbol for a code longer than FAST_BITS, decoded a bit at a time
+int decode_slow(BitReader& reader, const HuffmanTable& table) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        code |= int(reader.bits >> (len - 1) & 1);
+        int count = table.counts[len];
+        if (code - first < count) {
+            reader.consume(len);
+            return table.symbols[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+int decode_symbol(BitReader& reader, const HuffmanTable& table) {
+    uint32_t entry = table.fast[reader.bits & FAST_MASK];
+    if (entry_count(entry)) {
+        reader.consume(entry_bits(entry));
+        return entry_symbol(entry);
+    }
+    return decode_slow(reader, table);
+}
+
+bool inflate_block(BitReader& reader, const HuffmanTable& lengths,
+                   const HuffmanTable& distances, Output& out) {
+    while (true) {
+        reader.refill();
+        if (!out.reserve(258 + 8)) return false;
+
+        uint32_t entry = lengths.fast[reader.bits & FAST_MASK];
+        int symbol;
+        if (entry_count(entry) == 2) {
+            reader.consume(entry_bits(entry));
+            out.data[out.size++] = entry_symbol(entry);
+            out.data[out.size++] = entry_second(entry);
+            continue;
+        } else if (entry_count(entry) == 1) {
+            reader.consume(entry_bits(entry));
+            symbol = entry_symbol(entry);
+        } else {
+            symbol = decode_slow(reader, lengths);
+        }
+
+        if (symbol < 256) {
+            out.data[out.size++] = symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            return !reader.overrun();
+        }
+        symbol -= 257;
+        if (symbol < 0 || symbol >= 29) return false;
+        size_t length = LENGTH_BASE[symbol] + reader.take(LENGTH_EXTRA[symbol]);
+
+        int dist_symbol = decode_symbol(reader, distances);
+        if (dist_symbol < 0 || dist_symbol >= 30) return false;
+        size_t distance = DIST_BASE[dist_symbol] + reader.take(DIST_EXTRA[dist_symbol]);
+        if (distance > out.size || reader.overrun()) return false;
+
+        uint8_t* dst = out.data + out.size;
+        const uint8_t* src = dst - distance;
+        if (distance >= 8) {
+            // Chunks never overlap their own source; may write up to 7
+            // bytes past the match, inside the reserved slack
+            for (size_t i = 0; i < length; i += 8) {
+                memcpy(dst + i, src + i, 8);
+            }
+        } else if (distance == 1) {
+            memset(dst, src[0], length);
+        } else {
+            for (size_t i = 0; i < length; i++) dst[i] = src[i];
+        }
+        out.size += length;
+    }
+}
+
+const HuffmanTable* fixed_tables() {
+    static HuffmanTable tables[2];
+    static bool built = [] {
+        uint8_t lengths[288];
+        std::fill(lengths, lengths + 144, 8);
+        std::fill(lengths + 144, lengths + 256, 9);
+        std::fill(lengths + 256, lengths + 280, 7);
+        std::fill(lengths + 280, lengths + 288, 8);
+        tables[0].build(lengths, 288, true);
+        std::fill(lengths, lengths + 30, 5);
+        tables[1].build(lengths, 30, false);
+        return true;
+    }();
+    (void)built;
+    return tables;
+}
+
+bool read_dynamic_tables(BitReader& reader, HuffmanTable& lengths,
+                         HuffmanTable& distances) {
+    static const uint8_t ORDER[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+    reader.refill();
+    int num_lengths = reader.take(5) + 257;
+    int num_distances = reader.take(5) + 1;
+    int num_code_lengths = reader.take(4) + 4;
+    if (num_lengths > 286 || num_distances > 30) return false;
+
+    uint8_t code_length_lengths[19] = {};
+    for (int i = 0; i < num_code_lengths; i++) {
+        reader.refill();
+        code_length_lengths[ORDER[i]] = reader.take(3);
+    }
+    HuffmanTable code_lengths;
+    if (!code_lengths.build(code_length_lengths, 19, false)) return false;
+
+    uint8_t all[286 + 30] = {};
+    int total = num_lengths + num_distances;
+    for (int i = 0; i < total;) {
+        reader.refill();
+        int symbol = decode_symbol(reader, code_lengths);
+        if (symbol < 0) return false;
+        if (symbol < 16) {
+            all[i++] = symbol;
+            continue;
+        }
+        int repeat;
+        uint8_t value = 0;
+        if (symbol == 16) {
+            if (i == 0) return false;
+            value = all[i - 1];
+            repeat = 3 + reader.take(2);
+        } else if (symbol == 17) {
+            repeat = 3 + reader.take(3);
+        } else {
+            repeat = 11 + reader.take(7);
+        }
+        if (i + repeat > total) return false;
+        std::fill(all + i, all + i + repeat, value);
+        i += repeat;
+    }
+    if (all[256] == 0) return false;  // no end of block code
+    return lengths.build(all, num_lengths, true) &&
+           distances.build(all + num_lengths, num_distances, false) &&
+           !reader.overrun();
+}
+
+// Raw deflate stream into out; reader is left after the last block
+bool inflate(BitReader& reader, Output& out) {
+    auto dynamic = std::make_unique<HuffmanTable[]>(2);
+    bool final_block = false;
+    while (!final_block) {
+        reader.refill();
+        final_block = reader.take(1);
+        int type = reader.take(2);
+
+        if (type == 0) {
+            reader.consume(reader.count & 7);  // to a byte boundary
+            uint32_t len = reader.take(16);
+            uint32_t nlen = reader.take(16);
+            if ((len ^ 0xffff) != nlen || reader.overrun()) return false;
+            if (!out.reserve(len + 8)) return false;
+            // Whole bytes still in the bit buffer come first
+            while (len && reader.count >= 8) {
+                out.data[out.size++] = reader.take(8);
+                len--;
+            }
+            if (size_t(reader.end - reader.p) < len) return false;
+            memcpy(out.data + out.size, reader.p, len);
+            out.size += len;
+            reader.p += len;
+            if (reader.count == 0) reader.bits = 0;  // drop stale lookahead
+        } else if (type == 1) {
+            const HuffmanTable* fixed = fixed_tables();
+            if (!inflate_block(reader, fixed[0], fixed[1], out)) return false;
+        } else if (type == 2) {
+            if (!read_dynamic_tables(reader, dynamic[0], dynamic[1]) ||
+                !inflate_block(reader, dynamic[0], dynamic[1], out)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t adler32(const uint8_t* data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size) {
+        size_t chunk = std::min<size_t>(size, 5552);  // no overflow before mod
+        for (size_t i = 0; i < chunk; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += chunk;
+        size -= chunk;
+    }
+    return b << 16 | a;
+}
+
+bool zlib_decompress(const uint8_t* in, size_t size, Output& out,
+                     bool check_adler) {
+    if (size < 6) return false;
+    int cmf = in[0], flg = in[1];
+    if ((cmf * 256 + flg) % 31 || (cmf & 15) != 8 || (cmf >> 4) > 7 ||
+        (flg & 32)) {
+        return false;  // not deflate, or needs a preset dictionary
+    }
+    BitReader reader{in + 2, in + size};
+    if (!inflate(reader, out)) return false;
+
+    // The checksum follows on the next byte boundary
+    reader.consume(reader.count & 7);
+    uint8_t trailer[4];
+    for (auto& byte : trailer) {
+        reader.refill();
+        byte = reader.take(8);
+    }
+    if (reader.overrun()) return false;
+    uint32_t expected = uint32_t(trailer[0]) << 24 | trailer[1] << 16 |
+                        trailer[2] << 8 | trailer[3];
+    return !check_adler || adler32(out.data, out.size) == expected;
+}
+
+// Unfiltering ---------------------------------------------------------------
+
+uint8_t paeth(int a, int b, int c) {
+    int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+void unfilter_scalar(uint8_t* dst, const uint8_t* src, const uint8_t* prev,
+                     size_t length, int bpp, int type) {
+    switch (type) {
+        case 0:
+            memcpy(dst, src, length);
+            break;
+        case 1:
+            for (size_t i = 0; i < length; i++) {
+                dst[i] = src[i] + (i >= size_t(bpp) ? dst[i - bpp] : 0);
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < length; i++) dst[i] = src[i] + prev[i];
+            break;
+        case 3:
+            for (size_t i = 0; i < length; i++) {
+                int left = i >= size_t(bpp) ? dst[i - bpp] : 0;
+                dst[i] = src[i] + ((left + prev[i]) >> 1);
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < length; i++) {
+                bool first = i < size_t(bpp);
+                dst[i] = src[i] + paeth(first ? 0 : dst[i - bpp], prev[i],
+                                        first ? 0 : prev[i - bpp]);
+            }
+            break;
+    }
+}
+
+#ifdef FAST_PNG_SSE
+// Sub, Avg and Paeth depend on the pixel to the left, so the SIMD versions
+// work on one pixel (3 or 4 bytes) at a time; Up does 16 bytes at a time.
+// Pixels move as 4 bytes (a 3 byte copy through memory stalls store
+// forwarding), except the last one of a 3 byte row which would touch the
+// byte after the row. Stray 4th bytes get overwritten by the next pixel.
+__m128i load_pixel(const uint8_t* p, bool tail) {
+    uint32_t value;
+    if (tail) {
+        value = p[0] | p[1] << 8 | p[2] << 16;
+    } else {
+        memcpy(&value, p, 4);
+    }
+    return _mm_cvtsi32_si128(int(value));
+}
+
+void store_pixel(uint8_t* p, __m128i pixel, bool tail) {
+    uint32_t value = uint32_t(_mm_cvtsi128_si32(pixel));
+    if (tail) {
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+    } else {
+        memcpy(p, &value, 4);
+    }
+}
+
+__m128i abs_epi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+void unfilter_sse(uint8_t* dst, const uint8_t* src, const uint8_t* prev,
+                  size_t length, int bpp, int type) {
+    __m128i zero = _mm_setzero_si128();
+    size_t tail_start = bpp == 3 ? length - 3 : length;
+    switch (type) {
+        case 1: {
+            __m128i a = zero;
+            for (size_t i = 0; i < length; i += bpp) {
+                bool tail = i == tail_start;
+                a = _mm_add_epi8(a, load_pixel(src + i, tail));
+                store_pixel(dst + i, a, tail);
+            }
+            break;
+        }
+        case 2: {
+            size_t i = 0;
+            for (; i + 16 <= length; i += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(x, b));
+            }
+            for (; i < length; i++) dst[i] = src[i] + prev[i];
+            break;
+        }
+        case 3: {
+            __m128i a = zero;
+            __m128i one = _mm_set1_epi8(1);
+            for (size_t i = 0; i < length; i += bpp) {
+                bool tail = i == tail_start;
+                __m128i b = load_pixel(prev + i, tail);
+                // avg_epu8 rounds up, the filter rounds down
+                __m128i average = _mm_sub_epi8(
+                    _mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                a = _mm_add_epi8(load_pixel(src + i, tail), average);
+                store_pixel(dst + i, a, tail);
+            }
+            break;
+        }
+        case 4: {
+            // 16-bit lanes so a + b - 2c can't overflow
+            __m128i a = zero, c = zero;
+            for (size_t i = 0; i < length; i += bpp) {
+                bool tail = i == tail_start;
+                __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, tail), zero);
+                __m128i x = _mm_unpacklo_epi8(load_pixel(src + i, tail), zero);
+                __m128i b_c = _mm_sub_epi16(b, c);
+                __m128i a_c = _mm_sub_epi16(a, c);
+                __m128i pa = abs_epi16(b_c);
+                __m128i pb = abs_epi16(a_c);
+                __m128i pc = abs_epi16(_mm_add_epi16(b_c, a_c));
+                // a if pa <= pb and pa <= pc, else b if pb <= pc, else c
+                __m128i use_a = _mm_andnot_si128(
+                    _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)),
+                    _mm_set1_epi16(-1));
+                __m128i use_b = _mm_andnot_si128(
+                    _mm_or_si128(use_a, _mm_cmpgt_epi16(pb, pc)), _mm_set1_epi16(-1));
+                __m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b),
+                                                 _mm_set1_epi16(-1));
+                __m128i predictor = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+                    _mm_and_si128(use_c, c));
+                __m128i value = _mm_and_si128(_mm_add_epi16(x, predictor),
+                                              _mm_set1_epi16(0xff));
+                store_pixel(dst + i, _mm_packus_epi16(value, zero), tail);
+                a = value;
+                c = b;
+            }
+            break;
+        }
+        default:
+            memcpy(dst, src, length);
+    }
+}
+#endif
+
+void unfilter(uint8_t* dst, const uint8_t* src, const uint8_t* prev,
+              size_t length, int bpp, int type) {
+#ifdef FAST_PNG_SSE
+    if (bpp == 3 || bpp == 4) {
+        unfilter_sse(dst, src, prev, length, bpp, type);
+        return;
+    }
+#endif
+    unfilter_scalar(dst, src, prev, length, bpp, type);
+}
+
+// Gray, gray + alpha and RGB rows expanded to RGBA8
+void expand_row(uint8_t* out, const uint8_t* row, unsigned width, int color_type) {
+    if (color_type == 0) {
+        for (unsigned x = 0; x < width; x++, out += 4) {
+            out[0] = out[1] = out[2] = row[x];
+            out[3] = 255;
+        }
+    } else if (color_type == 4) {
+        for (unsigned x = 0; x < width; x++, out += 4) {
+            out[0] = out[1] = out[2] = row[x * 2];
+            out[3] = row[x * 2 + 1];
+        }
+    } else {
+        // 4 byte loads, the scratch row has a byte of padding
+        for (unsigned x = 0; x < width; x++, out += 4, row += 3) {
+            uint32_t pixel;
+            memcpy(&pixel, row, 4);
+            pixel |= 0xff000000u;  // little endian: alpha is the top byte
+            memcpy(out, &pixel, 4);
+        }
+    }
+}
+
+uint32_t read_u32(const uint8_t* p) {
+    return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Returns false for anything it doesn't handle, or any error, so lodepng
+// can decode it (or report the error) instead
+bool decode_fast(std::vector<unsigned char>& out, unsigned& width,
+                 unsigned& height, const uint8_t* data, size_t size) {
+    static const uint8_t SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 8 + 25 || memcmp(data, SIGNATURE, 8) != 0) return false;
+
+    int color_type = -1;
+    std::vector<uint8_t> idat;
+    bool ended = false;
+    for (size_t pos = 8; pos + 12 <= size && !ended;) {
+        uint32_t length = read_u32(data + pos);
+        if (length > size - pos - 12) return false;
+        const uint8_t* type = data + pos + 4;
+        const uint8_t* body = data + pos + 8;
+        if (lodepng_crc32(type, length + 4) != read_u32(body + length)) {
+            return false;
+        }
+
+        if (!memcmp(type, "IHDR", 4)) {
+            if (length != 13) return false;
+            width = read_u32(body);
+            height = read_u32(body + 4);
+            int bit_depth = body[8];
+            color_type = body[9];
+            bool interlaced = body[12];
+            if (bit_depth != 8 || body[10] || body[11] || interlaced ||
+                (color_type != 0 && color_type != 2 && color_type != 4 &&
+                 color_type != 6)) {
+                return false;
+            }
+        } else if (!memcmp(type, "IDAT", 4)) {
+            idat.insert(idat.end(), body, body + length);
+        } else if (!memcmp(type, "IEND", 4)) {
+            ended = true;
+        } else if (!memcmp(type, "tRNS", 4) || !(type[0] & 32)) {
+            return false;  // color key, or an unknown critical chunk
+        }
+        pos += 12 + length;
+    }
+    if (color_type < 0 || !ended || !width || !height) return false;
+
+    int bpp = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 4 ? 2 : 4;
+    size_t stride = size_t(width) * bpp;
+    if (stride / bpp != width || (stride + 1) * height / height != stride + 1) {
+        return false;
+    }
+    size_t expected = (stride + 1) * height;
+
+    Output raw;
+    raw.data = static_cast<uint8_t*>(malloc(expected + 258 + 8));
+    raw.capacity = raw.data ? expected + 258 + 8 : 0;
+    // Any other size is an error to lodepng, which the fallback reports
+    bool ok = zlib_decompress(idat.data(), idat.size(), raw, true) &&
+              raw.size == expected;
+    if (ok) {
+        out.resize(size_t(width) * height * 4);
+        // Scratch rows get a byte of padding for expand_row
+        std::vector<uint8_t> rows(color_type == 6 ? 0 : 2 * (stride + 1));
+        std::vector<uint8_t> zero_row(stride);
+        const uint8_t* prev = zero_row.data();
+        for (unsigned y = 0; y < height && ok; y++) {
+            const uint8_t* line = raw.data + y * (stride + 1);
+            int filter = line[0];
+            if (filter > 4) {
+                ok = false;
+                break;
+            }
+            // RGBA unfilters straight into the output
+            uint8_t* dst = color_type == 6
+                               ? &out[size_t(y) * stride]
+                               : &rows[(y & 1) * (stride + 1)];
+            unfilter(dst, line + 1, prev, stride, bpp, filter);
+            if (color_type != 6) {
+                expand_row(&out[size_t(y) * width * 4], dst, width, color_type);
+            }
+            prev = dst;
+        }
+    }
+    free(raw.data);
+    return ok;
+}
+
+}  // namespace
+
+unsigned fast_zlib_decompress(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGDecompressSettings* settings) {
+    Output output;
+    output.data = *out;
+    output.size = output.capacity = *outsize;
+    bool ok = zlib_decompress(in, insize, output, !settings->ignore_adler32);
+    *out = output.data;
+    *outsize = output.size;
+    return ok ? 0 : 1;
+}
+
+unsigned decode_png_rgba(std::vector<unsigned char>& out, unsigned& width,
+                         unsigned& height, const unsigned char* data,
+                         size_t size) {
+    if (decode_fast(out, width, height, data, size)) {
+        return 0;
+    }
+    lodepng::State state;
+    state.decoder.zlibsettings.custom_zlib = fast_zlib_decompress;
+    return lodepng::decode(out, width, height, state, data, size);
+}
+
+unsigned decode_png_rgba(std::vector<unsigned char>& out, unsigned& width,
+                         unsigned& height, const std::string& filename) {
+    std::vector<unsigned char> file;
+    unsigned error = lodepng::load_file(file, filename);
+    if (error) {
+        return error;
+    }
+    return decode_png_rgba(out, width, height, file.data(), file.size());
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "external/lodepng.h"
+
+// PNG decoding for textures, output identical to
+// lodepng::decode(out, w, h, ..., LCT_RGBA, 8).
+//
+// 8-bit, non-interlaced gray/gray+alpha/RGB/RGBA images (everything we
+// ship) take a fast path: our own inflate, SSE unfiltering, and rows
+// expanded straight into the RGBA8 output. Anything else (palettes, 16 bit,
+// interlacing, color-key tRNS) and anything the fast path rejects goes to
+// lodepng, which still inflates through fast_zlib_decompress, so error
+// codes are lodepng's. CRCs and the Adler-32 are checked either way.
+
+// Returns a lodepng error code, 0 on success
+unsigned decode_png_rgba(std::vector<unsigned char>& out, unsigned& width,
+                         unsigned& height, const unsigned char* data,
+                         size_t size);
+unsigned decode_png_rgba(std::vector<unsigned char>& out, unsigned& width,
+                         unsigned& height, const std::string& filename);
+
+// Table-driven inflate of a zlib stream, usable as lodepng's custom_zlib.
+// *out is malloc'd, as lodepng frees it.
+unsigned fast_zlib_decompress(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGDecompressSettings* settings);
@@ -0,0 +1,14 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// Per-frame shader inputs, shared by every program variant (and the
+// software rasterizer)
+// NOTE: only vec4/mat4 so the layout doesn't depend on GLM alignment flags,
+// and matches the shaders' std140 FrameBlock as is
+struct FrameUniforms {
+    glm::mat4 mvp;
+    glm::mat4 mv;
+    glm::mat4 normal_matrix;  // upper 3x3 is used
+    glm::vec4 view_light_pos;
+    glm::vec4 view_camera_pos;
+};
@@ -0,0 +1,355 @@
+#include "gpu_arena.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "memory_tracker.hpp"
+
+RangeAllocator::RangeAllocator(size_t capacity) : capacity_(capacity) {
+    if (capacity > 0) {
+        free_blocks.emplace(0, capacity);
+    }
+}
+
+// Empty ranges (a mesh without indices, say) take no space: offset 0, no
+// bookkeeping, and freeing them does nothing
+std::optional<size_t> RangeAllocator::allocate(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    for (auto it = free_blocks.begin(); it != free_blocks.end(); it++) {
+        if (it->second < size) {
+            continue;
+        }
+        size_t offset = it->first;
+        size_t remaining = it->second - size;
+        free_blocks.erase(it);
+        if (remaining > 0) {
+            free_blocks.emplace(offset + size, remaining);
+        }
+        used_ += size;
+        return offset;
+    }
+    return std::nullopt;
+}
+
+void RangeAllocator::free(size_t offset, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    used_ -= size;
+    auto [it, inserted] = free_blocks.emplace(offset, size);
+    if (!inserted) {
+        throw std::runtime_error("Double free in RangeAllocator\n");
+    }
+
+    // Merge with the following block
+    auto next = std::next(it);
+    if (next != free_blocks.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        free_blocks.erase(next);
+    }
+    // Merge with the preceding block
+    if (it != free_blocks.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+            prev->second += it->second;
+            free_blocks.erase(it);
+        }
+    }
+}
+
+void RangeAllocator::grow(size_t new_capacity) {
+    if (new_capacity <= capacity_) {
+        return;
+    }
+    size_t old_capacity = capacity_;
+    capacity_ = new_capacity;
+
+    // Temporarily count the new space as used so free() can merge it
+    used_ += new_capacity - old_capacity;
+    free(old_capacity, new_capacity - old_capacity);
+}
+
+void RangeAllocator::reset(size_t used, size_t capacity) {
+    capacity_ = capacity;
+    used_ = used;
+    free_blocks.clear();
+    if (used < capacity_) {
+        free_blocks.emplace(used, capacity_ - used);
+    }
+}
+
+size_t RangeAllocator::largest_free_block() const {
+    size_t largest = 0;
+    for (auto& [offset, size] : free_blocks) {
+        largest = std::max(largest, size);
+    }
+    return largest;
+}
+
+GpuBufferArena::GpuBufferArena(VertexLayout layout, size_t vertex_capacity,
+                               size_t index_capacity, GLenum index_type)
+    : layout(std::move(layout)),
+      index_type(index_type),
+      index_size(index_type == GL_UNSIGNED_SHORT ? sizeof(uint16_t)
+                                                 : sizeof(unsigned int)),
+      vertex_allocator(vertex_capacity),
+      index_allocator(index_capacity) {
+    glGenVertexArrays(1, &vao);
+    create_buffers(vertex_capacity, index_capacity);
+    setup_vao();
+}
+
+GpuBufferArena::~GpuBufferArena() {
+    glDeleteBuffers(1, &vbo);
+    glDeleteBuffers(1, &ebo);
+    track_gpu_bytes(MemoryTag::Mesh,
+                    -buffer_bytes(vertex_allocator.capacity(),
+                                  index_allocator.capacity()));
+    glDeleteVertexArrays(1, &vao);
+}
+
+void GpuBufferArena::create_buffers(size_t vertex_capacity,
+                                    size_t index_capacity) {
+    // Uploads go through the copy targets so the rasterizer's tracked
+    // GL_ARRAY_BUFFER binding isn't disturbed
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+    glBufferData(GL_COPY_WRITE_BUFFER, vertex_capacity * layout.stride,
+                 nullptr, GL_STATIC_DRAW);
+
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+    glBufferData(GL_COPY_WRITE_BUFFER, index_capacity * index_size,
+                 nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    track_gpu_bytes(MemoryTag::Mesh, buffer_bytes(vertex_capacity, index_capacity));
+}
+
+int64_t GpuBufferArena::buffer_bytes(size_t vertex_capacity,
+                                     size_t index_capacity) const {
+    return int64_t(vertex_capacity * layout.stride +
+                   index_capacity * index_size);
+}
+
+void GpuBufferArena::setup_vao() {
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    for (auto& attribute : layout.attributes) {
+        glEnableVertexAttribArray(attribute.location);
+        glVertexAttribPointer(attribute.location, attribute.components,
+                              GL_FLOAT, GL_FALSE, layout.stride,
+                              (GLvoid*)attribute.offset);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);  // captured by the VAO
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Copies the live prefix of each buffer into new ones of the given size.
+// Only valid when every allocation lies below the old capacities.
+void GpuBufferArena::resize(size_t vertex_capacity, size_t index_capacity) {
+    GLuint old_vbo = vbo;
+    GLuint old_ebo = ebo;
+    size_t old_vertex_capacity = vertex_allocator.capacity();
+    size_t old_index_capacity = index_allocator.capacity();
+    create_buffers(vertex_capacity, index_capacity);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, old_vbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                        std::min(old_vertex_capacity, vertex_capacity) *
+                            layout.stride);
+    glBindBuffer(GL_COPY_READ_BUFFER, old_ebo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+    glCopyBufferSubData(
+        GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+        std::min(old_index_capacity, index_capacity) * index_size);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    glDeleteBuffers(1, &old_vbo);
+    glDeleteBuffers(1, &old_ebo);
+    track_gpu_bytes(MemoryTag::Mesh,
+                    -buffer_bytes(old_vertex_capacity, old_index_capacity));
+    setup_vao();
+
+    vertex_allocator.grow(vertex_capacity);
+    index_allocator.grow(index_capacity);
+}
+
+GpuBufferArena::Handle GpuBufferArena::allocate(const void* vertices,
+                                                size_t vertex_count,
+                                                const void* indices,
+                                                size_t index_count) {
+    Handle handle = reserve(vertex_count, index_count);
+    write_vertices(handle, 0, vertices, vertex_count);
+    write_indices(handle, 0, indices, index_count);
+    return handle;
+}
+
+GpuBufferArena::Handle GpuBufferArena::reserve(size_t vertex_count,
+                                               size_t index_count) {
+    auto vertex_offset = vertex_allocator.allocate(vertex_count);
+    auto index_offset = index_allocator.allocate(index_count);
+    if (!vertex_offset || !index_offset) {
+        if (vertex_offset) vertex_allocator.free(*vertex_offset, vertex_count);
+        if (index_offset) index_allocator.free(*index_offset, index_count);
+
+        // Double until the new space alone can hold the request
+        size_t vertex_capacity = std::max<size_t>(vertex_allocator.capacity(), 1);
+        size_t index_capacity = std::max<size_t>(index_allocator.capacity(), 1);
+        while (vertex_capacity - vertex_allocator.capacity() < vertex_count) {
+            vertex_capacity *= 2;
+        }
+        while (index_capacity - index_allocator.capacity() < index_count) {
+            index_capacity *= 2;
+        }
+        fprintf(stdout, "Growing buffer arena to %zu vertices, %zu indices\n",
+                vertex_capacity, index_capacity);
+        resize(vertex_capacity, index_capacity);
+
+        vertex_offset = vertex_allocator.allocate(vertex_count);
+        index_offset = index_allocator.allocate(index_count);
+        if (!vertex_offset || !index_offset) {
+            throw std::runtime_error("Buffer arena allocation failed\n");
+        }
+    }
+
+    Handle handle = next_handle++;
+    ranges.emplace(handle, Range{GLint(*vertex_offset), *index_offset,
+                                 vertex_count, index_count});
+    return handle;
+}
+
+void GpuBufferArena::write_vertices(Handle handle, size_t first,
+                                    const void* vertices, size_t count) {
+    const Range& range = ranges.at(handle);
+    if (first + count > range.vertex_count) {
+        throw std::runtime_error("Vertex write past the end of its range\n");
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+                    (range.base_vertex + first) * layout.stride,
+                    count * layout.stride, vertices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void GpuBufferArena::write_indices(Handle handle, size_t first,
+                                   const void* indices, size_t count) {
+    const Range& range = ranges.at(handle);
+    if (first + count > range.index_count) {
+        throw std::runtime_error("Index write past the end of its range\n");
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+                    (range.first_index + first) * index_size,
+                    count * index_size, indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void GpuBufferArena::free(Handle handle) {
+    auto it = ranges.find(handle);
+    if (it == ranges.end()) {
+        return;
+    }
+    vertex_allocator.free(it->second.base_vertex, it->second.vertex_count);
+    index_allocator.free(it->second.first_index, it->second.index_count);
+    ranges.erase(it);
+}
+
+// Smallest buffers defragment shrinks to, so the next few uploads don't
+// have to grow them straight back
+static const size_t MIN_DEFRAGMENTED_CAPACITY = 1 << 16;  // elements
+
+void GpuBufferArena::defragment() {
+    size_t old_vertex_capacity = vertex_allocator.capacity();
+    size_t old_index_capacity = index_allocator.capacity();
+    size_t vertex_capacity = std::min(
+        old_vertex_capacity,
+        std::max(vertex_allocator.used(), MIN_DEFRAGMENTED_CAPACITY));
+    size_t index_capacity = std::min(
+        old_index_capacity,
+        std::max(index_allocator.used(), MIN_DEFRAGMENTED_CAPACITY));
+    GLuint old_vbo = vbo;
+    GLuint old_ebo = ebo;
+    create_buffers(vertex_capacity, index_capacity);
+
+    // Pack live ranges in their current order; handles stay valid and
+    // indices are base-vertex relative so they don't need rewriting
+    std::vector<Range*> live;
+    for (auto& [handle, range] : ranges) {
+        live.push_back(&range);
+    }
+    std::sort(live.begin(), live.end(), [](Range* a, Range* b) {
+        return a->base_vertex < b->base_vertex;
+    });
+
+    size_t next_vertex = 0;
+    size_t next_index = 0;
+    for (Range* range : live) {
+        glBindBuffer(GL_COPY_READ_BUFFER, old_vbo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            range->base_vertex * layout.stride,
+                            next_vertex * layout.stride,
+                            range->vertex_count * layout.stride);
+        glBindBuffer(GL_COPY_READ_BUFFER, old_ebo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            range->first_index * index_size,
+                            next_index * index_size,
+                            range->index_count * index_size);
+        range->base_vertex = next_vertex;
+        range->first_index = next_index;
+        next_vertex += range->vertex_count;
+        next_index += range->index_count;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &old_vbo);
+    glDeleteBuffers(1, &old_ebo);
+    track_gpu_bytes(MemoryTag::Mesh,
+                    -buffer_bytes(old_vertex_capacity, old_index_capacity));
+    setup_vao();
+
+    vertex_allocator.reset(next_vertex, vertex_capacity);
+    index_allocator.reset(next_index, index_capacity);
+}
+
+static double fragmentation(const RangeAllocator& allocator) {
+    size_t free_space = allocator.capacity() - allocator.used();
+    if (free_space == 0) {
+        return 0;
+    }
+    return 1 - double(allocator.largest_free_block()) / free_space;
+}
+
+double GpuBufferArena::vertex_fragmentation() const {
+    return fragmentation(vertex_allocator);
+}
+
+double GpuBufferArena::index_fragmentation() const {
+    return fragmentation(index_allocator);
+}
+
+void GpuBufferArena::print_stats(FILE* out) const {
+    auto utilization = [](const RangeAllocator& allocator) {
+        return allocator.capacity()
+                   ? 100.0 * allocator.used() / allocator.capacity()
+                   : 0.0;
+    };
+    fprintf(out,
+            "Buffer arena: %zu allocations\n"
+            "\tvertices: %zu / %zu (%.1f%% used, %.1f%% fragmented, %zu free "
+            "blocks)\n"
+            "\tindices:  %zu / %zu (%.1f%% used, %.1f%% fragmented, %zu free "
+            "blocks)\n",
+            ranges.size(), vertex_allocator.used(), vertex_allocator.capacity(),
+            utilization(vertex_allocator), vertex_fragmentation() * 100,
+            vertex_allocator.free_block_count(), index_allocator.used(),
+            index_allocator.capacity(), utilization(index_allocator),
+            index_fragmentation() * 100, index_allocator.free_block_count());
+}
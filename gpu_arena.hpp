@@ -0,0 +1,109 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <vector>
+
+// First-fit free-list allocator over an abstract range of elements.
+// Free blocks are kept sorted by offset and coalesced on free.
+class RangeAllocator {
+   public:
+    explicit RangeAllocator(size_t capacity = 0);
+
+    std::optional<size_t> allocate(size_t size);
+    void free(size_t offset, size_t size);
+    // Extends the range, the new space joins the last free block if adjacent
+    void grow(size_t new_capacity);
+    // Forgets all blocks, leaving [used, capacity) free (after compaction)
+    void reset(size_t used, size_t capacity);
+
+    size_t capacity() const { return capacity_; }
+    size_t used() const { return used_; }
+    size_t largest_free_block() const;
+    size_t free_block_count() const { return free_blocks.size(); }
+
+   private:
+    size_t capacity_;
+    size_t used_ = 0;
+    std::map<size_t, size_t> free_blocks;  // offset -> size
+};
+
+// How vertices in an arena are laid out; one VAO is shared by every mesh of
+// the same layout
+struct VertexLayout {
+    struct Attribute {
+        GLuint location;
+        GLint components;  // floats
+        size_t offset;     // bytes
+    };
+    GLsizei stride;
+    std::vector<Attribute> attributes;
+};
+
+// Large shared vertex + index buffers that meshes are sub-allocated from.
+// Indices are stored relative to the mesh's first vertex and drawn with
+// glDrawElementsBaseVertex, so all meshes share one VAO and one pair of
+// buffers instead of a VAO/VBO/EBO each.
+// Indices are GL_UNSIGNED_INT, or GL_UNSIGNED_SHORT for meshes split into
+// chunks of at most 65535 vertices; index counts and offsets are in
+// elements of that type.
+//
+// NOTE: leaves VAO, GL_ARRAY_BUFFER and GL_ELEMENT_ARRAY_BUFFER bound to 0
+class GpuBufferArena {
+   public:
+    using Handle = uint32_t;
+
+    struct Range {
+        GLint base_vertex;
+        size_t first_index;
+        size_t vertex_count;
+        size_t index_count;
+    };
+
+    GpuBufferArena(VertexLayout layout, size_t vertex_capacity,
+                   size_t index_capacity, GLenum index_type = GL_UNSIGNED_INT);
+    ~GpuBufferArena();
+
+    // Grows the buffers if there is no room
+    Handle allocate(const void* vertices, size_t vertex_count,
+                    const void* indices, size_t index_count);
+    // Same without the data, written later in pieces (streamed uploads)
+    Handle reserve(size_t vertex_count, size_t index_count);
+    // first and count are in elements, relative to the handle's range
+    void write_vertices(Handle handle, size_t first, const void* vertices,
+                        size_t count);
+    void write_indices(Handle handle, size_t first, const void* indices,
+                       size_t count);
+    void free(Handle handle);
+    const Range& range(Handle handle) const { return ranges.at(handle); }
+
+    // Moves every live allocation to the front of new buffers, shrunk to
+    // what's live (but at least 64K elements, and never grown)
+    void defragment();
+
+    // Fraction of free space that isn't in the largest free block
+    double vertex_fragmentation() const;
+    double index_fragmentation() const;
+    void print_stats(FILE* out = stdout) const;
+
+    GLuint vao;
+    const VertexLayout layout;
+    const GLenum index_type;
+    const size_t index_size;  // bytes
+
+   private:
+    GLuint vbo;
+    GLuint ebo;
+    RangeAllocator vertex_allocator;
+    RangeAllocator index_allocator;
+    std::map<Handle, Range> ranges;  // live allocations
+    Handle next_handle = 1;
+
+    void create_buffers(size_t vertex_capacity, size_t index_capacity);
+    int64_t buffer_bytes(size_t vertex_capacity, size_t index_capacity) const;
+    void setup_vao();
+    void resize(size_t vertex_capacity, size_t index_capacity);
+};
@@ -0,0 +1,10 @@
+#include "hash.hpp"
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+    auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, chainable through `hash`
+uint64_t fnv1a(const void* data, size_t size,
+               uint64_t hash = 0xcbf29ce484222325ull);
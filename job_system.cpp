@@ -0,0 +1,360 @@
+#include "job_system.hpp"
+
+#include "trace.hpp"
+
+struct JobSystem::Job {
+    std::function<void()> fn;
+    JobCounter* counter;
+    bool background;
+};
+
+// Chase-Lev deque with a fixed ring (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). Only the owner pushes and pops,
+// at the bottom; thieves take from the top, racing the owner for the last
+// job with a CAS on top.
+class JobSystem::Deque {
+   public:
+    // False when full, the caller runs the job itself
+    bool push(Job* job) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= int64_t(CAPACITY)) {
+            return false;
+        }
+        slots[b & (CAPACITY - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    Job* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);  // was empty
+            return nullptr;
+        }
+        Job* job = slots[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Last one: a thief may be taking it too
+            if (!top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                job = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    Job* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        Job* job = slots[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return nullptr;  // lost the race, the caller tries elsewhere
+        }
+        return job;
+    }
+
+   private:
+    static const size_t CAPACITY = 4096;  // power of two
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Job*> slots[CAPACITY] = {};
+};
+
+struct JobSystem::Worker {
+    Deque deque;
+    std::thread thread;
+    int index;
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> steals{0};
+};
+
+// One parallel_for call
+struct JobSystem::Loop {
+    Loop(const std::function<void(size_t)>& fn, size_t grain)
+        : fn(fn), grain(grain) {}
+
+    const std::function<void(size_t)>& fn;
+    size_t grain;
+    JobCounter counter;
+    std::atomic<bool> failed{false};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+};
+
+namespace {
+// Which worker of which system this thread is (systems can coexist, e.g.
+// one per thread count in a benchmark)
+thread_local const JobSystem* worker_system = nullptr;
+thread_local void* worker_self = nullptr;  // its Worker
+}  // namespace
+
+bool JobCounter::done() const {
+    if (pending.load(std::memory_order_acquire) != 0) {
+        return false;
+    }
+    // The job that brought it to 0 may still hold the lock
+    std::lock_guard lock(mutex);
+    return true;
+}
+
+JobSystem::JobSystem(int num_workers) {
+    for (int i = 0; i < num_workers; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        workers.back()->index = i;
+    }
+    // Started once every deque exists, as they steal from each other
+    for (auto& worker : workers) {
+        worker->thread = std::thread(&JobSystem::worker_loop, this, worker->index);
+    }
+}
+
+JobSystem::~JobSystem() {
+    stopping = true;
+    {
+        std::lock_guard lock(sleep_mutex);
+        wake.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+JobSystem::Worker* JobSystem::current_worker() const {
+    return worker_system == this ? static_cast<Worker*>(worker_self) : nullptr;
+}
+
+JobSystem::Stats JobSystem::stats() const {
+    Stats stats;
+    stats.jobs = outside_jobs.load(std::memory_order_relaxed);
+    for (auto& worker : workers) {
+        stats.jobs += worker->jobs.load(std::memory_order_relaxed);
+        stats.steals += worker->steals.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void JobSystem::notify() {
+    work_epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard lock(sleep_mutex);
+        wake.notify_all();
+    }
+}
+
+void JobSystem::sleep(uint64_t epoch, const JobCounter* counter) {
+    std::unique_lock lock(sleep_mutex);
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    wake.wait(lock, [&] {
+        return stopping || work_epoch.load(std::memory_order_seq_cst) != epoch ||
+               (counter && counter->pending.load(std::memory_order_acquire) == 0);
+    });
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void JobSystem::push(Job* job) {
+    if (workers.empty()) {
+        execute(job);  // nobody else would run it
+        return;
+    }
+    if (job->background) {
+        std::lock_guard lock(queue_mutex);
+        background.push_back(job);
+        background_count++;
+    } else if (Worker* self = current_worker()) {
+        if (!self->deque.push(job)) {
+            execute(job);
+            return;
+        }
+    } else {
+        std::lock_guard lock(queue_mutex);
+        injected.push_back(job);
+        injected_count++;
+    }
+    notify();
+}
+
+JobSystem::Job* JobSystem::find_job(Worker* self, bool allow_background) {
+    if (self) {
+        if (Job* job = self->deque.pop()) {
+            return job;
+        }
+    }
+    if (injected_count.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard lock(queue_mutex);
+        if (!injected.empty()) {
+            Job* job = injected.front();
+            injected.pop_front();
+            injected_count--;
+            return job;
+        }
+    }
+    if (!self) {
+        return nullptr;  // outside threads don't steal
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(self->index + i) % workers.size()];
+        if (Job* job = victim.deque.steal()) {
+            self->steals.fetch_add(1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+    if (allow_background && background_count.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard lock(queue_mutex);
+        if (!background.empty()) {
+            Job* job = background.front();
+            background.pop_front();
+            background_count--;
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void JobSystem::execute(Job* job) {
+    if (Worker* self = current_worker()) {
+        self->jobs.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        outside_jobs.fetch_add(1, std::memory_order_relaxed);
+    }
+    job->fn();
+    JobCounter* counter = job->counter;
+    delete job;
+    if (counter) {
+        finish(*counter);
+    }
+}
+
+void JobSystem::finish(JobCounter& counter) {
+    // Only the decrement to zero takes the lock (see JobCounter::done)
+    int pending = counter.pending.load(std::memory_order_relaxed);
+    while (pending > 1) {
+        if (counter.pending.compare_exchange_weak(pending, pending - 1,
+                                                  std::memory_order_acq_rel)) {
+            return;
+        }
+    }
+    std::vector<Job*> released;
+    {
+        std::lock_guard lock(counter.mutex);
+        if (counter.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            released.swap(counter.waiting);
+        }
+    }
+    // counter may be gone from here on
+    for (Job* job : released) {
+        push(job);
+    }
+    notify();  // wakes wait()s on it
+}
+
+void JobSystem::run(std::function<void()> fn, JobCounter* counter,
+                    JobCounter* after) {
+    Job* job = new Job{std::move(fn), counter, false};
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (after) {
+        std::lock_guard lock(after->mutex);
+        if (after->pending.load(std::memory_order_acquire) > 0) {
+            after->waiting.push_back(job);
+            return;
+        }
+    }
+    push(job);
+}
+
+void JobSystem::run_background(std::function<void()> fn, JobCounter* counter) {
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    push(new Job{std::move(fn), counter, true});
+}
+
+void JobSystem::wait(JobCounter& counter) {
+    Worker* self = current_worker();
+    while (counter.pending.load(std::memory_order_acquire) != 0) {
+        uint64_t epoch = work_epoch.load(std::memory_order_seq_cst);
+        if (Job* job = find_job(self, false)) {
+            execute(job);
+            continue;
+        }
+        sleep(epoch, &counter);
+    }
+    counter.done();  // until the finishing job lets go of the counter
+}
+
+void JobSystem::worker_loop(int index) {
+    TRACE_THREAD("job worker");
+    Worker* self = workers[index].get();
+    worker_system = this;
+    worker_self = self;
+    while (true) {
+        uint64_t epoch = work_epoch.load(std::memory_order_seq_cst);
+        if (Job* job = find_job(self, true)) {
+            TRACE_SCOPE("job");
+            execute(job);
+            continue;
+        }
+        if (stopping) {
+            return;  // only once the queues are drained
+        }
+        sleep(epoch, nullptr);
+    }
+}
+
+void JobSystem::run_range(Loop& loop, size_t begin, size_t end) {
+    // Hand the upper half off while bigger than a grain, so thieves take
+    // big pieces and split them further themselves
+    while (end - begin > loop.grain) {
+        size_t middle = begin + (end - begin) / 2;
+        run([this, &loop, middle, end] { run_range(loop, middle, end); },
+            &loop.counter);
+        end = middle;
+    }
+    if (loop.failed.load(std::memory_order_relaxed)) {
+        return;
+    }
+    try {
+        for (size_t i = begin; i < end; i++) {
+            loop.fn(i);
+        }
+    } catch (...) {
+        std::lock_guard lock(loop.error_mutex);
+        if (!loop.error) {
+            loop.error = std::current_exception();
+        }
+        loop.failed = true;
+    }
+}
+
+void JobSystem::parallel_for(size_t count,
+                             const std::function<void(size_t)>& fn,
+                             size_t grain) {
+    if (count == 0) {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    if (workers.empty() || count <= grain) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    Loop loop(fn, grain);
+    run_range(loop, 0, count);
+    wait(loop.counter);
+    if (loop.error) {
+        std::rethrow_exception(loop.error);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobCounter;
+
+// Work-stealing job system shared by everything that runs in parallel:
+// loading (texture decode, vertex dedup), texture processing (mips, block
+// compression) and per-frame loops (culling, lights, scene updates).
+//
+// Each worker owns a lock-free deque (Chase-Lev): it pushes and pops jobs
+// at the bottom, idle workers steal from the top. Threads that aren't
+// workers (the GL thread) submit through a shared queue instead. Jobs can
+// be counted on a JobCounter and held until another counter reaches zero,
+// which is how dependencies are expressed.
+//
+// Waiting helps: wait() runs queued jobs until the counter is done, so jobs
+// may wait on other jobs (nested parallel_for is fine). Outside the workers
+// it only runs jobs submitted from outside, never a slice of some worker's
+// job, so the GL thread isn't held up by another system's work mid-frame.
+//
+// Jobs must not throw (like std::thread); parallel_for passes the first
+// exception of its loop on to the caller.
+class JobSystem {
+   public:
+    // The calling thread takes part in parallel_for, so 0 workers just runs
+    // everything serially, background jobs included. The default keeps one
+    // worker even on a single core, so a background load never runs inside
+    // run_background.
+    explicit JobSystem(
+        int num_workers = std::max<int>(std::thread::hardware_concurrency() - 1, 1));
+    // Runs what's queued, then joins. Counted jobs should be waited for.
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    // Queues fn, counted on counter if given. With after, it's held until
+    // the jobs counted on after so far have finished.
+    void run(std::function<void()> fn, JobCounter* counter = nullptr,
+             JobCounter* after = nullptr);
+    // For long jobs (a whole model load): only idle workers pick these up,
+    // never a wait(), so a frame's wait can't end up running one. Don't
+    // wait() on them from inside a job; poll the counter instead.
+    void run_background(std::function<void()> fn, JobCounter* counter = nullptr);
+    // Runs queued jobs until counter is done
+    void wait(JobCounter& counter);
+
+    // Calls fn(i) for every i in [0, count) and returns once all have
+    // finished. The range is split in halves down to `grain` indices, so
+    // idle workers steal large pieces first.
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn,
+                      size_t grain = 1);
+
+    int thread_count() const { return int(workers.size()) + 1; }
+
+    struct Stats {
+        uint64_t jobs = 0;    // run, by any thread
+        uint64_t steals = 0;  // taken from another worker's deque
+    };
+    Stats stats() const;
+
+   private:
+    friend class JobCounter;
+    struct Job;
+    class Deque;
+    struct Worker;
+    struct Loop;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Jobs queued by threads that aren't workers, and background jobs
+    std::mutex queue_mutex;
+    std::deque<Job*> injected;
+    std::deque<Job*> background;
+    std::atomic<size_t> injected_count{0};
+    std::atomic<size_t> background_count{0};
+
+    // Idle threads sleep until something is queued or a counter finishes;
+    // work_epoch changes on both, so a wakeup between looking for work and
+    // going to sleep isn't lost
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> work_epoch{0};
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> stopping{false};
+
+    std::atomic<uint64_t> outside_jobs{0};  // run by threads not workers
+
+    Worker* current_worker() const;
+    void push(Job* job);
+    Job* find_job(Worker* self, bool allow_background);
+    void execute(Job* job);
+    void finish(JobCounter& counter);
+    void notify();
+    void sleep(uint64_t epoch, const JobCounter* counter);
+    void worker_loop(int index);
+    void run_range(Loop& loop, size_t begin, size_t end);
+};
+
+// Number of unfinished jobs counted on it. Poll done() to wait without
+// blocking (the GL thread, once per frame), or JobSystem::wait() to block.
+// Must outlive the jobs counted on it and any jobs held until it's done.
+class JobCounter {
+   public:
+    JobCounter() = default;
+    JobCounter(const JobCounter&) = delete;
+    JobCounter& operator=(const JobCounter&) = delete;
+
+    bool done() const;
+
+   private:
+    friend class JobSystem;
+    std::atomic<int> pending{0};
+    // Guards waiting, and the last decrement so the counter can be
+    // destroyed as soon as done() returns true
+    mutable std::mutex mutex;
+    std::vector<JobSystem::Job*> waiting;  // held until pending is 0
+};
@@ -0,0 +1,107 @@
+#include "light_clusters.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+LightClusters::LightClusters(int tiles_x, int tiles_y, int slices, float near,
+                             float far)
+    : tiles_x(tiles_x), tiles_y(tiles_y), slices(slices), near(near), far(far) {}
+
+float LightClusters::slice_depth(int slice) const {
+    return near * std::pow(far / near, float(slice) / slices);
+}
+
+void LightClusters::build(const std::vector<PointLight>& view_lights,
+                          const glm::mat4& projection, JobSystem* pool) {
+    auto start = std::chrono::steady_clock::now();
+
+    slice_lists.resize(slices);
+    for (auto& lists : slice_lists) {
+        lists.resize(tiles_x * tiles_y);
+        for (auto& list : lists) {
+            list.clear();
+        }
+    }
+
+    if (pool) {
+        pool->parallel_for(slices, [&](size_t slice) {
+            build_slice(slice, view_lights, projection);
+        });
+    } else {
+        for (int slice = 0; slice < slices; slice++) {
+            build_slice(slice, view_lights, projection);
+        }
+    }
+
+    // Pack into one index list, in cluster order
+    ranges.resize(size_t(slices) * tiles_x * tiles_y);
+    light_indices.clear();
+    max_cluster_lights = 0;
+    occupied_clusters = 0;
+    size_t cluster = 0;
+    for (auto& lists : slice_lists) {
+        for (auto& list : lists) {
+            ranges[cluster++] = {uint32_t(light_indices.size()),
+                                 uint32_t(list.size())};
+            light_indices.insert(light_indices.end(), list.begin(), list.end());
+            max_cluster_lights = std::max(max_cluster_lights, uint32_t(list.size()));
+            occupied_clusters += !list.empty();
+        }
+    }
+
+    build_ms = std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+}
+
+void LightClusters::build_slice(int slice,
+                                const std::vector<PointLight>& view_lights,
+                                const glm::mat4& projection) {
+    float slice_near = slice_depth(slice);
+    float slice_far = slice_depth(slice + 1);
+    auto& lists = slice_lists[slice];
+
+    for (uint32_t i = 0; i < view_lights.size(); i++) {
+        glm::vec3 center(view_lights[i].position_radius);
+        float radius = view_lights[i].position_radius.w;
+
+        // View space looks down -z
+        float depth_near = std::max(-center.z - radius, slice_near);
+        float depth_far = std::min(-center.z + radius, slice_far);
+        if (depth_near > depth_far) {
+            continue;
+        }
+
+        // Screen bounds of the sphere's box clipped to the slice. The box is
+        // in front of the camera, so its projection lies within its corners'.
+        glm::vec2 ndc_min(1e9f);
+        glm::vec2 ndc_max(-1e9f);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec4 clip =
+                projection *
+                glm::vec4(center.x + (corner & 1 ? radius : -radius),
+                          center.y + (corner & 2 ? radius : -radius),
+                          -(corner & 4 ? depth_far : depth_near), 1);
+            glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+            ndc_min = glm::min(ndc_min, ndc);
+            ndc_max = glm::max(ndc_max, ndc);
+        }
+        if (ndc_min.x > 1 || ndc_min.y > 1 || ndc_max.x < -1 || ndc_max.y < -1) {
+            continue;
+        }
+
+        auto tile = [](float ndc, int tiles) {
+            return std::clamp(int((ndc * .5f + .5f) * tiles), 0, tiles - 1);
+        };
+        int x0 = tile(ndc_min.x, tiles_x);
+        int x1 = tile(ndc_max.x, tiles_x);
+        int y0 = tile(ndc_min.y, tiles_y);
+        int y1 = tile(ndc_max.y, tiles_y);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                lists[y * tiles_x + x].push_back(i);
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "job_system.hpp"
+
+// Point light as stored in the light buffer, 2 texels per light
+// NOTE: only vec4 so the layout doesn't depend on GLM alignment flags
+struct PointLight {
+    glm::vec4 position_radius;  // xyz position, w radius of influence
+    glm::vec4 color;            // rgb color * intensity, w unused
+};
+
+// Assigns point lights to a 3D grid of view space clusters: x/y screen
+// tiles times depth slices spaced exponentially between near and far, so
+// slices stay roughly cube shaped. Each cluster gets a range in one flat
+// light index list, which the fragment shader walks instead of every light.
+//
+// Slices are independent, so assignment runs one slice per job. GL-free;
+// Rasterizer::setLights uploads the result.
+class LightClusters {
+   public:
+    struct Range {
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    LightClusters(int tiles_x = 16, int tiles_y = 9, int slices = 24,
+                  float near = 0.1f, float far = 100.f);
+
+    // view_lights are in view space; projection must use the same near/far
+    void build(const std::vector<PointLight>& view_lights,
+               const glm::mat4& projection, JobSystem* pool = nullptr);
+
+    int tiles_x;
+    int tiles_y;
+    int slices;
+    float near;
+    float far;
+
+    // Cluster (x, y, slice) is at (slice * tiles_y + y) * tiles_x + x
+    std::vector<Range> ranges;
+    std::vector<uint32_t> light_indices;
+
+    // Last build
+    double build_ms = 0;
+    uint32_t max_cluster_lights = 0;
+    size_t occupied_clusters = 0;
+
+    // Depth (positive, view space) where a slice starts
+    float slice_depth(int slice) const;
+
+   private:
+    // Per slice, per tile light lists (kept to reuse their capacity)
+    std::vector<std::vector<std::vector<uint32_t>>> slice_lists;
+
+    void build_slice(int slice, const std::vector<PointLight>& view_lights,
+                     const glm::mat4& projection);
+};
@@ -1,10 +1,16 @@
+#pragma once
 #include <glm/vec3.hpp>
+#include <memory>
 #include <string>
+#include <vector>
 
 struct TextureMap {
     std::vector<unsigned char> pixels;
-    unsigned int width;
-    unsigned int height;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int gpu_id = 0;  // GL texture, 0 until uploaded
+    size_t gpu_bytes = 0;     // estimated size of gpu_id
+    std::string path;  // source file, for caches derived from it
 };
 
 struct Material {
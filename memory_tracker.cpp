@@ -0,0 +1,284 @@
+#include "memory_tracker.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+const size_t TAG_COUNT = size_t(MemoryTag::COUNT);
+
+struct Counters {
+    std::atomic<int64_t> current{0};
+    std::atomic<int64_t> peak{0};
+    std::atomic<uint64_t> allocations{0};
+
+    void add(int64_t delta) {
+        int64_t now = current.fetch_add(delta, std::memory_order_relaxed) + delta;
+        int64_t seen = peak.load(std::memory_order_relaxed);
+        while (now > seen &&
+               !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    MemoryUsage usage() const {
+        return {current.load(std::memory_order_relaxed),
+                peak.load(std::memory_order_relaxed),
+                allocations.load(std::memory_order_relaxed)};
+    }
+};
+
+// Constant initialized, so allocations before main are counted too
+Counters cpu_counters[TAG_COUNT];
+Counters gpu_counters[TAG_COUNT];
+Counters cpu_total;
+Counters gpu_total;
+
+thread_local MemoryTag current_tag = MemoryTag::Other;
+
+#ifdef RASTERIZER_MEMORY_TRACKING
+
+// In front of every block: the requested size, the tag it was charged to,
+// and how far back the malloc'd block starts (further for over-aligned new)
+struct alignas(16) Header {
+    uint64_t size;
+    uint32_t offset;
+    MemoryTag tag;
+};
+static_assert(sizeof(Header) == 16);
+
+void* allocate(size_t size, size_t alignment) noexcept {
+    size_t offset = std::max(alignment, sizeof(Header));
+    void* base;
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        // aligned_alloc wants a multiple of the alignment
+        base = std::aligned_alloc(
+            alignment, (size + offset + alignment - 1) / alignment * alignment);
+    } else {
+        base = std::malloc(size + offset);
+    }
+    if (!base) {
+        return nullptr;
+    }
+
+    char* block = static_cast<char*>(base) + offset;
+    Header* header = reinterpret_cast<Header*>(block) - 1;
+    header->size = size;
+    header->offset = uint32_t(offset);
+    header->tag = current_tag;
+
+    Counters& counters = cpu_counters[size_t(header->tag)];
+    counters.add(int64_t(size));
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    cpu_total.add(int64_t(size));
+    cpu_total.allocations.fetch_add(1, std::memory_order_relaxed);
+    return block;
+}
+
+void* allocate_or_throw(size_t size, size_t alignment) {
+    while (true) {
+        if (void* block = allocate(size, alignment)) {
+            return block;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void deallocate(void* block) noexcept {
+    if (!block) {
+        return;
+    }
+    Header* header = static_cast<Header*>(block) - 1;
+    cpu_counters[size_t(header->tag)].add(-int64_t(header->size));
+    cpu_total.add(-int64_t(header->size));
+    std::free(static_cast<char*>(block) - header->offset);
+}
+
+#endif  // RASTERIZER_MEMORY_TRACKING
+
+size_t peak_rss_bytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return size_t(usage.ru_maxrss);  // bytes
+#else
+        return size_t(usage.ru_maxrss) * 1024;  // KB
+#endif
+    }
+#endif
+    return 0;
+}
+
+double mb(int64_t bytes) { return bytes / 1048576.0; }
+
+}  // namespace
+
+#ifdef RASTERIZER_MEMORY_TRACKING
+
+// Replaced global allocation functions ---------------------------------------
+
+void* operator new(size_t size) { return allocate_or_throw(size, 0); }
+void* operator new[](size_t size) { return allocate_or_throw(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return allocate(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return allocate(size, 0);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    return allocate_or_throw(size, size_t(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return allocate_or_throw(size, size_t(alignment));
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+    return allocate(size, size_t(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+    return allocate(size, size_t(alignment));
+}
+
+void operator delete(void* block) noexcept { deallocate(block); }
+void operator delete[](void* block) noexcept { deallocate(block); }
+void operator delete(void* block, size_t) noexcept { deallocate(block); }
+void operator delete[](void* block, size_t) noexcept { deallocate(block); }
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
+void operator delete(void* block, std::align_val_t) noexcept {
+    deallocate(block);
+}
+void operator delete[](void* block, std::align_val_t) noexcept {
+    deallocate(block);
+}
+void operator delete(void* block, size_t, std::align_val_t) noexcept {
+    deallocate(block);
+}
+void operator delete[](void* block, size_t, std::align_val_t) noexcept {
+    deallocate(block);
+}
+void operator delete(void* block, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
+void operator delete[](void* block, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
+
+#endif  // RASTERIZER_MEMORY_TRACKING
+
+// ---------------------------------------------------------------------------
+
+const char* memory_tag_name(MemoryTag tag) {
+    switch (tag) {
+        case MemoryTag::Other: return "other";
+        case MemoryTag::Loader: return "loader";
+        case MemoryTag::Mesh: return "mesh";
+        case MemoryTag::Texture: return "texture";
+        case MemoryTag::Upload: return "upload";
+        case MemoryTag::COUNT: break;
+    }
+    return "?";
+}
+
+MemoryScope::MemoryScope(MemoryTag tag) : previous(current_tag) {
+    current_tag = tag;
+}
+
+MemoryScope::~MemoryScope() { current_tag = previous; }
+
+void track_gpu_bytes(MemoryTag tag, int64_t delta) {
+    gpu_counters[size_t(tag)].add(delta);
+    gpu_total.add(delta);
+    if (delta > 0) {
+        gpu_counters[size_t(tag)].allocations.fetch_add(
+            1, std::memory_order_relaxed);
+        gpu_total.allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+MemoryReport memory_report() {
+    MemoryReport report;
+#ifdef RASTERIZER_MEMORY_TRACKING
+    report.cpu_tracked = true;
+#endif
+    for (size_t i = 0; i < TAG_COUNT; i++) {
+        report.cpu[i] = cpu_counters[i].usage();
+        report.gpu[i] = gpu_counters[i].usage();
+    }
+    report.cpu_total = cpu_total.usage();
+    report.gpu_total = gpu_total.usage();
+    report.peak_rss = peak_rss_bytes();
+    return report;
+}
+
+void print_memory_report(FILE* out) {
+    MemoryReport report = memory_report();
+    fprintf(out, "%-8s %12s %12s %14s %12s %12s\n", "memory", "CPU MB",
+            "CPU peak MB", "allocations", "GPU MB", "GPU peak MB");
+    auto row = [&](const char* name, const MemoryUsage& cpu,
+                   const MemoryUsage& gpu) {
+        fprintf(out, "%-8s %12.2f %12.2f %14llu %12.2f %12.2f\n", name,
+                mb(cpu.current), mb(cpu.peak),
+                (unsigned long long)cpu.allocations, mb(gpu.current),
+                mb(gpu.peak));
+    };
+    for (size_t i = 0; i < TAG_COUNT; i++) {
+        row(memory_tag_name(MemoryTag(i)), report.cpu[i], report.gpu[i]);
+    }
+    row("total", report.cpu_total, report.gpu_total);
+    if (!report.cpu_tracked) {
+        fprintf(out, "CPU heap not tracked (built without "
+                "RASTERIZER_MEMORY_TRACKING)\n");
+    }
+    fprintf(out, "Peak RSS: %.2f MB\n", mb(int64_t(report.peak_rss)));
+}
+
+std::string memory_report_json() {
+    MemoryReport report = memory_report();
+    auto usage = [](const MemoryUsage& usage) {
+        return std::format(
+            "{{\"current\": {}, \"peak\": {}, \"allocations\": {}}}",
+            usage.current, usage.peak, usage.allocations);
+    };
+    auto side = [&](const MemoryUsage* tags, const MemoryUsage& total) {
+        std::string json = "{";
+        for (size_t i = 0; i < TAG_COUNT; i++) {
+            json += std::format("\"{}\": {}, ", memory_tag_name(MemoryTag(i)),
+                                usage(tags[i]));
+        }
+        return json + "\"total\": " + usage(total) + "}";
+    };
+    return std::format(
+        "{{\"peak_rss\": {}, \"cpu_tracked\": {}, \"cpu\": {}, \"gpu\": {}}}\n",
+        report.peak_rss, report.cpu_tracked, side(report.cpu, report.cpu_total),
+        side(report.gpu, report.gpu_total));
+}
+
+bool write_memory_report(const char* path) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "ERROR: could not write memory report %s\n", path);
+        return false;
+    }
+    file << memory_report_json();
+    return bool(file);
+}
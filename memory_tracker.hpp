@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Where memory goes, per subsystem. Built with RASTERIZER_MEMORY_TRACKING,
+// every heap allocation (global operator new is replaced in
+// memory_tracker.cpp) is charged to the innermost MemoryScope on the
+// allocating thread, and credited back to the same tag when freed, wherever
+// that happens. Without it the CPU counters stay at zero and allocations
+// cost nothing extra. GPU memory is estimated from the sizes we pass to GL
+// and recorded explicitly with track_gpu_bytes.
+enum class MemoryTag : uint8_t {
+    Other,    // untagged, including job workers
+    Loader,   // obj/mtl parsing: vertex arrays, faces, material names
+    Mesh,     // Mesh streams and the vertex dedup map
+    Texture,  // decoded pixels, normal maps, compression
+    Upload,   // uploadMesh temporaries, occluder copies, per-frame buffers
+    COUNT
+};
+
+const char* memory_tag_name(MemoryTag tag);
+
+// Tags allocations on this thread until destroyed; scopes nest
+class MemoryScope {
+   public:
+    explicit MemoryScope(MemoryTag tag);
+    ~MemoryScope();
+
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+
+   private:
+    MemoryTag previous;
+};
+
+// Estimated GPU bytes: positive when a buffer/texture is created or grown,
+// negative when it's deleted
+void track_gpu_bytes(MemoryTag tag, int64_t delta);
+
+struct MemoryUsage {
+    int64_t current = 0;
+    int64_t peak = 0;
+    uint64_t allocations = 0;  // made so far, not the live count
+};
+
+struct MemoryReport {
+    bool cpu_tracked = false;  // built with RASTERIZER_MEMORY_TRACKING
+    MemoryUsage cpu[size_t(MemoryTag::COUNT)];
+    MemoryUsage gpu[size_t(MemoryTag::COUNT)];
+    MemoryUsage cpu_total;  // peak of the sum, not the sum of peaks
+    MemoryUsage gpu_total;
+    size_t peak_rss = 0;  // whole process, from the OS
+};
+
+// Snapshot of the counters, safe to take at any time from any thread
+MemoryReport memory_report();
+void print_memory_report(FILE* out = stdout);
+std::string memory_report_json();
+// Returns false if the file can't be written
+bool write_memory_report(const char* path);
@@ -1,17 +1,24 @@
+#pragma once
+#include <bit>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/vec3.hpp>
+#include <stdexcept>
 #include <tuple>
 
+#include "job_system.hpp"
+#include "memory_tracker.hpp"
 #include "obj_loader.hpp"
+#include "trace.hpp"
 const double MIN_DOUBLE = std::numeric_limits<double>::lowest();
 const double MAX_DOUBLE = std::numeric_limits<double>::max();
 
 struct TupleHash {
-    size_t operator()(const std::tuple<int, int, int>& t) const {
+    template <typename T>
+    size_t operator()(const std::tuple<T, T, T>& t) const {
         auto [a, b, c] = t;
-        size_t h1 = std::hash<int>{}(a);
-        size_t h2 = std::hash<int>{}(b);
-        size_t h3 = std::hash<int>{}(c);
+        size_t h1 = std::hash<T>{}(a);
+        size_t h2 = std::hash<T>{}(b);
+        size_t h3 = std::hash<T>{}(c);
 
         // simple but effective combine
         return h1 ^ (h2 << 1) ^ (h3 << 2);
@@ -37,7 +44,7 @@ struct BoundingBox {
         max.z = std::max(max.z, p.z);
     }
 
-    glm::vec3 center() {
+    glm::vec3 center() const {
         return glm::vec3((min.x + max.x) / 2, (min.y + max.y) / 2,
                          (min.z + max.z) / 2);
     }
@@ -52,7 +59,7 @@ struct Mesh {
 
     struct Triangle {
         glm::ivec3 vertices;
-        Material* material; // Later TODO: this should be an index into scene list of materials
+        Material* material = nullptr; // Later TODO: this should be an index into scene list of materials
     };
     std::vector<Triangle> triangles;
 
@@ -61,16 +68,27 @@ struct Mesh {
     // TODO: meshes need to be split by material (multiple mesh from 1 obj file)
         // Change this to a factory function of sorts
     // Actually, could keep it like this, then split on upload in rasterizer
-    Mesh(ObjLoader& obj) {
-        std::unordered_map<std::tuple<int, int, int>, size_t, TupleHash>
+    Mesh() = default;  // filled in directly (e.g. streaming proxies)
+    // With jobs, vertices are deduplicated in parallel (build_parallel),
+    // into exactly what the serial loop below gives
+    Mesh(ObjLoader& obj, JobSystem* jobs = nullptr) {
+        TRACE_SCOPE("Mesh");
+        MemoryScope memory_scope(MemoryTag::Mesh);
+        if (jobs && jobs->thread_count() > 1 &&
+            obj.faces.size() * 3 <= UINT32_MAX) {
+            build_parallel(obj, *jobs);
+            return;
+        }
+        std::unordered_map<std::tuple<int64_t, int64_t, int64_t>, size_t,
+                           TupleHash>
             unique_vertices;
 
         size_t num_faces_with_materials = 0;
         size_t curr_index = 0;
-        for (auto face : obj.faces) {
+        for (auto& face : obj.faces) {
             glm::ivec3 triangle_verts;
             for (int i = 0; i < 3; i++) {
-                int vi = face.vertex_indices[i];
+                int64_t vi = face.vertex_indices[i];
                 assert(vi >= 0 && vi < obj.vertices.size());
 
                 auto vertex = std::make_tuple(face.vertex_indices[i],
@@ -80,6 +98,12 @@ struct Mesh {
                 if (existing_index != unique_vertices.end()) {
                     triangle_verts[i] = existing_index->second;
                 } else {
+                    // Triangles index with int; the parse counts don't
+                    // have that limit, so check rather than wrap
+                    if (curr_index > size_t(INT32_MAX)) {
+                        throw std::runtime_error(
+                            "Mesh has more than 2^31 unique vertices\n");
+                    }
                     unique_vertices.emplace(vertex, curr_index);
                     glm::vec3 position = obj.vertices[face.vertex_indices[i]];
                     positions.push_back(position);
@@ -111,6 +135,169 @@ struct Mesh {
         fprintf(stdout, "\nDEBUG: %lu faces have materials\n\n", num_faces_with_materials);
     }
 
+    // Corners (face vertices) are sharded by the hash of their v/vt/vn
+    // triple and each shard finds its unique triples on its own, numbered
+    // by first occurrence. A serial pass over the corners then hands out
+    // the final indices in corner order, which is the serial numbering.
+    void build_parallel(ObjLoader& obj, JobSystem& jobs) {
+        using Key = std::tuple<int64_t, int64_t, int64_t>;
+        auto corner_key = [&](size_t corner) {
+            const Face& face = obj.faces[corner / 3];
+            int i = corner % 3;
+            return std::make_tuple(face.vertex_indices[i],
+                                   face.vertex_texture_indices[i],
+                                   face.vertex_normal_indices[i]);
+        };
+        size_t num_corners = obj.faces.size() * 3;
+
+        // A few shards per thread so uneven ones even out. The shard is
+        // the top bits of the mixed hash, the shard's map uses the rest.
+        int shard_bits = std::min(
+            int(std::bit_width(unsigned(jobs.thread_count() * 4 - 1))), 8);
+        size_t num_shards = size_t(1) << shard_bits;
+        size_t num_blocks = jobs.thread_count() * 4;
+        size_t block_size = (num_corners + num_blocks - 1) / num_blocks;
+        auto block_range = [&](size_t block) {
+            size_t begin = std::min(block * block_size, num_corners);
+            return std::make_pair(begin,
+                                  std::min(begin + block_size, num_corners));
+        };
+
+        // Shard of every corner, counted per block
+        std::vector<uint8_t> shards(num_corners);
+        std::vector<size_t> offsets(num_blocks * num_shards, 0);
+        jobs.parallel_for(num_blocks, [&](size_t block) {
+            auto [begin, end] = block_range(block);
+            for (size_t c = begin; c < end; c++) {
+                uint64_t h = TupleHash{}(corner_key(c));
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdull;
+                h ^= h >> 33;
+                shards[c] = uint8_t(h >> (64 - shard_bits));
+                offsets[block * num_shards + shards[c]]++;
+            }
+        });
+
+        // Corners sorted by shard, still in corner order within each
+        std::vector<size_t> shard_begin(num_shards + 1);
+        size_t total = 0;
+        for (size_t shard = 0; shard < num_shards; shard++) {
+            shard_begin[shard] = total;
+            for (size_t block = 0; block < num_blocks; block++) {
+                size_t count = offsets[block * num_shards + shard];
+                offsets[block * num_shards + shard] = total;
+                total += count;
+            }
+        }
+        shard_begin[num_shards] = total;
+        std::vector<uint32_t> order(num_corners);
+        jobs.parallel_for(num_blocks, [&](size_t block) {
+            auto [begin, end] = block_range(block);
+            for (size_t c = begin; c < end; c++) {
+                order[offsets[block * num_shards + shards[c]]++] = uint32_t(c);
+            }
+        });
+
+        // Index within its shard of every corner's triple
+        std::vector<uint32_t> local(num_corners);
+        std::vector<uint8_t> first(num_corners);
+        jobs.parallel_for(num_shards, [&](size_t shard) {
+            MemoryScope memory_scope(MemoryTag::Mesh);
+            std::unordered_map<Key, uint32_t, TupleHash> unique_vertices;
+            for (size_t i = shard_begin[shard]; i < shard_begin[shard + 1];
+                 i++) {
+                uint32_t c = order[i];
+                auto [existing, inserted] = unique_vertices.emplace(
+                    corner_key(c), uint32_t(unique_vertices.size()));
+                local[c] = existing->second;
+                first[c] = inserted;
+            }
+        });
+        order = {};
+
+        // Shard indices to final ones, and the corner each vertex is from
+        std::vector<std::vector<uint32_t>> shard_vertices(num_shards);
+        std::vector<uint32_t> sources;
+        for (size_t c = 0; c < num_corners; c++) {
+            if (first[c]) {
+                if (sources.size() > size_t(INT32_MAX)) {
+                    throw std::runtime_error(
+                        "Mesh has more than 2^31 unique vertices\n");
+                }
+                shard_vertices[shards[c]].push_back(uint32_t(sources.size()));
+                sources.push_back(uint32_t(c));
+            }
+        }
+
+        triangles.resize(obj.faces.size());
+        size_t face_block = (obj.faces.size() + num_blocks - 1) / num_blocks;
+        jobs.parallel_for(num_blocks, [&](size_t block) {
+            size_t begin = std::min(block * face_block, obj.faces.size());
+            size_t end = std::min(begin + face_block, obj.faces.size());
+            for (size_t f = begin; f < end; f++) {
+                Triangle& tri = triangles[f];
+                for (int i = 0; i < 3; i++) {
+                    size_t c = f * 3 + i;
+                    tri.vertices[i] = shard_vertices[shards[c]][local[c]];
+                }
+                const Face& face = obj.faces[f];
+                if (face.material.has_value()) {
+                    tri.material = obj.materials.at(face.material.value()).get();
+                }
+            }
+        });
+
+        size_t num_vertices = sources.size();
+        positions.resize(num_vertices);
+        texcoords.resize(num_vertices);
+        normals.resize(num_vertices);
+        std::vector<BoundingBox> block_bounds(num_blocks);
+        size_t vertex_block = (num_vertices + num_blocks - 1) / num_blocks;
+        jobs.parallel_for(num_blocks, [&](size_t block) {
+            size_t begin = std::min(block * vertex_block, num_vertices);
+            size_t end = std::min(begin + vertex_block, num_vertices);
+            for (size_t v = begin; v < end; v++) {
+                const Face& face = obj.faces[sources[v] / 3];
+                int i = sources[v] % 3;
+                int64_t vi = face.vertex_indices[i];
+                assert(vi >= 0 && size_t(vi) < obj.vertices.size());
+                positions[v] = obj.vertices[vi];
+                block_bounds[block].add_point(positions[v]);
+                texcoords[v] = glm::vec2(
+                    obj.vertex_textures[face.vertex_texture_indices[i]]);
+                normals[v] = obj.vertex_normals[face.vertex_normal_indices[i]];
+            }
+        });
+        for (size_t block = 0; block < num_blocks; block++) {
+            if (block * vertex_block < num_vertices) {  // not empty
+                bounds.add_point(block_bounds[block].min);
+                bounds.add_point(block_bounds[block].max);
+            }
+        }
+    }
+
+    // Maps every vertex to a position-only vertex list, welded on position
+    // alone: vertices only split by normal/texcoord seams become one
+    void weld_positions(std::vector<glm::vec3>& welded,
+                        std::vector<unsigned int>& remap) const {
+        std::unordered_map<std::tuple<int, int, int>, unsigned int, TupleHash>
+            unique_positions;
+        welded.clear();
+        remap.resize(positions.size());
+        for (size_t i = 0; i < positions.size(); i++) {
+            auto& p = positions[i];
+            auto key = std::make_tuple(std::bit_cast<int>(p.x),
+                                       std::bit_cast<int>(p.y),
+                                       std::bit_cast<int>(p.z));
+            auto [existing, inserted] =
+                unique_positions.emplace(key, welded.size());
+            if (inserted) {
+                welded.push_back(p);
+            }
+            remap[i] = existing->second;
+        }
+    }
+
     glm::mat4 center_mesh_transform() {
         float max_bounds_diff = std::max(
             bounds.max.x - bounds.min.x,
@@ -0,0 +1,100 @@
+#include "mesh_chunks.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "trace.hpp"
+
+namespace {
+
+struct ChunkSplitter {
+    const Mesh& mesh;
+    size_t max_vertices;
+    std::vector<MeshChunk>& chunks;
+
+    std::vector<glm::vec3> centroids;  // per triangle
+    // Last count_vertices call that saw each vertex, so counting a range
+    // needs no clearing
+    std::vector<uint32_t> seen;
+    uint32_t stamp = 0;
+
+    size_t count_vertices(const size_t* begin, const size_t* end) {
+        stamp++;
+        size_t count = 0;
+        for (const size_t* t = begin; t != end; t++) {
+            for (int v = 0; v < 3; v++) {
+                int vertex = mesh.triangles[*t].vertices[v];
+                if (seen[vertex] != stamp) {
+                    seen[vertex] = stamp;
+                    count++;
+                }
+            }
+        }
+        return count;
+    }
+
+    void split(Material* material, size_t* begin, size_t* end) {
+        size_t vertex_count = count_vertices(begin, end);
+        if (vertex_count <= max_vertices || end - begin < 2) {
+            chunks.push_back({material, std::vector<size_t>(begin, end)});
+            return;
+        }
+
+        BoundingBox bounds;
+        for (const size_t* t = begin; t != end; t++) {
+            bounds.add_point(centroids[*t]);
+        }
+        glm::vec3 extent = bounds.max - bounds.min;
+        int axis = extent.x >= extent.y ? (extent.x >= extent.z ? 0 : 2)
+                                        : (extent.y >= extent.z ? 1 : 2);
+
+        // Cut where it leaves whole chunks on the left rather than always
+        // halving, so chunks come out close to full
+        size_t parts = (vertex_count + max_vertices - 1) / max_vertices;
+        size_t count = end - begin;
+        size_t* middle =
+            begin + std::clamp<size_t>(count * (parts / 2) / parts, 1, count - 1);
+        std::nth_element(begin, middle, end, [&](size_t a, size_t b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        split(material, begin, middle);
+        split(material, middle, end);
+    }
+};
+
+}  // namespace
+
+std::vector<MeshChunk> split_mesh_chunks(const Mesh& mesh,
+                                         size_t max_vertices) {
+    TRACE_SCOPE("split_mesh_chunks");
+    MemoryScope memory_scope(MemoryTag::Upload);
+    std::vector<MeshChunk> chunks;
+    ChunkSplitter splitter{mesh, max_vertices, chunks, {}, {}, 0};
+    splitter.seen.assign(mesh.positions.size(), 0);
+    splitter.centroids.reserve(mesh.triangles.size());
+    for (auto& triangle : mesh.triangles) {
+        glm::ivec3 v = triangle.vertices;
+        splitter.centroids.push_back((mesh.positions[v.x] + mesh.positions[v.y] +
+                                      mesh.positions[v.z]) /
+                                     3.0f);
+    }
+
+    std::vector<size_t> order(mesh.triangles.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return mesh.triangles[a].material < mesh.triangles[b].material;
+    });
+    for (size_t first = 0; first < order.size();) {
+        Material* material = mesh.triangles[order[first]].material;
+        size_t last = first;
+        while (last < order.size() &&
+               mesh.triangles[order[last]].material == material) {
+            last++;
+        }
+        splitter.split(material, order.data() + first, order.data() + last);
+        first = last;
+    }
+    return chunks;
+}
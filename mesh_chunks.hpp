@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#include "mesh.hpp"
+
+// Most vertices a chunk can address with 16-bit indices (0xffff is left
+// free, it's the primitive restart index by convention)
+const size_t MAX_CHUNK_VERTICES = 65535;
+
+struct MeshChunk {
+    Material* material;
+    std::vector<size_t> triangles;  // into Mesh::triangles
+};
+
+// Splits a mesh into pieces that can be drawn with 16-bit indices: the
+// triangles are grouped by material (as in Rasterizer::prepareMesh), then
+// each group is cut recursively at its triangle centroids along the longest
+// axis until every piece uses at most max_vertices distinct vertices.
+// Pieces are spatially compact, so their bounds are tight enough to cull
+// one by one. Chunks of one material are consecutive.
+std::vector<MeshChunk> split_mesh_chunks(
+    const Mesh& mesh, size_t max_vertices = MAX_CHUNK_VERTICES);
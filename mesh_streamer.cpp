@@ -0,0 +1,285 @@
+#include "mesh_streamer.hpp"
+
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "obj_loader.hpp"
+
+void parse_obj_geometry(const char* filename, std::vector<glm::vec3>& positions,
+                        std::vector<glm::i64vec3>& triangles) {
+    TRACE_SCOPE("parse_obj_geometry");
+    MemoryScope memory_scope(MemoryTag::Loader);
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file: " +
+                                 std::string(filename) + "\n");
+    }
+
+    std::string line;
+    std::vector<int64_t> polygon;
+    while (getline(file, line)) {
+        if (line.size() < 2 || line[1] != ' ' ||
+            (line[0] != 'v' && line[0] != 'f')) {
+            continue;  // vt, vn, materials, groups, comments
+        }
+        const char* cursor = line.data() + 2;
+        const char* end = line.data() + line.size();
+        auto next_token = [&]() {
+            while (cursor < end && (*cursor == ' ' || *cursor == '\t')) cursor++;
+            const char* token = cursor;
+            while (cursor < end && *cursor != ' ' && *cursor != '\t' &&
+                   *cursor != '\r') {
+                cursor++;
+            }
+            return std::string_view(token, cursor - token);
+        };
+
+        if (line[0] == 'v') {
+            glm::vec3 p;
+            for (int i = 0; i < 3; i++) {
+                std::string_view token = next_token();
+                std::from_chars(token.data(), token.data() + token.size(), p[i]);
+            }
+            positions.push_back(p);
+            continue;
+        }
+
+        // Same corner parsing and index resolution as ObjLoader, so the
+        // proxy and the full mesh agree on every face
+        polygon.clear();
+        for (std::string_view token = next_token(); !token.empty();
+             token = next_token()) {
+            auto [v, t, n] = ObjLoader::get_face_vertex_index(token);
+            int64_t index = obj_index(v, positions.size());
+            if (index < 0 || size_t(index) >= positions.size()) {
+                polygon.clear();  // skip the face rather than guess
+                break;
+            }
+            polygon.push_back(index);
+        }
+        for (size_t i = 2; i < polygon.size(); i++) {
+            triangles.emplace_back(polygon[0], polygon[i - 1], polygon[i]);
+        }
+    }
+}
+
+Mesh cluster_vertices(const std::vector<glm::vec3>& positions,
+                      const std::vector<glm::i64vec3>& triangles, int grid) {
+    TRACE_SCOPE("cluster_vertices");
+    MemoryScope memory_scope(MemoryTag::Mesh);
+    Mesh proxy;
+    for (auto& triangle : triangles) {
+        for (int v = 0; v < 3; v++) {
+            proxy.bounds.add_point(positions[triangle[v]]);
+        }
+    }
+    if (triangles.empty()) {
+        return proxy;
+    }
+
+    // Cubic cells, grid of them along the longest side
+    glm::vec3 extent = proxy.bounds.max - proxy.bounds.min;
+    float cell = std::max({extent.x, extent.y, extent.z}) / grid;
+    if (cell <= 0) cell = 1;
+    auto cell_key = [&](glm::vec3 p) {
+        glm::ivec3 c = glm::clamp(glm::ivec3((p - proxy.bounds.min) / cell),
+                                  glm::ivec3(0), glm::ivec3(grid - 1));
+        return (uint64_t(c.x) << 42) | (uint64_t(c.y) << 21) | uint64_t(c.z);
+    };
+
+    // Cluster per input vertex, made on first use
+    std::unordered_map<uint64_t, uint32_t> cells;
+    std::vector<int32_t> cluster_of(positions.size(), -1);
+    std::vector<glm::vec3> sums;
+    std::vector<uint32_t> counts;
+    auto cluster = [&](int64_t vertex) {
+        if (cluster_of[vertex] < 0) {
+            auto [it, inserted] =
+                cells.emplace(cell_key(positions[vertex]), sums.size());
+            if (inserted) {
+                sums.emplace_back(0);
+                counts.push_back(0);
+            }
+            cluster_of[vertex] = it->second;
+            sums[it->second] += positions[vertex];
+            counts[it->second]++;
+        }
+        return uint32_t(cluster_of[vertex]);
+    };
+
+    // Keep each surviving triangle once, whatever its rotation
+    std::unordered_set<std::tuple<int, int, int>, TupleHash> kept;
+    for (auto& triangle : triangles) {
+        glm::ivec3 t(cluster(triangle[0]), cluster(triangle[1]),
+                     cluster(triangle[2]));
+        if (t.x == t.y || t.y == t.z || t.x == t.z) {
+            continue;  // collapsed into a cell
+        }
+        int first = t.x < t.y ? (t.x < t.z ? 0 : 2) : (t.y < t.z ? 1 : 2);
+        glm::ivec3 rotated(t[first], t[(first + 1) % 3], t[(first + 2) % 3]);
+        if (kept.emplace(rotated.x, rotated.y, rotated.z).second) {
+            Mesh::Triangle proxy_triangle;
+            proxy_triangle.vertices = rotated;
+            proxy.triangles.push_back(proxy_triangle);
+        }
+    }
+
+    proxy.positions.resize(sums.size());
+    for (size_t i = 0; i < sums.size(); i++) {
+        proxy.positions[i] = sums[i] / float(counts[i]);
+    }
+    // Area weighted face normals
+    proxy.normals.assign(sums.size(), glm::vec3(0));
+    for (auto& triangle : proxy.triangles) {
+        glm::ivec3 v = triangle.vertices;
+        glm::vec3 normal =
+            glm::cross(proxy.positions[v.y] - proxy.positions[v.x],
+                       proxy.positions[v.z] - proxy.positions[v.x]);
+        for (int i = 0; i < 3; i++) {
+            proxy.normals[v[i]] += normal;
+        }
+    }
+    for (auto& normal : proxy.normals) {
+        float length = glm::length(normal);
+        normal = length > 0 ? normal / length : glm::vec3(0, 1, 0);
+    }
+    proxy.texcoords.assign(sums.size(), glm::vec2(0));
+    return proxy;
+}
+
+MeshStreamer::MeshStreamer(std::string path, AssetManager& assets,
+                           JobSystem& jobs, StreamSettings settings)
+    : path(std::move(path)),
+      assets(assets),
+      settings(settings),
+      start(Clock::now()),
+      jobs(jobs) {
+    jobs.run_background([this] { load(); }, &loader);
+}
+
+MeshStreamer::~MeshStreamer() {
+    cancel = true;
+    jobs.wait(loader);
+}
+
+double MeshStreamer::elapsed_ms() const {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+}
+
+void MeshStreamer::load() {
+    TRACE_SCOPE("stream mesh");
+    try {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::i64vec3> triangles;
+        parse_obj_geometry(path.c_str(), positions, triangles);
+        Mesh proxy = cluster_vertices(positions, triangles, settings.proxy_grid);
+        fprintf(stdout, "Proxy: %zu -> %zu triangles, %zu vertices (%.1f ms)\n",
+                triangles.size(), proxy.triangles.size(),
+                proxy.positions.size(), elapsed_ms());
+        positions = {};
+        triangles = {};
+        auto upload =
+            std::make_unique<Rasterizer::MeshUpload>(Rasterizer::prepareMesh(proxy));
+        {
+            std::lock_guard lock(mutex);
+            proxy_upload = std::move(upload);
+            proxy_transform = proxy.center_mesh_transform();
+            proxy_triangles = proxy.triangles.size();
+            proxy_ready_ms = elapsed_ms();
+        }
+        if (cancel) return;
+
+        std::shared_ptr<Mesh> mesh = assets.mesh(path);
+        upload = std::make_unique<Rasterizer::MeshUpload>(
+            Rasterizer::prepareMesh(*mesh, settings.chunked));
+        std::lock_guard lock(mutex);
+        full_mesh = std::move(mesh);
+        full_upload = std::move(upload);
+        full_triangles = full_mesh->triangles.size();
+        full_ready_ms = elapsed_ms();
+        loader_done = true;
+    } catch (const std::exception& e) {
+        std::lock_guard lock(mutex);
+        error = e.what();
+        loader_done = true;
+    }
+}
+
+bool MeshStreamer::update(Rasterizer& rasterizer) {
+    if (finished) {
+        return false;
+    }
+
+    bool changed = false;
+    std::unique_lock lock(mutex);
+    if (!error.empty()) {
+        fprintf(stderr, "ERROR: streaming %s failed: %s", path.c_str(),
+                error.c_str());
+        finished = true;
+        return false;
+    }
+    // Proxy first, whole: it's small. Skipped if the full mesh beat it.
+    if (proxy_upload && !full_upload && !streaming) {
+        auto upload = std::move(proxy_upload);
+        transform = proxy_transform;
+        lock.unlock();
+        proxy_gpu = rasterizer.reserveMesh(*upload);
+        while (!rasterizer.streamMesh(proxy_gpu, *upload, SIZE_MAX)) {
+        }
+        current = &proxy_gpu;
+        changed = true;
+        lock.lock();
+    }
+    if (full_upload) {
+        streaming = std::move(full_upload);
+        if (!current) {
+            transform = proxy_transform;
+        }
+        lock.unlock();
+        full_gpu = rasterizer.reserveMesh(*streaming);
+    } else {
+        lock.unlock();
+    }
+
+    if (streaming) {
+        upload_frames++;
+        if (rasterizer.streamMesh(full_gpu, *streaming,
+                                  settings.upload_bytes_per_frame)) {
+            if (current == &proxy_gpu) {
+                rasterizer.freeMesh(proxy_gpu);
+            }
+            current = &full_gpu;
+            streaming = nullptr;
+            full_uploaded_ms = elapsed_ms();
+            assets.mesh_uploaded(full_mesh.get());
+            finished = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void MeshStreamer::frame_presented() {
+    if (current && first_frame_ms < 0) {
+        first_frame_ms = elapsed_ms();
+    }
+    if (full_detail() && full_detail_ms < 0) {
+        full_detail_ms = elapsed_ms();
+        print_stats();
+    }
+}
+
+void MeshStreamer::print_stats(FILE* out) const {
+    fprintf(out, "Progressive load of %s:\n", path.c_str());
+    fprintf(out, "\tproxy: %zu triangles, ready %.1f ms\n", proxy_triangles,
+            proxy_ready_ms);
+    fprintf(out, "\tfull: %zu triangles, loaded %.1f ms, uploaded %.1f ms "
+            "over %d frames\n",
+            full_triangles, full_ready_ms, full_uploaded_ms, upload_frames);
+    fprintf(out, "\ttime to first frame: %.1f ms\n", first_frame_ms);
+    fprintf(out, "\ttime to full detail: %.1f ms\n", full_detail_ms);
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "asset_manager.hpp"
+#include "job_system.hpp"
+#include "mesh.hpp"
+#include "rasterizer.hpp"
+
+struct StreamSettings {
+    // Cells along the longest side of the bounds for the coarse proxy
+    int proxy_grid = 64;
+    // Vertex/index bytes uploaded per update(), so a frame never waits on
+    // the whole mesh
+    size_t upload_bytes_per_frame = 4 << 20;
+    // Full mesh in 16-bit index chunks (Rasterizer::chunk_meshes); the
+    // proxy is small enough to stay whole
+    bool chunked = false;
+};
+
+// Progressive loading of one OBJ for a fast first frame.
+//
+// A background job first reads only the positions and faces (no normals,
+// texcoords or materials) and collapses them onto a coarse grid (vertex
+// clustering), which gives a small proxy with the right silhouette. Then it
+// loads the mesh in full through the asset manager. Both are prepared for
+// upload on the loader (Rasterizer::prepareMesh). The job runs on an idle
+// worker of the shared job system, never inside a frame's wait, so the
+// system needs at least one worker (the default always has one).
+//
+// On the GL thread, update() uploads the proxy as soon as it's ready, then
+// streams the full mesh in slices of upload_bytes_per_frame plus one
+// texture per frame. mesh() stays the proxy until every slice is in and is
+// swapped to the full mesh in one step, so a frame never draws a partly
+// uploaded mesh.
+//
+// The asset manager isn't thread safe: it belongs to the loader until
+// done(). The proxy has no materials, so drawing it doesn't touch it.
+class MeshStreamer {
+   public:
+    MeshStreamer(std::string path, AssetManager& assets, JobSystem& jobs,
+                 StreamSettings settings = StreamSettings());
+    // Waits for the loader; GPU meshes are left to the rasterizer's arenas
+    ~MeshStreamer();
+
+    MeshStreamer(const MeshStreamer&) = delete;
+    MeshStreamer& operator=(const MeshStreamer&) = delete;
+
+    // GL thread, once per frame before drawing. Returns true when mesh()
+    // changed (proxy shown or full detail swapped in).
+    bool update(Rasterizer& rasterizer);
+    // After the swap, so time to first frame and to full detail include it
+    void frame_presented();
+
+    // Null until the proxy is up
+    const GPUMesh* mesh() const { return current; }
+    bool full_detail() const { return current == &full_gpu; }
+    // Loader finished (or failed) and the full mesh is up
+    bool done() const { return finished; }
+    // Centers and scales the model, from the bounds of the first stage
+    // that arrived
+    glm::mat4 model_transform() const { return transform; }
+
+    void print_stats(FILE* out = stdout) const;
+
+   private:
+    using Clock = std::chrono::steady_clock;
+
+    std::string path;
+    AssetManager& assets;
+    StreamSettings settings;
+    Clock::time_point start;
+
+    // Loader results, handed over under the mutex
+    std::mutex mutex;
+    std::unique_ptr<Rasterizer::MeshUpload> proxy_upload;
+    std::unique_ptr<Rasterizer::MeshUpload> full_upload;
+    glm::mat4 proxy_transform;
+    std::shared_ptr<Mesh> full_mesh;
+    std::string error;
+    bool loader_done = false;
+    std::atomic<bool> cancel = false;
+    JobSystem& jobs;
+    JobCounter loader;
+
+    // GL thread state
+    GPUMesh proxy_gpu;
+    GPUMesh full_gpu;
+    std::unique_ptr<Rasterizer::MeshUpload> streaming;  // full, going up
+    const GPUMesh* current = nullptr;
+    glm::mat4 transform = glm::mat4(1);
+    bool finished = false;
+
+    // Stats, ms since construction (< 0 = not yet)
+    size_t proxy_triangles = 0;
+    size_t full_triangles = 0;
+    double proxy_ready_ms = -1;
+    double full_ready_ms = -1;    // loaded and prepared on the loader
+    double full_uploaded_ms = -1;
+    double first_frame_ms = -1;
+    double full_detail_ms = -1;
+    int upload_frames = 0;  // updates spent streaming the full mesh
+
+    double elapsed_ms() const;
+    void load();
+};
+
+// Coarse stand-in from positions and faces alone: vertices are merged per
+// grid cell (at their average), collapsed and duplicate triangles dropped,
+// and normals averaged from the remaining faces. Bounds are those of the
+// input, so the model transform matches the full mesh.
+Mesh cluster_vertices(const std::vector<glm::vec3>& positions,
+                      const std::vector<glm::i64vec3>& triangles, int grid);
+
+// Only the v and f lines of an OBJ file (polygons fanned into triangles),
+// with faces read the way ObjLoader reads them
+void parse_obj_geometry(const char* filename, std::vector<glm::vec3>& positions,
+                        std::vector<glm::i64vec3>& triangles);
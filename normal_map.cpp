@@ -0,0 +1,246 @@
+#include "normal_map.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "hash.hpp"
+
+namespace {
+
+const uint32_t CACHE_MAGIC = 0x314d524e;  // "NRM1"
+
+struct Normal {
+    float x, y, z;
+};
+
+// Splits [0, count) rows over the pool, or runs them here
+void for_rows(int count, JobSystem* pool, const std::function<void(size_t)>& fn) {
+    if (pool && count >= 64) {
+        pool->parallel_for(count, fn, 16);
+    } else {
+        for (int y = 0; y < count; y++) fn(y);
+    }
+}
+
+uint8_t encode(float value) {
+    return uint8_t(std::clamp(value * 127.5f + 127.5f + 0.5f, 0.f, 255.f));
+}
+
+void pack_level(const std::vector<Normal>& normals, NormalMapLevel& level,
+                JobSystem* pool) {
+    level.xy.resize(size_t(level.width) * level.height * 2);
+    for_rows(level.height, pool, [&](size_t y) {
+        size_t row = y * level.width;
+        for (int x = 0; x < level.width; x++) {
+            level.xy[(row + x) * 2] = encode(normals[row + x].x);
+            level.xy[(row + x) * 2 + 1] = encode(normals[row + x].y);
+        }
+    });
+}
+
+Normal normalized(float x, float y, float z) {
+    float length = std::sqrt(x * x + y * y + z * z);
+    if (length < 1e-12f) return {0, 0, 1};
+    return {x / length, y / length, z / length};
+}
+
+// Mean of the 2x2 normals under each texel, renormalized. Edge texels
+// repeat for odd sizes, like the color mip chain.
+std::vector<Normal> downsample(const std::vector<Normal>& normals, int width,
+                               int height, JobSystem* pool) {
+    int out_width = std::max(width / 2, 1);
+    int out_height = std::max(height / 2, 1);
+    std::vector<Normal> out(size_t(out_width) * out_height);
+    for_rows(out_height, pool, [&](size_t y) {
+        int y0 = std::min(2 * int(y), height - 1);
+        int y1 = std::min(2 * int(y) + 1, height - 1);
+        for (int x = 0; x < out_width; x++) {
+            int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            const Normal& a = normals[size_t(y0) * width + x0];
+            const Normal& b = normals[size_t(y0) * width + x1];
+            const Normal& c = normals[size_t(y1) * width + x0];
+            const Normal& d = normals[size_t(y1) * width + x1];
+            out[y * out_width + x] = normalized(a.x + b.x + c.x + d.x,
+                                                a.y + b.y + c.y + d.y,
+                                                a.z + b.z + c.z + d.z);
+        }
+    });
+    return out;
+}
+
+uint64_t cache_key(const std::string& path, const TextureMap& texture,
+                   const NormalMapSettings& settings) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) return 0;
+    int64_t modified =
+        std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    if (ec) return 0;
+
+    uint64_t key = fnv1a(&size, sizeof(size));
+    key = fnv1a(&modified, sizeof(modified), key);
+    key = fnv1a(&texture.width, sizeof(texture.width), key);
+    key = fnv1a(&texture.height, sizeof(texture.height), key);
+    key = fnv1a(&settings.strength, sizeof(settings.strength), key);
+    return fnv1a(&settings.sobel, sizeof(settings.sobel), key);
+}
+
+bool read_cache(const std::string& path, uint64_t key, NormalMap& map) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    uint32_t magic = 0, level_count = 0;
+    uint64_t stored_key = 0;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&stored_key, sizeof(stored_key));
+    file.read((char*)&level_count, sizeof(level_count));
+    if (!file || magic != CACHE_MAGIC || stored_key != key || level_count > 32) {
+        return false;
+    }
+    map.levels.resize(level_count);
+    for (auto& level : map.levels) {
+        file.read((char*)&level.width, sizeof(level.width));
+        file.read((char*)&level.height, sizeof(level.height));
+        if (!file || level.width <= 0 || level.height <= 0 ||
+            level.width > 1 << 16 || level.height > 1 << 16) {
+            return false;
+        }
+        level.xy.resize(size_t(level.width) * level.height * 2);
+        file.read((char*)level.xy.data(), level.xy.size());
+    }
+    return bool(file);
+}
+
+void write_cache(const std::string& path, uint64_t key, const NormalMap& map) {
+    // Write then rename so a crash never leaves a truncated entry behind
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary);
+        if (!file.is_open()) {
+            fprintf(stderr, "ERROR: could not write normal map cache %s\n",
+                    tmp_path.c_str());
+            return;
+        }
+        uint32_t level_count = map.levels.size();
+        file.write((const char*)&CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        file.write((const char*)&key, sizeof(key));
+        file.write((const char*)&level_count, sizeof(level_count));
+        for (auto& level : map.levels) {
+            file.write((const char*)&level.width, sizeof(level.width));
+            file.write((const char*)&level.height, sizeof(level.height));
+            file.write((const char*)level.xy.data(), level.xy.size());
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+}
+
+}  // namespace
+
+NormalMap height_to_normal_map(const uint8_t* rgba, int width, int height,
+                               const NormalMapSettings& settings,
+                               JobSystem* pool) {
+    auto start = std::chrono::steady_clock::now();
+    NormalMap map;
+
+    // Luminance in [0, 1]
+    std::vector<float> heights(size_t(width) * height);
+    for_rows(height, pool, [&](size_t y) {
+        const uint8_t* row = rgba + y * width * 4;
+        for (int x = 0; x < width; x++) {
+            heights[y * width + x] =
+                (0.299f * row[x * 4] + 0.587f * row[x * 4 + 1] +
+                 0.114f * row[x * 4 + 2]) / 255.f;
+        }
+    });
+
+    // Slopes in height per texel: Sobel weights sum to 4 per side, 2 texels
+    // apart, so both filters divide down to the same scale
+    std::vector<Normal> normals(heights.size());
+    for_rows(height, pool, [&](size_t y) {
+        const float* up = &heights[size_t((y + height - 1) % height) * width];
+        const float* row = &heights[y * width];
+        const float* down = &heights[size_t((y + 1) % height) * width];
+        for (int x = 0; x < width; x++) {
+            int left = (x + width - 1) % width, right = (x + 1) % width;
+            float dx, dy;
+            if (settings.sobel) {
+                dx = (up[right] + 2 * row[right] + down[right] - up[left] -
+                      2 * row[left] - down[left]) / 8;
+                dy = (down[left] + 2 * down[x] + down[right] - up[left] -
+                      2 * up[x] - up[right]) / 8;
+            } else {
+                dx = (row[right] - row[left]) / 2;
+                dy = (down[x] - up[x]) / 2;
+            }
+            normals[y * width + x] =
+                normalized(-settings.strength * dx, -settings.strength * dy, 1);
+        }
+    });
+
+    while (true) {
+        map.levels.push_back({width, height, {}});
+        pack_level(normals, map.levels.back(), pool);
+        if (width == 1 && height == 1) {
+            break;
+        }
+        normals = downsample(normals, width, height, pool);
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+    map.build_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    return map;
+}
+
+NormalMap load_normal_map(const TextureMap& texture,
+                          const NormalMapSettings& settings, JobSystem* pool) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t key = texture.path.empty() ? 0 : cache_key(texture.path, texture, settings);
+    std::string cache_path = texture.path + ".normal";
+
+    NormalMap map;
+    if (key && read_cache(cache_path, key, map)) {
+        map.from_cache = true;
+        map.build_ms = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+        return map;
+    }
+    map = height_to_normal_map(texture.pixels.data(), texture.width,
+                               texture.height, settings, pool);
+    if (key) {
+        write_cache(cache_path, key, map);
+    }
+    return map;
+}
+
+CompressedTexture compress_normal_map(const NormalMap& map, JobSystem* pool) {
+    auto start = std::chrono::steady_clock::now();
+    CompressedTexture texture;
+    texture.format = BlockFormat::BC5;
+    std::vector<uint8_t> rgba;
+    for (auto& level : map.levels) {
+        rgba.assign(level.xy.size() * 2, 0);
+        for (size_t i = 0; i < level.xy.size() / 2; i++) {
+            rgba[i * 4] = level.xy[i * 2];
+            rgba[i * 4 + 1] = level.xy[i * 2 + 1];
+        }
+        texture.levels.push_back(compress_texture_level(
+            rgba.data(), level.width, level.height, BlockFormat::BC5, pool));
+        texture.stats.megapixels += double(level.width) * level.height / 1e6;
+        texture.stats.bytes += texture.levels.back().data.size();
+    }
+    texture.stats.encode_ms = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+    return texture;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "job_system.hpp"
+#include "materials.hpp"
+#include "texture_compression.hpp"
+
+// Height (bump) maps turned into tangent space normal maps once at load
+// time, so shading needs one texture fetch instead of several neighbouring
+// height samples per fragment.
+struct NormalMapSettings {
+    // Slope scale: a height step of 1 (black to white) over one texel tilts
+    // the normal by atan(strength)
+    float strength = 4;
+    bool sobel = true;  // 3x3 Sobel, else central differences
+};
+
+// Two channels per texel, x and y mapped from [-1, 1] to [0, 255]; the
+// shader rebuilds z = sqrt(1 - x^2 - y^2). u runs along rows, v down them
+// (texture rows as uploaded).
+struct NormalMapLevel {
+    int width;
+    int height;
+    std::vector<uint8_t> xy;
+};
+
+struct NormalMap {
+    std::vector<NormalMapLevel> levels;  // full chain down to 1x1
+    double build_ms = 0;  // or load time, for a cache hit
+    bool from_cache = false;
+};
+
+// Height is the luminance of the RGBA8 pixels, sampled with wrapping since
+// bump maps tile. Rows are spread over the pool. Each mip averages the
+// level above's unit normals and renormalizes, rather than box filtering
+// the encoded values.
+NormalMap height_to_normal_map(const uint8_t* rgba, int width, int height,
+                               const NormalMapSettings& settings,
+                               JobSystem* pool = nullptr);
+
+// BC5 of every level, x in red and y in green
+CompressedTexture compress_normal_map(const NormalMap& map,
+                                      JobSystem* pool = nullptr);
+
+// height_to_normal_map for a loaded texture, cached next to its source file
+// as <path>.normal. Entries are keyed by the source's size and modification
+// time and the settings; a stale or unreadable entry is rebuilt.
+NormalMap load_normal_map(const TextureMap& texture,
+                          const NormalMapSettings& settings,
+                          JobSystem* pool = nullptr);
@@ -1,5 +1,12 @@
 #include "obj_loader.hpp"
 
+#include <algorithm>
+
+#include "fast_png.hpp"
+#include "hash.hpp"
+#include "memory_tracker.hpp"
+#include "trace.hpp"
+
 // Converts string to float (throws exception on failure)
 float string_to_float(std::string_view value_view) {
     float value;
@@ -14,9 +21,9 @@ float string_to_float(std::string_view value_view) {
     return value;
 }
 
-// Converts string to float (throws exception on failure)
-int string_to_int(std::string_view value_view) {
-    int value;
+// Converts string to a 64-bit integer (throws exception on failure)
+int64_t string_to_int(std::string_view value_view) {
+    int64_t value;
     auto [ptr, ec] = std::from_chars(
         value_view.data(), value_view.data() + value_view.size(), value);
     if (ec == std::errc::invalid_argument) {
@@ -28,7 +35,7 @@ int string_to_int(std::string_view value_view) {
     return value;
 }
 
-std::tuple<int, std::optional<int>, std::optional<int>>
+std::tuple<int64_t, std::optional<int64_t>, std::optional<int64_t>>
 ObjLoader::get_face_vertex_index(std::string_view face_index_group) {
     std::vector<std::string_view> tokens;
 
@@ -43,16 +50,18 @@ ObjLoader::get_face_vertex_index(std::string_view face_index_group) {
         start = pos + 1;
     }
 
-    int v = string_to_int(tokens[0]);  // TODO: use from_chars instead
+    int64_t v = string_to_int(tokens[0]);  // TODO: use from_chars instead
 
-    std::optional<int> vt;
-    std::optional<int> vn;
-    if (tokens[1] != "") vt = string_to_int(tokens[1]);
-    if (tokens[2] != "") vn = string_to_int(tokens[2]);
+    std::optional<int64_t> vt;
+    std::optional<int64_t> vn;
+    if (tokens.size() > 1 && tokens[1] != "") vt = string_to_int(tokens[1]);
+    if (tokens.size() > 2 && tokens[2] != "") vn = string_to_int(tokens[2]);
     return {v, vt, vn};
 }
 
 void ObjLoader::parse_obj_file(const char* filename) {
+    TRACE_SCOPE("parse_obj_file");
+    MemoryScope memory_scope(MemoryTag::Loader);
     std::ifstream file;
     file.open(filename);
     if (!file.is_open()) {
@@ -62,10 +71,14 @@ void ObjLoader::parse_obj_file(const char* filename) {
 
     fprintf(stdout, "Using obj file: %s\n", std::string(filename).c_str());
 
+    // Writes to an unopened stream are no-ops
     std::ofstream testFile;
-    testFile.open("test_file.obj");
-    if (!testFile.is_open()) {
-        throw std::runtime_error("Failed to open test file: \n");
+    if (!debug_obj_path.empty()) {
+        testFile.open(debug_obj_path);
+        if (!testFile.is_open()) {
+            throw std::runtime_error("Failed to open test file: " +
+                                     debug_obj_path + "\n");
+        }
     }
 
     std::string curr_material;
@@ -76,7 +89,10 @@ void ObjLoader::parse_obj_file(const char* filename) {
             "/";  // TODO: this expects forward slash for dir structure
     }
     std::string line;
+    content_hash = fnv1a(nullptr, 0);
     while (getline(file, line)) {
+        content_hash = fnv1a(line.data(), line.size(), content_hash);
+        content_hash = fnv1a("\n", 1, content_hash);
         if (!line.empty() && line.back() == '\r') {
             line.pop_back();
         }
@@ -146,9 +162,9 @@ void ObjLoader::parse_obj_file(const char* filename) {
 
         if (type == "f") {
             if (tokens.size() > 3) {  // polygon
-                std::vector<unsigned int> positions;
-                std::vector<unsigned int> normals;
-                std::vector<unsigned int> texcoords;
+                std::vector<int64_t> positions;
+                std::vector<int64_t> normals;
+                std::vector<int64_t> texcoords;
 
                 std::string string = "f ";
                 for (int i = 0; i < tokens.size(); i++) {
@@ -170,17 +186,21 @@ void ObjLoader::parse_obj_file(const char* filename) {
                 //                std::string(tokens[2]) +
                 //                "\n";
 
-                for (int i = 1; i < positions.size() - 1; i++) {
+                for (size_t i = 1; i < positions.size() - 1; i++) {
                     Face f;
-                    f.vertex_indices =
-                        glm::ivec3(positions[0] - 1, positions[i] - 1,
-                                   positions[i + 1] - 1);
+                    size_t nv = vertices.size();
+                    f.vertex_indices = glm::i64vec3(
+                        obj_index(positions[0], nv), obj_index(positions[i], nv),
+                        obj_index(positions[i + 1], nv));
                     if (!normals.empty()) {
-                        f.vertex_texture_indices =
-                            glm::ivec3(texcoords[0] - 1, texcoords[i] - 1,
-                                       texcoords[i + 1] - 1);
-                        f.vertex_normal_indices = glm::ivec3(
-                            normals[0] - 1, normals[i] - 1, normals[i + 1] - 1);
+                        size_t nt = vertex_textures.size();
+                        size_t nn = vertex_normals.size();
+                        f.vertex_texture_indices = glm::i64vec3(
+                            obj_index(texcoords[0], nt), obj_index(texcoords[i], nt),
+                            obj_index(texcoords[i + 1], nt));
+                        f.vertex_normal_indices = glm::i64vec3(
+                            obj_index(normals[0], nn), obj_index(normals[i], nn),
+                            obj_index(normals[i + 1], nn));
                     }
                     if (!curr_material.empty()) {
                         f.material = curr_material;
@@ -196,14 +216,20 @@ void ObjLoader::parse_obj_file(const char* filename) {
             const auto [v3, vt3, vn3] = get_face_vertex_index(tokens[2]);
 
             // Convert to 0-based indices
-            f.vertex_indices = glm::ivec3(v1 - 1, v2 - 1, v3 - 1);
+            size_t nv = vertices.size();
+            f.vertex_indices = glm::i64vec3(obj_index(v1, nv), obj_index(v2, nv),
+                                            obj_index(v3, nv));
             if (vt1.has_value()) {
-                f.vertex_texture_indices = glm::ivec3(
-                    vt1.value() - 1, vt2.value() - 1, vt3.value() - 1);
+                size_t nt = vertex_textures.size();
+                f.vertex_texture_indices = glm::i64vec3(
+                    obj_index(vt1.value(), nt), obj_index(vt2.value(), nt),
+                    obj_index(vt3.value(), nt));
             }
             if (vn1.has_value()) {
-                f.vertex_normal_indices = glm::ivec3(
-                    vn1.value() - 1, vn2.value() - 1, vn3.value() - 1);
+                size_t nn = vertex_normals.size();
+                f.vertex_normal_indices = glm::i64vec3(
+                    obj_index(vn1.value(), nn), obj_index(vn2.value(), nn),
+                    obj_index(vn3.value(), nn));
             }
             if (!curr_material.empty()) {
                 f.material = curr_material;
@@ -219,7 +245,13 @@ void ObjLoader::parse_obj_file(const char* filename) {
 
         if (type == "mtllib") {
             auto mtl_filename = filepath_dir + std::string(tokens[0]);
-            parse_mtl_file(filepath_dir, mtl_filename);
+            if (assets) {
+                auto library = assets->material_library(mtl_filename);
+                materials.insert(library->begin(), library->end());
+                material_libraries.push_back(std::move(library));
+            } else {
+                parse_mtl_file(filepath_dir, std::string(tokens[0]));
+            }
             loaded_materials.emplace(mtl_filename);
         }
 
@@ -240,6 +272,7 @@ void ObjLoader::parse_obj_file(const char* filename) {
 
 void ObjLoader::parse_mtl_file(std::string filepath_dir,
                                std::string mtl_filename) {
+    TRACE_SCOPE("parse_mtl_file");
     if (loaded_materials.contains(filepath_dir +
                                   mtl_filename)) {  // File already loaded
         return;
@@ -254,6 +287,7 @@ void ObjLoader::parse_mtl_file(std::string filepath_dir,
     }
 
     Material* curr_material;
+    std::vector<PendingMap> maps;
 
     std::string line;
     while (getline(file, line)) {
@@ -289,7 +323,7 @@ void ObjLoader::parse_mtl_file(std::string filepath_dir,
 
         auto type = tokens[0];
         if (type == "newmtl") {
-            auto mat_u = std::make_unique<Material>();
+            auto mat_u = std::make_shared<Material>();
             curr_material = mat_u.get();
             materials.emplace(std::string(tokens[1]), std::move(mat_u));
         }
@@ -330,74 +364,93 @@ void ObjLoader::parse_mtl_file(std::string filepath_dir,
 
         // }
 
-        // TODO: make neater
-        // TODO: test this works as intended
         // Texture Maps
         else if (type == "map_Ka") {  // ambient map
-            auto texture_file = filepath_dir + std::string(tokens[1]);
-            if (loaded_texture_maps.contains(texture_file)) {
-                curr_material->ambient_map_filepath =
-                    texture_maps.at(texture_file);
-                continue;
-            }
-            curr_material->ambient_map_filepath =
-                std::make_shared<TextureMap>();
-            decode_texture_png(texture_file,
-                               curr_material->ambient_map_filepath.get());
-            texture_maps.emplace(texture_file,
-                                 curr_material->ambient_map_filepath);
-            loaded_texture_maps.emplace(texture_file);
-
+            maps.push_back({&curr_material->ambient_map_filepath,
+                            filepath_dir + std::string(tokens[1])});
         } else if (type == "map_Kd") {  // diffuse map
-            auto texture_file = filepath_dir + std::string(tokens[1]);
-            if (loaded_texture_maps.contains(texture_file)) {
-                curr_material->diffuse_map_filepath =
-                    texture_maps.at(texture_file);
-                continue;
-            }
-            curr_material->diffuse_map_filepath =
-                std::make_shared<TextureMap>();
-            decode_texture_png(texture_file,
-                               curr_material->diffuse_map_filepath.get());
-            texture_maps.emplace(texture_file,
-                                 curr_material->diffuse_map_filepath);
-            loaded_texture_maps.emplace(texture_file);
-
+            maps.push_back({&curr_material->diffuse_map_filepath,
+                            filepath_dir + std::string(tokens[1])});
         } else if (type == "map_Ks") {  // specular map
-            auto texture_file = filepath_dir + std::string(tokens[1]);
-            if (loaded_texture_maps.contains(texture_file)) {
-                curr_material->specular_map_filepath =
-                    texture_maps.at(texture_file);
-                continue;
-            }
-            curr_material->specular_map_filepath =
-                std::make_shared<TextureMap>();
-            decode_texture_png(texture_file,
-                               curr_material->specular_map_filepath.get());
-            texture_maps.emplace(texture_file,
-                                 curr_material->specular_map_filepath);
-            loaded_texture_maps.emplace(texture_file);
-
+            maps.push_back({&curr_material->specular_map_filepath,
+                            filepath_dir + std::string(tokens[1])});
         } else if (type == "map_bump" || type == "bump") {  // bump map
-            auto texture_file = filepath_dir + std::string(tokens[1]);
-            if (loaded_texture_maps.contains(texture_file)) {
-                curr_material->bump_map_filepath =
-                    texture_maps.at(texture_file);
-                continue;
-            }
-            curr_material->bump_map_filepath = std::make_shared<TextureMap>();
-            decode_texture_png(texture_file,
-                               curr_material->bump_map_filepath.get());
-            texture_maps.emplace(texture_file,
-                                 curr_material->bump_map_filepath);
-            loaded_texture_maps.emplace(texture_file);
+            maps.push_back({&curr_material->bump_map_filepath,
+                            filepath_dir + std::string(tokens[1])});
         }
     }
+    load_texture_maps(maps);
+}
+
+// Each texture file is decoded once, per loader or through the asset manager
+std::shared_ptr<TextureMap> ObjLoader::load_texture_map(
+    const std::string& filename) {
+    if (loaded_texture_maps.contains(filename)) {
+        return texture_maps.at(filename);
+    }
+    MemoryScope memory_scope(MemoryTag::Texture);
+    std::shared_ptr<TextureMap> texture;
+    if (assets) {
+        texture = assets->texture(filename);
+    } else {
+        texture = std::make_shared<TextureMap>();
+        if (decode_textures) {
+            decode_texture_png(filename, texture.get());
+        }
+        texture->path = filename;
+    }
+    texture_maps.emplace(filename, texture);
+    loaded_texture_maps.emplace(filename);
+    return texture;
+}
+
+// With jobs, files not loaded yet are decoded in parallel, then every map
+// is set as it would have been line by line
+void ObjLoader::load_texture_maps(const std::vector<PendingMap>& maps) {
+    if (!jobs || jobs->thread_count() == 1) {
+        for (auto& map : maps) {
+            *map.slot = load_texture_map(map.filename);
+        }
+        return;
+    }
+
+    std::vector<std::string> missing;
+    for (auto& map : maps) {
+        if (!loaded_texture_maps.contains(map.filename) &&
+            std::find(missing.begin(), missing.end(), map.filename) ==
+                missing.end()) {
+            missing.push_back(map.filename);
+        }
+    }
+    MemoryScope memory_scope(MemoryTag::Texture);
+    std::vector<std::shared_ptr<TextureMap>> loaded;
+    if (assets) {
+        loaded = assets->textures(missing);
+    } else {
+        loaded.resize(missing.size());
+        jobs->parallel_for(missing.size(), [&](size_t i) {
+            MemoryScope memory_scope(MemoryTag::Texture);
+            auto texture = std::make_shared<TextureMap>();
+            if (decode_textures) {
+                decode_texture_png(missing[i], texture.get());
+            }
+            texture->path = missing[i];
+            loaded[i] = std::move(texture);
+        });
+    }
+    for (size_t i = 0; i < missing.size(); i++) {
+        texture_maps.emplace(missing[i], loaded[i]);
+        loaded_texture_maps.emplace(missing[i]);
+    }
+    for (auto& map : maps) {
+        *map.slot = texture_maps.at(map.filename);
+    }
 }
 
 void ObjLoader::decode_texture_png(std::string filename,
                                    TextureMap* textureMap) {
-    unsigned int error = lodepng::decode(textureMap->pixels, textureMap->width,
+    TRACE_SCOPE("decode_texture_png");
+    unsigned int error = decode_png_rgba(textureMap->pixels, textureMap->width,
                                          textureMap->height, filename);
     if (error) {
         throw std::runtime_error("Decoder error for " + filename + ": " +
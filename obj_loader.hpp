@@ -4,23 +4,39 @@
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <glm/ext/vector_int3_sized.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec2.hpp>
 #include <unordered_set>
 #include <vector>
 
+#include "asset_manager.hpp"
+#include "job_system.hpp"
 #include "materials.hpp"
 #include "external/lodepng.h"
 
+// Indices are 64-bit so scans with more than 2^31 v/vt/vn lines parse
+// without wrapping; Mesh checks they fit what it can address
 struct Face {
-    glm::ivec3 vertex_indices;
-    glm::ivec3 vertex_texture_indices;
-    glm::ivec3 vertex_normal_indices;
+    glm::i64vec3 vertex_indices;
+    glm::i64vec3 vertex_texture_indices;
+    glm::i64vec3 vertex_normal_indices;
     std::optional<std::string> material;
 };
 
+// OBJ indices are 1-based, or negative to count back from the last element
+// read so far (count); returns the 0-based index
+inline int64_t obj_index(int64_t index, size_t count) {
+    return index < 0 ? int64_t(count) + index : index - 1;
+}
+
 struct ObjLoader {
    public:
+    // One corner of an f line ("v", "v/t", "v//n" or "v/t/n"), as written
+    // in the file (1-based or negative); throws on a malformed number
+    static std::tuple<int64_t, std::optional<int64_t>, std::optional<int64_t>>
+    get_face_vertex_index(std::string_view face_index_group);
+
     // TODO: this currently converts indices to 0-based (can change this to
     // remain 1-based and rely on mesh to convert)
     void parse_obj_file(const char* filename);
@@ -31,16 +47,39 @@ struct ObjLoader {
 
     std::vector<Face> faces;
     // TODO: should i be creating the material pointers here?
-    std::unordered_map<std::string, std::unique_ptr<Material>> materials;
+    std::unordered_map<std::string, std::shared_ptr<Material>> materials;
     std::unordered_map<std::string, std::shared_ptr<TextureMap>> texture_maps;
 
+    // If set, mtl files and textures come from (and are shared through)
+    // the asset manager. material_libraries keeps the ones used alive.
+    AssetManager* assets = nullptr;
+    std::vector<std::shared_ptr<MaterialLibrary>> material_libraries;
+
+    // Without the asset manager: false leaves texture maps empty apart from
+    // their path (the baker decodes them in their own jobs)
+    bool decode_textures = true;
+    // If set, the texture maps of an mtl file are decoded in parallel once
+    // the whole file is read
+    JobSystem* jobs = nullptr;
+    // If set, parsed v/vn/f lines are echoed to this file (debugging)
+    std::string debug_obj_path;
+    // FNV-1a of the obj file's lines, taken while parsing so callers that
+    // key on contents (the asset manager) don't read the file twice
+    uint64_t content_hash = 0;
+
     // Loaded materials and texture maps for efficiency
     // TODO: how am i redirecting the data tho? Solution: use a map to shared_ptr
     std::unordered_set<std::string> loaded_materials;
     std::unordered_set<std::string> loaded_texture_maps;
 
    private:
-    std::tuple<int, std::optional<int>, std::optional<int>>
-    get_face_vertex_index(std::string_view face_index_group);
+    // A map_* line: where the texture goes and the file it comes from
+    struct PendingMap {
+        std::shared_ptr<TextureMap>* slot;
+        std::string filename;
+    };
+
     void decode_texture_png(std::string filename, TextureMap* textureMap);
+    std::shared_ptr<TextureMap> load_texture_map(const std::string& filename);
+    void load_texture_maps(const std::vector<PendingMap>& maps);
 };
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "occlusion_culler.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OCCLUSION_SSE 1
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Anything this close to the eye (or behind it) isn't projected
+static const float NEAR_W = 1e-5f;
+
+static double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+}
+
+OcclusionCuller::OcclusionCuller(int width, int height, JobSystem* pool)
+    : pool(pool) {
+    tiles_x = (std::max(width, 1) + TILE_W - 1) / TILE_W;
+    tiles_y = (std::max(height, 1) + TILE_H - 1) / TILE_H;
+    width_ = tiles_x * TILE_W;
+    height_ = tiles_y * TILE_H;
+    depth.resize(width_ * height_);
+    tile_max.resize(tiles_x * tiles_y);
+    bins.resize((height_ + BAND_H - 1) / BAND_H);
+    begin_frame();
+}
+
+void OcclusionCuller::begin_frame() {
+    std::fill(depth.begin(), depth.end(), 1.0f);
+    std::fill(tile_max.begin(), tile_max.end(), 1.0f);
+    triangles.clear();
+    for (auto& bin : bins) {
+        bin.clear();
+    }
+    stats_ = OcclusionStats();
+}
+
+void OcclusionCuller::add_occluder(const glm::vec3* positions,
+                                   const unsigned int* indices,
+                                   size_t index_count, const glm::mat4& mvp) {
+    auto start = Clock::now();
+
+    // Transform each referenced vertex once
+    unsigned int max_index = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        max_index = std::max(max_index, indices[i]);
+    }
+    clip_positions.resize(index_count ? max_index + 1 : 0);
+    for (size_t i = 0; i < clip_positions.size(); i++) {
+        clip_positions[i] = mvp * glm::vec4(positions[i], 1);
+    }
+
+    for (size_t i = 0; i + 2 < index_count; i += 3) {
+        glm::vec4 clip[3] = {clip_positions[indices[i]],
+                             clip_positions[indices[i + 1]],
+                             clip_positions[indices[i + 2]]};
+
+        // Triangles reaching in front of the near plane are dropped rather
+        // than clipped; GL clips them away, and their depth would be
+        // clamped toward 0 and hide what's behind. Fewer occluders only
+        // means less gets culled.
+        bool in_front = false;
+        for (int v = 0; v < 3; v++) {
+            in_front |= clip[v].w <= NEAR_W || clip[v].z < -clip[v].w;
+        }
+        if (in_front) {
+            continue;
+        }
+
+        float x[3], y[3];
+        float max_depth = 0;
+        for (int v = 0; v < 3; v++) {
+            x[v] = (clip[v].x / clip[v].w * 0.5f + 0.5f) * width_;
+            y[v] = (clip[v].y / clip[v].w * 0.5f + 0.5f) * height_;
+            max_depth = std::max(max_depth, clip[v].z / clip[v].w * 0.5f + 0.5f);
+        }
+        if (max_depth >= 1.0f) {
+            continue;  // reaches past the far plane, can't lower anything
+        }
+
+        // Orient counter-clockwise so inside is positive for both windings
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (area == 0) {
+            continue;
+        }
+        if (area < 0) {
+            std::swap(x[1], x[2]);
+            std::swap(y[1], y[2]);
+        }
+
+        ScreenTriangle tri;
+        for (int e = 0; e < 3; e++) {
+            int next = (e + 1) % 3;
+            tri.a[e] = y[e] - y[next];
+            tri.b[e] = x[next] - x[e];
+            tri.c[e] = x[e] * y[next] - x[next] * y[e] -
+                       0.5f * (std::abs(tri.a[e]) + std::abs(tri.b[e]));
+        }
+        tri.max_depth = max_depth;
+
+        // Pixels it might cover. Clamped as floats first: near the eye x/w
+        // can be far out of int range.
+        float min_x = std::min({x[0], x[1], x[2]});
+        float max_x = std::max({x[0], x[1], x[2]});
+        float min_y = std::min({y[0], y[1], y[2]});
+        float max_y = std::max({y[0], y[1], y[2]});
+        if (max_x < 0 || min_x > width_ || max_y < 0 || min_y > height_) {
+            continue;  // off screen
+        }
+        tri.min_x = int(std::floor(std::clamp(min_x, 0.0f, float(width_))));
+        tri.max_x = std::min(int(std::ceil(std::clamp(max_x, 0.0f, float(width_)))),
+                             width_ - 1);
+        tri.min_y = int(std::floor(std::clamp(min_y, 0.0f, float(height_))));
+        tri.max_y = std::min(int(std::ceil(std::clamp(max_y, 0.0f, float(height_)))),
+                             height_ - 1);
+        if (tri.min_x > tri.max_x || tri.min_y > tri.max_y) {
+            continue;
+        }
+
+        uint32_t index = triangles.size();
+        triangles.push_back(tri);
+        for (int band = tri.min_y / BAND_H; band <= tri.max_y / BAND_H; band++) {
+            bins[band].push_back(index);
+        }
+        stats_.occluder_triangles++;
+    }
+
+    stats_.rasterize_ms += ms_since(start);
+}
+
+void OcclusionCuller::rasterize() {
+    auto start = Clock::now();
+    if (pool) {
+        pool->parallel_for(bins.size(), [&](size_t band) { rasterize_band(band); });
+    } else {
+        for (size_t band = 0; band < bins.size(); band++) {
+            rasterize_band(band);
+        }
+    }
+    stats_.rasterize_ms += ms_since(start);
+}
+
+// Bands are whole tiles tall, so each one owns its rows and tiles outright
+void OcclusionCuller::rasterize_band(int band) {
+    int y0 = band * BAND_H;
+    int y1 = std::min(y0 + BAND_H, height_) - 1;
+    for (uint32_t index : bins[band]) {
+        rasterize_triangle(triangles[index], y0, y1);
+    }
+    update_tiles(y0, y1);
+}
+
+// Coverage is inner-conservative: the edge functions are biased to each
+// pixel's worst corner (see add_occluder), so a pixel only takes the
+// triangle's depth when the triangle covers all of it
+void OcclusionCuller::rasterize_triangle(const ScreenTriangle& tri, int y0,
+                                         int y1) {
+    int row_start = std::max(tri.min_y, y0);
+    int row_end = std::min(tri.max_y, y1);
+    // Spans start on a multiple of 4; rows are whole tiles wide, so 4-wide
+    // steps never run past the end of a row
+    int x_start = tri.min_x & ~3;
+
+#ifdef OCCLUSION_SSE
+    __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 a[3], step[3];
+    for (int e = 0; e < 3; e++) {
+        a[e] = _mm_set1_ps(tri.a[e]);
+        step[e] = _mm_set1_ps(tri.a[e] * 4);
+    }
+    __m128 tri_depth = _mm_set1_ps(tri.max_depth);
+    __m128 zero = _mm_setzero_ps();
+
+    for (int y = row_start; y <= row_end; y++) {
+        float py = y + 0.5f;
+        __m128 xs = _mm_add_ps(_mm_set1_ps(float(x_start)), offsets);
+        __m128 edge[3];
+        for (int e = 0; e < 3; e++) {
+            edge[e] = _mm_add_ps(_mm_mul_ps(a[e], xs),
+                                 _mm_set1_ps(tri.b[e] * py + tri.c[e]));
+        }
+
+        float* row = &depth[y * width_];
+        for (int x = x_start; x <= tri.max_x; x += 4) {
+            __m128 inside = _mm_and_ps(
+                _mm_and_ps(_mm_cmpgt_ps(edge[0], zero), _mm_cmpgt_ps(edge[1], zero)),
+                _mm_cmpgt_ps(edge[2], zero));
+            if (_mm_movemask_ps(inside)) {
+                __m128 old_depth = _mm_loadu_ps(row + x);
+                __m128 new_depth = _mm_min_ps(old_depth, tri_depth);
+                _mm_storeu_ps(row + x,
+                              _mm_or_ps(_mm_and_ps(inside, new_depth),
+                                        _mm_andnot_ps(inside, old_depth)));
+            }
+            for (int e = 0; e < 3; e++) {
+                edge[e] = _mm_add_ps(edge[e], step[e]);
+            }
+        }
+    }
+#else
+    for (int y = row_start; y <= row_end; y++) {
+        float py = y + 0.5f;
+        float* row = &depth[y * width_];
+        for (int x = x_start; x <= tri.max_x; x++) {
+            float px = x + 0.5f;
+            bool inside = true;
+            for (int e = 0; e < 3; e++) {
+                inside &= tri.a[e] * px + tri.b[e] * py + tri.c[e] > 0;
+            }
+            if (inside) {
+                row[x] = std::min(row[x], tri.max_depth);
+            }
+        }
+    }
+#endif
+}
+
+void OcclusionCuller::update_tiles(int y0, int y1) {
+    for (int ty = y0 / TILE_H; ty <= y1 / TILE_H; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            float farthest = 0;
+            for (int y = ty * TILE_H; y < (ty + 1) * TILE_H; y++) {
+                const float* row = &depth[y * width_ + tx * TILE_W];
+                for (int x = 0; x < TILE_W; x++) {
+                    farthest = std::max(farthest, row[x]);
+                }
+            }
+            tile_max[ty * tiles_x + tx] = farthest;
+        }
+    }
+}
+
+bool OcclusionCuller::is_visible(const BoundingBox& box,
+                                 const glm::mat4& mvp) const {
+    float min_x = FLT_MAX, max_x = -FLT_MAX;
+    float min_y = FLT_MAX, max_y = -FLT_MAX;
+    float nearest = 1;
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 clip = mvp * glm::vec4(corner & 1 ? box.max.x : box.min.x,
+                                         corner & 2 ? box.max.y : box.min.y,
+                                         corner & 4 ? box.max.z : box.min.z, 1);
+        if (clip.w <= NEAR_W) {
+            return true;  // straddles the eye, don't guess
+        }
+        float x = (clip.x / clip.w * 0.5f + 0.5f) * width_;
+        float y = (clip.y / clip.w * 0.5f + 0.5f) * height_;
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        min_y = std::min(min_y, y);
+        max_y = std::max(max_y, y);
+        nearest = std::min(nearest, clip.z / clip.w * 0.5f + 0.5f);
+    }
+
+    if (max_x < 0 || min_x >= width_ || max_y < 0 || min_y >= height_) {
+        return true;  // off screen, that's for frustum culling to decide
+    }
+    // Clamped as floats, the projection can be far out of int range
+    int x0 = int(std::floor(std::clamp(min_x, 0.0f, float(width_ - 1))));
+    int x1 = int(std::floor(std::clamp(max_x, 0.0f, float(width_ - 1))));
+    int y0 = int(std::floor(std::clamp(min_y, 0.0f, float(height_ - 1))));
+    int y1 = int(std::floor(std::clamp(max_y, 0.0f, float(height_ - 1))));
+
+    for (int ty = y0 / TILE_H; ty <= y1 / TILE_H; ty++) {
+        for (int tx = x0 / TILE_W; tx <= x1 / TILE_W; tx++) {
+            // Strict, so a box is never hidden by its own front face
+            if (nearest > tile_max[ty * tiles_x + tx]) {
+                continue;  // whole tile is in front of the box
+            }
+            // Coarse test failed, check the covered pixels of this tile
+            int px0 = std::max(x0, tx * TILE_W);
+            int px1 = std::min(x1, tx * TILE_W + TILE_W - 1);
+            int py0 = std::max(y0, ty * TILE_H);
+            int py1 = std::min(y1, ty * TILE_H + TILE_H - 1);
+            for (int y = py0; y <= py1; y++) {
+                for (int x = px0; x <= px1; x++) {
+                    if (nearest <= depth[y * width_ + x]) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void OcclusionCuller::test(const BoundingBox* boxes, size_t count,
+                           const glm::mat4& mvp, uint8_t* visible) {
+    auto start = Clock::now();
+    auto test_one = [&](size_t i) { visible[i] = is_visible(boxes[i], mvp); };
+    if (pool) {
+        pool->parallel_for(count, test_one, 16);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            test_one(i);
+        }
+    }
+
+    stats_.tested += count;
+    for (size_t i = 0; i < count; i++) {
+        stats_.occluded += !visible[i];
+    }
+    stats_.test_ms += ms_since(start);
+}
+
+void OcclusionCuller::print_stats(FILE* out) const {
+    fprintf(out,
+            "Occlusion (%dx%d): %zu occluder triangles, %zu / %zu occluded, "
+            "raster %.3f ms, test %.3f ms\n",
+            width_, height_, stats_.occluder_triangles, stats_.occluded,
+            stats_.tested, stats_.rasterize_ms, stats_.test_ms);
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "job_system.hpp"
+#include "mesh.hpp"
+
+// Per-frame results, reset by begin_frame
+struct OcclusionStats {
+    size_t occluder_triangles = 0;  // binned for rasterization
+    size_t tested = 0;
+    size_t occluded = 0;
+    double rasterize_ms = 0;  // transform + binning + raster + hierarchy
+    double test_ms = 0;
+};
+
+// CPU occlusion culling against a low resolution depth buffer, in the
+// spirit of masked occlusion culling. GL-free, so it runs anywhere.
+//
+// Occluders (a mesh, or a simplified hull that lies inside it) are
+// rasterized with SSE, 4 pixels at a time, in horizontal bands spread over
+// the job system. A pixel counts as covered only if a triangle covers all
+// of it, and keeps the nearest of those triangles' farthest vertex depths,
+// which keeps the buffer conservative without interpolating depth. Per-tile maximum depth forms the coarse level that
+// most occludee tests stop at.
+//
+// Depth is GL window depth: NDC z mapped to [0, 1], 1 is the far plane.
+class OcclusionCuller {
+   public:
+    static const int TILE_W = 8;
+    static const int TILE_H = 8;
+    static const int BAND_H = 4 * TILE_H;  // rows per raster job
+
+    // Width/height are rounded up to whole tiles. pool may be null (serial).
+    OcclusionCuller(int width = 256, int height = 128,
+                    JobSystem* pool = nullptr);
+
+    // Clears the depth buffer and stats
+    void begin_frame();
+
+    // Transforms and bins occluder triangles (indices into positions)
+    void add_occluder(const glm::vec3* positions, const unsigned int* indices,
+                      size_t index_count, const glm::mat4& mvp);
+
+    // Rasterizes everything binned since begin_frame
+    void rasterize();
+
+    // False only if the box is hidden behind rasterized occluders
+    bool is_visible(const BoundingBox& box, const glm::mat4& mvp) const;
+    // Tests boxes in parallel, visible[i] is 0 or 1. Counts towards stats.
+    void test(const BoundingBox* boxes, size_t count, const glm::mat4& mvp,
+              uint8_t* visible);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    float depth_at(int x, int y) const { return depth[y * width_ + x]; }
+
+    const OcclusionStats& stats() const { return stats_; }
+    void print_stats(FILE* out = stdout) const;
+
+   private:
+    struct ScreenTriangle {
+        // Edge functions, positive inside: e = a * x + b * y + c. c is
+        // biased by half a pixel's extent along the normal, so e > 0 at a
+        // pixel center means the whole pixel is inside.
+        float a[3], b[3], c[3];
+        float max_depth;
+        int min_x, max_x, min_y, max_y;
+    };
+
+    int width_;
+    int height_;
+    int tiles_x;
+    int tiles_y;
+    JobSystem* pool;
+
+    std::vector<float> depth;     // width * height
+    std::vector<float> tile_max;  // tiles_x * tiles_y
+    std::vector<ScreenTriangle> triangles;
+    std::vector<std::vector<uint32_t>> bins;  // triangle indices per band
+    std::vector<glm::vec4> clip_positions;    // scratch for add_occluder
+
+    OcclusionStats stats_;
+
+    void rasterize_band(int band);
+    void rasterize_triangle(const ScreenTriangle& tri, int y0, int y1);
+    void update_tiles(int y0, int y1);
+};
@@ -0,0 +1,278 @@
+#include "offscreen_renderer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "external/lodepng.h"
+#include "memory_tracker.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::vector<CameraPose> load_camera_poses(const char* filename) {
+    std::ifstream file;
+    file.open(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open pose file: " +
+                                 std::string(filename) + "\n");
+    }
+
+    std::vector<CameraPose> poses;
+    std::string line;
+    int line_number = 0;
+    while (getline(file, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream tokens(line);
+        CameraPose pose;
+        if (!(tokens >> pose.pitch >> pose.yaw >> pose.radius)) {
+            throw std::runtime_error(std::format(
+                "Malformed pose on line {} of {}\n", line_number, filename));
+        }
+        // Target is optional, defaults to the origin
+        tokens >> pose.target.x >> pose.target.y >> pose.target.z;
+        poses.push_back(pose);
+    }
+    return poses;
+}
+
+// Color + depth renderbuffers (depth24 is 4 bytes in practice) and 2 PBOs
+static int64_t gpu_bytes(int width, int height) {
+    return int64_t(width) * height * (4 + 4 + 2 * 4);
+}
+
+OffscreenRenderer::OffscreenRenderer(int width, int height, int num_encoders)
+    : width(width), height(height) {
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+    glGenRenderbuffers(1, &color_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, color_rb);
+
+    glGenRenderbuffers(1, &depth_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width,
+                          height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, depth_rb);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        // No destructor runs for a throwing constructor
+        glDeleteRenderbuffers(1, &color_rb);
+        glDeleteRenderbuffers(1, &depth_rb);
+        glDeleteFramebuffers(1, &fbo);
+        throw std::runtime_error("Offscreen framebuffer is incomplete\n");
+    }
+
+    size_t frame_bytes = size_t(width) * height * 4;
+    glGenBuffers(2, pbos);
+    for (GLuint pbo : pbos) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes, nullptr,
+                     GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    track_gpu_bytes(MemoryTag::Other, gpu_bytes(width, height));
+
+    // A couple of frames per encoder keeps them busy without letting the
+    // queue grow unbounded when encoding is the slow stage
+    num_encoders = std::max(num_encoders, 1);
+    max_queued_jobs = num_encoders * 2;
+    try {
+        for (int i = 0; i < num_encoders; i++) {
+            encoders.emplace_back(&OffscreenRenderer::encoder_loop, this);
+        }
+    } catch (...) {
+        stop_encoders();
+        release_gl();
+        throw;
+    }
+}
+
+OffscreenRenderer::~OffscreenRenderer() {
+    stop_encoders();
+    release_gl();
+}
+
+void OffscreenRenderer::stop_encoders() {
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        stopping = true;
+    }
+    jobs_ready.notify_all();
+    for (auto& encoder : encoders) {
+        encoder.join();
+    }
+}
+
+void OffscreenRenderer::release_gl() {
+    for (GLsync& fence : fences) {
+        if (fence) glDeleteSync(fence);
+    }
+    glDeleteBuffers(2, pbos);
+    track_gpu_bytes(MemoryTag::Other, -gpu_bytes(width, height));
+    glDeleteRenderbuffers(1, &color_rb);
+    glDeleteRenderbuffers(1, &depth_rb);
+    glDeleteFramebuffers(1, &fbo);
+}
+
+void OffscreenRenderer::encoder_loop() {
+    while (true) {
+        EncodeJob job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {  // stopping and drained
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        jobs_space.notify_one();
+
+        auto start = Clock::now();
+        // GL rows are bottom-up, PNG rows are top-down
+        size_t row_bytes = size_t(width) * 4;
+        std::vector<unsigned char> row(row_bytes);
+        for (int y = 0; y < height / 2; y++) {
+            unsigned char* top = &job.pixels[y * row_bytes];
+            unsigned char* bottom = &job.pixels[(height - 1 - y) * row_bytes];
+            memcpy(row.data(), top, row_bytes);
+            memcpy(top, bottom, row_bytes);
+            memcpy(bottom, row.data(), row_bytes);
+        }
+
+        unsigned error =
+            lodepng::encode(job.filename, job.pixels, width, height);
+        if (error) {
+            fprintf(stderr, "ERROR: encoding %s failed: %s\n",
+                    job.filename.c_str(), lodepng_error_text(error));
+        }
+        encode_time_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                              Clock::now() - start)
+                              .count();
+
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            in_flight--;
+        }
+        jobs_done.notify_all();
+    }
+}
+
+void OffscreenRenderer::push_job(EncodeJob job) {
+    {
+        // Back-pressure: block the GL thread if the encoders fall behind
+        std::unique_lock<std::mutex> lock(jobs_mutex);
+        jobs_space.wait(lock, [this] { return jobs.size() < max_queued_jobs; });
+        jobs.push_back(std::move(job));
+        in_flight++;
+    }
+    jobs_ready.notify_one();
+}
+
+// Waits for the readback in `slot` and hands its pixels to the encoders
+void OffscreenRenderer::collect_frame(int slot, const std::string& filename) {
+    auto start = Clock::now();
+    glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                     GL_TIMEOUT_IGNORED);
+    glDeleteSync(fences[slot]);
+    fences[slot] = nullptr;
+
+    size_t frame_bytes = size_t(width) * height * 4;
+    EncodeJob job;
+    job.filename = filename;
+    job.pixels.resize(frame_bytes);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    void* mapped =
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_bytes, GL_MAP_READ_BIT);
+    if (mapped) {
+        memcpy(job.pixels.data(), mapped, frame_bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        fprintf(stderr, "ERROR: failed to map readback buffer for %s\n",
+                filename.c_str());
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback_time += seconds_since(start);
+
+    push_job(std::move(job));
+}
+
+void OffscreenRenderer::render_poses(
+    const std::vector<CameraPose>& poses, const std::string& output_dir,
+    const std::function<void(const CameraPose&)>& draw) {
+    std::filesystem::create_directories(output_dir);
+    draw_time = 0;
+    readback_time = 0;
+    encode_time_us = 0;
+
+    auto filename_for = [&](size_t i) {
+        return std::format("{}/frame_{:05}.png", output_dir, i);
+    };
+
+    auto batch_start = Clock::now();
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, width, height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    for (size_t i = 0; i < poses.size(); i++) {
+        int slot = i % 2;
+
+        auto start = Clock::now();
+        draw(poses[i]);
+
+        // Asynchronous: with a pack buffer bound, glReadPixels only queues
+        // the copy
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        draw_time += seconds_since(start);
+
+        // Previous frame has had a whole frame of GPU time to finish
+        if (i > 0) {
+            collect_frame(1 - slot, filename_for(i - 1));
+        }
+    }
+    if (!poses.empty()) {
+        collect_frame((poses.size() - 1) % 2, filename_for(poses.size() - 1));
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Wait for the encoders to finish everything that was queued
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex);
+        jobs_done.wait(lock, [this] { return in_flight == 0; });
+    }
+
+    double total = seconds_since(batch_start);
+    double encode_time = encode_time_us / 1e6;
+    size_t n = std::max<size_t>(poses.size(), 1);
+    fprintf(stdout,
+            "Batch: %zu frames (%dx%d) in %.3fs, %.2f fps\n"
+            "\tdraw+submit: %.2f ms/frame\n"
+            "\treadback:    %.2f ms/frame\n"
+            "\tencode:      %.2f ms/frame on one encoder (%zu encoders)\n",
+            poses.size(), width, height, total, poses.size() / total,
+            draw_time * 1000 / n, readback_time * 1000 / n,
+            encode_time * 1000 / n, encoders.size());
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <glm/vec3.hpp>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One camera placement for batch rendering (matches OrbitCamera's parameters)
+struct CameraPose {
+    float pitch;
+    float yaw;
+    float radius;
+    glm::vec3 target = glm::vec3(0);
+};
+
+// Reads poses from a text file, one per line: "pitch yaw radius [tx ty tz]"
+// Lines starting with '#' are ignored. Throws on malformed input.
+std::vector<CameraPose> load_camera_poses(const char* filename);
+
+// Renders a list of camera poses into an FBO and writes each one to a PNG.
+// The three stages are pipelined: frame N is drawn while frame N-1 is read
+// back through the other PBO and older frames are encoded by worker threads,
+// so throughput is bounded by the slowest stage rather than their sum.
+class OffscreenRenderer {
+   public:
+    OffscreenRenderer(int width, int height, int num_encoders);
+    ~OffscreenRenderer();
+
+    // draw is called with the FBO bound and should issue a full frame
+    void render_poses(const std::vector<CameraPose>& poses,
+                      const std::string& output_dir,
+                      const std::function<void(const CameraPose&)>& draw);
+
+    int width;
+    int height;
+
+   private:
+    struct EncodeJob {
+        std::vector<unsigned char> pixels;  // bottom-up rows, as read by GL
+        std::string filename;
+    };
+
+    GLuint fbo;
+    GLuint color_rb;
+    GLuint depth_rb;
+
+    // Double-buffered readback: one PBO is being filled while the other is
+    // mapped and copied out
+    GLuint pbos[2];
+    GLsync fences[2] = {nullptr, nullptr};
+
+    // Encoder pool
+    std::vector<std::thread> encoders;
+    std::deque<EncodeJob> jobs;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_ready;
+    std::condition_variable jobs_space;
+    std::condition_variable jobs_done;
+    size_t in_flight = 0;  // queued or currently encoding
+    size_t max_queued_jobs;
+    bool stopping = false;
+
+    // Stage timings (seconds, summed over a batch)
+    double draw_time = 0;
+    double readback_time = 0;
+    std::atomic<long long> encode_time_us = 0;
+
+    void encoder_loop();
+    // Teardown, shared by the destructor and a constructor that fails
+    // after creating the encoders
+    void stop_encoders();
+    void release_gl();
+    void collect_frame(int slot, const std::string& filename);
+    void push_job(EncodeJob job);
+};
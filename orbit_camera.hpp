@@ -1,3 +1,5 @@
+#pragma once
+#include <algorithm>
 #include <cmath>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/vec3.hpp>
@@ -50,7 +52,12 @@ struct OrbitCamera {
         updateBasis();
     }
 
-    // dolly
+    // Moves toward (positive) or away from the target, proportionally to
+    // the distance like pan
+    void dolly(float amount) {
+        radius = std::max(radius * (1 - amount * .1f), .01f);
+        updateBasis();
+    }
 
     glm::mat4 calcViewMatrix() { return glm::lookAt(pos, target, up); }
 };
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+void RollingStats::add(double value) {
+    if (samples.size() < capacity) {
+        samples.push_back(value);
+    } else {
+        samples[next] = value;
+    }
+    next = (next + 1) % capacity;
+}
+
+double RollingStats::percentile(double p) const {
+    if (samples.empty()) {
+        return 0;
+    }
+    std::vector<double> sorted = samples;
+    size_t index = std::min(size_t(p * (sorted.size() - 1) + 0.5),
+                            sorted.size() - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+}
+
+double RollingStats::mean() const {
+    if (samples.empty()) {
+        return 0;
+    }
+    double sum = 0;
+    for (double sample : samples) {
+        sum += sample;
+    }
+    return sum / samples.size();
+}
+
+void Profiler::begin_frame() {
+    counters = FrameCounters();
+    if (!enabled) {
+        return;
+    }
+    // Queries live as long as the context, so they are never deleted
+    if (!queries_created) {
+        free_queries.resize(QUERY_POOL_SIZE);
+        glGenQueries(QUERY_POOL_SIZE, free_queries.data());
+        queries_created = true;
+    }
+    begin_scope("frame", false);
+}
+
+void Profiler::end_frame() {
+    if (!enabled) {
+        return;
+    }
+    end_scope();  // "frame"
+    collect_queries();
+
+    draw_calls.add(counters.draw_calls);
+    triangles.add(counters.triangles);
+    binds_issued.add(counters.binds_issued);
+    binds_skipped.add(counters.binds_skipped);
+    uniform_uploads.add(counters.uniform_uploads);
+    uniform_bytes.add(counters.uniform_bytes);
+    frame_count++;
+}
+
+void Profiler::begin_scope(const char* name, bool gpu) {
+    if (!enabled) {
+        return;
+    }
+    OpenScope scope;
+    auto entry = scopes.try_emplace(name).first;
+    scope.name = entry->first.c_str();
+    scope.stats = &entry->second;
+    scope.query = 0;
+    if (gpu && !gpu_query_active) {
+        if (!free_queries.empty()) {
+            scope.query = free_queries.back();
+            free_queries.pop_back();
+            glBeginQuery(GL_TIME_ELAPSED, scope.query);
+            gpu_query_active = true;
+        } else {
+            dropped_gpu_samples++;  // results are lagging too far behind
+        }
+    }
+    scope.start = Clock::now();
+    open_scopes.push_back(scope);
+}
+
+void Profiler::end_scope() {
+    if (!enabled || open_scopes.empty()) {
+        return;
+    }
+    OpenScope scope = open_scopes.back();
+    open_scopes.pop_back();
+
+    Clock::time_point end = Clock::now();
+    double cpu_ms =
+        std::chrono::duration<double, std::milli>(end - scope.start).count();
+    scope.stats->cpu_ms.add(cpu_ms);
+#ifdef RASTERIZER_TRACING
+    if (tracing_enabled.load(std::memory_order_relaxed)) {
+        auto ns = [](Clock::time_point t) {
+            return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                t.time_since_epoch())
+                                .count());
+        };
+        trace_event(scope.name, ns(scope.start), ns(end));
+    }
+#endif
+
+    if (scope.query) {
+        glEndQuery(GL_TIME_ELAPSED);
+        gpu_query_active = false;
+        pending_queries.push_back({scope.query, scope.stats});
+    }
+}
+
+// Reads back every query that has finished, without waiting on the rest
+void Profiler::collect_queries() {
+    while (!pending_queries.empty()) {
+        PendingQuery pending = pending_queries.front();
+        GLint available = 0;
+        glGetQueryObjectiv(pending.query, GL_QUERY_RESULT_AVAILABLE,
+                           &available);
+        if (!available) {
+            break;  // later queries can't be done either
+        }
+        GLuint64 elapsed_ns = 0;
+        glGetQueryObjectui64v(pending.query, GL_QUERY_RESULT, &elapsed_ns);
+        pending.stats->gpu_ms.add(elapsed_ns / 1e6);
+
+        pending_queries.pop_front();
+        free_queries.push_back(pending.query);
+    }
+}
+
+void Profiler::print_summary(FILE* out) const {
+    fprintf(out, "\nProfile over last %zu frames (%llu total):\n",
+            draw_calls.samples.size(), (unsigned long long)frame_count);
+    fprintf(out, "\t%-20s %27s   %27s\n", "scope", "cpu ms (p50/p95/p99)",
+            "gpu ms (p50/p95/p99)");
+    for (auto& [name, stats] : scopes) {
+        fprintf(out, "\t%-20s %8.3f %8.3f %8.3f   %8.3f %8.3f %8.3f\n",
+                name.c_str(), stats.cpu_ms.percentile(.5),
+                stats.cpu_ms.percentile(.95), stats.cpu_ms.percentile(.99),
+                stats.gpu_ms.percentile(.5), stats.gpu_ms.percentile(.95),
+                stats.gpu_ms.percentile(.99));
+    }
+    fprintf(out, "\tdraw calls:      %.1f\n", draw_calls.mean());
+    fprintf(out, "\ttriangles:       %.1f\n", triangles.mean());
+    fprintf(out, "\tbinds issued:    %.1f\n", binds_issued.mean());
+    fprintf(out, "\tbinds skipped:   %.1f\n", binds_skipped.mean());
+    fprintf(out, "\tuniform uploads: %.1f (%.1f bytes)\n",
+            uniform_uploads.mean(), uniform_bytes.mean());
+    if (dropped_gpu_samples) {
+        fprintf(out, "\tdropped gpu samples: %llu\n",
+                (unsigned long long)dropped_gpu_samples);
+    }
+}
+
+static void write_stats_json(FILE* out, const char* name,
+                             const RollingStats& stats, bool last = false) {
+    fprintf(out,
+            "\"%s\": {\"mean\": %f, \"p50\": %f, \"p95\": %f, \"p99\": %f}%s",
+            name, stats.mean(), stats.percentile(.5), stats.percentile(.95),
+            stats.percentile(.99), last ? "" : ", ");
+}
+
+bool Profiler::dump_json(const char* filename) const {
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", filename);
+        return false;
+    }
+
+    fprintf(out, "{\n  \"frames\": %llu,\n  \"scopes\": {\n",
+            (unsigned long long)frame_count);
+    size_t i = 0;
+    for (auto& [name, stats] : scopes) {
+        fprintf(out, "    \"%s\": {", name.c_str());
+        write_stats_json(out, "cpu_ms", stats.cpu_ms);
+        write_stats_json(out, "gpu_ms", stats.gpu_ms, true);
+        fprintf(out, "}%s\n", ++i < scopes.size() ? "," : "");
+    }
+    fprintf(out, "  },\n  \"counters\": {");
+    write_stats_json(out, "draw_calls", draw_calls);
+    write_stats_json(out, "triangles", triangles);
+    write_stats_json(out, "binds_issued", binds_issued);
+    write_stats_json(out, "binds_skipped", binds_skipped);
+    write_stats_json(out, "uniform_uploads", uniform_uploads);
+    write_stats_json(out, "uniform_bytes", uniform_bytes, true);
+    fprintf(out, "},\n  \"dropped_gpu_samples\": %llu\n}\n",
+            (unsigned long long)dropped_gpu_samples);
+    fclose(out);
+    return true;
+}
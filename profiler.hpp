@@ -0,0 +1,117 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Counters reset at the start of every frame
+struct FrameCounters {
+    uint64_t draw_calls = 0;
+    uint64_t triangles = 0;
+    uint64_t binds_issued = 0;   // state changes that reached GL
+    uint64_t binds_skipped = 0;  // redundant binds filtered by GLState
+    uint64_t uniform_uploads = 0;
+    uint64_t uniform_bytes = 0;
+};
+
+// Fixed-size window of the most recent samples
+struct RollingStats {
+    std::vector<double> samples;
+    size_t next = 0;
+    size_t capacity = 256;
+
+    void add(double value);
+    double percentile(double p) const;  // p in [0, 1]
+    double mean() const;
+};
+
+// Frame instrumentation: named CPU/GPU timer scopes plus draw and state
+// counters, kept as rolling percentiles.
+//
+// GPU scopes use GL_TIME_ELAPSED queries from a fixed pool. Results are read
+// back frames later, only once GL reports them available, so the profiler
+// never stalls the pipeline. GL_TIME_ELAPSED queries can't nest, so only the
+// outermost GPU scope is timed on the GPU; inner scopes get CPU time only.
+// The implicit "frame" scope is CPU-only so top-level scopes can use the GPU.
+// CPU times of every scope also go to the trace when tracing (trace.hpp).
+class Profiler {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    bool enabled = true;
+    FrameCounters counters;
+
+    void begin_frame();
+    void end_frame();
+
+    // gpu=false skips the timer query (CPU time only)
+    void begin_scope(const char* name, bool gpu = true);
+    void end_scope();
+
+    // RAII helper: Profiler::Scope scope(profiler, "shadow");
+    struct Scope {
+        Profiler& profiler;
+        Scope(Profiler& profiler, const char* name) : profiler(profiler) {
+            profiler.begin_scope(name);
+        }
+        ~Scope() { profiler.end_scope(); }
+    };
+
+    void count_bind(bool issued) {
+        issued ? counters.binds_issued++ : counters.binds_skipped++;
+    }
+    void count_uniform(size_t bytes) {
+        counters.uniform_uploads++;
+        counters.uniform_bytes += bytes;
+    }
+    void count_draw(uint64_t triangles) {
+        counters.draw_calls++;
+        counters.triangles += triangles;
+    }
+
+    void print_summary(FILE* out = stdout) const;
+    bool dump_json(const char* filename) const;
+
+   private:
+    static const int QUERY_POOL_SIZE = 64;
+
+    struct ScopeStats {
+        RollingStats cpu_ms;
+        RollingStats gpu_ms;
+    };
+    struct OpenScope {
+        const char* name;  // the key in scopes, so it lives as long
+        ScopeStats* stats;
+        Clock::time_point start;
+        GLuint query;  // 0 if not GPU timed
+    };
+    struct PendingQuery {
+        GLuint query;
+        ScopeStats* stats;
+    };
+
+    std::map<std::string, ScopeStats> scopes;
+    std::vector<OpenScope> open_scopes;
+
+    std::vector<GLuint> free_queries;
+    std::deque<PendingQuery> pending_queries;  // in issue order
+    bool gpu_query_active = false;
+    bool queries_created = false;
+    uint64_t dropped_gpu_samples = 0;
+
+    // Per-frame counters as rolling stats
+    RollingStats draw_calls;
+    RollingStats triangles;
+    RollingStats binds_issued;
+    RollingStats binds_skipped;
+    RollingStats uniform_uploads;
+    RollingStats uniform_bytes;
+    uint64_t frame_count = 0;
+
+    void collect_queries();
+};
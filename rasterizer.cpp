@@ -1,9 +1,13 @@
 #include "rasterizer.hpp"
 
+#include "mesh_chunks.hpp"
+
 void Rasterizer::bindProgram(GLuint program) {
     if (program == curr_state.boundProgram) {
+        profiler.count_bind(false);
         return;
     }
+    profiler.count_bind(true);
     GLint linkStatus;
     glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
     if (linkStatus == GL_FALSE) {
@@ -15,8 +19,10 @@ void Rasterizer::bindProgram(GLuint program) {
 
 void Rasterizer::bindVAO(GLuint vao) {
     if (curr_state.boundVAO == vao) {
+        profiler.count_bind(false);
         return;
     }
+    profiler.count_bind(true);
     glBindVertexArray(vao);
     curr_state.boundVAO = vao;
 }
@@ -24,32 +30,184 @@ void Rasterizer::bindVAO(GLuint vao) {
 // TODO: generally a vbo, but not always
 void Rasterizer::bindArrayBuffer(GLuint vbo) {
     if (curr_state.boundArrayBuffer == vbo) {
+        profiler.count_bind(false);
         return;
     }
+    profiler.count_bind(true);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     curr_state.boundArrayBuffer = vbo;
 }
 
 void Rasterizer::bindElementBuffer(GLuint ebo) {
     if (curr_state.boundElementBuffer == ebo) {
+        profiler.count_bind(false);
         return;
     }
+    profiler.count_bind(true);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
     curr_state.boundElementBuffer = ebo;
 }
 
-// TODO: allow for one mesh to have multiple materials
-void Rasterizer::uploadMesh(Mesh& mesh) {
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    bindVAO(vao);
-    GLuint vbo;
-    glGenBuffers(1, &vbo);
-    bindArrayBuffer(vbo);
+void Rasterizer::drawElements(GLenum mode, GLsizei count, GLenum type,
+                              const void* offset) {
+    glDrawElements(mode, count, type, offset);
+    profiler.count_draw(mode == GL_TRIANGLES ? count / 3 : 0);
+}
+
+void Rasterizer::drawElementsBaseVertex(GLenum mode, GLsizei count,
+                                        GLenum type, const void* offset,
+                                        GLint base_vertex) {
+    glDrawElementsBaseVertex(mode, count, type, offset, base_vertex);
+    profiler.count_draw(mode == GL_TRIANGLES ? count / 3 : 0);
+}
+
+void Rasterizer::drawElementsInstancedBaseVertex(GLenum mode, GLsizei count,
+                                                 GLenum type,
+                                                 const void* offset,
+                                                 GLsizei instances,
+                                                 GLint base_vertex) {
+    glDrawElementsInstancedBaseVertex(mode, count, type, offset, instances,
+                                      base_vertex);
+    profiler.count_draw(mode == GL_TRIANGLES ? count / 3 * instances : 0);
+}
+
+GpuBufferArena& Rasterizer::meshArena(GLenum index_type) {
+    auto& arena =
+        index_type == GL_UNSIGNED_SHORT ? short_mesh_arena : mesh_arena;
+    if (!arena) {
+        // Fixed attribute locations, so every shader variant can share the
+        // arena's VAO
+        VertexLayout layout;
+        layout.stride = sizeof(VertexData);
+        layout.attributes = {
+            {ATTRIB_POSITION, 3, offsetof(VertexData, position)},
+            {ATTRIB_NORMAL, 3, offsetof(VertexData, normal)},
+            {ATTRIB_TEXCOORD, 2, offsetof(VertexData, texcoord)},
+        };
+        // 1M vertices / 3M indices to start, grows by doubling
+        arena = std::make_unique<GpuBufferArena>(layout, 1 << 20, 3 << 20,
+                                                 index_type);
+        arenaChangedBindings();
+    }
+    return *arena;
+}
+
+GpuBufferArena& Rasterizer::depthArena(GLenum index_type) {
+    auto& arena =
+        index_type == GL_UNSIGNED_SHORT ? short_depth_arena : depth_arena;
+    if (!arena) {
+        // Tightly packed positions, 12 bytes per vertex
+        VertexLayout layout;
+        layout.stride = sizeof(glm::vec3);
+        layout.attributes = {{ATTRIB_POSITION, 3, 0}};
+        arena = std::make_unique<GpuBufferArena>(layout, 1 << 20, 3 << 20,
+                                                 index_type);
+        arenaChangedBindings();
+    }
+    return *arena;
+}
+
+void Rasterizer::defragmentMeshArena() {
+    for (auto* arena : {&mesh_arena, &depth_arena, &short_mesh_arena,
+                        &short_depth_arena}) {
+        if (*arena) (*arena)->defragment();
+    }
+    arenaChangedBindings();
+}
+
+void Rasterizer::printArenaStats(FILE* out) const {
+    if (!mesh_arena && !short_mesh_arena) {
+        fprintf(out, "Buffer arena: nothing uploaded\n");
+    }
+    if (mesh_arena) {
+        mesh_arena->print_stats(out);
+    }
+    if (short_mesh_arena) {
+        fprintf(out, "16-bit index ");
+        short_mesh_arena->print_stats(out);
+    }
+}
+
+// The arena binds buffers and VAOs behind GLState's back (leaving them 0)
+void Rasterizer::arenaChangedBindings() {
+    curr_state.boundVAO = 0;
+    curr_state.boundArrayBuffer = 0;
+    curr_state.boundElementBuffer = 0;
+}
+
+GPUMesh Rasterizer::uploadMesh(Mesh& mesh) {
+    TRACE_SCOPE("uploadMesh");
+    MeshUpload upload = prepareMesh(mesh, chunk_meshes);
+    GPUMesh gpu_mesh = reserveMesh(upload);
+    while (!streamMesh(gpu_mesh, upload, SIZE_MAX)) {
+    }
+    fprintf(stdout, "Uploaded mesh: %zu submeshes\n", gpu_mesh.submeshes.size());
+    gpu_mesh.arena->print_stats();
+    return gpu_mesh;
+}
+
+size_t Rasterizer::MeshUpload::bytes() const {
+    size_t bytes = vertices.size() * sizeof(VertexData) +
+                   depth_positions.size() * sizeof(glm::vec3);
+    if (index_type == GL_UNSIGNED_SHORT) {
+        return bytes + (short_indices.size() + short_depth_indices.size()) *
+                           sizeof(uint16_t);
+    }
+    return bytes +
+           (indices.size() + depth_indices.size()) * sizeof(unsigned int);
+}
+
+// Textures go up with the mesh rather than on first draw
+static void collect_textures(Rasterizer::MeshUpload& upload) {
+    Material* previous = nullptr;  // chunks of a material are consecutive
+    for (auto& submesh : upload.submeshes) {
+        Material* material = submesh.material;
+        if (!material || material == previous) continue;
+        previous = material;
+        std::pair<TextureMap*, TextureUsage> maps[] = {
+            {material->diffuse_map_filepath.get(), TextureUsage::Color},
+            {material->ambient_map_filepath.get(), TextureUsage::Color},
+            {material->specular_map_filepath.get(), TextureUsage::Mask},
+            {material->bump_map_filepath.get(), TextureUsage::Height}};
+        for (auto map : maps) {
+            if (map.first) upload.textures.push_back(map);
+        }
+    }
+}
+
+// Submeshes that make good occluders: opaque, and big enough next to the
+// whole mesh to hide something. Small details would cost raster time and
+// (with inner-conservative coverage) hardly cover a pixel.
+static const float OCCLUDER_MIN_EXTENT = 0.1f;  // of the mesh's diagonal
+
+static void select_occluders(const Mesh& mesh,
+                             Rasterizer::MeshUpload& upload) {
+    float mesh_diagonal = glm::length(mesh.bounds.max - mesh.bounds.min);
+    for (size_t i = 0; i < upload.submeshes.size(); i++) {
+        auto& submesh = upload.submeshes[i];
+        auto& bounds = upload.submesh_bounds[i];
+        bool opaque = !submesh.material || submesh.material->transparency <= 0;
+        submesh.occluder = opaque && submesh.index_count > 0 &&
+                           glm::length(bounds.max - bounds.min) >=
+                               OCCLUDER_MIN_EXTENT * mesh_diagonal;
+    }
+}
+
+Rasterizer::MeshUpload Rasterizer::prepareMesh(const Mesh& mesh,
+                                               bool chunked) {
+    TRACE_SCOPE("prepareMesh");
+    MemoryScope memory_scope(MemoryTag::Upload);
+    MeshUpload upload;
+    if (chunked) {
+        prepareChunks(mesh, upload);
+        collect_textures(upload);
+        select_occluders(mesh, upload);
+        return upload;
+    }
 
     // Set up unified vertex buffer
-    std::vector<VertexData> vertices;
-    vertices.reserve(mesh.positions.size() * 3);
+    std::vector<VertexData>& vertices = upload.vertices;
+    vertices.reserve(mesh.positions.size());
     for (int i = 0; i < mesh.positions.size(); i++) {
         vertices.emplace_back(mesh.positions[i], mesh.normals[i],
                               mesh.texcoords[i]);
@@ -58,74 +216,290 @@ void Rasterizer::uploadMesh(Mesh& mesh) {
         // glm::normalize(mesh.texcoords[i]));  // Change to st-coords
     }
 
-    // For drawing without EBO
-    // for (auto& triangle : mesh.triangles) {
-    //     vertices.push_back(mesh.positions[triangle.vertices.x]);
-    //     vertices.push_back(mesh.positions[triangle.vertices.y]);
-    //     vertices.push_back(mesh.positions[triangle.vertices.z]);
-    // }
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VertexData),
-                 vertices.data(), GL_STATIC_DRAW);
+    // Set up element array buffer (indices), grouped by material so each
+    // material is one contiguous draw
+    std::vector<size_t> order(mesh.triangles.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return mesh.triangles[a].material < mesh.triangles[b].material;
+    });
 
-    // Set up element array buffer (indices)
     // std::vector<glm::ivec3> indices;  // NOTE: must be unsigned int!
-    std::vector<unsigned int> indices;
-    for (auto& triangle : mesh.triangles) {
-        indices.push_back(triangle.vertices.x);
-        indices.push_back(triangle.vertices.y);
-        indices.push_back(triangle.vertices.z);
-        // indices.push_back(triangle.vertices);
-    }
-
-    GLuint ebo;
-    glGenBuffers(1, &ebo);
-    bindElementBuffer(ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
-                 indices.data(), GL_STATIC_DRAW);
-
-    // TODO: do i also assign to attributes now? Make sure after shaders
-    // compiled position
-    GLuint pos = glGetAttribLocation(curr_state.boundProgram, "pos");
-    if (pos == -1) {
-        fprintf(stderr, "ERROR: pos not found or optimized out\n");
-        // return false;
-    }
-    glEnableVertexAttribArray(pos);
-    glVertexAttribPointer(pos, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData),
-                          (GLvoid*)0);
-    // For without EBO
-    // glVertexAttribPointer(pos, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
-
-    // normal
-    GLuint norm = glGetAttribLocation(
-        curr_state.boundProgram,
-        "norm");  // Note: optimized out by linker if not used
-    if (norm == -1) {
-        fprintf(stderr, "ERROR: norm not found or optimized out\n");
-        // return false;
-    }
-    glEnableVertexAttribArray(norm);
-    glVertexAttribPointer(norm, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData),
-                          (GLvoid*)sizeof(glm::vec3));
-
-    // texcoords
-    GLuint texcoord = glGetAttribLocation(curr_state.boundProgram, "texcoord");
-    if (texcoord == -1) {
-        fprintf(stderr, "ERROR: texcoord not found or optimized out\n");
-        // return false;
-    }
-    glEnableVertexAttribArray(texcoord);  // pos
-    glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData),
-                          (GLvoid*)(sizeof(glm::vec3) * 2));
-
-    // TODO: unbind VAO? why? Do i want this to be self-contained? probably.
-    // How do i give access to the ids tho?
-
-    // Material
-    // TODO: will upload based on grouped triangles
-    upload_material(mesh.triangles[0].material);
+    std::vector<unsigned int>& indices = upload.indices;
+    indices.reserve(mesh.triangles.size() * 3);
+    for (size_t i : order) {
+        auto& triangle = mesh.triangles[i];
+        if (upload.submeshes.empty() ||
+            upload.submeshes.back().material != triangle.material) {
+            SubMesh submesh;
+            submesh.material = triangle.material;
+            submesh.index_count = 0;
+            submesh.first_index = indices.size();
+            upload.submeshes.push_back(submesh);
+            upload.submesh_bounds.emplace_back();
+        }
+        auto& submesh = upload.submeshes.back();
+        if (submesh.index_count > INT32_MAX - 3) {
+            throw std::runtime_error(
+                "Submesh has more than 2^31 indices, upload it chunked\n");
+        }
+        for (int v = 0; v < 3; v++) {
+            indices.push_back(triangle.vertices[v]);
+            upload.submesh_bounds.back().add_point(
+                mesh.positions[triangle.vertices[v]]);
+        }
+        submesh.index_count += 3;
+    }
+
+    // Position-only stream for the depth pre-pass
+    std::vector<unsigned int> remap;
+    mesh.weld_positions(upload.depth_positions, remap);
+    upload.depth_indices.reserve(indices.size());
+    for (auto index : indices) {
+        upload.depth_indices.push_back(remap[index]);
+    }
+    fprintf(stdout, "Depth stream: %zu welded positions (from %zu vertices)\n",
+            upload.depth_positions.size(), vertices.size());
+
+    collect_textures(upload);
+    select_occluders(mesh, upload);
+    return upload;
+}
+
+// Each chunk gets its own vertices (shared ones are duplicated on borders)
+// and its own welded depth positions, indexed from its first one
+void Rasterizer::prepareChunks(const Mesh& mesh, MeshUpload& upload) {
+    std::vector<MeshChunk> chunks = split_mesh_chunks(mesh);
+    upload.index_type = GL_UNSIGNED_SHORT;
+
+    std::vector<glm::vec3> welded;
+    std::vector<unsigned int> remap;
+    mesh.weld_positions(welded, remap);
+
+    // Index of each vertex / welded position in the current chunk, -1 if
+    // it isn't in it yet; reset from the member lists after each chunk
+    std::vector<int32_t> local(mesh.positions.size(), -1);
+    std::vector<int32_t> depth_local(welded.size(), -1);
+    std::vector<unsigned int> members;
+    std::vector<unsigned int> depth_members;
+    upload.short_indices.reserve(mesh.triangles.size() * 3);
+    upload.short_depth_indices.reserve(mesh.triangles.size() * 3);
+    upload.depth_indices.reserve(mesh.triangles.size() * 3);
+    for (auto& chunk : chunks) {
+        SubMesh submesh;
+        submesh.material = chunk.material;
+        submesh.index_count = GLsizei(chunk.triangles.size() * 3);
+        submesh.first_index = upload.short_indices.size();
+        submesh.base_vertex = GLint(upload.vertices.size());
+        submesh.depth_base_vertex = GLint(upload.depth_positions.size());
+        BoundingBox bounds;
+        for (size_t t : chunk.triangles) {
+            for (int v = 0; v < 3; v++) {
+                unsigned int vertex = mesh.triangles[t].vertices[v];
+                if (local[vertex] < 0) {
+                    local[vertex] = int32_t(members.size());
+                    members.push_back(vertex);
+                    upload.vertices.push_back({mesh.positions[vertex],
+                                               mesh.normals[vertex],
+                                               mesh.texcoords[vertex]});
+                    bounds.add_point(mesh.positions[vertex]);
+                }
+                unsigned int position = remap[vertex];
+                if (depth_local[position] < 0) {
+                    depth_local[position] = int32_t(depth_members.size());
+                    depth_members.push_back(position);
+                    upload.depth_positions.push_back(welded[position]);
+                }
+                upload.short_indices.push_back(uint16_t(local[vertex]));
+                upload.short_depth_indices.push_back(
+                    uint16_t(depth_local[position]));
+                upload.depth_indices.push_back(submesh.depth_base_vertex +
+                                               depth_local[position]);
+            }
+        }
+        for (auto vertex : members) local[vertex] = -1;
+        for (auto position : depth_members) depth_local[position] = -1;
+        members.clear();
+        depth_members.clear();
+        upload.submeshes.push_back(submesh);
+        upload.submesh_bounds.push_back(bounds);
+    }
+
+    // What chunking costs (border vertices) and buys (16-bit indices, and
+    // smaller units for culling), against one submesh per material
+    size_t groups = 0;
+    double group_diagonals = 0;
+    double chunk_diagonals = 0;
+    BoundingBox group_bounds;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto& bounds = upload.submesh_bounds[i];
+        chunk_diagonals += glm::length(bounds.max - bounds.min);
+        group_bounds.add_point(bounds.min);
+        group_bounds.add_point(bounds.max);
+        if (i + 1 == chunks.size() ||
+            chunks[i + 1].material != chunks[i].material) {
+            group_diagonals += glm::length(group_bounds.max - group_bounds.min);
+            group_bounds = BoundingBox();
+            groups++;
+        }
+    }
+    double mesh_diagonal = glm::length(mesh.bounds.max - mesh.bounds.min);
+    size_t index_count = upload.short_indices.size();
+    size_t full_bytes = mesh.positions.size() * sizeof(VertexData) +
+                        welded.size() * sizeof(glm::vec3) +
+                        2 * index_count * sizeof(unsigned int);
+    size_t chunked_bytes = upload.vertices.size() * sizeof(VertexData) +
+                           upload.depth_positions.size() * sizeof(glm::vec3) +
+                           2 * index_count * sizeof(uint16_t);
+    fprintf(stdout,
+            "Chunked mesh: %zu material groups -> %zu chunks of <= %zu "
+            "vertices\n"
+            "\tvertices: %zu -> %zu (+%.1f%% on chunk borders), depth "
+            "positions %zu -> %zu\n"
+            "\tindex memory: %.2f -> %.2f MB (32 -> 16 bit, both streams)\n"
+            "\tvertex + index memory: %.2f -> %.2f MB (%.1f%% saved)\n"
+            "\tculling units: %.0f -> %.0f triangles each, bounds diagonal "
+            "%.1f%% -> %.1f%% of the mesh's\n",
+            groups, chunks.size(), MAX_CHUNK_VERTICES, mesh.positions.size(),
+            upload.vertices.size(),
+            mesh.positions.empty()
+                ? 0.0
+                : 100.0 * upload.vertices.size() / mesh.positions.size() - 100,
+            welded.size(), upload.depth_positions.size(),
+            2 * index_count * sizeof(unsigned int) / 1e6,
+            2 * index_count * sizeof(uint16_t) / 1e6, full_bytes / 1e6,
+            chunked_bytes / 1e6,
+            full_bytes ? 100.0 - 100.0 * chunked_bytes / full_bytes : 0.0,
+            groups ? mesh.triangles.size() / double(groups) : 0.0,
+            chunks.empty() ? 0.0 : mesh.triangles.size() / double(chunks.size()),
+            groups && mesh_diagonal > 0
+                ? 100 * group_diagonals / groups / mesh_diagonal
+                : 0.0,
+            !chunks.empty() && mesh_diagonal > 0
+                ? 100 * chunk_diagonals / chunks.size() / mesh_diagonal
+                : 0.0);
+}
+
+GPUMesh Rasterizer::reserveMesh(const MeshUpload& upload) {
+    GPUMesh gpu_mesh;
+    gpu_mesh.submeshes = upload.submeshes;
+    gpu_mesh.submesh_bounds = upload.submesh_bounds;
+    bool short_indices = upload.index_type == GL_UNSIGNED_SHORT;
+    gpu_mesh.arena = &meshArena(upload.index_type);
+    gpu_mesh.allocation = gpu_mesh.arena->reserve(
+        upload.vertices.size(),
+        short_indices ? upload.short_indices.size() : upload.indices.size());
+    gpu_mesh.depth_arena = &depthArena(upload.index_type);
+    gpu_mesh.depth_allocation = gpu_mesh.depth_arena->reserve(
+        upload.depth_positions.size(), short_indices
+                                           ? upload.short_depth_indices.size()
+                                           : upload.depth_indices.size());
+    arenaChangedBindings();
+    return gpu_mesh;
+}
+
+bool Rasterizer::streamMesh(GPUMesh& gpu_mesh, MeshUpload& upload,
+                            size_t max_bytes) {
+    TRACE_SCOPE("streamMesh");
+    // Next slice of each stream in turn, until the budget runs out
+    auto write = [&](auto& data, size_t& written, auto&& upload_slice) {
+        using Element = typename std::decay_t<decltype(data)>::value_type;
+        size_t count = std::min(data.size() - written,
+                                std::max<size_t>(max_bytes / sizeof(Element), 1));
+        if (count == 0 || max_bytes == 0) return;
+        upload_slice(written, data.data() + written, count);
+        written += count;
+        max_bytes -= std::min(max_bytes, count * sizeof(Element));
+    };
+    GpuBufferArena* arena = gpu_mesh.arena;
+    GpuBufferArena* depth = gpu_mesh.depth_arena;
+    auto handle = gpu_mesh.allocation;
+    auto depth_handle = gpu_mesh.depth_allocation;
+    write(upload.vertices, upload.vertices_written,
+          [&](size_t first, const VertexData* data, size_t count) {
+              arena->write_vertices(handle, first, data, count);
+          });
+    auto write_indices = [&](size_t first, const auto* data, size_t count) {
+        arena->write_indices(handle, first, data, count);
+    };
+    auto write_depth_indices = [&](size_t first, const auto* data,
+                                   size_t count) {
+        depth->write_indices(depth_handle, first, data, count);
+    };
+    bool short_indices = upload.index_type == GL_UNSIGNED_SHORT;
+    if (short_indices) {
+        write(upload.short_indices, upload.indices_written, write_indices);
+    } else {
+        write(upload.indices, upload.indices_written, write_indices);
+    }
+    write(upload.depth_positions, upload.depth_positions_written,
+          [&](size_t first, const glm::vec3* data, size_t count) {
+              depth->write_vertices(depth_handle, first, data, count);
+          });
+    if (short_indices) {
+        write(upload.short_depth_indices, upload.depth_indices_written,
+              write_depth_indices);
+    } else {
+        write(upload.depth_indices, upload.depth_indices_written,
+              write_depth_indices);
+    }
+    if (upload.depth_indices_written < (short_indices
+                                            ? upload.short_depth_indices.size()
+                                            : upload.depth_indices.size())) {
+        return false;
+    }
+
+    // Geometry is in: one texture map per call after that
+    if (upload.textures_uploaded < upload.textures.size()) {
+        auto [map, usage] = upload.textures[upload.textures_uploaded++];
+        upload_texture(map, usage);
+        return false;
+    }
+
+    // The welded copy of the occluder submeshes is the occluder. Indices
+    // of both uploads run parallel to depth_indices.
+    if (gpu_mesh.occluder_indices.empty()) {
+        std::vector<int32_t> remap(upload.depth_positions.size(), -1);
+        for (auto& submesh : gpu_mesh.submeshes) {
+            if (!submesh.occluder) continue;
+            for (GLsizei i = 0; i < submesh.index_count; i++) {
+                unsigned int index =
+                    upload.depth_indices[submesh.first_index + i];
+                if (remap[index] < 0) {
+                    remap[index] = int32_t(gpu_mesh.occluder_positions.size());
+                    gpu_mesh.occluder_positions.push_back(
+                        upload.depth_positions[index]);
+                }
+                gpu_mesh.occluder_indices.push_back(remap[index]);
+            }
+        }
+    }
+    return true;
 }
 
+void Rasterizer::freeMesh(GPUMesh& mesh) {
+    if (mesh.arena) {
+        mesh.arena->free(mesh.allocation);
+        mesh.arena = nullptr;
+    }
+    if (mesh.depth_arena) {
+        mesh.depth_arena->free(mesh.depth_allocation);
+        mesh.depth_arena = nullptr;
+    }
+    mesh.submeshes.clear();
+}
+
+// Stands in for submeshes without a material, so they don't inherit the
+// previous draw's constants
+static Material DEFAULT_MATERIAL = {glm::vec3(0.2f), glm::vec3(0.8f),
+                                    glm::vec3(0), 0.0f, 0.0f, glm::vec3(1),
+                                    1.0f, 0, nullptr, nullptr, nullptr,
+                                    nullptr};
+
+// Uploads material constants to the bound program. Which textures the
+// shader samples is decided at compile time by the variant's feature bits.
 void Rasterizer::upload_material(Material* material) {
     uploadVec3("material.ambient", material->K_a);
     uploadVec3("material.diffuse", material->K_d);
@@ -134,75 +508,665 @@ void Rasterizer::upload_material(Material* material) {
     uploadFloat("material.ior", material->ior);
     uploadFloat("material.transparency", material->transparency);
     uploadVec3("material.transmission_color", material->transmission_color);
+}
 
+// Texture units are global state, independent of the bound program
+void Rasterizer::bind_material_textures(Material* material) {
+    if (material == textures_material) {
+        return;
+    }
+    textures_material = material;
+
+    auto bind = [&](TextureMap* texture, int unit, TextureUsage usage) {
+        if (assets) assets->texture_used(texture);
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, upload_texture(texture, usage));
+    };
     if (material->diffuse_map_filepath) {
-        uploadBool("material.has_diffuse_tex", true);
-        upload_texture(material->diffuse_map_filepath.get(), "diffuse_tex", 0);
+        bind(material->diffuse_map_filepath.get(), DIFFUSE_TEX_UNIT,
+             TextureUsage::Color);
     }
     if (material->ambient_map_filepath) {
-        uploadBool("material.has_ambient_tex", true);
-        upload_texture(material->ambient_map_filepath.get(), "ambient_tex", 1);
+        bind(material->ambient_map_filepath.get(), AMBIENT_TEX_UNIT,
+             TextureUsage::Color);
     }
     if (material->specular_map_filepath) {
-        uploadBool("material.has_specular_tex", true);
-        upload_texture(material->specular_map_filepath.get(), "specular_tex",
-                       2);
+        bind(material->specular_map_filepath.get(), SPECULAR_TEX_UNIT,
+             TextureUsage::Mask);
     }
     if (material->bump_map_filepath) {
-        uploadBool("material.has_bump_tex", true);
-        upload_texture(material->bump_map_filepath.get(), "bump_tex", 3);
+        bind(material->bump_map_filepath.get(), BUMP_TEX_UNIT,
+             TextureUsage::Height);
     }
 }
 
-void Rasterizer::upload_texture(TextureMap* texture, const GLchar* shaderVar,
-                                int textureIndex) {
-    // TODO: For now, just diffuse, then abstract out
+// Returns the GL texture for this map, uploading it on first use
+GLuint Rasterizer::upload_texture(TextureMap* texture, TextureUsage usage) {
+    if (texture->gpu_id) {
+        return texture->gpu_id;
+    }
+    TRACE_SCOPE("upload_texture");
+    if (assets && !assets->ensure_pixels(texture)) {
+        return 0;
+    }
+    MemoryScope memory_scope(MemoryTag::Texture);
+
     GLuint texID;
-    glGenTextures(1, &texID);  // Could move this to upload_material to generate
-                               // all that i need at once
-    glActiveTexture(GL_TEXTURE0 + textureIndex);
+    glGenTextures(1, &texID);
     glBindTexture(GL_TEXTURE_2D, texID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->width, texture->height, 0,
-                 GL_RGBA, GL_UNSIGNED_BYTE, &texture->pixels[0]);
+    textures_material = nullptr;  // clobbered the active unit
 
-    // Filters: mipmap must be generated for default filter!
-    glGenerateMipmap(GL_TEXTURE_2D);
+    size_t gpu_bytes = 0;
+    std::optional<BlockFormat> format;
+    if (compress_textures && usage != TextureUsage::Height) {
+        format = textureFormat(texture, usage);
+    }
+    if (usage == TextureUsage::Height) {
+        gpu_bytes = uploadNormalMap(*texture);
+    } else if (format) {
+        CompressedTexture compressed = compress_texture(
+            texture->pixels.data(), texture->width, texture->height, *format,
+            jobs);
+        for (size_t level = 0; level < compressed.levels.size(); level++) {
+            auto& data = compressed.levels[level];
+            glCompressedTexImage2D(GL_TEXTURE_2D, level,
+                                   compressedInternalFormat(*format),
+                                   data.width, data.height, 0,
+                                   data.data.size(), data.data.data());
+        }
+        if (block_format_channels(*format) == 1) {
+            // Shaders read .rgb, so spread red like an uncompressed gray map
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        }
+        auto& stats = compressed.stats;
+        gpu_bytes = stats.bytes;
+        fprintf(stdout,
+                "Texture %ux%u -> %s, %zu levels: %.1f MP/s, PSNR %.2f dB "
+                "(max error %d), %.2f MB\n",
+                texture->width, texture->height, block_format_name(*format),
+                compressed.levels.size(), stats.mp_per_s(), stats.psnr,
+                stats.max_error, gpu_bytes / 1048576.0);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->width,
+                     texture->height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     &texture->pixels[0]);
+
+        // Filters: mipmap must be generated for default filter!
+        glGenerateMipmap(GL_TEXTURE_2D);
+        gpu_bytes = size_t(texture->width) * texture->height * 4 * 4 / 3;
+    }
 
     // Tiling
 
-    GLint sampler = glGetUniformLocation(curr_state.boundProgram, shaderVar);
-    if (sampler == -1) {
-        fprintf(stderr,
-                "ERROR: %s sampler uniform not found or optimized out\n",
-                shaderVar);
+    texture->gpu_id = texID;
+    texture->gpu_bytes = gpu_bytes;
+    track_gpu_bytes(MemoryTag::Texture, gpu_bytes);
+    if (assets) {
+        assets->texture_uploaded(texture, gpu_bytes);
+    }
+    return texture->gpu_id;  // the budget may have evicted it already
+}
+
+// Height maps go up as two channel normal maps with their own renormalized
+// mips: BC5 when compressing, RG8 otherwise. Returns the GPU bytes.
+size_t Rasterizer::uploadNormalMap(const TextureMap& texture) {
+    NormalMap normal_map = load_normal_map(texture, normal_maps, jobs);
+    std::optional<BlockFormat> format;
+    if (compress_textures) {
+        format = textureFormat(&texture, TextureUsage::Normal);
+    }
+
+    size_t gpu_bytes = 0;
+    if (format) {
+        CompressedTexture compressed =
+            compress_normal_map(normal_map, jobs);
+        for (size_t level = 0; level < compressed.levels.size(); level++) {
+            auto& data = compressed.levels[level];
+            glCompressedTexImage2D(GL_TEXTURE_2D, level,
+                                   compressedInternalFormat(*format),
+                                   data.width, data.height, 0,
+                                   data.data.size(), data.data.data());
+        }
+        gpu_bytes = compressed.stats.bytes;
+    } else {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // RG8 rows aren't 4-byte multiples
+        for (size_t level = 0; level < normal_map.levels.size(); level++) {
+            auto& data = normal_map.levels[level];
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RG8, data.width, data.height,
+                         0, GL_RG, GL_UNSIGNED_BYTE, data.xy.data());
+            gpu_bytes += data.xy.size();
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    fprintf(stdout, "Normal map %ux%u (%s) -> %s, %zu levels: %.1f ms%s\n",
+            texture.width, texture.height,
+            normal_maps.sobel ? "Sobel" : "central differences",
+            format ? block_format_name(*format) : "RG8",
+            normal_map.levels.size(), normal_map.build_ms,
+            normal_map.from_cache ? " (cached)" : "");
+    return gpu_bytes;
+}
+
+// Block format for this map, if the driver can sample it
+std::optional<BlockFormat> Rasterizer::textureFormat(const TextureMap* texture,
+                                                     TextureUsage usage) const {
+    bool has_alpha = false;
+    for (size_t i = 3; i < texture->pixels.size() && !has_alpha; i += 4) {
+        has_alpha = texture->pixels[i] != 255;
+    }
+    bool bc7 = allow_bc7 && (GLEW_VERSION_4_2 || GLEW_ARB_texture_compression_bptc);
+    BlockFormat format = choose_block_format(usage, has_alpha, bc7);
+    if ((format == BlockFormat::BC1 || format == BlockFormat::BC3) &&
+        !GLEW_EXT_texture_compression_s3tc) {
+        return std::nullopt;
+    }
+    return format;  // RGTC (BC4/BC5) is core
+}
+
+GLenum Rasterizer::compressedInternalFormat(BlockFormat format) {
+    switch (format) {
+        case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BlockFormat::BC4: return GL_COMPRESSED_RED_RGTC1;
+        case BlockFormat::BC5: return GL_COMPRESSED_RG_RGTC2;
+        case BlockFormat::BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
+    return GL_RGBA;
+}
+
+void Rasterizer::setAssetManager(AssetManager* manager) {
+    assets = manager;
+    assets->release_gpu = [this](TextureMap& texture) {
+        glDeleteTextures(1, &texture.gpu_id);
+        texture.gpu_id = 0;
+        track_gpu_bytes(MemoryTag::Texture, -int64_t(texture.gpu_bytes));
+        texture.gpu_bytes = 0;
+        textures_material = nullptr;  // rebound (and re-uploaded) on use
+    };
+}
+
+// Sampler units never change, so each program only needs them set once
+void Rasterizer::initSamplers() {
+    auto set_unit = [&](const GLchar* name, int unit) {
+        GLint sampler = uniformLocation(name);
+        if (sampler != -1) {
+            glUniform1i(sampler, unit);
+            profiler.count_uniform(sizeof(GLint));
+        }
+    };
+    set_unit("diffuse_tex", DIFFUSE_TEX_UNIT);
+    set_unit("ambient_tex", AMBIENT_TEX_UNIT);
+    set_unit("specular_tex", SPECULAR_TEX_UNIT);
+    set_unit("bump_tex", BUMP_TEX_UNIT);
+    set_unit("light_data", LIGHT_DATA_TEX_UNIT);
+    set_unit("cluster_ranges", CLUSTER_RANGES_TEX_UNIT);
+    set_unit("light_indices", LIGHT_INDICES_TEX_UNIT);
+
+    // GLSL 4.10 has no layout(binding) for blocks
+    GLuint program = curr_state.boundProgram;
+    GLuint frame_block = glGetUniformBlockIndex(program, "FrameBlock");
+    if (frame_block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, frame_block, FRAME_BLOCK_BINDING);
+    }
+}
+
+void Rasterizer::setFrameUniforms(const FrameUniforms& uniforms) {
+    frame_uniforms = uniforms;
+    frame_uniforms_version++;
+}
+
+void Rasterizer::endFrame() {
+    if (uniform_ring) {
+        uniform_ring->end_frame();
+    }
+}
+
+void Rasterizer::applyFrameUniforms() {
+    // One block per change, shared by every program through its binding
+    if (frame_block_version != frame_uniforms_version) {
+        if (!uniform_ring) {
+            uniform_ring = std::make_unique<UniformRing>(64 << 10);
+        }
+        UniformRing::Block block = uniform_ring->push(frame_uniforms);
+        uniform_ring->flush();
+        uniform_ring->bind(FRAME_BLOCK_BINDING, block);
+        profiler.count_uniform(sizeof(frame_uniforms));
+        frame_block_version = frame_uniforms_version;
+    }
+
+    auto [it, first_use] =
+        program_frame_version.try_emplace(curr_state.boundProgram, 0);
+    if (first_use) {
+        initSamplers();
+    } else if (it->second == frame_uniforms_version) {
+        return;
+    }
+    it->second = frame_uniforms_version;
+
+    if (clustered_lighting) {
+        uploadVec4("cluster_grid", cluster_grid);
+        uploadVec4("cluster_depth", cluster_depth);
+    }
+}
+
+uint32_t Rasterizer::variantFeatures(const Material* material) const {
+    uint32_t features = material_features(material);
+    if (clustered_lighting) {
+        features |= FEATURE_CLUSTERED;
+    }
+    if (transparentPass(material)) {
+        features |= FEATURE_OIT;
+    }
+    return features;
+}
+
+bool Rasterizer::transparentPass(const Material* material) const {
+    return transparency && oit_composite_program && material &&
+           material->transparency > 0;
+}
+
+void Rasterizer::setLights(const std::vector<PointLight>& view_lights,
+                           const LightClusters& clusters, glm::ivec2 viewport) {
+    if (!light_buffers[0]) {
+        glGenBuffers(3, light_buffers);
+        glGenTextures(3, light_textures);
+    }
+
+    // Orphan and refill every frame. Texture buffers can't be empty, so
+    // each gets at least one element.
+    auto upload = [&](int i, GLenum format, const void* data, size_t size,
+                      size_t min_size, int unit) {
+        glBindBuffer(GL_TEXTURE_BUFFER, light_buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(size, min_size), nullptr,
+                     GL_STREAM_DRAW);
+        track_gpu_bytes(MemoryTag::Upload,
+                        int64_t(std::max(size, min_size)) - light_buffer_bytes[i]);
+        light_buffer_bytes[i] = std::max(size, min_size);
+        if (size) {
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+        }
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_BUFFER, light_textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, light_buffers[i]);
+    };
+    upload(0, GL_RGBA32F, view_lights.data(),
+           view_lights.size() * sizeof(PointLight), sizeof(PointLight),
+           LIGHT_DATA_TEX_UNIT);
+    upload(1, GL_RG32UI, clusters.ranges.data(),
+           clusters.ranges.size() * sizeof(LightClusters::Range),
+           sizeof(LightClusters::Range), CLUSTER_RANGES_TEX_UNIT);
+    upload(2, GL_R32UI, clusters.light_indices.data(),
+           clusters.light_indices.size() * sizeof(uint32_t), sizeof(uint32_t),
+           LIGHT_INDICES_TEX_UNIT);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    cluster_grid = glm::vec4(clusters.tiles_x, clusters.tiles_y,
+                             clusters.slices, view_lights.size());
+    cluster_depth = glm::vec4(
+        clusters.near, clusters.slices / std::log(clusters.far / clusters.near),
+        float(viewport.x) / clusters.tiles_x,
+        float(viewport.y) / clusters.tiles_y);
+    frame_uniforms_version++;  // programs pick up the new grid lazily
+}
+
+void Rasterizer::drawSubMesh(const GPUMesh& mesh, const SubMesh& submesh,
+                             bool depth_only, GLsizei instances) {
+    GpuBufferArena* arena = depth_only ? mesh.depth_arena : mesh.arena;
+    auto& range =
+        arena->range(depth_only ? mesh.depth_allocation : mesh.allocation);
+    bindVAO(arena->vao);
+    const void* offset = (const void*)((range.first_index + submesh.first_index) *
+                                       arena->index_size);
+    GLint base_vertex =
+        range.base_vertex +
+        (depth_only ? submesh.depth_base_vertex : submesh.base_vertex);
+    if (instances == 1) {
+        drawElementsBaseVertex(GL_TRIANGLES, submesh.index_count,
+                               arena->index_type, offset, base_vertex);
+    } else {
+        drawElementsInstancedBaseVertex(GL_TRIANGLES, submesh.index_count,
+                                        arena->index_type, offset, instances,
+                                        base_vertex);
+    }
+}
+
+std::vector<const SubMesh*> Rasterizer::frontToBack(
+    const GPUMesh& mesh, const uint8_t* visible) const {
+    std::vector<std::pair<float, const SubMesh*>> keyed;
+    keyed.reserve(mesh.submeshes.size());
+    for (size_t i = 0; i < mesh.submeshes.size(); i++) {
+        if (visible && !visible[i]) {
+            continue;
+        }
+        // View space looks down -z
+        glm::vec4 center =
+            frame_uniforms.mv * glm::vec4(mesh.submesh_bounds[i].center(), 1);
+        keyed.emplace_back(-center.z, &mesh.submeshes[i]);
+    }
+    std::sort(keyed.begin(), keyed.end(),
+              [](auto& a, auto& b) { return a.first < b.first; });
+
+    std::vector<const SubMesh*> sorted;
+    sorted.reserve(keyed.size());
+    for (auto& [depth, submesh] : keyed) {
+        sorted.push_back(submesh);
+    }
+    return sorted;
+}
+
+void Rasterizer::drawShaded(const GPUMesh& mesh, const SubMesh& submesh,
+                            ShaderVariants& variants) {
+    GLuint program = variants.get(variantFeatures(submesh.material));
+    if (!program) {
+        return;  // compile error already reported
+    }
+    bindProgram(program);
+    applyFrameUniforms();
+
+    // Skip re-uploading if this program already has the material
+    Material* material =
+        submesh.material ? submesh.material : &DEFAULT_MATERIAL;
+    Material*& uploaded = program_material[program];
+    if (uploaded != material) {
+        upload_material(material);
+        uploaded = material;
+    }
+    bind_material_textures(material);
+
+    drawSubMesh(mesh, submesh);
+}
+
+void Rasterizer::drawMesh(const GPUMesh& mesh, ShaderVariants& variants) {
+    const uint8_t* visible = nullptr;
+    if (occlusion_culler && !mesh.occluder_indices.empty()) {
+        Profiler::Scope scope(profiler, "occlusion");
+        occlusion_culler->begin_frame();
+        occlusion_culler->add_occluder(mesh.occluder_positions.data(),
+                                       mesh.occluder_indices.data(),
+                                       mesh.occluder_indices.size(),
+                                       frame_uniforms.mvp);
+        occlusion_culler->rasterize();
+        submesh_visible.resize(mesh.submeshes.size());
+        occlusion_culler->test(mesh.submesh_bounds.data(),
+                               mesh.submesh_bounds.size(), frame_uniforms.mvp,
+                               submesh_visible.data());
+        visible = submesh_visible.data();
+    }
+
+    // Transparent submeshes are pulled out of the depth and shading passes
+    transparent_submeshes.clear();
+    if (transparency && oit_composite_program) {
+        if (!visible) {
+            submesh_visible.assign(mesh.submeshes.size(), 1);
+        }
+        for (size_t i = 0; i < mesh.submeshes.size(); i++) {
+            if (submesh_visible[i] &&
+                transparentPass(mesh.submeshes[i].material)) {
+                transparent_submeshes.push_back(&mesh.submeshes[i]);
+                submesh_visible[i] = 0;
+            }
+        }
+        visible = submesh_visible.data();
+    }
+
+    std::vector<const SubMesh*> sorted = frontToBack(mesh, visible);
+    bool prepass = depth_prepass && depth_program && mesh.depth_arena;
+
+    if (prepass) {
+        Profiler::Scope scope(profiler, "depth prepass");
+        bindProgram(depth_program);
+        applyFrameUniforms();
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        for (const SubMesh* submesh : sorted) {
+            drawSubMesh(mesh, *submesh, true);
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        // Depth is final: only the visible fragment at each pixel passes
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+    }
+
+    {
+        Profiler::Scope scope(profiler, "shading");
+        beginFragmentQuery();
+        if (prepass) {
+            // Order no longer matters for overdraw, keep material grouping
+            // to minimize program/texture switches
+            for (size_t i = 0; i < mesh.submeshes.size(); i++) {
+                if (!visible || visible[i]) {
+                    drawShaded(mesh, mesh.submeshes[i], variants);
+                }
+            }
+        } else {
+            for (const SubMesh* submesh : sorted) {
+                drawShaded(mesh, *submesh, variants);
+            }
+        }
+        endFragmentQuery();
+    }
+
+    if (prepass) {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    }
+
+    if (!transparent_submeshes.empty()) {
+        Profiler::Scope scope(profiler, "transparency");
+        if (!oit) {
+            oit = std::make_unique<WeightedOit>(oit_composite_program);
+        }
+        oit->begin();
+        for (const SubMesh* submesh : transparent_submeshes) {
+            drawShaded(mesh, *submesh, variants);
+        }
+        oit->end();
+        // The composite binds its own program, VAO and textures
+        curr_state = GLState();
+        textures_material = nullptr;
+    }
+}
+
+void Rasterizer::drawMeshMultiview(const GPUMesh& mesh,
+                                   ShaderVariants& variants,
+                                   const std::vector<FrameUniforms>& views,
+                                   const std::vector<glm::vec4>& viewports) {
+    if (views.empty() || views.size() != viewports.size()) {
+        fprintf(stderr, "ERROR: drawMeshMultiview needs one viewport per view\n");
+        return;
+    }
+    uint32_t routing = FEATURE_MULTIVIEW;
+    if (GLEW_ARB_shader_viewport_layer_array) {
+        routing |= FEATURE_VS_VIEWPORT_INDEX;
+    }
+
+    GLint previous_viewport[4];
+    glGetIntegerv(GL_VIEWPORT, previous_viewport);
+
+    // Per view arrays, as the shaders declare them
+    glm::mat4 mvp[MAX_VIEWS];
+    glm::mat4 mv[MAX_VIEWS];
+    glm::mat4 normal_matrix[MAX_VIEWS];
+    glm::vec4 light_pos[MAX_VIEWS];
+    glm::vec4 camera_pos[MAX_VIEWS];
+
+    Profiler::Scope scope(profiler, "multiview");
+    for (size_t first = 0; first < views.size(); first += MAX_VIEWS) {
+        GLsizei count = GLsizei(std::min<size_t>(MAX_VIEWS, views.size() - first));
+        for (GLsizei i = 0; i < count; i++) {
+            const FrameUniforms& view = views[first + i];
+            mvp[i] = view.mvp;
+            mv[i] = view.mv;
+            normal_matrix[i] = view.normal_matrix;
+            light_pos[i] = view.view_light_pos;
+            camera_pos[i] = view.view_camera_pos;
+            const glm::vec4& viewport = viewports[first + i];
+            glViewportIndexedf(i, viewport.x, viewport.y, viewport.z,
+                               viewport.w);
+        }
+
+        // Programs are shared by submeshes with the same features, so each
+        // gets the view arrays once per submission
+        std::vector<GLuint> programs_with_views;
+        for (auto& submesh : mesh.submeshes) {
+            GLuint program =
+                variants.get(material_features(submesh.material) | routing);
+            if (!program) {
+                continue;  // compile error already reported
+            }
+            bindProgram(program);
+            if (program_frame_version.try_emplace(program, 0).second) {
+                initSamplers();
+            }
+            if (std::find(programs_with_views.begin(), programs_with_views.end(),
+                          program) == programs_with_views.end()) {
+                programs_with_views.push_back(program);
+                auto upload = [&](const GLchar* name, const glm::mat4* data) {
+                    GLint location = uniformLocation(name);
+                    if (location != -1) {
+                        glUniformMatrix4fv(location, count, GL_FALSE,
+                                           &data[0][0][0]);
+                        profiler.count_uniform(count * sizeof(glm::mat4));
+                    }
+                };
+                upload("multiview_mvp", mvp);
+                upload("multiview_mv", mv);
+                upload("multiview_normal_matrix", normal_matrix);
+                for (auto [name, data] : {std::pair{"multiview_light_pos", light_pos},
+                                          std::pair{"multiview_camera_pos", camera_pos}}) {
+                    GLint location = uniformLocation(name);
+                    if (location != -1) {
+                        glUniform4fv(location, count, &data[0][0]);
+                        profiler.count_uniform(count * sizeof(glm::vec4));
+                    }
+                }
+            }
+
+            Material* material =
+                submesh.material ? submesh.material : &DEFAULT_MATERIAL;
+            Material*& uploaded = program_material[program];
+            if (uploaded != material) {
+                upload_material(material);
+                uploaded = material;
+            }
+            bind_material_textures(material);
+            drawSubMesh(mesh, submesh, false, count);
+        }
+    }
+
+    glViewport(previous_viewport[0], previous_viewport[1], previous_viewport[2],
+               previous_viewport[3]);
+}
+
+// Occlusion queries form a small ring; results are only read once
+// available, the oldest first
+void Rasterizer::beginFragmentQuery() {
+    if (!count_shaded_fragments) {
+        return;
+    }
+    if (!fragment_queries[0]) {
+        glGenQueries(std::size(fragment_queries), fragment_queries);
+    }
+
+    const int num_queries = std::size(fragment_queries);
+    while (fragment_queries_pending > 0) {
+        int oldest = (fragment_query_next - fragment_queries_pending +
+                      num_queries) % num_queries;
+        GLint available = 0;
+        glGetQueryObjectiv(fragment_queries[oldest], GL_QUERY_RESULT_AVAILABLE,
+                           &available);
+        // Ring full: wait rather than reuse a query still in flight
+        if (!available && fragment_queries_pending < num_queries) {
+            break;
+        }
+        GLuint64 samples = 0;
+        glGetQueryObjectui64v(fragment_queries[oldest], GL_QUERY_RESULT,
+                              &samples);
+        shaded_fragments = samples;
+        fragment_queries_pending--;
+    }
+    glBeginQuery(GL_SAMPLES_PASSED, fragment_queries[fragment_query_next]);
+}
+
+void Rasterizer::endFragmentQuery() {
+    if (!count_shaded_fragments) {
+        return;
+    }
+    glEndQuery(GL_SAMPLES_PASSED);
+    fragment_query_next = (fragment_query_next + 1) % std::size(fragment_queries);
+    fragment_queries_pending++;
+}
+
+// Cached per program; -1 (optimized out in this variant) is cached too
+GLint Rasterizer::uniformLocation(const GLchar* varName) {
+    auto& locations = uniform_locations[curr_state.boundProgram];
+    auto existing = locations.find(varName);
+    if (existing != locations.end()) {
+        return existing->second;
     }
-    glUseProgram(curr_state.boundProgram);  // Is this needed?
-    glUniform1i(sampler, textureIndex);
+    GLint location = glGetUniformLocation(curr_state.boundProgram, varName);
+    locations.emplace(varName, location);
+    return location;
 }
 
 void Rasterizer::uploadVec3(const GLchar* varName, glm::vec3 data) {
-    auto location = glGetUniformLocation(curr_state.boundProgram, varName);
+    auto location = uniformLocation(varName);
     if (location == -1) {
-        fprintf(stderr, "ERROR: %s uniform not found or optimized out\n",
-                varName);
+        return;  // optimized out in this variant
     }
     glUniform3fv(location, 1, &data[0]);
+    profiler.count_uniform(sizeof(data));
+}
+
+void Rasterizer::uploadVec4(const GLchar* varName, glm::vec4 data) {
+    auto location = uniformLocation(varName);
+    if (location == -1) {
+        return;
+    }
+    glUniform4fv(location, 1, &data[0]);
+    profiler.count_uniform(sizeof(data));
+}
+
+void Rasterizer::uploadMat4(const GLchar* varName, const glm::mat4& data) {
+    auto location = uniformLocation(varName);
+    if (location == -1) {
+        return;
+    }
+    glUniformMatrix4fv(location, 1, GL_FALSE, &data[0][0]);
+    profiler.count_uniform(sizeof(data));
+}
+
+void Rasterizer::uploadMat3(const GLchar* varName, const glm::mat4& data) {
+    auto location = uniformLocation(varName);
+    if (location == -1) {
+        return;
+    }
+    GLfloat mat3[9];
+    for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < 3; r++) {
+            mat3[c * 3 + r] = data[c][r];
+        }
+    }
+    glUniformMatrix3fv(location, 1, GL_FALSE, mat3);
+    profiler.count_uniform(sizeof(mat3));
 }
 
 void Rasterizer::uploadFloat(const GLchar* varName, float data) {
-    auto location = glGetUniformLocation(curr_state.boundProgram, varName);
+    auto location = uniformLocation(varName);
     if (location == -1) {
-        fprintf(stderr, "ERROR: %s uniform not found or optimized out\n",
-                varName);
+        return;
     }
     glUniform1f(location, data);
+    profiler.count_uniform(sizeof(data));
 }
 
 void Rasterizer::uploadBool(const GLchar* varName, bool data) {
-    auto location = glGetUniformLocation(curr_state.boundProgram, varName);
+    auto location = uniformLocation(varName);
     if (location == -1) {
-        fprintf(stderr, "ERROR: %s uniform not found or optimized out\n",
-                varName);
+        return;
     }
     glUniform1i(location, data);
-}
\ No newline at end of file
+    profiler.count_uniform(sizeof(GLint));
+}
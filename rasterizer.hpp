@@ -2,22 +2,92 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <cstdio>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
 
+#include "asset_manager.hpp"
+#include "frame_uniforms.hpp"
+#include "gpu_arena.hpp"
+#include "light_clusters.hpp"
+#include "memory_tracker.hpp"
 #include "mesh.hpp"
+#include "normal_map.hpp"
+#include "occlusion_culler.hpp"
+#include "profiler.hpp"
+#include "shader_variants.hpp"
+#include "texture_compression.hpp"
+#include "trace.hpp"
+#include "uniform_ring.hpp"
+#include "weighted_oit.hpp"
 
 struct GLState {
-    GLuint boundProgram;
-    GLuint boundVAO;
-    GLuint boundArrayBuffer;
-    GLuint boundElementBuffer;
+    GLuint boundProgram = 0;
+    GLuint boundVAO = 0;
+    GLuint boundArrayBuffer = 0;
+    GLuint boundElementBuffer = 0;
+};
+
+// Contiguous index range sharing one material
+struct SubMesh {
+    Material* material;  // may be null (shader default material)
+    GLsizei index_count;
+    size_t first_index;  // relative to the mesh's arena range
+    // Added to the range's base vertex: chunks with 16-bit indices each
+    // start at their own first vertex (0 otherwise)
+    GLint base_vertex = 0;
+    GLint depth_base_vertex = 0;
+    // Rasterized into the software occlusion buffer (see select_occluders)
+    bool occluder = false;
+};
+
+// A mesh living in a shared buffer arena
+struct GPUMesh {
+    GpuBufferArena* arena;
+    GpuBufferArena::Handle allocation;
+    std::vector<SubMesh> submeshes;
+    // Model space bounds per submesh, for draw ordering and culling. Kept
+    // out of SubMesh so its layout doesn't depend on glm's alignment config,
+    // which differs between translation units.
+    std::vector<BoundingBox> submesh_bounds;
+
+    // Position-only copy welded on position, for the depth pre-pass. Its
+    // indices are in the same order, so submesh ranges apply unchanged.
+    GpuBufferArena* depth_arena = nullptr;
+    GpuBufferArena::Handle depth_allocation = 0;
+
+    // CPU copy of the welded triangles of the occluder submeshes, compacted
+    // to the positions they use, for software occlusion culling
+    std::vector<glm::vec3> occluder_positions;
+    std::vector<unsigned int> occluder_indices;
 };
 
 // TODO: this API can be improved immensely
 class Rasterizer {
    public:
     GLState curr_state;
+    Profiler profiler;
+
+    // Matches layout(location=...) in the vertex shaders
+    static const GLuint ATTRIB_POSITION = 0;
+    static const GLuint ATTRIB_NORMAL = 1;
+    static const GLuint ATTRIB_TEXCOORD = 2;
+
+    // Texture units per map type
+    static const int DIFFUSE_TEX_UNIT = 0;
+    static const int AMBIENT_TEX_UNIT = 1;
+    static const int SPECULAR_TEX_UNIT = 2;
+    static const int BUMP_TEX_UNIT = 3;
+    // Clustered lighting buffers (texture buffers)
+    static const int LIGHT_DATA_TEX_UNIT = 4;
+    static const int CLUSTER_RANGES_TEX_UNIT = 5;
+    static const int LIGHT_INDICES_TEX_UNIT = 6;
 
     struct VertexData {
         glm::vec3 position;
@@ -35,10 +105,210 @@ class Rasterizer {
     void uploadFloat(const GLchar* varName, float data);
     void uploadBool(const GLchar* varName, bool data);
 
-    void uploadMesh(Mesh& mesh);
+    void uploadMat4(const GLchar* varName, const glm::mat4& data);
+    void uploadMat3(const GLchar* varName, const glm::mat4& data);
+    void uploadVec4(const GLchar* varName, glm::vec4 data);
+
+    // Counted draws: all draws should go through here for the profiler
+    void drawElements(GLenum mode, GLsizei count, GLenum type,
+                      const void* offset);
+    void drawElementsBaseVertex(GLenum mode, GLsizei count, GLenum type,
+                                const void* offset, GLint base_vertex);
+    void drawElementsInstancedBaseVertex(GLenum mode, GLsizei count,
+                                         GLenum type, const void* offset,
+                                         GLsizei instances, GLint base_vertex);
+
+    // Triangles are grouped by material into one submesh each. Vertex and
+    // index data is sub-allocated from the shared mesh arena.
+    GPUMesh uploadMesh(Mesh& mesh);
+    // Upload meshes split spatially into chunks of at most 65535 vertices
+    // (split_mesh_chunks), one submesh each with 16-bit indices and its own
+    // bounds, for huge meshes and finer culling. Vertices on chunk borders
+    // are duplicated.
+    bool chunk_meshes = false;
+
+    // uploadMesh in pieces, for streaming: prepareMesh does the CPU work
+    // and touches no GL state, so it can run on a loader thread. Then
+    // reserveMesh takes the arena space and each streamMesh call uploads at
+    // most max_bytes of vertex/index data, or one texture map once that's
+    // done. The GPUMesh can be drawn once streamMesh returns true.
+    struct MeshUpload {
+        std::vector<VertexData> vertices;
+        std::vector<unsigned int> indices;
+        std::vector<glm::vec3> depth_positions;  // welded, for the pre-pass
+        std::vector<unsigned int> depth_indices;
+        std::vector<SubMesh> submeshes;
+        std::vector<BoundingBox> submesh_bounds;
+        std::vector<std::pair<TextureMap*, TextureUsage>> textures;
+
+        // Chunked uploads have GL_UNSIGNED_SHORT indices, in the short_
+        // vectors instead, and keep depth_indices (rebased to 32-bit) only
+        // as the occluder
+        GLenum index_type = GL_UNSIGNED_INT;
+        std::vector<uint16_t> short_indices;
+        std::vector<uint16_t> short_depth_indices;
+
+        // Streaming progress, in elements
+        size_t vertices_written = 0;
+        size_t indices_written = 0;
+        size_t depth_positions_written = 0;
+        size_t depth_indices_written = 0;
+        size_t textures_uploaded = 0;
+
+        size_t bytes() const;
+    };
+    static MeshUpload prepareMesh(const Mesh& mesh, bool chunked = false);
+    GPUMesh reserveMesh(const MeshUpload& upload);
+    bool streamMesh(GPUMesh& gpu_mesh, MeshUpload& upload, size_t max_bytes);
+    void freeMesh(GPUMesh& mesh);
+    // One pair of arenas per index type (chunked meshes use 16-bit)
+    GpuBufferArena& meshArena(GLenum index_type = GL_UNSIGNED_INT);
+    GpuBufferArena& depthArena(GLenum index_type = GL_UNSIGNED_INT);
+    void defragmentMeshArena();
+    void printArenaStats(FILE* out = stdout) const;
     void upload_material(Material* material);
-    void upload_texture(TextureMap* texture, const GLchar* shaderVar,
-                        int textureIndex);
+    void bind_material_textures(Material* material);
+    GLuint upload_texture(TextureMap* texture,
+                          TextureUsage usage = TextureUsage::Color);
+
+    // Block-compress textures on upload (format picked by usage), encoding
+    // on jobs if set. BC7 for color maps needs allow_bc7 and driver
+    // support, and is slower to encode than BC1.
+    bool compress_textures = false;
+    bool allow_bc7 = false;
+    JobSystem* jobs = nullptr;
+
+    // Bump maps (TextureUsage::Height) are converted to normal maps on
+    // upload with these settings, and cached next to their source
+    NormalMapSettings normal_maps;
+
+    // Textures from the asset manager are reported to it on upload, and it
+    // may delete them again to stay within its VRAM budget
+    void setAssetManager(AssetManager* manager);
+    AssetManager* assets = nullptr;
+
+    // Frame uniforms are written lazily, once per change, as a FrameBlock
+    // uniform block in a UniformRing that every program shares
+    void setFrameUniforms(const FrameUniforms& uniforms);
+    static const GLuint FRAME_BLOCK_BINDING = 0;
+    // Call once per frame (after the swap) so the ring can reuse space as
+    // soon as the GPU is done with it
+    void endFrame();
+
+    // Uploads view space lights and their cluster lists for the CLUSTERED
+    // shader variants, which replace the single view_light_pos light.
+    // viewport is the framebuffer size in pixels.
+    void setLights(const std::vector<PointLight>& view_lights,
+                   const LightClusters& clusters, glm::ivec2 viewport);
+    bool clustered_lighting = false;
+
+    // Shader features for a material under the current lighting mode
+    uint32_t variantFeatures(const Material* material) const;
+
+    // Draws every submesh with the shader variant matching its material.
+    // With depth_prepass set (and a depth_program), depth is laid down first
+    // from the position-only stream, front to back, and the shading pass
+    // runs with GL_LEQUAL and depth writes off so hidden fragments are
+    // never shaded.
+    // With an occlusion_culler, the mesh's occluder submeshes (large and
+    // opaque ones) are rasterized on the CPU first and hidden submeshes are
+    // skipped.
+    // Transparent submeshes (see transparentPass) are left out of both and
+    // drawn last, unsorted, with weighted blended OIT.
+    void drawMesh(const GPUMesh& mesh, ShaderVariants& variants);
+    // Draws one submesh with whatever program is bound
+    void drawSubMesh(const GPUMesh& mesh, const SubMesh& submesh,
+                     bool depth_only = false, GLsizei instances = 1);
+
+    // Views per multiview submission (GL_MAX_VIEWPORTS is at least 16)
+    static const int MAX_VIEWS = 16;
+
+    // Draws the mesh into every view at once: one instanced draw per
+    // submesh, instance i transformed by views[i] and routed to viewports[i]
+    // (x, y, width, height) and to layer i of a layered framebuffer. Vertex
+    // data, programs and material binds are shared by all views. Routing is
+    // done by the vertex shader with GL_ARB_shader_viewport_layer_array, else
+    // by the variants' geometry shader. More than MAX_VIEWS views take
+    // several submissions.
+    // Lighting is the single view_light_pos light; the depth pre-pass,
+    // occlusion culling, clustered lights and OIT are per view and not
+    // applied (transparent materials are drawn opaque).
+    // Viewport 0's previous rectangle is restored for every viewport after.
+    void drawMeshMultiview(const GPUMesh& mesh, ShaderVariants& variants,
+                           const std::vector<FrameUniforms>& views,
+                           const std::vector<glm::vec4>& viewports);
+
+    bool depth_prepass = false;
+    GLuint depth_program = 0;
+
+    // Materials with transparency (Tr, or d < 1) are drawn in a separate
+    // pass, blended order-independently, when there's a composite program
+    // (oit_composite.vert/frag). Otherwise they're drawn opaque.
+    bool transparency = true;
+    GLuint oit_composite_program = 0;
+    bool transparentPass(const Material* material) const;
+
+    OcclusionCuller* occlusion_culler = nullptr;
+
+    // Fragments that passed the depth test in shading passes, sampled with
+    // an occlusion query and read back without stalling (a few frames late)
+    bool count_shaded_fragments = false;
+    uint64_t shaded_fragments = 0;
 
    private:
+    // Created on first upload (needs a GL context)
+    std::unique_ptr<GpuBufferArena> mesh_arena;
+    std::unique_ptr<GpuBufferArena> depth_arena;
+    std::unique_ptr<GpuBufferArena> short_mesh_arena;
+    std::unique_ptr<GpuBufferArena> short_depth_arena;
+
+    GLuint fragment_queries[4] = {};
+    int fragment_query_next = 0;
+    int fragment_queries_pending = 0;
+
+    std::vector<uint8_t> submesh_visible;  // scratch for drawMesh
+    std::vector<const SubMesh*> transparent_submeshes;  // scratch too
+
+    std::unique_ptr<WeightedOit> oit;  // created on first transparent draw
+
+    // Submeshes sorted by view depth of their bounds' center, skipping any
+    // marked hidden in visible (if given)
+    std::vector<const SubMesh*> frontToBack(const GPUMesh& mesh,
+                                            const uint8_t* visible) const;
+    void drawShaded(const GPUMesh& mesh, const SubMesh& submesh,
+                    ShaderVariants& variants);
+    void beginFragmentQuery();
+    void endFragmentQuery();
+
+    FrameUniforms frame_uniforms;
+    uint64_t frame_uniforms_version = 0;
+    uint64_t frame_block_version = UINT64_MAX;  // last written to the ring
+    std::unique_ptr<UniformRing> uniform_ring;  // created on first use
+
+    // Light data, cluster ranges, light indices
+    GLuint light_buffers[3] = {};
+    size_t light_buffer_bytes[3] = {};  // for memory tracking
+    GLuint light_textures[3] = {};
+    glm::vec4 cluster_grid;   // tiles x, tiles y, slices, light count
+    glm::vec4 cluster_depth;  // near, slices / log(far / near), tile w, h
+
+    // Per program: which frame uniforms it has, and cached uniform locations
+    std::unordered_map<GLuint, uint64_t> program_frame_version;
+    std::unordered_map<GLuint, std::unordered_map<std::string, GLint>>
+        uniform_locations;
+
+    Material* textures_material = nullptr;  // whose maps are bound
+
+    // Material currently uploaded to each program
+    std::unordered_map<GLuint, Material*> program_material;
+
+    static void prepareChunks(const Mesh& mesh, MeshUpload& upload);
+    std::optional<BlockFormat> textureFormat(const TextureMap* texture,
+                                             TextureUsage usage) const;
+    static GLenum compressedInternalFormat(BlockFormat format);
+    size_t uploadNormalMap(const TextureMap& texture);
+    void arenaChangedBindings();
+    GLint uniformLocation(const GLchar* varName);
+    void applyFrameUniforms();
+    void initSamplers();
 };
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "render_bench.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+int CameraPath::frames() const {
+    int total = 0;
+    for (auto& keyframe : keyframes) {
+        total += keyframe.frames;
+    }
+    return total;
+}
+
+void CameraPath::reset(OrbitCamera& camera) const {
+    camera.pitch = start.pitch;
+    camera.yaw = start.yaw;
+    camera.radius = start.radius;
+    camera.target = start.target;
+    camera.updateBasis();
+}
+
+void CameraPath::step(int frame, OrbitCamera& camera) const {
+    int total = frames();
+    if (total == 0) return;
+    frame %= total;
+    for (auto& keyframe : keyframes) {
+        if (frame >= keyframe.frames) {
+            frame -= keyframe.frames;
+            continue;
+        }
+        float x = keyframe.x / keyframe.frames;
+        float y = keyframe.y / keyframe.frames;
+        switch (keyframe.type) {
+            case CameraKeyframe::Orbit: camera.orbit(x, y); break;
+            case CameraKeyframe::Pan: camera.pan(x, y); break;
+            case CameraKeyframe::Dolly: camera.dolly(x); break;
+        }
+        return;
+    }
+}
+
+CameraPath load_camera_path(const char* filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open camera path: " +
+                                 std::string(filename) + "\n");
+    }
+
+    CameraPath path;
+    std::string line;
+    int line_number = 0;
+    while (getline(file, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        std::string type;
+        if (!(tokens >> type)) {
+            continue;  // blank or comment
+        }
+
+        bool ok;
+        if (type == "start") {
+            ok = bool(tokens >> path.start.pitch >> path.start.yaw >>
+                      path.start.radius);
+            // Target is optional, defaults to the origin
+            tokens >> path.start.target.x >> path.start.target.y >>
+                path.start.target.z;
+        } else {
+            CameraKeyframe keyframe;
+            if (type == "orbit") {
+                keyframe.type = CameraKeyframe::Orbit;
+                ok = bool(tokens >> keyframe.frames >> keyframe.x >> keyframe.y);
+            } else if (type == "pan") {
+                keyframe.type = CameraKeyframe::Pan;
+                ok = bool(tokens >> keyframe.frames >> keyframe.x >> keyframe.y);
+            } else if (type == "dolly") {
+                keyframe.type = CameraKeyframe::Dolly;
+                ok = bool(tokens >> keyframe.frames >> keyframe.x);
+            } else {
+                ok = false;
+            }
+            ok = ok && keyframe.frames > 0;
+            if (ok) path.keyframes.push_back(keyframe);
+        }
+        if (!ok) {
+            throw std::runtime_error(std::format(
+                "Malformed camera path entry on line {} of {}\n", line_number,
+                filename));
+        }
+    }
+    if (path.keyframes.empty()) {
+        throw std::runtime_error("Camera path " + std::string(filename) +
+                                 " has no keyframes\n");
+    }
+    return path;
+}
+
+CameraPath default_camera_path() {
+    CameraPath path;
+    path.keyframes = {
+        {CameraKeyframe::Orbit, 120, 0, 360},
+        {CameraKeyframe::Pan, 30, 1, .5},
+        {CameraKeyframe::Dolly, 60, 4},
+        {CameraKeyframe::Orbit, 60, 30, 90},
+        {CameraKeyframe::Dolly, 60, -4},
+        {CameraKeyframe::Pan, 30, -1, -.5},
+    };
+    return path;
+}
+
+GpuFrameTimer::GpuFrameTimer() { glGenQueries(RING_SIZE, queries); }
+
+GpuFrameTimer::~GpuFrameTimer() { glDeleteQueries(RING_SIZE, queries); }
+
+void GpuFrameTimer::collect(int slot) {
+    if (!results[slot]) return;
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &ns);
+    *results[slot] = ns / 1e6;
+    results[slot] = nullptr;
+}
+
+void GpuFrameTimer::begin() {
+    // RING_SIZE frames old, so normally already available
+    collect(next);
+    glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+}
+
+void GpuFrameTimer::end(double* out_ms) {
+    glEndQuery(GL_TIME_ELAPSED);
+    results[next] = out_ms;
+    next = (next + 1) % RING_SIZE;
+}
+
+void GpuFrameTimer::finish() {
+    for (int slot = 0; slot < RING_SIZE; slot++) {
+        collect(slot);
+    }
+}
+
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    size_t rank = size_t(std::ceil(p * samples.size()));
+    size_t index = std::clamp<size_t>(rank, 1, samples.size()) - 1;
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static double mean(const std::vector<double>& samples) {
+    if (samples.empty()) return 0;
+    return std::accumulate(samples.begin(), samples.end(), 0.0) /
+           samples.size();
+}
+
+void print_bench_run(const BenchRun& run, FILE* out) {
+    fprintf(out, "%s: %zu triangles, %zu frames\n", run.model.c_str(),
+            run.triangles, run.frame_ms.size());
+    fprintf(out, "  %-10s %9s %9s %9s %9s\n", "ms", "mean", "p50", "p95",
+            "p99");
+    auto row = [&](const char* name, const std::vector<double>& samples) {
+        fprintf(out, "  %-10s %9.3f %9.3f %9.3f %9.3f\n", name, mean(samples),
+                percentile(samples, .5), percentile(samples, .95),
+                percentile(samples, .99));
+    };
+    row("frame", run.frame_ms);
+    row("cpu submit", run.submit_ms);
+    row("gpu", run.gpu_ms);
+}
+
+static std::string json_string(const std::string& value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            escaped += std::format("\\u{:04x}", int(c));
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+static std::string stats_json(const std::vector<double>& samples) {
+    double max = samples.empty()
+                     ? 0
+                     : *std::max_element(samples.begin(), samples.end());
+    return std::format(
+        "{{\"mean\": {:.4f}, \"p50\": {:.4f}, \"p95\": {:.4f}, \"p99\": "
+        "{:.4f}, \"max\": {:.4f}}}",
+        mean(samples), percentile(samples, .5), percentile(samples, .95),
+        percentile(samples, .99), max);
+}
+
+std::string bench_results_json(const BenchInfo& info,
+                               const std::vector<BenchRun>& runs) {
+    std::string json = std::format(
+        "{{\n  \"renderer\": {},\n  \"gl_version\": {},\n  \"camera_path\": "
+        "{},\n  \"width\": {},\n  \"height\": {},\n  \"warmup_frames\": {},\n"
+        "  \"frames\": {},\n  \"runs\": [",
+        json_string(info.renderer), json_string(info.version),
+        json_string(info.path.empty() ? "default" : info.path), info.width,
+        info.height, info.warmup_frames, info.frames);
+    for (size_t i = 0; i < runs.size(); i++) {
+        auto& run = runs[i];
+        json += std::format(
+            "{}\n    {{\"model\": {}, \"triangles\": {},\n     \"frame_ms\": "
+            "{},\n     \"cpu_submit_ms\": {},\n     \"gpu_ms\": {}}}",
+            i ? "," : "", json_string(run.model), run.triangles,
+            stats_json(run.frame_ms), stats_json(run.submit_ms),
+            stats_json(run.gpu_ms));
+    }
+    return json + "\n  ]\n}\n";
+}
+
+bool write_bench_results(const char* path, const BenchInfo& info,
+                         const std::vector<BenchRun>& runs) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "ERROR: could not write benchmark results %s\n", path);
+        return false;
+    }
+    file << bench_results_json(info, runs);
+    return bool(file);
+}
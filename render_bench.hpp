@@ -0,0 +1,94 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "offscreen_renderer.hpp"
+#include "orbit_camera.hpp"
+
+// One segment of a benchmark camera path. The motion is spread evenly over
+// its frames, in the same units as the viewer's mouse/keyboard input:
+// orbit is pitch/yaw degrees, pan and dolly as OrbitCamera::pan/dolly.
+struct CameraKeyframe {
+    enum Type { Orbit, Pan, Dolly };
+    Type type;
+    int frames;
+    float x;
+    float y = 0;  // unused by dolly
+};
+
+// Deterministic camera motion for benchmarks: the same path gives the same
+// camera on the same frame on every run and build.
+//
+// File format, one entry per line ('#' starts a comment):
+//   start pitch yaw radius [tx ty tz]
+//   orbit frames delta_pitch delta_yaw
+//   pan frames dx dy
+//   dolly frames amount
+struct CameraPath {
+    CameraPose start = {0, -90, 2};  // OrbitCamera's default
+    std::vector<CameraKeyframe> keyframes;
+
+    int frames() const;
+    void reset(OrbitCamera& camera) const;
+    // Applies frame `frame`'s motion; frames past the end loop the path
+    void step(int frame, OrbitCamera& camera) const;
+};
+
+// Throws on malformed input
+CameraPath load_camera_path(const char* filename);
+// Orbit, pan, dolly in and back out again: 360 frames
+CameraPath default_camera_path();
+
+// GL_TIME_ELAPSED per frame from a small ring of queries. Results are read
+// back a few frames later, so timing doesn't stall the pipeline.
+class GpuFrameTimer {
+   public:
+    GpuFrameTimer();
+    ~GpuFrameTimer();
+
+    void begin();
+    // Stores the frame's time in *out_ms once it's known
+    void end(double* out_ms);
+    // Waits for every outstanding query
+    void finish();
+
+   private:
+    static const int RING_SIZE = 4;
+    GLuint queries[RING_SIZE];
+    double* results[RING_SIZE] = {};  // null if the slot is free
+    int next = 0;
+
+    void collect(int slot);
+};
+
+// Per-frame times of one model's run, warm-up frames excluded
+struct BenchRun {
+    std::string model;
+    size_t triangles = 0;
+    std::vector<double> frame_ms;   // start of frame to after swap
+    std::vector<double> submit_ms;  // CPU: update and draw calls
+    std::vector<double> gpu_ms;
+};
+
+// Nearest rank, p in [0, 1]
+double percentile(std::vector<double> samples, double p);
+
+struct BenchInfo {
+    std::string renderer;  // GL_RENDERER
+    std::string version;   // GL_VERSION
+    std::string path;      // camera path file, empty = default
+    int width;
+    int height;
+    int warmup_frames;
+    int frames;
+};
+
+void print_bench_run(const BenchRun& run, FILE* out = stdout);
+std::string bench_results_json(const BenchInfo& info,
+                               const std::vector<BenchRun>& runs);
+// Returns false if the file can't be written
+bool write_bench_results(const char* path, const BenchInfo& info,
+                         const std::vector<BenchRun>& runs);
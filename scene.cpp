@@ -0,0 +1,178 @@
+#include "scene.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SCENE_SSE 1
+#endif
+
+// out = a * b, column major. Each output column is a weighted sum of a's
+// columns, which is 4 multiply-adds per column with SSE.
+static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#ifdef SCENE_SSE
+    const float* pa = &a[0][0];
+    const float* pb = &b[0][0];
+    float* po = &out[0][0];
+    __m128 a0 = _mm_loadu_ps(pa);
+    __m128 a1 = _mm_loadu_ps(pa + 4);
+    __m128 a2 = _mm_loadu_ps(pa + 8);
+    __m128 a3 = _mm_loadu_ps(pa + 12);
+    for (int c = 0; c < 4; c++) {
+        const float* col = pb + c * 4;
+        __m128 sum = _mm_mul_ps(a0, _mm_set1_ps(col[0]));
+        sum = _mm_add_ps(sum, _mm_mul_ps(a1, _mm_set1_ps(col[1])));
+        sum = _mm_add_ps(sum, _mm_mul_ps(a2, _mm_set1_ps(col[2])));
+        sum = _mm_add_ps(sum, _mm_mul_ps(a3, _mm_set1_ps(col[3])));
+        _mm_storeu_ps(po + c * 4, sum);
+    }
+#else
+    out = a * b;
+#endif
+}
+
+uint32_t Scene::add_node(uint32_t parent, const glm::mat4& local,
+                         int32_t mesh, int32_t material) {
+    uint32_t node = parents.size();
+    if (parent != NO_PARENT && parent >= node) {
+        throw std::runtime_error("Scene: parent must be added before child");
+    }
+    parents.push_back(parent);
+    mesh_ids.push_back(mesh);
+    material_ids.push_back(material);
+    locals.push_back(local);
+    worlds.push_back(local);
+    dirty.push_back(1);
+    depths.push_back(parent == NO_PARENT ? 0 : depths[parent] + 1);
+    dirty_count++;
+
+    // Appending keeps level order only if it extends the last level or
+    // starts the next one
+    if (!level_offsets.empty()) {
+        size_t last_level = level_offsets.size() - 2;
+        if (depths.back() == last_level) {
+            level_offsets.back() = size();
+        } else if (depths.back() == last_level + 1) {
+            level_offsets.push_back(size());
+        } else {
+            level_offsets.clear();
+        }
+    }
+    return node;
+}
+
+void Scene::set_local(uint32_t node, const glm::mat4& local) {
+    locals[node] = local;
+    dirty_count += !dirty[node];
+    dirty[node] = 1;
+}
+
+void Scene::mark_all_dirty() {
+    std::fill(dirty.begin(), dirty.end(), 1);
+    dirty_count = dirty.size();
+}
+
+// Dirty flags flow down as we go: a node is stale if it or its parent is,
+// and the parent was visited first
+size_t Scene::update_range(size_t begin, size_t end) {
+    size_t updated = 0;
+    for (size_t i = begin; i < end; i++) {
+        uint32_t parent = parents[i];
+        if (parent == NO_PARENT) {
+            if (dirty[i]) {
+                worlds[i] = locals[i];
+                updated++;
+            }
+            continue;
+        }
+        dirty[i] |= dirty[parent];
+        if (dirty[i]) {
+            multiply(worlds[parent], locals[i], worlds[i]);
+            updated++;
+        }
+    }
+    return updated;
+}
+
+size_t Scene::update_world(JobSystem* pool) {
+    if (!dirty_count) {
+        update_ms = 0;
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    size_t updated = 0;
+    if (!pool || level_offsets.empty()) {
+        updated = update_range(0, size());
+    } else {
+        for (size_t level = 0; level + 1 < level_offsets.size(); level++) {
+            size_t begin = level_offsets[level];
+            size_t end = level_offsets[level + 1];
+            if (end - begin < PARALLEL_MIN_NODES) {
+                updated += update_range(begin, end);
+                continue;
+            }
+            std::atomic<size_t> level_updated{0};
+            size_t chunks = (end - begin + CHUNK_NODES - 1) / CHUNK_NODES;
+            pool->parallel_for(chunks, [&](size_t chunk) {
+                size_t chunk_begin = begin + chunk * CHUNK_NODES;
+                size_t chunk_end = std::min(chunk_begin + CHUNK_NODES, end);
+                level_updated += update_range(chunk_begin, chunk_end);
+            });
+            updated += level_updated;
+        }
+    }
+
+    memset(dirty.data(), 0, dirty.size());
+    dirty_count = 0;
+    update_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    return updated;
+}
+
+std::vector<uint32_t> Scene::sort_by_level() {
+    uint32_t max_depth = 0;
+    for (uint32_t depth : depths) {
+        max_depth = std::max(max_depth, depth);
+    }
+
+    // Counting sort by depth, stable so siblings keep their order
+    level_offsets.assign(max_depth + 2, 0);
+    for (uint32_t depth : depths) {
+        level_offsets[depth + 1]++;
+    }
+    for (size_t level = 1; level < level_offsets.size(); level++) {
+        level_offsets[level] += level_offsets[level - 1];
+    }
+    std::vector<size_t> next(level_offsets.begin(), level_offsets.end() - 1);
+    std::vector<uint32_t> remap(size());
+    for (size_t i = 0; i < size(); i++) {
+        remap[i] = next[depths[i]]++;
+    }
+
+    auto permute = [&](auto& values) {
+        std::remove_reference_t<decltype(values)> sorted(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            sorted[remap[i]] = values[i];
+        }
+        values.swap(sorted);
+    };
+    for (auto& parent : parents) {
+        if (parent != NO_PARENT) {
+            parent = remap[parent];
+        }
+    }
+    permute(parents);
+    permute(mesh_ids);
+    permute(material_ids);
+    permute(locals);
+    permute(worlds);
+    permute(dirty);
+    permute(depths);
+    return remap;
+}
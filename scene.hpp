@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "job_system.hpp"
+
+// Flat transform hierarchy. Nodes are plain indices into parallel arrays
+// (structure of arrays), and a parent always comes before its children, so
+// one forward pass over the arrays updates every world matrix.
+//
+// sort_by_level() additionally groups nodes by depth. Nodes within a level
+// don't depend on each other, so each level can be split over the pool.
+//
+// Meshes and materials are referenced by index into whatever lists the
+// renderer keeps (-1 for none), so nodes stay plain data.
+class Scene {
+   public:
+    static const uint32_t NO_PARENT = UINT32_MAX;
+
+    // parent must already exist (or be NO_PARENT)
+    uint32_t add_node(uint32_t parent, const glm::mat4& local,
+                      int32_t mesh = -1, int32_t material = -1);
+
+    void set_local(uint32_t node, const glm::mat4& local);
+    const glm::mat4& local(uint32_t node) const { return locals[node]; }
+    const glm::mat4& world(uint32_t node) const { return worlds[node]; }
+    size_t size() const { return parents.size(); }
+
+    // Recomputes the world matrix of every node whose local matrix, or an
+    // ancestor's, changed since the last update. Returns how many changed.
+    size_t update_world(JobSystem* pool = nullptr);
+
+    // Marks every node dirty (e.g. to time a full update)
+    void mark_all_dirty();
+
+    // Reorders nodes breadth first, keeping parents before children.
+    // Returns old index -> new index.
+    std::vector<uint32_t> sort_by_level();
+
+    std::vector<uint32_t> parents;
+    std::vector<int32_t> mesh_ids;
+    std::vector<int32_t> material_ids;
+
+    // Last update
+    double update_ms = 0;
+
+   private:
+    // Levels smaller than this aren't worth waking the pool for
+    static const size_t PARALLEL_MIN_NODES = 4096;
+    static const size_t CHUNK_NODES = 1024;
+
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+    std::vector<uint8_t> dirty;
+    std::vector<uint32_t> depths;
+    size_t dirty_count = 0;
+
+    // Start of each level, plus the end; empty until sort_by_level()
+    std::vector<size_t> level_offsets;
+
+    size_t update_range(size_t begin, size_t end);
+};
@@ -0,0 +1,258 @@
+#include "shader_cache.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <sstream>
+
+#include "trace.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const uint32_t BINARY_MAGIC = 0x42505352;  // "RSPB"
+
+bool read_text_file(const char* filename, std::string& contents) {
+    std::ifstream file;
+    file.open(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::stringstream stream;
+    stream << file.rdbuf();
+    contents = stream.str();
+    return true;
+}
+
+std::string inject_defines(const std::string& source,
+                           const std::vector<std::string>& defines) {
+    if (defines.empty()) {
+        return source;
+    }
+    std::string define_block;
+    for (auto& define : defines) {
+        define_block += "#define " + define + "\n";
+    }
+
+    // #version must stay the first statement
+    size_t version = source.find("#version");
+    if (version == std::string::npos) {
+        return define_block + source;
+    }
+    size_t line_end = source.find('\n', version);
+    if (line_end == std::string::npos) {
+        return source + "\n" + define_block;
+    }
+    return source.substr(0, line_end + 1) + define_block +
+           source.substr(line_end + 1);
+}
+
+ProgramCache::ProgramCache(std::string cache_dir)
+    : cache_dir(std::move(cache_dir)) {
+    driver_id = std::string((const char*)glGetString(GL_VENDOR)) + "|" +
+                (const char*)glGetString(GL_RENDERER) + "|" +
+                (const char*)glGetString(GL_VERSION);
+
+    // Some drivers (and software GL) expose no binary formats at all
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    binaries_supported = num_formats > 0;
+    if (!binaries_supported) {
+        fprintf(stdout, "Program binaries not supported, caching disabled\n");
+    }
+}
+
+GLuint ProgramCache::load_program(const char* vert_path, const char* frag_path,
+                                  const std::vector<std::string>& defines,
+                                  const char* geom_path) {
+    TRACE_SCOPE("load_program");
+    std::string vert_source;
+    std::string frag_source;
+    std::string geom_source;
+    if (!read_text_file(vert_path, vert_source)) {
+        fprintf(stderr, "Failed to open shader file: %s\n", vert_path);
+        return 0;
+    }
+    if (!read_text_file(frag_path, frag_source)) {
+        fprintf(stderr, "Failed to open shader file: %s\n", frag_path);
+        return 0;
+    }
+    if (geom_path && !read_text_file(geom_path, geom_source)) {
+        fprintf(stderr, "Failed to open shader file: %s\n", geom_path);
+        return 0;
+    }
+    vert_source = inject_defines(vert_source, defines);
+    frag_source = inject_defines(frag_source, defines);
+    if (geom_path) {
+        geom_source = inject_defines(geom_source, defines);
+    }
+
+    bool use_cache = enabled && binaries_supported;
+    std::string binary_path;
+    if (use_cache) {
+        // Each field's length goes in before its bytes, so moving text
+        // from one stage to the next can't give the same key
+        uint64_t key = fnv1a(nullptr, 0);
+        for (const std::string* field :
+             {&vert_source, &frag_source, &geom_source, &driver_id}) {
+            uint64_t size = field->size();
+            key = fnv1a(&size, sizeof(size), key);
+            key = fnv1a(field->data(), field->size(), key);
+        }
+        binary_path = std::format("{}/{:016x}.bin", cache_dir, key);
+
+        auto start = Clock::now();
+        GLuint program = load_binary(binary_path);
+        if (program) {
+            hits++;
+            load_ms += std::chrono::duration<double, std::milli>(
+                           Clock::now() - start)
+                           .count();
+            return program;
+        }
+    }
+
+    auto start = Clock::now();
+    GLuint program = compile_and_link(vert_source, frag_source, geom_source);
+    compile_ms +=
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    misses++;
+
+    if (program && use_cache) {
+        save_binary(program, binary_path);
+    }
+    return program;
+}
+
+static GLuint compile_shader(GLenum type, const std::string& source) {
+    TRACE_SCOPE("compile_shader");
+    const GLchar* code = source.c_str();
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &code, nullptr);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char shaderLog[512];
+        glGetShaderInfoLog(shader, 512, nullptr, shaderLog);
+        fprintf(stderr, "Shader compilation error:\n%s\n", shaderLog);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+GLuint ProgramCache::compile_and_link(const std::string& vert_source,
+                                      const std::string& frag_source,
+                                      const std::string& geom_source) {
+    TRACE_SCOPE("compile_and_link");
+    GLuint vs = compile_shader(GL_VERTEX_SHADER, vert_source);
+    GLuint fs = compile_shader(GL_FRAGMENT_SHADER, frag_source);
+    GLuint gs = geom_source.empty()
+                    ? 0
+                    : compile_shader(GL_GEOMETRY_SHADER, geom_source);
+    if (!vs || !fs || (!geom_source.empty() && !gs)) {
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        glDeleteShader(gs);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (gs) {
+        glAttachShader(program, gs);
+    }
+    if (binaries_supported) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
+    glLinkProgram(program);
+
+    // Shaders are no longer needed once linked
+    glDetachShader(program, vs);
+    glDetachShader(program, fs);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    if (gs) {
+        glDetachShader(program, gs);
+        glDeleteShader(gs);
+    }
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char log[512];
+        glGetProgramInfoLog(program, 512, nullptr, log);
+        fprintf(stderr, "Program link error:\n%s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// File layout: magic, binary format, length, binary
+GLuint ProgramCache::load_binary(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return 0;
+    }
+    uint32_t magic = 0;
+    GLenum format = 0;
+    GLint length = 0;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&format, sizeof(format));
+    file.read((char*)&length, sizeof(length));
+    if (!file || magic != BINARY_MAGIC || length <= 0) {
+        return 0;
+    }
+    std::vector<char> binary(length);
+    file.read(binary.data(), length);
+    if (!file) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), length);
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        // Driver changed in a way the version string didn't capture
+        rejected++;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void ProgramCache::save_binary(GLuint program, const std::string& path) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+    std::error_code ec;
+    std::filesystem::create_directories(cache_dir, ec);
+    // Write then rename so a crash never leaves a truncated entry behind
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary);
+        if (!file.is_open()) {
+            fprintf(stderr, "ERROR: could not write shader cache %s\n",
+                    tmp_path.c_str());
+            return;
+        }
+        file.write((const char*)&BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        file.write((const char*)&format, sizeof(format));
+        file.write((const char*)&length, sizeof(length));
+        file.write(binary.data(), length);
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hash.hpp"
+
+// Reads a whole text file, returns false if it can't be opened
+bool read_text_file(const char* filename, std::string& contents);
+
+// Inserts "#define X" lines right after the #version directive
+std::string inject_defines(const std::string& source,
+                           const std::vector<std::string>& defines);
+
+// On-disk cache of linked program binaries (glGetProgramBinary).
+// Entries are keyed by a hash of the shader sources, the defines, and the
+// GL renderer/version strings, so a driver update invalidates them. If the
+// driver rejects a cached binary the program is compiled from source and
+// the entry rewritten.
+class ProgramCache {
+   public:
+    explicit ProgramCache(std::string cache_dir = "shader_cache");
+
+    // Returns 0 on failure (errors are printed). geom_path is optional.
+    GLuint load_program(const char* vert_path, const char* frag_path,
+                        const std::vector<std::string>& defines = {},
+                        const char* geom_path = nullptr);
+
+    bool enabled = true;
+
+    // Startup stats
+    int hits = 0;
+    int misses = 0;
+    int rejected = 0;  // binaries the driver refused
+    double load_ms = 0;     // time spent in hits
+    double compile_ms = 0;  // time spent compiling from source
+
+   private:
+    std::string cache_dir;
+    std::string driver_id;
+    bool binaries_supported = false;
+
+    // Empty geom_source = no geometry stage
+    GLuint compile_and_link(const std::string& vert_source,
+                            const std::string& frag_source,
+                            const std::string& geom_source);
+    GLuint load_binary(const std::string& path);
+    void save_binary(GLuint program, const std::string& path);
+};
@@ -0,0 +1,56 @@
+#include "shader_variants.hpp"
+
+#include <cstdio>
+
+uint32_t material_features(const Material* material) {
+    if (!material) {
+        return FEATURE_SPECULAR;  // default material is specular
+    }
+    uint32_t features = 0;
+    if (material->diffuse_map_filepath) features |= FEATURE_DIFFUSE_TEX;
+    if (material->ambient_map_filepath) features |= FEATURE_AMBIENT_TEX;
+    if (material->bump_map_filepath) features |= FEATURE_BUMP_TEX;
+    if (material->specular_map_filepath) {
+        features |= FEATURE_SPECULAR_TEX | FEATURE_SPECULAR;
+    } else if (material->K_s != glm::vec3(0)) {
+        features |= FEATURE_SPECULAR;
+    }
+    return features;
+}
+
+std::vector<std::string> feature_defines(uint32_t features) {
+    static const char* names[] = {"HAS_DIFFUSE_TEX", "HAS_AMBIENT_TEX",
+                                  "HAS_SPECULAR_TEX", "HAS_BUMP_TEX",
+                                  "HAS_SPECULAR", "CLUSTERED",
+                                  "MULTIVIEW", "VS_VIEWPORT_INDEX", "OIT"};
+    std::vector<std::string> defines;
+    for (size_t bit = 0; bit < std::size(names); bit++) {
+        if (features & (1u << bit)) {
+            defines.emplace_back(names[bit]);
+        }
+    }
+    return defines;
+}
+
+GLuint ShaderVariants::get(uint32_t features) {
+    auto existing = programs.find(features);
+    if (existing != programs.end()) {
+        return existing->second;
+    }
+
+    bool geometry_stage = (features & FEATURE_MULTIVIEW) &&
+                          !(features & FEATURE_VS_VIEWPORT_INDEX) &&
+                          !geom_path.empty();
+    GLuint program = cache.load_program(
+        vert_path.c_str(), frag_path.c_str(), feature_defines(features),
+        geometry_stage ? geom_path.c_str() : nullptr);
+    if (!program) {
+        fprintf(stderr, "ERROR: shader variant 0x%x failed to build\n",
+                features);
+    } else {
+        fprintf(stdout, "Built shader variant 0x%x\n", features);
+    }
+    // Failures are cached too, so a broken variant isn't retried every draw
+    programs.emplace(features, program);
+    return program;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "materials.hpp"
+#include "shader_cache.hpp"
+
+// Feature bits for shader permutations. Each bit becomes a #define, so a
+// material only pays for the texture fetches and lighting terms it uses.
+enum ShaderFeature : uint32_t {
+    FEATURE_DIFFUSE_TEX = 1 << 0,
+    FEATURE_AMBIENT_TEX = 1 << 1,
+    FEATURE_SPECULAR_TEX = 1 << 2,
+    FEATURE_BUMP_TEX = 1 << 3,
+    FEATURE_SPECULAR = 1 << 4,  // any specular term at all
+    FEATURE_CLUSTERED = 1 << 5,  // clustered point lights, not per material
+    // Instanced multiview draws (Rasterizer::drawMeshMultiview), routed to
+    // viewports by the geometry stage unless FEATURE_VS_VIEWPORT_INDEX
+    FEATURE_MULTIVIEW = 1 << 6,
+    FEATURE_VS_VIEWPORT_INDEX = 1 << 7,  // GL_ARB_shader_viewport_layer_array
+    // Writes weighted blended transparency targets instead of a color
+    FEATURE_OIT = 1 << 8,
+};
+
+// Features needed to draw this material (null = shader default material)
+uint32_t material_features(const Material* material);
+
+// "#define" names for a feature mask, in bit order
+std::vector<std::string> feature_defines(uint32_t features);
+
+// Lazily compiled program variants of one vertex/fragment shader pair,
+// keyed by feature mask. The geometry shader, if given, is only linked into
+// multiview variants that route views with it.
+class ShaderVariants {
+   public:
+    ShaderVariants(ProgramCache& cache, std::string vert_path,
+                   std::string frag_path, std::string geom_path = "")
+        : cache(cache),
+          vert_path(std::move(vert_path)),
+          frag_path(std::move(frag_path)),
+          geom_path(std::move(geom_path)) {}
+
+    // Returns 0 if the variant failed to compile (reported once)
+    GLuint get(uint32_t features);
+
+    size_t size() const { return programs.size(); }
+
+   private:
+    ProgramCache& cache;
+    std::string vert_path;
+    std::string frag_path;
+    std::string geom_path;
+    std::unordered_map<uint32_t, GLuint> programs;
+};
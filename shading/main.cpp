@@ -9,6 +9,7 @@
 #include "../obj_loader.hpp"
 #include "../orbit_camera.hpp"
 #include "../rasterizer.hpp"
+#include "../shader_cache.hpp"
 
 // NOTE: any struct containing glm types need to be manually aligned or
 // allocated as a unique ptr Using alignas should work with smaller types (vec3,
@@ -119,38 +120,6 @@ static void cursor_position_callback(GLFWwindow* window, double xpos,
     state->prev_y = ypos;
 }
 
-// Compiles shaders from source file, returns false on failure
-bool compileShader(GLuint& shader, GLuint program, GLenum shaderType,
-                   const char* source) {
-    std::ifstream shaderFile;
-    shaderFile.open(source);
-    if (!shaderFile.is_open()) {
-        fprintf(stderr, "Failed to open shader file: %s", source);
-        return false;
-    }
-    std::stringstream shaderStream;
-    shaderStream << shaderFile.rdbuf();
-    std::string shaderString = shaderStream.str();
-    const GLchar* shaderCode = shaderString.c_str();
-    shaderFile.close();
-
-    shader = glCreateShader(shaderType);
-    glShaderSource(shader, 1, &shaderCode, nullptr);
-    glCompileShader(shader);
-
-    GLint success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char shaderLog[512];
-        glGetShaderInfoLog(shader, 512, nullptr, shaderLog);
-        fprintf(stderr, "Shader compilation error:\n%s\n", shaderLog);
-        return false;
-    }
-
-    glAttachShader(program, shader);
-    return true;
-}
-
 bool setVertexShaderInput(Rasterizer& rasterizer) {
     GLuint pos = glGetAttribLocation(rasterizer.curr_state.boundProgram, "pos");
     if (pos == -1) {
@@ -167,6 +136,11 @@ int main(int argc, char** argv) {
 
     // Initialize
     if (!glfwInit()) return -1;
+    // Declared before anything that owns GL objects, so it terminates GLFW
+    // (and destroys the context) only after they've all been freed
+    struct GlfwSession {
+        ~GlfwSession() { glfwTerminate(); }
+    } glfw_session;
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
@@ -175,7 +149,6 @@ int main(int argc, char** argv) {
 
     window = glfwCreateWindow(640, 480, "Rasterizer", NULL, NULL);
     if (!window) {
-        glfwTerminate();
         fprintf(stderr, "GLFW context initialization failed\n");
         return -1;
     }
@@ -227,44 +200,27 @@ int main(int argc, char** argv) {
     // rasterizer.bindArrayBuffer(vbo);
     // glBufferData(GL_ARRAY_BUFFER);
 
-    GLuint program = glCreateProgram();
-
-    // Compile vertex shader
-    GLuint vs;
-    if (!compileShader(vs, program, GL_VERTEX_SHADER, "../shader.vert")) {
-        glfwTerminate();
-        return -1;
-    }
-
-    // Compile fragment shader
-    GLuint fs;
-    if (!compileShader(fs, program, GL_FRAGMENT_SHADER, "../shader.frag")) {
-        glfwTerminate();
-        return -1;
-    }
-
-    // TODO: maybe move into rasterizer?
-    glLinkProgram(program);
-    GLint success;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
-    if (!success) {
-        char log[512];
-        glGetProgramInfoLog(program, 512, nullptr, log);
-        fprintf(stderr, "Program link error:\n%s\n", log);
-        glfwTerminate();
+    // Linked programs are cached on disk, keyed by source + driver
+    ProgramCache program_cache;
+    GLuint program =
+        program_cache.load_program("../shader.vert", "../shader.frag");
+    if (!program) {
         return -1;
     }
+    fprintf(stdout,
+            "Shader programs: %d cached (%.2f ms), %d compiled (%.2f ms), "
+            "%d rejected\n",
+            program_cache.hits, program_cache.load_ms, program_cache.misses,
+            program_cache.compile_ms, program_cache.rejected);
 
     try {
         rasterizer.bindProgram(program);
     } catch (std::runtime_error e) {
         fprintf(stderr, "Program link error:\n%s\n", e.what());
-        glfwTerminate();
         return -1;
     }
 
-    rasterizer.uploadMesh(
-        mesh);  // Here because shaders need to be compiled first
+    GPUMesh gpu_mesh = rasterizer.uploadMesh(mesh);
 
     // auto transform = glm::scale(glm::mat4(1.0f), glm::vec3(.05,.05,.05));
 
@@ -321,8 +277,10 @@ int main(int argc, char** argv) {
 
     while (!glfwWindowShouldClose(window)) {
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glDrawElements(GL_TRIANGLES, mesh.triangles.size() * 3, GL_UNSIGNED_INT,
-                       0);
+        // Shading ignores materials, so one program draws every submesh
+        for (auto& submesh : gpu_mesh.submeshes) {
+            rasterizer.drawSubMesh(gpu_mesh, submesh);
+        }
         // glDrawArrays(GL_TRIANGLES, 0, mesh.triangles.size() * 3);
         // glm::vec3 rotationAxis(1, 0, 0);
         // appState.view_matrix = glm::rotate(appState.view_matrix,
@@ -334,6 +292,5 @@ int main(int argc, char** argv) {
         glfwPollEvents();
     }
 
-    glfwTerminate();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,598 @@
+#include "soft_rasterizer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SOFT_RASTER_SSE 1
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+static const size_t SETUP_CHUNK_TRIANGLES = 2048;
+static const float LIGHT_INTENSITY = .4f;  // I in shader.frag
+
+static double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+}
+
+// ---------------------------------------------------------------------------
+// Textures
+
+SoftTexture::SoftTexture(const TextureMap& map) {
+    Level base;
+    base.width = map.width;
+    base.height = map.height;
+    base.texels = map.pixels;
+    levels.push_back(std::move(base));
+
+    // 2x2 box filter down to 1x1, odd edges clamp
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Level& prev = levels.back();
+        Level next;
+        next.width = std::max(prev.width / 2, 1);
+        next.height = std::max(prev.height / 2, 1);
+        next.texels.resize(next.width * next.height * 4);
+        for (int y = 0; y < next.height; y++) {
+            for (int x = 0; x < next.width; x++) {
+                int x0 = std::min(x * 2, prev.width - 1);
+                int x1 = std::min(x * 2 + 1, prev.width - 1);
+                int y0 = std::min(y * 2, prev.height - 1);
+                int y1 = std::min(y * 2 + 1, prev.height - 1);
+                for (int c = 0; c < 4; c++) {
+                    int sum = prev.texels[(y0 * prev.width + x0) * 4 + c] +
+                              prev.texels[(y0 * prev.width + x1) * 4 + c] +
+                              prev.texels[(y1 * prev.width + x0) * 4 + c] +
+                              prev.texels[(y1 * prev.width + x1) * 4 + c];
+                    next.texels[(y * next.width + x) * 4 + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        levels.push_back(std::move(next));
+    }
+}
+
+static int wrap(int i, int size) {
+    i %= size;
+    return i < 0 ? i + size : i;
+}
+
+static glm::vec4 texel(const SoftTexture::Level& level, int x, int y) {
+    const uint8_t* p =
+        &level.texels[(wrap(y, level.height) * level.width +
+                       wrap(x, level.width)) * 4];
+    return glm::vec4(p[0], p[1], p[2], p[3]) * (1.0f / 255);
+}
+
+static glm::vec4 sample_nearest(const SoftTexture::Level& level, glm::vec2 uv) {
+    return texel(level, int(std::floor(uv.x * level.width)),
+                 int(std::floor(uv.y * level.height)));
+}
+
+static glm::vec4 sample_bilinear(const SoftTexture::Level& level,
+                                 glm::vec2 uv) {
+    float x = uv.x * level.width - .5f;
+    float y = uv.y * level.height - .5f;
+    int x0 = int(std::floor(x));
+    int y0 = int(std::floor(y));
+    float fx = x - x0;
+    float fy = y - y0;
+    glm::vec4 top = glm::mix(texel(level, x0, y0), texel(level, x0 + 1, y0), fx);
+    glm::vec4 bottom =
+        glm::mix(texel(level, x0, y0 + 1), texel(level, x0 + 1, y0 + 1), fx);
+    return glm::mix(top, bottom, fy);
+}
+
+glm::vec4 SoftTexture::sample(glm::vec2 uv, glm::vec2 duv_dx,
+                              glm::vec2 duv_dy) const {
+    glm::vec2 size(levels[0].width, levels[0].height);
+    float footprint = std::max(glm::length(duv_dx * size),
+                               glm::length(duv_dy * size));
+    float lod = footprint > 0 ? std::log2(footprint) : 0;
+    if (lod <= 0) {
+        return sample_bilinear(levels[0], uv);
+    }
+
+    int max_level = int(levels.size()) - 1;
+    int level = std::min(int(lod), max_level);
+    int next_level = std::min(level + 1, max_level);
+    return glm::mix(sample_nearest(levels[level], uv),
+                    sample_nearest(levels[next_level], uv), lod - int(lod));
+}
+
+// ---------------------------------------------------------------------------
+// Setup
+
+SoftRasterizer::SoftRasterizer(int width, int height, JobSystem* pool)
+    : pool(pool) {
+    resize(width, height);
+}
+
+void SoftRasterizer::resize(int width, int height) {
+    width_ = width;
+    height_ = height;
+    tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    color.assign(width * height * 4, 0);
+    depth.assign(width * height, 1.0f);
+    chunks.clear();
+}
+
+void SoftRasterizer::parallel_for(size_t count,
+                                  const std::function<void(size_t)>& fn,
+                                  size_t grain) {
+    if (pool) {
+        pool->parallel_for(count, fn, grain);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+    }
+}
+
+const SoftTexture* SoftRasterizer::texture(
+    const std::shared_ptr<TextureMap>& map) {
+    if (!map) {
+        return nullptr;
+    }
+    auto& texture = textures[map.get()];
+    if (!texture) {
+        texture = std::make_unique<SoftTexture>(*map);
+    }
+    return texture.get();
+}
+
+SoftMesh SoftRasterizer::upload_mesh(const Mesh& mesh) {
+    SoftMesh soft_mesh;
+    soft_mesh.vertex_count = mesh.positions.size();
+    size_t padded = (soft_mesh.vertex_count + 3) & ~size_t(3);
+    soft_mesh.positions_x.resize(padded);
+    soft_mesh.positions_y.resize(padded);
+    soft_mesh.positions_z.resize(padded);
+    for (size_t i = 0; i < soft_mesh.vertex_count; i++) {
+        soft_mesh.positions_x[i] = mesh.positions[i].x;
+        soft_mesh.positions_y[i] = mesh.positions[i].y;
+        soft_mesh.positions_z[i] = mesh.positions[i].z;
+    }
+    soft_mesh.normals = mesh.normals;
+    soft_mesh.texcoords = mesh.texcoords;
+
+    // Group by material, same as Rasterizer::uploadMesh
+    std::vector<size_t> order(mesh.triangles.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return mesh.triangles[a].material < mesh.triangles[b].material;
+    });
+
+    Material* current = nullptr;
+    for (size_t i : order) {
+        auto& triangle = mesh.triangles[i];
+        if (soft_mesh.submeshes.empty() || current != triangle.material) {
+            current = triangle.material;
+
+            // Mirrors the shader's default material and material_features()
+            SoftMaterial material;
+            if (current) {
+                material.ambient = current->K_a;
+                material.diffuse = current->K_d;
+                material.specular = current->K_s;
+                material.shininess = current->shininess;
+                material.has_specular = current->specular_map_filepath ||
+                                        current->K_s != glm::vec3(0);
+                material.diffuse_tex = texture(current->diffuse_map_filepath);
+                material.ambient_tex = texture(current->ambient_map_filepath);
+                material.specular_tex = texture(current->specular_map_filepath);
+            } else {
+                material.ambient = glm::vec3(.6, .6, .6);
+                material.diffuse = glm::vec3(.6, .6, .6);
+                material.specular = glm::vec3(.7, .7, .7);
+                material.shininess = 20;
+                material.has_specular = true;
+            }
+            soft_mesh.submeshes.push_back(
+                {material, soft_mesh.indices.size(), 0});
+        }
+        for (int v = 0; v < 3; v++) {
+            soft_mesh.indices.push_back(triangle.vertices[v]);
+        }
+        soft_mesh.submeshes.back().index_count += 3;
+    }
+    return soft_mesh;
+}
+
+void SoftRasterizer::clear(glm::vec4 clear_color) {
+    uint8_t rgba[4];
+    for (int c = 0; c < 4; c++) {
+        rgba[c] = uint8_t(std::clamp(clear_color[c], 0.0f, 1.0f) * 255 + .5f);
+    }
+    for (size_t i = 0; i < color.size(); i += 4) {
+        std::copy(rgba, rgba + 4, &color[i]);
+    }
+    std::fill(depth.begin(), depth.end(), 1.0f);
+}
+
+// ---------------------------------------------------------------------------
+// Stage 1: vertex transform
+
+void SoftRasterizer::transform_vertices(const SoftMesh& mesh) {
+    size_t padded = mesh.positions_x.size();
+    for (auto* v : {&clip_x, &clip_y, &clip_z, &clip_w, &view_x, &view_y,
+                    &view_z}) {
+        v->resize(padded);
+    }
+    view_normals.resize(mesh.vertex_count);
+
+    const glm::mat4& mvp = frame_uniforms.mvp;
+    const glm::mat4& mv = frame_uniforms.mv;
+    glm::mat3 normal_matrix(frame_uniforms.normal_matrix);
+
+    // Blocks of 4 vertices
+    parallel_for(
+        padded / 4,
+        [&](size_t block) {
+            size_t i = block * 4;
+#ifdef SOFT_RASTER_SSE
+            __m128 x = _mm_loadu_ps(&mesh.positions_x[i]);
+            __m128 y = _mm_loadu_ps(&mesh.positions_y[i]);
+            __m128 z = _mm_loadu_ps(&mesh.positions_z[i]);
+            auto row = [&](const glm::mat4& m, int r, float* out) {
+                __m128 result = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][r]), x),
+                               _mm_mul_ps(_mm_set1_ps(m[1][r]), y)),
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2][r]), z),
+                               _mm_set1_ps(m[3][r])));
+                _mm_storeu_ps(out + i, result);
+            };
+#else
+            auto row = [&](const glm::mat4& m, int r, float* out) {
+                for (size_t j = i; j < i + 4; j++) {
+                    out[j] = m[0][r] * mesh.positions_x[j] +
+                             m[1][r] * mesh.positions_y[j] +
+                             m[2][r] * mesh.positions_z[j] + m[3][r];
+                }
+            };
+#endif
+            row(mvp, 0, clip_x.data());
+            row(mvp, 1, clip_y.data());
+            row(mvp, 2, clip_z.data());
+            row(mvp, 3, clip_w.data());
+            row(mv, 0, view_x.data());
+            row(mv, 1, view_y.data());
+            row(mv, 2, view_z.data());
+
+            for (size_t j = i; j < std::min(i + 4, mesh.vertex_count); j++) {
+                view_normals[j] = glm::normalize(normal_matrix * mesh.normals[j]);
+            }
+        },
+        256);
+}
+
+// ---------------------------------------------------------------------------
+// Stage 2: clipping, setup and binning
+
+void SoftRasterizer::setup_chunk(const SoftMesh& mesh, size_t chunk_index,
+                                 size_t first_triangle,
+                                 size_t triangle_count) {
+    SetupChunk& chunk = chunks[chunk_index];
+    chunk.triangles.clear();
+    chunk.bins.resize(tiles_x * tiles_y);
+    for (auto& bin : chunk.bins) {
+        bin.clear();
+    }
+
+    // Submeshes are few, find the first one containing this chunk
+    size_t submesh = 0;
+    while (mesh.submeshes[submesh].first_index +
+               mesh.submeshes[submesh].index_count <=
+           first_triangle * 3) {
+        submesh++;
+    }
+
+    for (size_t t = first_triangle; t < first_triangle + triangle_count; t++) {
+        while (mesh.submeshes[submesh].first_index +
+                   mesh.submeshes[submesh].index_count <=
+               t * 3) {
+            submesh++;
+        }
+
+        ClipVertex vertices[3];
+        for (int v = 0; v < 3; v++) {
+            unsigned int i = mesh.indices[t * 3 + v];
+            ClipVertex& out = vertices[v];
+            out.clip = glm::vec4(clip_x[i], clip_y[i], clip_z[i], clip_w[i]);
+            out.attribs[0] = view_x[i];
+            out.attribs[1] = view_y[i];
+            out.attribs[2] = view_z[i];
+            out.attribs[3] = view_normals[i].x;
+            out.attribs[4] = view_normals[i].y;
+            out.attribs[5] = view_normals[i].z;
+            out.attribs[6] = mesh.texcoords[i].x;
+            out.attribs[7] = mesh.texcoords[i].y;
+        }
+
+        // Trivially outside one of the frustum planes
+        bool outside = false;
+        for (int axis = 0; axis < 3 && !outside; axis++) {
+            bool all_below = true;
+            bool all_above = true;
+            for (auto& v : vertices) {
+                all_below &= v.clip[axis] < -v.clip.w;
+                all_above &= v.clip[axis] > v.clip.w;
+            }
+            outside = all_below || all_above;
+        }
+        if (outside) {
+            continue;
+        }
+
+        // Clip against the near plane (z >= -w); the rest is handled by the
+        // screen bounds in setup
+        ClipVertex polygon[4];
+        int count = 0;
+        for (int v = 0; v < 3; v++) {
+            const ClipVertex& a = vertices[v];
+            const ClipVertex& b = vertices[(v + 1) % 3];
+            float da = a.clip.z + a.clip.w;
+            float db = b.clip.z + b.clip.w;
+            if (da >= 0) {
+                polygon[count++] = a;
+            }
+            if ((da >= 0) != (db >= 0)) {
+                float t = da / (da - db);
+                ClipVertex& out = polygon[count++];
+                out.clip = glm::mix(a.clip, b.clip, t);
+                for (int k = 0; k < ATTRIB_COUNT; k++) {
+                    out.attribs[k] = a.attribs[k] + (b.attribs[k] - a.attribs[k]) * t;
+                }
+            }
+        }
+
+        const SoftMaterial* material = &mesh.submeshes[submesh].material;
+        for (int v = 1; v + 1 < count; v++) {
+            ClipVertex fan[3] = {polygon[0], polygon[v], polygon[v + 1]};
+            setup_triangle(fan, material, chunk);
+        }
+    }
+}
+
+void SoftRasterizer::setup_triangle(const ClipVertex* vertices,
+                                    const SoftMaterial* material,
+                                    SetupChunk& chunk) {
+    // Screen space, y down (top row first), plus depth and 1/w
+    float x[3], y[3], z[3], inv_w[3];
+    for (int v = 0; v < 3; v++) {
+        const glm::vec4& clip = vertices[v].clip;
+        inv_w[v] = 1 / clip.w;
+        x[v] = (clip.x * inv_w[v] * .5f + .5f) * width_;
+        y[v] = (.5f - clip.y * inv_w[v] * .5f) * height_;
+        z[v] = clip.z * inv_w[v] * .5f + .5f;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0 || !std::isfinite(area)) {
+        return;
+    }
+    // No face culling in the GL path either; orient so inside is positive
+    int order[3] = {0, 1, 2};
+    if (area < 0) {
+        std::swap(order[1], order[2]);
+        area = -area;
+    }
+
+    SetupTriangle tri;
+    for (int e = 0; e < 3; e++) {
+        int v0 = order[e];
+        int v1 = order[(e + 1) % 3];
+        tri.a[e] = y[v0] - y[v1];
+        tri.b[e] = x[v1] - x[v0];
+        tri.c[e] = x[v0] * y[v1] - x[v1] * y[v0];
+    }
+
+    // Planes through the 3 vertices, in the original winding (the plane
+    // doesn't depend on it)
+    float signed_area =
+        (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    auto plane = [&](float v0, float v1, float v2) {
+        Plane p;
+        p.dx = ((v1 - v0) * (y[2] - y[0]) - (v2 - v0) * (y[1] - y[0])) /
+               signed_area;
+        p.dy = ((v2 - v0) * (x[1] - x[0]) - (v1 - v0) * (x[2] - x[0])) /
+               signed_area;
+        p.c = v0 - p.dx * x[0] - p.dy * y[0];
+        return p;
+    };
+    tri.depth = plane(z[0], z[1], z[2]);
+    tri.inv_w = plane(inv_w[0], inv_w[1], inv_w[2]);
+    for (int k = 0; k < ATTRIB_COUNT; k++) {
+        tri.attribs[k] = plane(vertices[0].attribs[k] * inv_w[0],
+                               vertices[1].attribs[k] * inv_w[1],
+                               vertices[2].attribs[k] * inv_w[2]);
+    }
+    tri.material = material;
+
+    tri.min_x = std::max(int(std::floor(std::min({x[0], x[1], x[2]}))), 0);
+    tri.max_x = std::min(int(std::ceil(std::max({x[0], x[1], x[2]}))), width_ - 1);
+    tri.min_y = std::max(int(std::floor(std::min({y[0], y[1], y[2]}))), 0);
+    tri.max_y = std::min(int(std::ceil(std::max({y[0], y[1], y[2]}))), height_ - 1);
+    if (tri.min_x > tri.max_x || tri.min_y > tri.max_y) {
+        return;
+    }
+
+    uint32_t index = chunk.triangles.size();
+    chunk.triangles.push_back(tri);
+    for (int ty = tri.min_y / TILE_SIZE; ty <= tri.max_y / TILE_SIZE; ty++) {
+        for (int tx = tri.min_x / TILE_SIZE; tx <= tri.max_x / TILE_SIZE; tx++) {
+            chunk.bins[ty * tiles_x + tx].push_back(index);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Stage 3: per tile rasterization and shading
+
+// Coverage of 8 pixels starting at x, one bit per pixel. Edges are
+// inclusive on both sides: there's no blending and the depth test is
+// strict, so pixels on a shared edge are simply drawn once.
+static int coverage8(const float* a, const float* b, const float* c, int x,
+                     int y) {
+    float py = y + .5f;
+#ifdef SOFT_RASTER_SSE
+    __m128 xs_lo = _mm_add_ps(_mm_set1_ps(float(x)),
+                              _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f));
+    __m128 xs_hi = _mm_add_ps(xs_lo, _mm_set1_ps(4));
+    __m128 zero = _mm_setzero_ps();
+    __m128 inside_lo = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 inside_hi = inside_lo;
+    for (int e = 0; e < 3; e++) {
+        __m128 ea = _mm_set1_ps(a[e]);
+        __m128 row = _mm_set1_ps(b[e] * py + c[e]);
+        inside_lo = _mm_and_ps(
+            inside_lo, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea, xs_lo), row), zero));
+        inside_hi = _mm_and_ps(
+            inside_hi, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea, xs_hi), row), zero));
+    }
+    return _mm_movemask_ps(inside_lo) | (_mm_movemask_ps(inside_hi) << 4);
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        float px = x + lane + .5f;
+        bool inside = true;
+        for (int e = 0; e < 3; e++) {
+            inside &= a[e] * px + b[e] * py + c[e] >= 0;
+        }
+        mask |= inside << lane;
+    }
+    return mask;
+#endif
+}
+
+void SoftRasterizer::raster_tile(size_t tile) {
+    int tile_x0 = (tile % tiles_x) * TILE_SIZE;
+    int tile_y0 = (tile / tiles_x) * TILE_SIZE;
+    int tile_x1 = std::min(tile_x0 + TILE_SIZE, width_) - 1;
+    int tile_y1 = std::min(tile_y0 + TILE_SIZE, height_) - 1;
+
+    for (auto& chunk : chunks) {
+        for (uint32_t index : chunk.bins[tile]) {
+            const SetupTriangle& tri = chunk.triangles[index];
+            // Spans of 8 aligned to the tile
+            int x0 = std::max(tri.min_x, tile_x0) & ~7;
+            int x1 = std::min(tri.max_x, tile_x1);
+            int y0 = std::max(tri.min_y, tile_y0);
+            int y1 = std::min(tri.max_y, tile_y1);
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x += 8) {
+                    int mask = coverage8(tri.a, tri.b, tri.c, x, y);
+                    while (mask) {
+                        int lane = std::countr_zero(unsigned(mask));
+                        mask &= mask - 1;
+                        if (x + lane > x1) {
+                            break;
+                        }
+                        shade_pixel(tri, x + lane, y);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SoftRasterizer::shade_pixel(const SetupTriangle& tri, int x, int y) {
+    float px = x + .5f;
+    float py = y + .5f;
+    float z = tri.depth.at(px, py);
+    float& stored = depth[y * width_ + x];
+    if (!(z < stored) || z < 0) {
+        return;  // GL_LESS
+    }
+    stored = z;
+
+    // Perspective correct attributes
+    float w = 1 / tri.inv_w.at(px, py);
+    float attribs[ATTRIB_COUNT];
+    for (int k = 0; k < ATTRIB_COUNT; k++) {
+        attribs[k] = tri.attribs[k].at(px, py) * w;
+    }
+    glm::vec4 view_pos(attribs[0], attribs[1], attribs[2], 1);
+    glm::vec3 N = glm::normalize(glm::vec3(attribs[3], attribs[4], attribs[5]));
+    glm::vec2 uv(attribs[6], attribs[7]);
+
+    // d(uv)/dx = (d(uv/w)/dx - uv * d(1/w)/dx) * w
+    glm::vec2 duv_dx((tri.attribs[6].dx - uv.x * tri.inv_w.dx) * w,
+                     (tri.attribs[7].dx - uv.y * tri.inv_w.dx) * w);
+    glm::vec2 duv_dy((tri.attribs[6].dy - uv.x * tri.inv_w.dy) * w,
+                     (tri.attribs[7].dy - uv.y * tri.inv_w.dy) * w);
+
+    // Blinn-Phong, as in textures/shader.frag
+    const SoftMaterial& material = *tri.material;
+    glm::vec3 dir_to_light = glm::normalize(
+        glm::vec3(frame_uniforms.view_light_pos - view_pos));
+
+    glm::vec3 ambient_color =
+        material.ambient_tex
+            ? glm::vec3(material.ambient_tex->sample(uv, duv_dx, duv_dy))
+            : material.ambient;
+    glm::vec3 diffuse_color =
+        material.diffuse_tex
+            ? glm::vec3(material.diffuse_tex->sample(uv, duv_dx, duv_dy))
+            : material.diffuse;
+    glm::vec3 result = ambient_color * LIGHT_INTENSITY +
+                       diffuse_color * LIGHT_INTENSITY *
+                           glm::dot(N, dir_to_light);
+
+    if (material.has_specular) {
+        glm::vec3 dir_to_camera = glm::normalize(
+            glm::vec3(frame_uniforms.view_camera_pos - view_pos));
+        glm::vec3 H = glm::normalize(dir_to_camera + dir_to_light);
+        float cos_phi = std::max(glm::dot(N, H), 0.0f);
+        glm::vec3 specular_color =
+            material.specular_tex
+                ? glm::vec3(material.specular_tex->sample(uv, duv_dx, duv_dy))
+                : material.specular;
+        result += specular_color * std::pow(cos_phi, material.shininess);
+    }
+
+    uint8_t* out = &color[(y * width_ + x) * 4];
+    for (int c = 0; c < 3; c++) {
+        out[c] = uint8_t(std::clamp(result[c], 0.0f, 1.0f) * 255 + .5f);
+    }
+    out[3] = 255;
+}
+
+// ---------------------------------------------------------------------------
+
+void SoftRasterizer::draw_mesh(const SoftMesh& mesh) {
+    size_t triangle_count = mesh.indices.size() / 3;
+    stats.triangles += triangle_count;
+
+    auto start = Clock::now();
+    transform_vertices(mesh);
+    stats.transform_ms += ms_since(start);
+
+    start = Clock::now();
+    size_t num_chunks =
+        (triangle_count + SETUP_CHUNK_TRIANGLES - 1) / SETUP_CHUNK_TRIANGLES;
+    chunks.resize(num_chunks);
+    parallel_for(num_chunks, [&](size_t chunk) {
+        size_t first = chunk * SETUP_CHUNK_TRIANGLES;
+        setup_chunk(mesh, chunk, first,
+                    std::min(SETUP_CHUNK_TRIANGLES, triangle_count - first));
+    });
+    for (auto& chunk : chunks) {
+        stats.triangles_drawn += chunk.triangles.size();
+        for (auto& bin : chunk.bins) {
+            stats.tile_bins += bin.size();
+        }
+    }
+    stats.setup_ms += ms_since(start);
+
+    start = Clock::now();
+    parallel_for(tiles_x * tiles_y, [&](size_t tile) { raster_tile(tile); });
+    stats.raster_ms += ms_since(start);
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <glm/glm.hpp>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "frame_uniforms.hpp"
+#include "job_system.hpp"
+#include "materials.hpp"
+#include "mesh.hpp"
+
+// RGBA8 texture with a box-filtered mip chain
+struct SoftTexture {
+    struct Level {
+        int width;
+        int height;
+        std::vector<uint8_t> texels;
+    };
+    std::vector<Level> levels;
+
+    explicit SoftTexture(const TextureMap& map);
+
+    // Matches the GL defaults the hardware path uses: GL_REPEAT,
+    // GL_LINEAR magnification, GL_NEAREST_MIPMAP_LINEAR minification.
+    // duv_dx/duv_dy are screen space derivatives, for the mip level.
+    glm::vec4 sample(glm::vec2 uv, glm::vec2 duv_dx, glm::vec2 duv_dy) const;
+};
+
+// Material constants and textures resolved for shading
+struct SoftMaterial {
+    glm::vec3 ambient;
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+    float shininess;
+    bool has_specular;
+    const SoftTexture* diffuse_tex = nullptr;
+    const SoftTexture* ambient_tex = nullptr;
+    const SoftTexture* specular_tex = nullptr;
+};
+
+struct SoftSubMesh {
+    SoftMaterial material;
+    size_t first_index;
+    size_t index_count;
+};
+
+// Mesh copied for the software rasterizer. Positions are SoA (padded to a
+// multiple of 4) for the SIMD transform.
+struct SoftMesh {
+    std::vector<float> positions_x;
+    std::vector<float> positions_y;
+    std::vector<float> positions_z;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> texcoords;
+    std::vector<unsigned int> indices;
+    std::vector<SoftSubMesh> submeshes;
+    size_t vertex_count = 0;
+};
+
+struct SoftRasterStats {
+    size_t triangles = 0;        // submitted
+    size_t triangles_drawn = 0;  // after culling and near clipping
+    size_t tile_bins = 0;        // triangle/tile pairs
+    double transform_ms = 0;
+    double setup_ms = 0;  // clipping, setup and binning
+    double raster_ms = 0;  // coverage, depth and shading
+};
+
+// CPU backend doing what Rasterizer + textures/shader.{vert,frag} do, for
+// machines without a GPU. Writes RGBA8, top row first.
+//
+// Stages, each spread over the job system:
+//  1. Vertex transform, 4 vertices at a time with SSE
+//  2. Near plane clipping, triangle setup and binning into screen tiles,
+//     in chunks of triangles that each keep their own bins
+//  3. Per tile rasterization: edge functions are evaluated 8 pixels at a
+//     time, then covered pixels are depth tested and shaded (Blinn-Phong,
+//     same as shader.frag)
+// Tiles are claimed dynamically, so busy tiles don't hold up idle threads.
+// Within a tile, triangles are drawn in submission order, so the output
+// doesn't depend on the thread count.
+class SoftRasterizer {
+   public:
+    static const int TILE_SIZE = 64;
+
+    SoftRasterizer(int width, int height, JobSystem* pool = nullptr);
+
+    void resize(int width, int height);
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Copies the mesh and converts its textures (once per TextureMap)
+    SoftMesh upload_mesh(const Mesh& mesh);
+
+    void set_frame_uniforms(const FrameUniforms& uniforms) {
+        frame_uniforms = uniforms;
+    }
+
+    void clear(glm::vec4 color = glm::vec4(0, 0, 0, 1));
+    void draw_mesh(const SoftMesh& mesh);
+
+    const std::vector<uint8_t>& color_buffer() const { return color; }
+    SoftRasterStats stats;
+
+   private:
+    struct Plane {
+        float dx, dy, c;
+        float at(float x, float y) const { return dx * x + dy * y + c; }
+    };
+
+    static const int ATTRIB_COUNT = 8;  // view pos, view normal, uv
+
+    struct SetupTriangle {
+        // Edge functions, inside is >= 0: e = a * x + b * y + c
+        float a[3], b[3], c[3];
+        Plane depth;     // window depth, linear in screen space
+        Plane inv_w;     // 1/w
+        Plane attribs[ATTRIB_COUNT];  // attribute/w
+        int min_x, max_x, min_y, max_y;
+        const SoftMaterial* material;
+    };
+
+    struct ClipVertex {
+        glm::vec4 clip;
+        float attribs[ATTRIB_COUNT];
+    };
+
+    // One chunk of submitted triangles and the tiles they touch
+    struct SetupChunk {
+        std::vector<SetupTriangle> triangles;
+        std::vector<std::vector<uint32_t>> bins;  // per tile
+    };
+
+    int width_;
+    int height_;
+    int tiles_x;
+    int tiles_y;
+    JobSystem* pool;
+    FrameUniforms frame_uniforms;
+
+    std::vector<uint8_t> color;
+    std::vector<float> depth;
+
+    // Transformed vertices, SoA
+    std::vector<float> clip_x, clip_y, clip_z, clip_w;
+    std::vector<float> view_x, view_y, view_z;
+    std::vector<glm::vec3> view_normals;
+
+    std::vector<SetupChunk> chunks;
+    std::unordered_map<const TextureMap*, std::unique_ptr<SoftTexture>>
+        textures;
+
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn,
+                      size_t grain = 1);
+
+    void transform_vertices(const SoftMesh& mesh);
+    void setup_chunk(const SoftMesh& mesh, size_t chunk, size_t first_triangle,
+                     size_t triangle_count);
+    void setup_triangle(const ClipVertex* vertices,
+                        const SoftMaterial* material, SetupChunk& chunk);
+    void raster_tile(size_t tile);
+    void shade_pixel(const SetupTriangle& tri, int x, int y);
+
+    const SoftTexture* texture(const std::shared_ptr<TextureMap>& map);
+};
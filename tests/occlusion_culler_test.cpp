@@ -0,0 +1,254 @@
+// Coverage, depth and false-cull cases for OcclusionCuller. Plain asserts
+// in a main, exits non-zero on the first failure.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "../job_system.hpp"
+#include "../occlusion_culler.hpp"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                  \
+    do {                                                                  \
+        if (!(condition)) {                                               \
+            fprintf(stderr, "FAILED %s:%d: %s\n", __FILE__, __LINE__,     \
+                    #condition);                                          \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+const int SIZE = 64;
+
+// Model space is pixels in x/y and window depth in z: clip x = x / 32 - 1,
+// clip z = 2 z - 1, w = 1
+glm::mat4 pixel_mvp() {
+    glm::mat4 m(1);
+    m[0][0] = 2.0f / SIZE;
+    m[1][1] = 2.0f / SIZE;
+    m[2][2] = 2;
+    m[3] = glm::vec4(-1, -1, -1, 1);
+    return m;
+}
+
+BoundingBox box(glm::vec3 min, glm::vec3 max) {
+    BoundingBox b;
+    b.add_point(min);
+    b.add_point(max);
+    return b;
+}
+
+void add_triangle(OcclusionCuller& culler, glm::vec2 a, glm::vec2 b,
+                  glm::vec2 c, float z, const glm::mat4& mvp) {
+    glm::vec3 positions[] = {{a.x, a.y, z}, {b.x, b.y, z}, {c.x, c.y, z}};
+    unsigned int indices[] = {0, 1, 2};
+    culler.add_occluder(positions, indices, 3, mvp);
+}
+
+// One triangle over the whole screen
+void add_screen(OcclusionCuller& culler, float z, const glm::mat4& mvp) {
+    add_triangle(culler, {-10, -10}, {3 * SIZE, -10}, {-10, 3 * SIZE}, z, mvp);
+}
+
+// Everything left of x = edge_x, with a vertical edge there
+void add_left_of(OcclusionCuller& culler, float edge_x, float z,
+                 const glm::mat4& mvp) {
+    add_triangle(culler, {edge_x, -4 * SIZE}, {edge_x, 4 * SIZE},
+                 {-8 * SIZE, SIZE / 2}, z, mvp);
+}
+
+void test_full_cover() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    add_screen(culler, 0.5f, mvp);
+    culler.rasterize();
+    CHECK(culler.depth_at(0, 0) == 0.5f);
+    CHECK(culler.depth_at(SIZE - 1, SIZE - 1) == 0.5f);
+    CHECK(!culler.is_visible(box({10, 10, 0.6f}, {20, 20, 0.7f}), mvp));
+    CHECK(culler.is_visible(box({10, 10, 0.3f}, {20, 20, 0.4f}), mvp));
+    // Straddles the occluder's depth
+    CHECK(culler.is_visible(box({10, 10, 0.4f}, {20, 20, 0.6f}), mvp));
+}
+
+// Only pixels the occluder covers entirely get its depth
+void test_partial_pixels() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    add_left_of(culler, 10.6f, 0.5f, mvp);
+    culler.rasterize();
+    CHECK(culler.depth_at(9, 5) == 0.5f);
+    CHECK(culler.depth_at(10, 5) == 1.0f);  // center covered, cell isn't
+    CHECK(culler.depth_at(11, 5) == 1.0f);
+}
+
+// A quad as two triangles: neither covers the pixels its shared diagonal
+// crosses, so those stay empty (conservative, at some cost in culling)
+void test_shared_edge() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    glm::vec3 positions[] = {{20.5f, 20.5f, 0.5f}, {40.5f, 20.5f, 0.5f},
+                             {40.5f, 40.5f, 0.5f}, {20.5f, 40.5f, 0.5f}};
+    unsigned int indices[] = {0, 1, 2, 0, 2, 3};
+    culler.add_occluder(positions, indices, 6, mvp);
+    culler.rasterize();
+    CHECK(culler.depth_at(20, 30) == 1.0f);
+    CHECK(culler.depth_at(40, 30) == 1.0f);
+    CHECK(culler.depth_at(22, 35) == 0.5f);
+    CHECK(culler.depth_at(35, 22) == 0.5f);
+    CHECK(culler.depth_at(30, 30) == 1.0f);  // on the diagonal
+}
+
+// Box behind the occluder's depth but just past its edge, inside a pixel
+// whose center the occluder covers
+void test_edge_false_cull() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    add_left_of(culler, 10.6f, 0.5f, mvp);
+    culler.rasterize();
+    CHECK(culler.is_visible(box({10.7f, 20, 0.8f}, {10.95f, 30, 0.9f}), mvp));
+    CHECK(!culler.is_visible(box({2, 20, 0.8f}, {8, 30, 0.9f}), mvp));
+}
+
+// Slanted edges: no box fully outside the triangle is ever culled
+void test_slanted_edges() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    glm::vec3 positions[] = {{3.3f, 2.7f, 0.2f}, {60.1f, 9.4f, 0.2f},
+                             {17.8f, 58.9f, 0.2f}};
+    unsigned int indices[] = {0, 1, 2};
+    culler.add_occluder(positions, indices, 3, mvp);
+    culler.rasterize();
+
+    auto edge = [&](int e, glm::vec2 p) {
+        glm::vec2 a(positions[e]), b(positions[(e + 1) % 3]);
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    };
+    // Every covered pixel lies entirely inside the (counter-clockwise)
+    // triangle
+    for (int y = 0; y < SIZE; y++) {
+        for (int x = 0; x < SIZE; x++) {
+            if (culler.depth_at(x, y) == 1.0f) continue;
+            for (int corner = 0; corner < 4; corner++) {
+                glm::vec2 p(x + (corner & 1), y + (corner >> 1));
+                for (int e = 0; e < 3; e++) {
+                    CHECK(edge(e, p) >= 0);
+                }
+            }
+        }
+    }
+    // Tiny boxes just outside each edge, behind the occluder
+    for (int e = 0; e < 3; e++) {
+        glm::vec2 a(positions[e]), b(positions[(e + 1) % 3]);
+        glm::vec2 outward = glm::normalize(glm::vec2(b.y - a.y, a.x - b.x));
+        for (float t = 0.1f; t < 0.9f; t += 0.1f) {
+            glm::vec2 p = a + (b - a) * t + outward * 0.05f;
+            CHECK(culler.is_visible(
+                box({p.x, p.y, 0.5f}, {p.x + 0.01f, p.y + 0.01f, 0.6f}), mvp));
+        }
+    }
+}
+
+void test_near_and_off_screen() {
+    OcclusionCuller culler(SIZE, SIZE);
+    glm::mat4 mvp = pixel_mvp();
+    add_screen(culler, 0.5f, mvp);
+    culler.rasterize();
+    CHECK(culler.is_visible(box({-20, -20, 0.8f}, {-10, -10, 0.9f}), mvp));
+    CHECK(culler.is_visible(box({SIZE + 5.0f, 10, 0.8f}, {SIZE + 9.0f, 20, 0.9f}),
+                            mvp));
+
+    // Perspective with w barely above the near threshold: coordinates far
+    // out of int range must neither crash nor cull. Depth is 0.05, in
+    // front of the occluder.
+    glm::mat4 perspective(1);
+    perspective[3][3] = 0;
+    perspective[2][3] = 1;  // w = z
+    perspective[2][2] = -0.9f;
+    CHECK(culler.is_visible(box({-1e30f, -1e30f, 2e-5f}, {1e30f, 1e30f, 3e-5f}),
+                            perspective));
+    CHECK(culler.is_visible(box({-1, -1, -1}, {1, 1, 1}), perspective));
+    glm::vec3 positions[] = {{1e20f, 0, 2e-5f}, {-1e20f, 1, 2e-5f},
+                             {0, 1e20f, 3e-5f}};
+    unsigned int indices[] = {0, 1, 2};
+    culler.add_occluder(positions, indices, 3, perspective);
+    culler.rasterize();
+}
+
+// An occluder between the eye and the near plane is clipped away by GL, so
+// it mustn't hide anything (the camera dollied into the mesh)
+void test_in_front_of_near_plane() {
+    // GL style perspective, 90 degree fov, near 0.1, far 100
+    float near = 0.1f, far = 100;
+    glm::mat4 perspective(0);
+    perspective[0][0] = 1;
+    perspective[1][1] = 1;
+    perspective[2][2] = (far + near) / (near - far);
+    perspective[2][3] = -1;
+    perspective[3][2] = 2 * far * near / (near - far);
+    BoundingBox visible = box({-0.5f, -0.5f, -5.5f}, {0.5f, 0.5f, -4.5f});
+
+    OcclusionCuller culler(SIZE, SIZE);
+    add_triangle(culler, {-0.2f, -0.2f}, {0.6f, -0.2f}, {-0.2f, 0.6f}, -0.05f,
+                 perspective);
+    culler.rasterize();
+    CHECK(culler.is_visible(visible, perspective));
+
+    // The same screen covering occluder past the near plane does hide it
+    culler.begin_frame();
+    add_triangle(culler, {-2, -2}, {6, -2}, {-2, 6}, -0.5f, perspective);
+    culler.rasterize();
+    CHECK(!culler.is_visible(visible, perspective));
+}
+
+// Bands on the job system give the same buffer as serially
+void test_parallel_matches() {
+    JobSystem jobs(3);
+    OcclusionCuller serial(256, 128), parallel(256, 128, &jobs);
+    glm::mat4 mvp(1);
+    std::vector<glm::vec3> positions;
+    std::vector<unsigned int> indices;
+    srand(7);
+    for (int i = 0; i < 300; i++) {
+        for (int v = 0; v < 3; v++) {
+            positions.push_back({rand() / float(RAND_MAX) * 2 - 1,
+                                 rand() / float(RAND_MAX) * 2 - 1,
+                                 rand() / float(RAND_MAX) * 1.8f - 0.9f});
+            indices.push_back(indices.size());
+        }
+    }
+    for (OcclusionCuller* culler : {&serial, &parallel}) {
+        culler->add_occluder(positions.data(), indices.data(), indices.size(),
+                             mvp);
+        culler->rasterize();
+    }
+    bool same = true;
+    for (int y = 0; y < serial.height(); y++) {
+        for (int x = 0; x < serial.width(); x++) {
+            same &= serial.depth_at(x, y) == parallel.depth_at(x, y);
+        }
+    }
+    CHECK(same);
+}
+
+}  // namespace
+
+int main() {
+    test_full_cover();
+    test_partial_pixels();
+    test_shared_edge();
+    test_edge_false_cull();
+    test_slanted_edges();
+    test_near_and_off_screen();
+    test_in_front_of_near_plane();
+    test_parallel_matches();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("occlusion_culler: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,671 @@
+#include "texture_compression.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COMPRESSION_SSE 1
+#endif
+
+const char* block_format_name(BlockFormat format) {
+    switch (format) {
+        case BlockFormat::BC1: return "BC1";
+        case BlockFormat::BC3: return "BC3";
+        case BlockFormat::BC4: return "BC4";
+        case BlockFormat::BC5: return "BC5";
+        case BlockFormat::BC7: return "BC7";
+    }
+    return "?";
+}
+
+size_t block_bytes(BlockFormat format) {
+    return format == BlockFormat::BC1 || format == BlockFormat::BC4 ? 8 : 16;
+}
+
+int block_format_channels(BlockFormat format) {
+    switch (format) {
+        case BlockFormat::BC1: return 3;
+        case BlockFormat::BC4: return 1;
+        case BlockFormat::BC5: return 2;
+        default: return 4;
+    }
+}
+
+BlockFormat choose_block_format(TextureUsage usage, bool has_alpha,
+                                bool bc7_supported) {
+    switch (usage) {
+        case TextureUsage::Color:
+            if (bc7_supported) return BlockFormat::BC7;
+            return has_alpha ? BlockFormat::BC3 : BlockFormat::BC1;
+        case TextureUsage::Mask:
+        case TextureUsage::Height:
+            return BlockFormat::BC4;
+        case TextureUsage::Normal:
+            return BlockFormat::BC5;
+    }
+    return BlockFormat::BC1;
+}
+
+namespace {
+
+// The 16 pixels of a block, one array per channel
+struct BlockPixels {
+    alignas(16) float c[4][16];
+};
+
+void split_channels(const uint8_t* pixels, BlockPixels& block) {
+    for (int i = 0; i < 16; i++) {
+        for (int ch = 0; ch < 4; ch++) {
+            block.c[ch][i] = pixels[i * 4 + ch];
+        }
+    }
+}
+
+// Mean and principal axis (power iteration on the covariance) of the first
+// `channels` channels. The axis is zero for a flat block.
+void principal_axis(const BlockPixels& block, int channels, float mean[4],
+                    float axis[4]) {
+    for (int ch = 0; ch < 4; ch++) {
+        float sum = 0;
+        for (int i = 0; i < 16; i++) sum += block.c[ch][i];
+        mean[ch] = ch < channels ? sum / 16 : 0;
+        axis[ch] = ch < channels ? 1.f : 0.f;
+    }
+
+    float cov[4][4] = {};
+    for (int i = 0; i < 16; i++) {
+        for (int a = 0; a < channels; a++) {
+            for (int b = a; b < channels; b++) {
+                cov[a][b] += (block.c[a][i] - mean[a]) * (block.c[b][i] - mean[b]);
+            }
+        }
+    }
+    for (int a = 0; a < channels; a++) {
+        for (int b = 0; b < a; b++) cov[a][b] = cov[b][a];
+    }
+
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[4] = {};
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) next[a] += cov[a][b] * axis[b];
+        }
+        float length = 0;
+        for (int a = 0; a < channels; a++) length += next[a] * next[a];
+        length = std::sqrt(length);
+        if (length < 1e-6f) {
+            std::fill(axis, axis + 4, 0.f);
+            return;
+        }
+        for (int a = 0; a < channels; a++) axis[a] = next[a] / length;
+    }
+}
+
+// Line through the block: the ends of its pixels' projections on the axis
+void fit_line(const BlockPixels& block, int channels, float end0[4],
+              float end1[4]) {
+    float mean[4], axis[4];
+    principal_axis(block, channels, mean, axis);
+    float t_min = 0, t_max = 0;
+    for (int i = 0; i < 16; i++) {
+        float t = 0;
+        for (int ch = 0; ch < channels; ch++) {
+            t += (block.c[ch][i] - mean[ch]) * axis[ch];
+        }
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+    for (int ch = 0; ch < 4; ch++) {
+        end0[ch] = std::clamp(mean[ch] + axis[ch] * t_min, 0.f, 255.f);
+        end1[ch] = std::clamp(mean[ch] + axis[ch] * t_max, 0.f, 255.f);
+    }
+}
+
+// Picks the closest palette entry for every pixel, returning the total
+// squared error. With SSE, 4 pixels are compared against an entry at once.
+float nearest_palette(const BlockPixels& block, int channels,
+                      const int (*palette)[4], int count, uint8_t* indices) {
+    float error = 0;
+#ifdef COMPRESSION_SSE
+    for (int i = 0; i < 16; i += 4) {
+        __m128 best = _mm_set1_ps(1e30f);
+        __m128 best_index = _mm_setzero_ps();
+        for (int k = 0; k < count; k++) {
+            __m128 distance = _mm_setzero_ps();
+            for (int ch = 0; ch < channels; ch++) {
+                __m128 diff = _mm_sub_ps(_mm_load_ps(block.c[ch] + i),
+                                         _mm_set1_ps(float(palette[k][ch])));
+                distance = _mm_add_ps(distance, _mm_mul_ps(diff, diff));
+            }
+            __m128 closer = _mm_cmplt_ps(distance, best);
+            best = _mm_min_ps(distance, best);
+            best_index = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(float(k))),
+                                   _mm_andnot_ps(closer, best_index));
+        }
+        alignas(16) float best_out[4], index_out[4];
+        _mm_store_ps(best_out, best);
+        _mm_store_ps(index_out, best_index);
+        for (int j = 0; j < 4; j++) {
+            indices[i + j] = uint8_t(index_out[j]);
+            error += best_out[j];
+        }
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        float best = 1e30f;
+        for (int k = 0; k < count; k++) {
+            float distance = 0;
+            for (int ch = 0; ch < channels; ch++) {
+                float diff = block.c[ch][i] - palette[k][ch];
+                distance += diff * diff;
+            }
+            if (distance < best) {
+                best = distance;
+                indices[i] = k;
+            }
+        }
+        error += best;
+    }
+#endif
+    return error;
+}
+
+// Little-endian bit packing, as the BC7 spec lays blocks out
+struct BitWriter {
+    uint8_t* out;
+    int position = 0;
+    void write(uint32_t value, int bits) {
+        for (int i = 0; i < bits; i++, position++) {
+            if (value >> i & 1) out[position / 8] |= 1 << (position % 8);
+        }
+    }
+};
+
+struct BitReader {
+    const uint8_t* in;
+    int position = 0;
+    uint32_t read(int bits) {
+        uint32_t value = 0;
+        for (int i = 0; i < bits; i++, position++) {
+            value |= uint32_t(in[position / 8] >> (position % 8) & 1) << i;
+        }
+        return value;
+    }
+};
+
+// BC1 -----------------------------------------------------------------------
+
+uint16_t pack_565(const float* rgb) {
+    int r = std::clamp(int(std::lround(rgb[0] * 31 / 255)), 0, 31);
+    int g = std::clamp(int(std::lround(rgb[1] * 63 / 255)), 0, 63);
+    int b = std::clamp(int(std::lround(rgb[2] * 31 / 255)), 0, 31);
+    return uint16_t(r << 11 | g << 5 | b);
+}
+
+void unpack_565(uint16_t color, int* rgb) {
+    int r = color >> 11 & 31, g = color >> 5 & 63, b = color & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+}
+
+void bc1_palette(uint16_t c0, uint16_t c1, bool four_color, int palette[4][4]) {
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int ch = 0; ch < 3; ch++) {
+        if (four_color) {
+            palette[2][ch] = (2 * palette[0][ch] + palette[1][ch]) / 3;
+            palette[3][ch] = (palette[0][ch] + 2 * palette[1][ch]) / 3;
+        } else {
+            palette[2][ch] = (palette[0][ch] + palette[1][ch]) / 2;
+            palette[3][ch] = 0;
+        }
+    }
+    for (int k = 0; k < 4; k++) palette[k][3] = 255;
+}
+
+float bc1_fit(const BlockPixels& block, uint16_t c0, uint16_t c1,
+              uint8_t* indices) {
+    int palette[4][4];
+    bc1_palette(c0, c1, true, palette);
+    return nearest_palette(block, 3, palette, c0 == c1 ? 1 : 4, indices);
+}
+
+// Always 4-color mode (c0 > c1), as BC3's color block requires
+void encode_bc1(const BlockPixels& block, uint8_t* out) {
+    float end0[4], end1[4];
+    fit_line(block, 3, end0, end1);
+    uint16_t c0 = pack_565(end1);
+    uint16_t c1 = pack_565(end0);
+    uint8_t indices[16];
+    float error = bc1_fit(block, c0, c1, indices);
+
+    // One least squares pass: the endpoints that best fit these indices
+    static const float weight0[4] = {1, 0, 2.f / 3, 1.f / 3};
+    float aa = 0, ab = 0, bb = 0, ax[3] = {}, bx[3] = {};
+    for (int i = 0; i < 16; i++) {
+        float a = weight0[indices[i]], b = 1 - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int ch = 0; ch < 3; ch++) {
+            ax[ch] += a * block.c[ch][i];
+            bx[ch] += b * block.c[ch][i];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (std::fabs(det) > 1e-4f) {
+        float refined0[3], refined1[3];
+        for (int ch = 0; ch < 3; ch++) {
+            refined0[ch] = (bb * ax[ch] - ab * bx[ch]) / det;
+            refined1[ch] = (aa * bx[ch] - ab * ax[ch]) / det;
+        }
+        uint16_t r0 = pack_565(refined0), r1 = pack_565(refined1);
+        uint8_t refined_indices[16];
+        float refined_error = bc1_fit(block, r0, r1, refined_indices);
+        if (refined_error < error) {
+            c0 = r0;
+            c1 = r1;
+            memcpy(indices, refined_indices, 16);
+        }
+    }
+
+    // Swapping the endpoints swaps palette entries 0/1 and 2/3
+    if (c0 < c1) {
+        std::swap(c0, c1);
+        for (auto& index : indices) index ^= 1;
+    }
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; i++) {
+        bits |= uint32_t(c0 == c1 ? 0 : indices[i]) << (2 * i);
+    }
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    memcpy(out + 4, &bits, 4);
+}
+
+void decode_bc1(const uint8_t* in, bool force_four_color, uint8_t* pixels) {
+    uint16_t c0 = in[0] | in[1] << 8;
+    uint16_t c1 = in[2] | in[3] << 8;
+    int palette[4][4];
+    bc1_palette(c0, c1, force_four_color || c0 > c1, palette);
+    uint32_t bits;
+    memcpy(&bits, in + 4, 4);
+    for (int i = 0; i < 16; i++) {
+        int index = bits >> (2 * i) & 3;
+        for (int ch = 0; ch < 3; ch++) pixels[i * 4 + ch] = palette[index][ch];
+    }
+}
+
+// BC4 -----------------------------------------------------------------------
+
+// 8-value mode (r0 > r1): r0, r1, then 6 steps from r0 to r1
+void encode_bc4(const float* values, uint8_t* out) {
+    float lo = 255, hi = 0;
+    for (int i = 0; i < 16; i++) {
+        lo = std::min(lo, values[i]);
+        hi = std::max(hi, values[i]);
+    }
+    int r0 = int(std::lround(hi)), r1 = int(std::lround(lo));
+    out[0] = r0;
+    out[1] = r1;
+    uint64_t bits = 0;
+    if (r0 > r1) {
+        for (int i = 0; i < 16; i++) {
+            int step = int(std::lround((r0 - values[i]) * 7 / (r0 - r1)));
+            step = std::clamp(step, 0, 7);
+            int index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+            bits |= uint64_t(index) << (3 * i);
+        }
+    }
+    for (int byte = 0; byte < 6; byte++) out[2 + byte] = bits >> (8 * byte);
+}
+
+void decode_bc4(const uint8_t* in, uint8_t* pixels, int channel) {
+    int palette[8];
+    palette[0] = in[0];
+    palette[1] = in[1];
+    if (palette[0] > palette[1]) {
+        for (int k = 1; k <= 6; k++) {
+            palette[k + 1] = ((7 - k) * palette[0] + k * palette[1]) / 7;
+        }
+    } else {
+        for (int k = 1; k <= 4; k++) {
+            palette[k + 1] = ((5 - k) * palette[0] + k * palette[1]) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t bits = 0;
+    for (int byte = 0; byte < 6; byte++) bits |= uint64_t(in[2 + byte]) << (8 * byte);
+    for (int i = 0; i < 16; i++) {
+        pixels[i * 4 + channel] = palette[bits >> (3 * i) & 7];
+    }
+}
+
+// BC7 mode 6 ----------------------------------------------------------------
+
+const int BC7_WEIGHTS[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                             34, 38, 43, 47, 51, 55, 60, 64};
+
+int bc7_interpolate(int e0, int e1, int weight) {
+    return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+}
+
+// Endpoints are 7 bits per channel plus a p-bit shared by the endpoint's
+// channels; picks the p-bit that lands closer
+void bc7_quantize(const float* end, int* quantized, int& p_bit) {
+    float best = 1e30f;
+    for (int p = 0; p < 2; p++) {
+        int candidate[4];
+        float error = 0;
+        for (int ch = 0; ch < 4; ch++) {
+            candidate[ch] = std::clamp(int(std::lround((end[ch] - p) / 2)), 0, 127);
+            float diff = (candidate[ch] << 1 | p) - end[ch];
+            error += diff * diff;
+        }
+        if (error < best) {
+            best = error;
+            p_bit = p;
+            std::copy(candidate, candidate + 4, quantized);
+        }
+    }
+}
+
+void encode_bc7(const BlockPixels& block, uint8_t* out) {
+    float end0[4], end1[4];
+    fit_line(block, 4, end0, end1);
+    int q[2][4], p[2];
+    bc7_quantize(end0, q[0], p[0]);
+    bc7_quantize(end1, q[1], p[1]);
+
+    int palette[16][4];
+    for (int k = 0; k < 16; k++) {
+        for (int ch = 0; ch < 4; ch++) {
+            palette[k][ch] = bc7_interpolate(q[0][ch] << 1 | p[0],
+                                             q[1][ch] << 1 | p[1],
+                                             BC7_WEIGHTS[k]);
+        }
+    }
+    uint8_t indices[16];
+    nearest_palette(block, 4, palette, 16, indices);
+
+    // The first pixel's index has an implied 0 top bit
+    if (indices[0] & 8) {
+        std::swap(q[0], q[1]);
+        std::swap(p[0], p[1]);
+        for (auto& index : indices) index = 15 - index;
+    }
+
+    memset(out, 0, 16);
+    BitWriter writer{out};
+    writer.write(1 << 6, 7);  // mode 6
+    for (int ch = 0; ch < 4; ch++) {
+        writer.write(q[0][ch], 7);
+        writer.write(q[1][ch], 7);
+    }
+    writer.write(p[0], 1);
+    writer.write(p[1], 1);
+    for (int i = 0; i < 16; i++) {
+        writer.write(indices[i], i == 0 ? 3 : 4);
+    }
+}
+
+void decode_bc7(const uint8_t* in, uint8_t* pixels) {
+    BitReader reader{in};
+    if (reader.read(7) != 1 << 6) {
+        memset(pixels, 0, 64);  // not a mode we write
+        return;
+    }
+    int e[2][4];
+    for (int ch = 0; ch < 4; ch++) {
+        e[0][ch] = reader.read(7);
+        e[1][ch] = reader.read(7);
+    }
+    int p0 = reader.read(1), p1 = reader.read(1);
+    for (int ch = 0; ch < 4; ch++) {
+        e[0][ch] = e[0][ch] << 1 | p0;
+        e[1][ch] = e[1][ch] << 1 | p1;
+    }
+    for (int i = 0; i < 16; i++) {
+        int weight = BC7_WEIGHTS[reader.read(i == 0 ? 3 : 4)];
+        for (int ch = 0; ch < 4; ch++) {
+            pixels[i * 4 + ch] = bc7_interpolate(e[0][ch], e[1][ch], weight);
+        }
+    }
+}
+
+// Levels --------------------------------------------------------------------
+
+// 2x2 box filter, edge texels repeat for odd sizes
+std::vector<uint8_t> downsample(const uint8_t* pixels, int width, int height) {
+    int out_width = std::max(width / 2, 1);
+    int out_height = std::max(height / 2, 1);
+    std::vector<uint8_t> out(size_t(out_width) * out_height * 4);
+    for (int y = 0; y < out_height; y++) {
+        int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+        for (int x = 0; x < out_width; x++) {
+            int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            for (int ch = 0; ch < 4; ch++) {
+                int sum = pixels[(y0 * width + x0) * 4 + ch] +
+                          pixels[(y0 * width + x1) * 4 + ch] +
+                          pixels[(y1 * width + x0) * 4 + ch] +
+                          pixels[(y1 * width + x1) * 4 + ch];
+                out[(size_t(y) * out_width + x) * 4 + ch] = (sum + 2) / 4;
+            }
+        }
+    }
+    return out;
+}
+
+// Block (bx, by), edge pixels repeated past the texture
+void gather_block(const uint8_t* pixels, int width, int height, int bx, int by,
+                  uint8_t* block) {
+    for (int y = 0; y < 4; y++) {
+        int sy = std::min(by * 4 + y, height - 1);
+        for (int x = 0; x < 4; x++) {
+            int sx = std::min(bx * 4 + x, width - 1);
+            memcpy(block + (y * 4 + x) * 4,
+                   pixels + (size_t(sy) * width + sx) * 4, 4);
+        }
+    }
+}
+
+CompressedLevel encode_level(const uint8_t* pixels, int width, int height,
+                             BlockFormat format, JobSystem* pool) {
+    CompressedLevel level{width, height, {}};
+    int blocks_x = (width + 3) / 4;
+    int blocks_y = (height + 3) / 4;
+    size_t bytes = block_bytes(format);
+    level.data.resize(size_t(blocks_x) * blocks_y * bytes);
+
+    auto encode_row = [&](size_t by) {
+        uint8_t block[64];
+        for (int bx = 0; bx < blocks_x; bx++) {
+            gather_block(pixels, width, height, bx, int(by), block);
+            encode_block(format, block,
+                         &level.data[(by * blocks_x + bx) * bytes]);
+        }
+    };
+    if (pool && blocks_y >= 4) {
+        pool->parallel_for(blocks_y, encode_row);
+    } else {
+        for (int by = 0; by < blocks_y; by++) encode_row(by);
+    }
+    return level;
+}
+
+// The mip chain as jobs: each downsample waits for the one before, and
+// each level's encode for its downsample, so the big levels encode (rows
+// split further by encode_level) while the small ones are still filtered
+void encode_chain(const uint8_t* rgba, int width, int height,
+                  BlockFormat format, JobSystem& pool,
+                  CompressedTexture& texture) {
+    int num_levels = 1;
+    for (int w = width, h = height; w > 1 || h > 1; num_levels++) {
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+    texture.levels.resize(num_levels);
+    std::vector<std::vector<uint8_t>> mips(num_levels);
+    std::vector<JobCounter> ready(num_levels);  // level's pixels are in
+    JobCounter encoded;
+
+    auto level_pixels = [&](int level) {
+        return level > 0 ? mips[level].data() : rgba;
+    };
+    auto level_size = [&](int level) {
+        return std::make_pair(std::max(width >> level, 1),
+                              std::max(height >> level, 1));
+    };
+    for (int level = 0; level < num_levels; level++) {
+        if (level > 0) {
+            pool.run(
+                [&, level] {
+                    auto [w, h] = level_size(level - 1);
+                    mips[level] = downsample(level_pixels(level - 1), w, h);
+                },
+                &ready[level], &ready[level - 1]);
+        }
+        pool.run(
+            [&, level] {
+                auto [w, h] = level_size(level);
+                texture.levels[level] =
+                    encode_level(level_pixels(level), w, h, format, &pool);
+            },
+            &encoded, &ready[level]);
+    }
+    pool.wait(encoded);
+}
+
+void measure_level(const uint8_t* pixels, const CompressedLevel& level,
+                   BlockFormat format, CompressionStats& stats) {
+    int channels = block_format_channels(format);
+    int blocks_x = (level.width + 3) / 4;
+    int blocks_y = (level.height + 3) / 4;
+    size_t bytes = block_bytes(format);
+    double squared_error = 0;
+    size_t samples = 0;
+    for (int by = 0; by < blocks_y; by++) {
+        for (int bx = 0; bx < blocks_x; bx++) {
+            uint8_t decoded[64];
+            decode_block(format, &level.data[(by * blocks_x + bx) * bytes],
+                         decoded);
+            for (int y = 0; y < 4 && by * 4 + y < level.height; y++) {
+                for (int x = 0; x < 4 && bx * 4 + x < level.width; x++) {
+                    const uint8_t* source =
+                        pixels + (size_t(by * 4 + y) * level.width + bx * 4 + x) * 4;
+                    for (int ch = 0; ch < channels; ch++) {
+                        int diff = int(decoded[(y * 4 + x) * 4 + ch]) - source[ch];
+                        squared_error += diff * diff;
+                        stats.max_error = std::max(stats.max_error, std::abs(diff));
+                    }
+                    samples += channels;
+                }
+            }
+        }
+    }
+    double mse = samples ? squared_error / samples : 0;
+    stats.psnr = mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 99;
+}
+
+}  // namespace
+
+void encode_block(BlockFormat format, const uint8_t* pixels, uint8_t* block) {
+    BlockPixels channels;
+    split_channels(pixels, channels);
+    switch (format) {
+        case BlockFormat::BC1:
+            encode_bc1(channels, block);
+            break;
+        case BlockFormat::BC3:
+            encode_bc4(channels.c[3], block);
+            encode_bc1(channels, block + 8);
+            break;
+        case BlockFormat::BC4:
+            encode_bc4(channels.c[0], block);
+            break;
+        case BlockFormat::BC5:
+            encode_bc4(channels.c[0], block);
+            encode_bc4(channels.c[1], block + 8);
+            break;
+        case BlockFormat::BC7:
+            encode_bc7(channels, block);
+            break;
+    }
+}
+
+// Channels a format doesn't store come out as GL samples them (0, alpha 1)
+void decode_block(BlockFormat format, const uint8_t* block, uint8_t* pixels) {
+    for (int i = 0; i < 16; i++) {
+        pixels[i * 4] = pixels[i * 4 + 1] = pixels[i * 4 + 2] = 0;
+        pixels[i * 4 + 3] = 255;
+    }
+    switch (format) {
+        case BlockFormat::BC1:
+            decode_bc1(block, false, pixels);
+            break;
+        case BlockFormat::BC3:
+            decode_bc4(block, pixels, 3);
+            decode_bc1(block + 8, true, pixels);
+            break;
+        case BlockFormat::BC4:
+            decode_bc4(block, pixels, 0);
+            break;
+        case BlockFormat::BC5:
+            decode_bc4(block, pixels, 0);
+            decode_bc4(block + 8, pixels, 1);
+            break;
+        case BlockFormat::BC7:
+            decode_bc7(block, pixels);
+            break;
+    }
+}
+
+CompressedTexture compress_texture(const uint8_t* rgba, int width, int height,
+                                   BlockFormat format, JobSystem* pool,
+                                   bool measure_error) {
+    auto start = std::chrono::steady_clock::now();
+    CompressedTexture texture;
+    texture.format = format;
+
+    if (pool && pool->thread_count() > 1) {
+        encode_chain(rgba, width, height, format, *pool, texture);
+    } else {
+        std::vector<uint8_t> mip;
+        const uint8_t* pixels = rgba;
+        while (true) {
+            texture.levels.push_back(
+                encode_level(pixels, width, height, format, pool));
+            if (width == 1 && height == 1) {
+                break;
+            }
+            mip = downsample(pixels, width, height);
+            pixels = mip.data();
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+    }
+    for (auto& level : texture.levels) {
+        texture.stats.megapixels += double(level.width) * level.height / 1e6;
+        texture.stats.bytes += level.data.size();
+    }
+    texture.stats.encode_ms = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+
+    if (measure_error) {
+        measure_level(rgba, texture.levels[0], format, texture.stats);
+    }
+    return texture;
+}
+
+CompressedLevel compress_texture_level(const uint8_t* rgba, int width,
+                                       int height, BlockFormat format,
+                                       JobSystem* pool) {
+    return encode_level(rgba, width, height, format, pool);
+}
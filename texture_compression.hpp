@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "job_system.hpp"
+
+// What a texture map holds, which decides how it's compressed
+enum class TextureUsage {
+    Color,   // diffuse/ambient: BC1 (BC3 with alpha) or BC7
+    Mask,    // single channel like specular: BC4
+    Height,  // bump maps, uploaded as Normal maps (normal_map.hpp)
+    Normal,  // tangent space xy, z rebuilt in the shader: BC5
+};
+
+enum class BlockFormat { BC1, BC3, BC4, BC5, BC7 };
+
+const char* block_format_name(BlockFormat format);
+size_t block_bytes(BlockFormat format);  // per 4x4 block
+int block_format_channels(BlockFormat format);  // RGBA channels it keeps
+
+BlockFormat choose_block_format(TextureUsage usage, bool has_alpha,
+                                bool bc7_supported);
+
+struct CompressedLevel {
+    int width;
+    int height;
+    std::vector<uint8_t> data;
+};
+
+struct CompressionStats {
+    double encode_ms = 0;   // whole mip chain, including downsampling
+    double megapixels = 0;  // whole mip chain
+    double psnr = 0;        // level 0, over the channels the format keeps
+    int max_error = 0;      // level 0, largest channel difference
+    size_t bytes = 0;       // compressed, all levels
+
+    double mp_per_s() const { return encode_ms ? megapixels / encode_ms * 1000 : 0; }
+};
+
+struct CompressedTexture {
+    BlockFormat format;
+    std::vector<CompressedLevel> levels;  // full chain down to 1x1
+    CompressionStats stats;
+};
+
+// Builds a box-filtered mip chain from RGBA8 pixels and encodes every level.
+// Block rows are spread over the pool; the endpoint fit and index search
+// work on 4 pixels at a time with SSE where available.
+// measure_error decodes level 0 again for PSNR/max_error.
+CompressedTexture compress_texture(const uint8_t* rgba, int width, int height,
+                                   BlockFormat format,
+                                   JobSystem* pool = nullptr,
+                                   bool measure_error = true);
+
+// One level as is, for callers that build their own mip chain
+CompressedLevel compress_texture_level(const uint8_t* rgba, int width,
+                                       int height, BlockFormat format,
+                                       JobSystem* pool = nullptr);
+
+// Single blocks: 16 RGBA pixels in row order <-> block_bytes(format) bytes.
+// BC7 encoding uses mode 6 only (one subset, RGBA, 4-bit indices).
+void encode_block(BlockFormat format, const uint8_t* pixels, uint8_t* block);
+void decode_block(BlockFormat format, const uint8_t* block, uint8_t* pixels);
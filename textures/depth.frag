@@ -0,0 +1,4 @@
+#version 410 core
+
+// Depth only, color writes are masked off
+void main() {}
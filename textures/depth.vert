@@ -0,0 +1,21 @@
+#version 410 core
+
+// Depth pre-pass: position only, must match shader.vert's gl_Position
+// exactly so the shading pass can depth test with GL_EQUAL/GL_LEQUAL
+layout(location=0) in vec3 pos;
+
+// Rasterizer::setFrameUniforms, std140 layout of FrameUniforms
+layout(std140) uniform FrameBlock {
+    mat4 mvp;
+    mat4 mv;
+    mat4 normal_matrix;  // upper 3x3
+    vec4 view_light_pos;
+    vec4 view_camera_pos;
+};
+
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = mvp * vec4(pos,1);
+}
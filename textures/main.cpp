@@ -2,54 +2,167 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <cctype>
+#include <chrono>
+#include <random>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
+#include "../external/lodepng.h"
+#include "../fast_png.hpp"
+#include "../light_clusters.hpp"
+#include "../memory_tracker.hpp"
+#include "../mesh_streamer.hpp"
 #include "../obj_loader.hpp"
+#include "../occlusion_culler.hpp"
+#include "../offscreen_renderer.hpp"
 #include "../orbit_camera.hpp"
 #include "../rasterizer.hpp"
+#include "../render_bench.hpp"
+#include "../scene.hpp"
+#include "../shader_cache.hpp"
+#include "../shader_variants.hpp"
+#include "../soft_rasterizer.hpp"
+#include "../texture_compression.hpp"
+#include "../trace.hpp"
 
 // NOTE: any struct containing glm types need to be manually aligned or
 // allocated as a unique ptr Using alignas should work with smaller types (vec3,
 // etc) but not consistently with mat4 Seems to be complicated why this is an
 // issue as it is dependent on compiler (more issues with ARM64)
 struct AppState {
+    Rasterizer* rasterizer;
+    OcclusionCuller* occlusion_culler;
+    MeshStreamer* streamer = nullptr;  // --progressive, until done
     OrbitCamera camera;
     double prev_x;
     double prev_y;
 
+    // The model is node model_node; model_matrix is its world matrix
+    Scene scene;
+    uint32_t model_node = 0;
+
     glm::mat4 model_matrix;
     glm::mat4 view_matrix;
     glm::mat4 projection_matrix;
     glm::vec4 light_pos = glm::vec4(-.5, -1, 1, 1);
 
-    GLint mvp_location;
-    GLint mv_location;
-    GLint normal_mat_location;
-    GLint view_light_pos_location;
-    GLint view_camera_pos_location;
+    // What needs recomputing. Set view_dirty after moving the camera and
+    // model_dirty after changing the model or projection matrix.
+    bool view_dirty = true;
+    bool model_dirty = true;
+    bool lights_dirty = true;
+    bool redraw = true;  // anything else that changes the image (toggles)
 
-    void update_shader_inputs() {
-        // TODO: should this be moved out? not explicitly done by this function
-        view_matrix = camera.calcViewMatrix();
+    // Input since the last frame, applied once per frame
+    glm::vec2 pending_orbit = glm::vec2(0);
+    glm::vec2 pending_pan = glm::vec2(0);
+    float pending_dolly = 0;
 
-        glm::mat4 mv = view_matrix * model_matrix;
-        glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(mv)));
-        glm::mat4 mvp = projection_matrix * mv;
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, &mvp[0][0]);
-        glUniformMatrix4fv(mv_location, 1, GL_FALSE, &mv[0][0]);
-        glUniformMatrix3fv(normal_mat_location, 1, GL_FALSE,
-                           &normal_matrix[0][0]);
+    FrameUniforms uniforms;
 
-        glm::vec4 view_light_pos = view_matrix * light_pos;
-        glUniform4fv(view_light_pos_location, 1, &view_light_pos[0]);
+    // Uniforms are uploaded lazily by the rasterizer to whichever shader
+    // variants draw this frame. Returns false if nothing changed.
+    bool update_shader_inputs() {
+        if (!view_dirty && !model_dirty) {
+            return false;
+        }
+        if (view_dirty) {
+            view_matrix = camera.calcViewMatrix();
+            uniforms.view_light_pos = view_matrix * light_pos;
+            uniforms.view_camera_pos = view_matrix * glm::vec4(camera.pos, 1);
+        }
+        uniforms.mv = view_matrix * model_matrix;
+        uniforms.normal_matrix = glm::mat4(
+            glm::transpose(glm::inverse(glm::mat3(uniforms.mv))));
+        uniforms.mvp = projection_matrix * uniforms.mv;
+        rasterizer->setFrameUniforms(uniforms);
+        view_dirty = false;
+        model_dirty = false;
+        return true;
+    }
 
-        glm::vec4 view_camera_pos = view_matrix * glm::vec4(camera.pos, 1);
-        glUniform4fv(view_camera_pos_location, 1, &view_camera_pos[0]);
+    bool needs_redraw() const {
+        return redraw || view_dirty || model_dirty ||
+               pending_orbit != glm::vec2(0) || pending_pan != glm::vec2(0) ||
+               pending_dolly != 0;
+    }
+
+    // Once per frame: applies the coalesced input, then refreshes whatever
+    // it invalidated
+    void update_frame() {
+        if (pending_orbit != glm::vec2(0)) {
+            camera.orbit(pending_orbit.x, pending_orbit.y);
+            view_dirty = true;
+        }
+        if (pending_pan != glm::vec2(0)) {
+            camera.pan(pending_pan.x, pending_pan.y);
+            view_dirty = true;
+        }
+        if (pending_dolly != 0) {
+            camera.dolly(pending_dolly);
+            view_dirty = true;
+        }
+        pending_orbit = glm::vec2(0);
+        pending_pan = glm::vec2(0);
+        pending_dolly = 0;
+
+        if (scene.update_world(jobs)) {
+            model_matrix = scene.world(model_node);
+            model_dirty = true;
+        }
+        lights_dirty |= view_dirty;
+        update_shader_inputs();
+        if (lights_dirty && rasterizer->clustered_lighting) {
+            update_lights();
+        }
+        redraw = false;
+    }
+
+    // Clustered lighting: world space point lights, re-clustered whenever
+    // the view changes
+    std::vector<PointLight> lights;
+    LightClusters* light_clusters;
+    JobSystem* jobs;
+    glm::ivec2 framebuffer_size;
+
+    void update_lights() {
+        std::vector<PointLight> view_lights(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) {
+            glm::vec4 position = view_matrix *
+                glm::vec4(glm::vec3(lights[i].position_radius), 1);
+            view_lights[i].position_radius =
+                glm::vec4(glm::vec3(position), lights[i].position_radius.w);
+            view_lights[i].color = lights[i].color;
+        }
+        light_clusters->build(view_lights, projection_matrix, jobs);
+        rasterizer->setLights(view_lights, *light_clusters, framebuffer_size);
+        lights_dirty = false;
     }
 };
 
+// Random point lights around the model (centered and scaled to ~[-1, 1])
+std::vector<PointLight> make_lights(int count) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(-1.2f, 1.2f);
+    std::uniform_real_distribution<float> radius(.3f, .7f);
+    std::uniform_real_distribution<float> channel(.2f, 1.f);
+
+    std::vector<PointLight> lights(count);
+    for (auto& light : lights) {
+        light.position_radius = glm::vec4(position(rng), position(rng),
+                                          position(rng), radius(rng));
+        // Same intensity as the single light
+        light.color = glm::vec4(channel(rng), channel(rng), channel(rng), 0) * .4f;
+    }
+    return lights;
+}
+
 void key_callback(GLFWwindow* window, int key, int scancode, int action,
                   int mods) {
     // action: press, repeat, release
@@ -62,28 +175,108 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action,
         glfwSetWindowShouldClose(window, GLFW_TRUE);
     }
 
+    auto* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+
+    // Profiling: P prints rolling stats, J dumps them as JSON
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        state->rasterizer->profiler.print_summary();
+    }
+    if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+        if (state->rasterizer->profiler.dump_json("frame_stats.json")) {
+            fprintf(stdout, "Wrote frame_stats.json\n");
+        }
+    }
+
+    // Buffer arena: M prints usage (and asset and tagged memory), N
+    // compacts it
+    if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+        state->rasterizer->printArenaStats();
+        // The streamer's loader may still be using the asset manager
+        if (state->rasterizer->assets &&
+            (!state->streamer || state->streamer->done())) {
+            state->rasterizer->assets->print_stats();
+        }
+        print_memory_report();
+    }
+    if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+        state->rasterizer->defragmentMeshArena();
+        state->redraw = true;
+        state->rasterizer->printArenaStats();
+    }
+
+    // Z toggles the depth pre-pass, printing fragments shaded before the
+    // switch (the query result lags a few frames)
+    if (key == GLFW_KEY_Z && action == GLFW_PRESS) {
+        Rasterizer* rasterizer = state->rasterizer;
+        fprintf(stdout, "Depth pre-pass %s: %llu fragments shaded\n",
+                rasterizer->depth_prepass ? "on" : "off",
+                (unsigned long long)rasterizer->shaded_fragments);
+        rasterizer->depth_prepass = !rasterizer->depth_prepass;
+        state->redraw = true;
+        fprintf(stdout, "Depth pre-pass now %s\n",
+                rasterizer->depth_prepass ? "on" : "off");
+    }
+
+    // O toggles CPU occlusion culling, printing the last frame's stats
+    if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+        Rasterizer* rasterizer = state->rasterizer;
+        if (rasterizer->occlusion_culler) {
+            rasterizer->occlusion_culler->print_stats();
+            rasterizer->occlusion_culler = nullptr;
+        } else {
+            rasterizer->occlusion_culler = state->occlusion_culler;
+        }
+        state->redraw = true;
+        fprintf(stdout, "Occlusion culling %s\n",
+                rasterizer->occlusion_culler ? "on" : "off");
+    }
+
+    // T toggles order-independent transparency (transparent materials are
+    // drawn opaque without it)
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        Rasterizer* rasterizer = state->rasterizer;
+        rasterizer->transparency = !rasterizer->transparency;
+        state->redraw = true;
+        fprintf(stdout, "Transparency %s\n",
+                rasterizer->transparency ? "on" : "off");
+    }
+
+    // L toggles clustered lighting (needs --lights n)
+    if (key == GLFW_KEY_L && action == GLFW_PRESS && !state->lights.empty()) {
+        Rasterizer* rasterizer = state->rasterizer;
+        rasterizer->clustered_lighting = !rasterizer->clustered_lighting;
+        state->redraw = true;
+        fprintf(stdout, "Clustered lighting %s (%zu lights)\n",
+                rasterizer->clustered_lighting ? "on" : "off",
+                state->lights.size());
+        if (rasterizer->clustered_lighting) {
+            state->update_lights();
+            LightClusters* clusters = state->light_clusters;
+            fprintf(stdout,
+                    "\t%zu / %zu clusters lit, max %u lights, assigned in "
+                    "%.3f ms\n",
+                    clusters->occupied_clusters, clusters->ranges.size(),
+                    clusters->max_cluster_lights, clusters->build_ms);
+        }
+    }
+
     // TOOD: these are dependent on world and not camera, so upon rotation,
     // changes direction of movement
 
-    auto* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
     if (key == GLFW_KEY_D && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        state->camera.pan(.1, 0);
-        state->update_shader_inputs();
+        state->pending_pan += glm::vec2(.1, 0);
     }
 
     if (key == GLFW_KEY_A && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        state->camera.pan(-.1, 0);
-        state->update_shader_inputs();
+        state->pending_pan += glm::vec2(-.1, 0);
     }
 
     if (key == GLFW_KEY_W && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        state->camera.pan(0, .1);
-        state->update_shader_inputs();
+        state->pending_pan += glm::vec2(0, .1);
     }
 
     if (key == GLFW_KEY_S && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        state->camera.pan(0, -.1);
-        state->update_shader_inputs();
+        state->pending_pan += glm::vec2(0, -.1);
     }
 }
 
@@ -100,10 +293,6 @@ static void cursor_position_callback(GLFWwindow* window, double xpos,
     double dy = xpos - state->prev_x;
     double dx = state->prev_y - ypos;
 
-    fprintf(stdout,
-            "dx: %f, curr_x: %f, prev_x: %f, dy: %f, curr_y %f, prev_y: %f\n",
-            dx, xpos, state->prev_x, dy, ypos, state->prev_y);
-
     // Rotating around world axes (z is up for some reason, prob
     // defined in obj file) not camera axes
     // state->view_matrix = glm::rotate(
@@ -111,44 +300,23 @@ static void cursor_position_callback(GLFWwindow* window, double xpos,
     // state->view_matrix = glm::rotate(
     //     state->view_matrix, glm::radians(float(dy*.5)), glm::vec3(0, 0, 1));
 
-    state->camera.orbit(dx * .5, dy * .5);
-    state->camera.updateBasis();
-    state->update_shader_inputs();
+    // Applied once per frame, however many events arrive in between
+    state->pending_orbit += glm::vec2(dx * .5, dy * .5);
 
     state->prev_x = xpos;
     state->prev_y = ypos;
 }
 
-// Compiles shaders from source file, returns false on failure
-bool compileShader(GLuint& shader, GLuint program, GLenum shaderType,
-                   const char* source) {
-    std::ifstream shaderFile;
-    shaderFile.open(source);
-    if (!shaderFile.is_open()) {
-        fprintf(stderr, "Failed to open shader file: %s", source);
-        return false;
-    }
-    std::stringstream shaderStream;
-    shaderStream << shaderFile.rdbuf();
-    std::string shaderString = shaderStream.str();
-    const GLchar* shaderCode = shaderString.c_str();
-    shaderFile.close();
-
-    shader = glCreateShader(shaderType);
-    glShaderSource(shader, 1, &shaderCode, nullptr);
-    glCompileShader(shader);
-
-    GLint success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char shaderLog[512];
-        glGetShaderInfoLog(shader, 512, nullptr, shaderLog);
-        fprintf(stderr, "Shader compilation error:\n%s\n", shaderLog);
-        return false;
-    }
+// Scrolling up moves toward the model
+static void scroll_callback(GLFWwindow* window, double /*xoffset*/,
+                            double yoffset) {
+    auto* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    state->pending_dolly += float(yoffset);
+}
 
-    glAttachShader(program, shader);
-    return true;
+static void window_refresh_callback(GLFWwindow* window) {
+    auto* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    state->redraw = true;
 }
 
 bool setVertexShaderInput(Rasterizer& rasterizer) {
@@ -162,20 +330,945 @@ bool setVertexShaderInput(Rasterizer& rasterizer) {
     return true;
 }
 
+struct Options {
+    const char* model_path = nullptr;  // yoda, or the teapot for benchmarks
+    // Every --model given; only the render benchmark uses more than the first
+    std::vector<const char*> models;
+    int width = 640;
+    int height = 480;
+
+    // Batch mode: render every pose in the file to <batch_output>/frame_N.png
+    const char* batch_poses = nullptr;
+    const char* batch_output = nullptr;
+    int num_encoders = std::max<int>(std::thread::hardware_concurrency() - 1, 1);
+
+    bool shader_cache = true;
+    // Per subsystem memory as JSON, written after loading and at exit
+    const char* memory_report = nullptr;
+    // Chrome trace JSON of the whole run, written at exit
+    const char* trace = nullptr;
+    AssetBudget asset_budget;
+    bool compress_textures = false;
+    bool bc7 = false;
+    NormalMapSettings normal_maps;  // bump maps are converted on upload
+
+    // Block compression benchmark on one png, no GL needed
+    const char* compress_bench = nullptr;
+    // PNG decode benchmark, lodepng against fast_png, no GL needed
+    bool png_bench = false;
+    bool depth_prepass = false;
+    bool occlusion_culling = false;
+    // Split meshes into 16-bit index chunks of <= 65535 vertices on upload
+    bool chunk_meshes = false;
+
+    // Software rasterizer benchmark, no window or GL context needed
+    bool soft_bench = false;
+    int soft_bench_frames = 60;
+
+    // Scene graph benchmark, no window or GL context needed
+    bool scene_bench = false;
+    // Loading and texture stages at 1..N threads, no GL needed
+    bool jobs_bench = false;
+
+    // Clustered point lights (0 = the single shader light)
+    int num_lights = 0;
+    bool light_bench = false;
+    // Multiview against one draw sequence per view, in views per second
+    bool multiview_bench = false;
+    // Per-draw uniforms: glUniform* calls against ring buffer blocks
+    bool uniform_bench = false;
+
+    // Redraw every frame instead of only when something changed
+    bool continuous = false;
+    // Show a coarse proxy while the model loads (interactive only)
+    bool progressive = false;
+
+    // Render benchmark: replays a camera path over each model in a hidden
+    // window (OSMesa without a display) and writes frame time percentiles
+    bool render_bench = false;
+    const char* bench_path = nullptr;  // default_camera_path() if null
+    int bench_frames = 0;              // 0 = one pass over the path
+    int bench_warmup = 30;
+    const char* bench_output = "bench_results.json";
+};
+
+bool parse_options(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--model") && i + 1 < argc) {
+            options.models.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 2 < argc) {
+            options.width = atoi(argv[++i]);
+            options.height = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--batch") && i + 2 < argc) {
+            options.batch_poses = argv[++i];
+            options.batch_output = argv[++i];
+        } else if (!strcmp(argv[i], "--encoders") && i + 1 < argc) {
+            options.num_encoders = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--memory-report") && i + 1 < argc) {
+            options.memory_report = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            options.trace = argv[++i];
+        } else if (!strcmp(argv[i], "--no-shader-cache")) {
+            options.shader_cache = false;
+        } else if (!strcmp(argv[i], "--ram-budget") && i + 1 < argc) {
+            options.asset_budget.ram_bytes = size_t(atoi(argv[++i])) << 20;
+        } else if (!strcmp(argv[i], "--vram-budget") && i + 1 < argc) {
+            options.asset_budget.vram_bytes = size_t(atoi(argv[++i])) << 20;
+        } else if (!strcmp(argv[i], "--release-cpu")) {
+            options.asset_budget.release_cpu_after_upload = true;
+        } else if (!strcmp(argv[i], "--compress-textures")) {
+            options.compress_textures = true;
+        } else if (!strcmp(argv[i], "--bc7")) {
+            options.compress_textures = true;
+            options.bc7 = true;
+        } else if (!strcmp(argv[i], "--bump-strength") && i + 1 < argc) {
+            options.normal_maps.strength = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--bump-central")) {
+            options.normal_maps.sobel = false;
+        } else if (!strcmp(argv[i], "--compress-bench")) {
+            options.compress_bench = "../yoda/yoda-body-bump.png";
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                options.compress_bench = argv[++i];
+            }
+        } else if (!strcmp(argv[i], "--png-bench")) {
+            options.png_bench = true;
+        } else if (!strcmp(argv[i], "--depth-prepass")) {
+            options.depth_prepass = true;
+        } else if (!strcmp(argv[i], "--occlusion")) {
+            options.occlusion_culling = true;
+        } else if (!strcmp(argv[i], "--chunk-meshes")) {
+            options.chunk_meshes = true;
+        } else if (!strcmp(argv[i], "--lights") && i + 1 < argc) {
+            options.num_lights = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--light-bench")) {
+            options.light_bench = true;
+        } else if (!strcmp(argv[i], "--multiview-bench")) {
+            options.multiview_bench = true;
+        } else if (!strcmp(argv[i], "--uniform-bench")) {
+            options.uniform_bench = true;
+        } else if (!strcmp(argv[i], "--scene-bench")) {
+            options.scene_bench = true;
+        } else if (!strcmp(argv[i], "--jobs-bench")) {
+            options.jobs_bench = true;
+        } else if (!strcmp(argv[i], "--continuous")) {
+            options.continuous = true;
+        } else if (!strcmp(argv[i], "--progressive")) {
+            options.progressive = true;
+        } else if (!strcmp(argv[i], "--bench")) {
+            options.render_bench = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                options.bench_path = argv[++i];
+            }
+        } else if (!strcmp(argv[i], "--bench-frames") && i + 1 < argc) {
+            options.bench_frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-warmup") && i + 1 < argc) {
+            options.bench_warmup = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-output") && i + 1 < argc) {
+            options.bench_output = argv[++i];
+        } else if (!strcmp(argv[i], "--soft-bench")) {
+            options.soft_bench = true;
+            if (i + 1 < argc && isdigit(argv[i + 1][0])) {
+                options.soft_bench_frames = atoi(argv[++i]);
+            }
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--model file.obj] [--size w h]\n"
+                    "\t[--batch poses.txt output_dir] [--encoders n]\n"
+                    "\t[--no-shader-cache] [--depth-prepass] [--occlusion]\n"
+                    "\t[--chunk-meshes]\n"
+                    "\t[--memory-report file.json] [--trace file.json]\n"
+                    "\t[--soft-bench [frames]] [--lights n] [--light-bench]\n"
+                    "\t[--continuous] [--progressive] [--scene-bench]\n"
+                    "\t[--ram-budget MB] [--vram-budget MB] [--release-cpu]\n"
+                    "\t[--compress-textures] [--bc7] [--compress-bench [png]]\n"
+                    "\t[--png-bench] [--bump-strength s] [--bump-central]\n"
+                    "\t[--bench [path.txt]] [--bench-frames n]\n"
+                    "\t[--bench-warmup n] [--bench-output file.json]\n"
+                    "\t[--multiview-bench] [--uniform-bench] [--jobs-bench]\n",
+                    argv[0]);
+            return false;
+        }
+    }
+    if (options.models.empty()) {
+        options.models.push_back(options.soft_bench || options.render_bench
+                                     ? "../teapot/teapot.obj"
+                                     : "../yoda/yoda.obj");
+    }
+    options.model_path = options.models[0];
+    return options.width > 0 && options.height > 0;
+}
+
+// Renders an orbit around the model with the software rasterizer at several
+// resolutions and thread counts, printing fps and per-stage times. The last
+// frame of the largest run is written to soft_bench.png.
+int run_soft_bench(const Options& options) {
+    ObjLoader objData;
+    try {
+        objData.parse_obj_file(options.model_path);
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Failed to parse obj file: %s", e.what());
+        return -1;
+    }
+    Mesh mesh(objData);
+    glm::mat4 model_matrix = mesh.center_mesh_transform();
+    glm::vec4 light_pos(-.5, -1, 1, 1);  // same as AppState
+
+    const int resolutions[][2] = {{320, 240}, {640, 480}, {1280, 720},
+                                  {1920, 1080}};
+    int max_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    std::vector<int> thread_counts;
+    for (int threads : {1, 2, 4, 8, 16}) {
+        if (threads < max_threads) thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    fprintf(stdout,
+            "Software rasterizer: %s, %zu triangles, %d frames per run\n"
+            "%-10s %7s %9s %9s %9s %9s\n",
+            options.model_path, mesh.triangles.size(),
+            options.soft_bench_frames, "size", "threads", "fps",
+            "xform ms", "setup ms", "raster ms");
+
+    for (int threads : thread_counts) {
+        JobSystem pool(threads - 1);
+        SoftRasterizer soft(1, 1, &pool);
+        SoftMesh soft_mesh = soft.upload_mesh(mesh);
+
+        for (auto& resolution : resolutions) {
+            int width = resolution[0];
+            int height = resolution[1];
+            soft.resize(width, height);
+            soft.stats = SoftRasterStats();
+            glm::mat4 projection = glm::perspective<float>(
+                glm::radians(60.f), float(width) / height, 0.1f, 100.f);
+
+            OrbitCamera camera;
+            auto start = std::chrono::steady_clock::now();
+            for (int frame = 0; frame < options.soft_bench_frames; frame++) {
+                camera.orbit(0, 360.f / options.soft_bench_frames);
+                glm::mat4 view = camera.calcViewMatrix();
+
+                FrameUniforms uniforms;
+                uniforms.mv = view * model_matrix;
+                uniforms.normal_matrix = glm::mat4(
+                    glm::transpose(glm::inverse(glm::mat3(uniforms.mv))));
+                uniforms.mvp = projection * uniforms.mv;
+                uniforms.view_light_pos = view * light_pos;
+                uniforms.view_camera_pos = view * glm::vec4(camera.pos, 1);
+                soft.set_frame_uniforms(uniforms);
+
+                soft.clear();
+                soft.draw_mesh(soft_mesh);
+            }
+            double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+
+            int frames = std::max(options.soft_bench_frames, 1);
+            fprintf(stdout, "%4dx%-5d %7d %9.1f %9.2f %9.2f %9.2f\n", width,
+                    height, threads, frames / seconds,
+                    soft.stats.transform_ms / frames,
+                    soft.stats.setup_ms / frames,
+                    soft.stats.raster_ms / frames);
+        }
+
+        if (threads == thread_counts.back()) {
+            unsigned error = lodepng::encode("soft_bench.png",
+                                             soft.color_buffer(), soft.width(),
+                                             soft.height());
+            if (error) {
+                fprintf(stderr, "ERROR: could not write soft_bench.png: %s\n",
+                        lodepng_error_text(error));
+            }
+        }
+    }
+    return 0;
+}
+
+// World matrix updates for 100k nodes with 1% of them moving each frame,
+// against recomputing every node, serial and on the job system
+int run_scene_bench() {
+    const int num_nodes = 100000;
+    const int moving = num_nodes / 100;
+    const int frames = 200;
+
+    // Random recursive tree: each node hangs off any earlier one, giving
+    // a few wide levels and a long tail, in no particular order
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> offset(-1.f, 1.f);
+    Scene scene;
+    scene.add_node(Scene::NO_PARENT, glm::mat4(1));
+    for (int i = 1; i < num_nodes; i++) {
+        glm::vec3 position(offset(rng), offset(rng), offset(rng));
+        scene.add_node(rng() % i, glm::translate(glm::mat4(1), position), 0);
+    }
+    scene.sort_by_level();
+
+    JobSystem pool;
+    fprintf(stdout,
+            "Scene: %d nodes, %d moving per frame, %d frames, %d threads\n"
+            "%-12s %8s %12s %14s\n",
+            num_nodes, moving, frames, pool.thread_count(), "update",
+            "threads", "ms/frame", "nodes/frame");
+
+    for (bool full : {true, false}) {
+        for (JobSystem* threads : {(JobSystem*)nullptr, &pool}) {
+            std::mt19937 move_rng(2);
+            double total_ms = 0;
+            size_t updated = 0;
+            for (int frame = 0; frame < frames; frame++) {
+                for (int i = 0; i < moving; i++) {
+                    uint32_t node = move_rng() % num_nodes;
+                    glm::vec3 position(offset(move_rng), offset(move_rng),
+                                       offset(move_rng));
+                    scene.set_local(node,
+                                    glm::translate(glm::mat4(1), position));
+                }
+                if (full) {
+                    scene.mark_all_dirty();
+                }
+                updated += scene.update_world(threads);
+                total_ms += scene.update_ms;
+            }
+            fprintf(stdout, "%-12s %8d %12.3f %14zu\n", full ? "full" : "dirty",
+                    threads ? threads->thread_count() : 1, total_ms / frames,
+                    updated / frames);
+        }
+    }
+    return 0;
+}
+
+// Scaling of the job system from 1 thread to all of them: vertex dedup of
+// the model (parsed once), decoding its mtl textures, BC1 with mips of its
+// first texture, and a fine-grained parallel_for with little work per index
+int run_jobs_bench(const Options& options) {
+    ObjLoader objData;
+    objData.decode_textures = false;  // decoded per run below
+    try {
+        objData.parse_obj_file(options.model_path);
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Failed to parse obj file: %s", e.what());
+        return -1;
+    }
+    std::vector<std::string> texture_paths(objData.loaded_texture_maps.begin(),
+                                           objData.loaded_texture_maps.end());
+    std::sort(texture_paths.begin(), texture_paths.end());
+    std::vector<unsigned char> pixels;
+    unsigned width = 0, height = 0;
+    if (!texture_paths.empty() &&
+        decode_png_rgba(pixels, width, height, texture_paths[0])) {
+        pixels.clear();
+    }
+
+    int max_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    std::vector<int> thread_counts;
+    for (int threads : {1, 2, 4, 8, 16}) {
+        if (threads < max_threads) thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    struct Run {
+        int threads;
+        double ms[4];  // dedup, decode, bc1, loop
+        JobSystem::Stats stats;
+    };
+    std::vector<Run> runs;
+    for (int threads : thread_counts) {
+        JobSystem jobs(threads - 1);
+        Run run{threads, {}, {}};
+        auto time = [&](double& ms, auto&& fn) {
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            ms = std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+        };
+
+        time(run.ms[0], [&] { Mesh mesh(objData, &jobs); });
+        time(run.ms[1], [&] {
+            ObjLoader loader;
+            loader.jobs = &jobs;
+            for (auto& mtl : objData.loaded_materials) {
+                std::filesystem::path path(mtl);
+                loader.parse_mtl_file(path.parent_path().string() + "/",
+                                      path.filename().string());
+            }
+        });
+        run.ms[2] = 0;
+        if (!pixels.empty()) {
+            time(run.ms[2], [&] {
+                compress_texture(pixels.data(), width, height,
+                                 BlockFormat::BC1, &jobs, false);
+            });
+        }
+        std::vector<uint32_t> values(1 << 22);
+        time(run.ms[3], [&] {
+            jobs.parallel_for(
+                values.size(),
+                [&](size_t i) {
+                    uint32_t h = uint32_t(i);
+                    for (int round = 0; round < 16; round++) {
+                        h = (h ^ (h >> 15)) * 0x2c1b3c6d;
+                    }
+                    values[i] = h;
+                },
+                256);
+        });
+        run.stats = jobs.stats();
+        runs.push_back(run);
+    }
+
+    fprintf(stdout,
+            "Job system: %s, %zu faces, %zu textures, BC1 of %s (%ux%u)\n"
+            "%7s %16s %16s %16s %16s %10s %8s\n",
+            options.model_path, objData.faces.size(), texture_paths.size(),
+            pixels.empty() ? "nothing" : texture_paths[0].c_str(), width,
+            height, "threads", "dedup ms", "decode ms", "bc1 ms", "loop ms",
+            "jobs", "steals");
+    for (auto& run : runs) {
+        fprintf(stdout, "%7d", run.threads);
+        for (int stage = 0; stage < 4; stage++) {
+            double speedup =
+                run.ms[stage] ? runs[0].ms[stage] / run.ms[stage] : 0;
+            fprintf(stdout, " %9.1f %5.2fx", run.ms[stage], speedup);
+        }
+        fprintf(stdout, " %10llu %8llu\n", (unsigned long long)run.stats.jobs,
+                (unsigned long long)run.stats.steals);
+    }
+    return 0;
+}
+
+// Encodes one png (and its mips) to every block format, serial and on all
+// threads, printing throughput and error against the source
+int run_compress_bench(const Options& options) {
+    std::vector<unsigned char> pixels;
+    unsigned width, height;
+    unsigned error = decode_png_rgba(pixels, width, height,
+                                     options.compress_bench);
+    if (error) {
+        fprintf(stderr, "ERROR: could not read %s: %s\n",
+                options.compress_bench, lodepng_error_text(error));
+        return -1;
+    }
+
+    JobSystem pool;
+    fprintf(stdout, "%s: %ux%u\n%-6s %8s %10s %10s %10s %10s\n",
+            options.compress_bench, width, height, "format", "threads",
+            "MP/s", "PSNR dB", "max error", "MB");
+    for (BlockFormat format : {BlockFormat::BC1, BlockFormat::BC3,
+                               BlockFormat::BC4, BlockFormat::BC5,
+                               BlockFormat::BC7}) {
+        for (JobSystem* threads : {(JobSystem*)nullptr, &pool}) {
+            CompressedTexture compressed = compress_texture(
+                pixels.data(), width, height, format, threads);
+            auto& stats = compressed.stats;
+            fprintf(stdout, "%-6s %8d %10.1f %10.2f %10d %10.2f\n",
+                    block_format_name(format),
+                    threads ? threads->thread_count() : 1, stats.mp_per_s(),
+                    stats.psnr, stats.max_error, stats.bytes / 1048576.0);
+        }
+    }
+    fprintf(stdout, "Uncompressed with mips: %.2f MB\n",
+            width * height * 4 * 4 / 3 / 1048576.0);
+    return 0;
+}
+
+// Decodes every bundled png with plain lodepng and with fast_png, checking
+// the pixels match and printing decode throughput (MB of RGBA8 output)
+int run_png_bench() {
+    const int runs = 5;
+    double total_lodepng_ms = 0, total_fast_ms = 0;
+    fprintf(stdout, "%-32s %10s %12s %12s %8s\n", "png", "size",
+            "lodepng MB/s", "fast MB/s", "speedup");
+    for (const char* dir : {"../yoda", "../teapot"}) {
+        std::vector<std::filesystem::path> paths;
+        for (const auto& file : std::filesystem::directory_iterator(dir)) {
+            if (file.path().extension() == ".png") {
+                paths.push_back(file.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+
+        for (const auto& path : paths) {
+            std::vector<unsigned char> file;
+            if (lodepng::load_file(file, path.string())) continue;
+
+            std::vector<unsigned char> expected, pixels;
+            unsigned width = 0, height = 0;
+            double lodepng_ms = 1e30, fast_ms = 1e30;  // best of runs
+            for (int run = 0; run < runs; run++) {
+                auto start = std::chrono::steady_clock::now();
+                unsigned error = lodepng::decode(expected, width, height, file);
+                auto middle = std::chrono::steady_clock::now();
+                error |= decode_png_rgba(pixels, width, height, file.data(),
+                                         file.size());
+                auto end = std::chrono::steady_clock::now();
+                if (error || pixels != expected) {
+                    fprintf(stderr, "ERROR: %s decodes differently\n",
+                            path.c_str());
+                    return -1;
+                }
+                lodepng_ms = std::min(
+                    lodepng_ms, std::chrono::duration<double, std::milli>(
+                                    middle - start).count());
+                fast_ms = std::min(fast_ms,
+                                   std::chrono::duration<double, std::milli>(
+                                       end - middle).count());
+            }
+            total_lodepng_ms += lodepng_ms;
+            total_fast_ms += fast_ms;
+            double mb = expected.size() / 1048576.0;
+            char size[32];
+            snprintf(size, sizeof(size), "%ux%u", width, height);
+            fprintf(stdout, "%-32s %10s %12.1f %12.1f %7.2fx\n",
+                    path.filename().c_str(), size, mb / lodepng_ms * 1000,
+                    mb / fast_ms * 1000, lodepng_ms / fast_ms);
+        }
+    }
+    fprintf(stdout, "Total: lodepng %.1f ms, fast %.1f ms (%.2fx)\n",
+            total_lodepng_ms, total_fast_ms,
+            total_fast_ms ? total_lodepng_ms / total_fast_ms : 0);
+    return 0;
+}
+
+// Frame cost of clustered lighting as the light count grows, from the
+// single unclustered light to 1024 point lights. Each run orbits the model
+// once with vsync off and glFinish every frame, so GPU time is included.
+void run_light_bench(GLFWwindow* window, AppState* state, const GPUMesh& mesh,
+                     ShaderVariants& variants) {
+    Rasterizer* rasterizer = state->rasterizer;
+    const int frames = 120;
+    glfwSwapInterval(0);
+
+    auto draw_frame = [&]() {
+        state->view_dirty = true;
+        state->update_shader_inputs();
+        if (rasterizer->clustered_lighting) {
+            state->update_lights();
+        }
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        rasterizer->drawMesh(mesh, variants);
+        glfwSwapBuffers(window);
+        rasterizer->endFrame();
+        glFinish();
+    };
+
+    fprintf(stdout, "%8s %10s %10s %12s %14s\n", "lights", "frame ms",
+            "assign ms", "max/cluster", "lit clusters");
+    for (int count = 0; count <= 1024; count = count ? count * 2 : 1) {
+        state->lights = make_lights(count);
+        rasterizer->clustered_lighting = count > 0;
+        draw_frame();  // compile the variant outside the timing
+
+        double assign_ms = 0;
+        size_t max_cluster_lights = 0;
+        size_t occupied_clusters = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            state->camera.orbit(0, 360.f / frames);
+            draw_frame();
+            if (rasterizer->clustered_lighting) {
+                LightClusters* clusters = state->light_clusters;
+                assign_ms += clusters->build_ms;
+                max_cluster_lights = std::max<size_t>(
+                    max_cluster_lights, clusters->max_cluster_lights);
+                occupied_clusters += clusters->occupied_clusters;
+            }
+            glfwPollEvents();
+        }
+        double frame_ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count() /
+                          frames;
+        fprintf(stdout, "%8d %10.3f %10.3f %12zu %14zu\n", count, frame_ms,
+                assign_ms / frames, max_cluster_lights,
+                occupied_clusters / frames);
+    }
+}
+
+// CPU submit time of 10k draws that each have their own object uniforms
+// (mvp, mv, normal matrix, light and camera position), set with one
+// glUniform* call per value, or as one UniformRing block per draw bound
+// with glBindBufferRange: either written and bound draw by draw, or all
+// written first with a single flush. Each draw is one triangle so the GPU
+// keeps up; the glFinish after each frame isn't timed.
+int run_uniform_bench(Rasterizer* rasterizer, const GPUMesh& mesh,
+                      ProgramCache& cache) {
+    const int draws = 10000;
+    const int frames = 30;
+    const GLuint binding = 1;  // clear of Rasterizer::FRAME_BLOCK_BINDING
+
+    GLuint uniform_program = cache.load_program("../uniform_bench.vert",
+                                                "../uniform_bench.frag");
+    GLuint block_program = cache.load_program(
+        "../uniform_bench.vert", "../uniform_bench.frag", {"UNIFORM_BLOCK"});
+    if (!uniform_program || !block_program) {
+        return -1;
+    }
+    glUniformBlockBinding(block_program,
+                          glGetUniformBlockIndex(block_program, "ObjectBlock"),
+                          binding);
+
+    // A grid of objects, each with its own transforms
+    std::vector<FrameUniforms> objects(draws);
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 120), glm::vec3(0),
+                                 glm::vec3(0, 1, 0));
+    glm::mat4 projection =
+        glm::perspective<float>(glm::radians(60.f), 4.f / 3, 0.1f, 1000.f);
+    for (int i = 0; i < draws; i++) {
+        glm::mat4 model = glm::translate(
+            glm::mat4(1), glm::vec3(i % 100 - 50, i / 100 - 50, 0));
+        FrameUniforms& object = objects[i];
+        object.mv = view * model;
+        object.normal_matrix = glm::mat4(
+            glm::transpose(glm::inverse(glm::mat3(object.mv))));
+        object.mvp = projection * object.mv;
+        object.view_light_pos = view * glm::vec4(-.5, -1, 1, 1);
+        object.view_camera_pos = glm::vec4(0, 0, 0, 1);
+    }
+    SubMesh triangle = {nullptr, 3, 0};
+    UniformRing ring(draws * 256);  // blocks padded to the usual alignment
+    std::vector<UniformRing::Block> blocks(draws);
+
+    auto measure = [&](const char* name, auto&& submit) {
+        std::vector<double> submit_ms;
+        for (int frame = 0; frame < frames; frame++) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            auto start = std::chrono::steady_clock::now();
+            submit();
+            submit_ms.push_back(std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count());
+            ring.end_frame();
+            glFinish();
+        }
+        double median = percentile(submit_ms, .5);
+        fprintf(stdout, "%-26s %10.3f %10.3f %10.1f\n", name, median,
+                percentile(submit_ms, .95), median * 1e6 / draws);
+    };
+
+    fprintf(stdout,
+            "Uniform submit, %d draws per frame, ring %s (%zu KB)\n"
+            "%-26s %10s %10s %10s\n",
+            draws, ring.persistent() ? "persistently mapped" : "map unsynchronized",
+            ring.capacity() >> 10, "", "p50 ms", "p95 ms", "ns/draw");
+    measure("glUniform per value", [&]() {
+        rasterizer->bindProgram(uniform_program);
+        for (auto& object : objects) {
+            rasterizer->uploadMat4("mvp", object.mvp);
+            rasterizer->uploadMat4("mv", object.mv);
+            rasterizer->uploadMat3("normal_matrix", object.normal_matrix);
+            rasterizer->uploadVec4("view_light_pos", object.view_light_pos);
+            rasterizer->uploadVec4("view_camera_pos", object.view_camera_pos);
+            rasterizer->drawSubMesh(mesh, triangle);
+        }
+    });
+    measure("ring, block per draw", [&]() {
+        rasterizer->bindProgram(block_program);
+        for (auto& object : objects) {
+            UniformRing::Block block = ring.push(object);
+            ring.flush();
+            ring.bind(binding, block);
+            rasterizer->drawSubMesh(mesh, triangle);
+        }
+    });
+    measure("ring, all blocks first", [&]() {
+        rasterizer->bindProgram(block_program);
+        for (int i = 0; i < draws; i++) {
+            blocks[i] = ring.push(objects[i]);
+        }
+        ring.flush();
+        for (int i = 0; i < draws; i++) {
+            ring.bind(binding, blocks[i]);
+            rasterizer->drawSubMesh(mesh, triangle);
+        }
+    });
+    fprintf(stdout, "Ring waited %llu times, %.3f ms total\n",
+            (unsigned long long)ring.waits, ring.wait_ms);
+    return 0;
+}
+
+// Views per second rendering n views of the model (a thumbnail grid
+// orbiting it) as one multiview submission, against the naive loop of one
+// drawMesh per view, for a stereo pair, cube map faces, a 4x4 grid and two
+// submissions' worth. glFinish every frame so GPU time is included. Both
+// methods' images are read back and compared.
+void run_multiview_bench(AppState* state, const GPUMesh& mesh,
+                         ShaderVariants& variants) {
+    Rasterizer* rasterizer = state->rasterizer;
+    const int frames = 60;
+    glm::ivec2 size = state->framebuffer_size;
+
+    // Per view state is what multiview leaves out, so keep it off for both
+    bool clustered = rasterizer->clustered_lighting;
+    bool prepass = rasterizer->depth_prepass;
+    OcclusionCuller* culler = rasterizer->occlusion_culler;
+    rasterizer->clustered_lighting = false;
+    rasterizer->depth_prepass = false;
+    rasterizer->occlusion_culler = nullptr;
+
+    auto make_views = [&](int count, std::vector<FrameUniforms>& views,
+                          std::vector<glm::vec4>& viewports) {
+        int cols = int(std::ceil(std::sqrt(double(count))));
+        int rows = (count + cols - 1) / cols;
+        float width = float(size.x / cols);
+        float height = float(size.y / rows);
+        glm::mat4 projection = glm::perspective<float>(
+            glm::radians(60.f), width / height, 0.1f, 100.f);
+        views.resize(count);
+        viewports.resize(count);
+        for (int i = 0; i < count; i++) {
+            OrbitCamera camera;
+            camera.pitch = 15;
+            camera.yaw = -90 + 360.f * i / count;
+            camera.updateBasis();
+            glm::mat4 view = camera.calcViewMatrix();
+
+            FrameUniforms& uniforms = views[i];
+            uniforms.mv = view * state->model_matrix;
+            uniforms.normal_matrix = glm::mat4(
+                glm::transpose(glm::inverse(glm::mat3(uniforms.mv))));
+            uniforms.mvp = projection * uniforms.mv;
+            uniforms.view_light_pos = view * state->light_pos;
+            uniforms.view_camera_pos = view * glm::vec4(camera.pos, 1);
+            viewports[i] = glm::vec4((i % cols) * width,
+                                     (rows - 1 - i / cols) * height, width,
+                                     height);
+        }
+    };
+
+    auto draw_naive = [&](const std::vector<FrameUniforms>& views,
+                          const std::vector<glm::vec4>& viewports) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        for (size_t i = 0; i < views.size(); i++) {
+            glViewport(viewports[i].x, viewports[i].y, viewports[i].z,
+                       viewports[i].w);
+            rasterizer->setFrameUniforms(views[i]);
+            rasterizer->drawMesh(mesh, variants);
+        }
+        glViewport(0, 0, size.x, size.y);
+        rasterizer->endFrame();
+        glFinish();
+    };
+    auto draw_multiview = [&](const std::vector<FrameUniforms>& views,
+                              const std::vector<glm::vec4>& viewports) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        rasterizer->drawMeshMultiview(mesh, variants, views, viewports);
+        rasterizer->endFrame();
+        glFinish();
+    };
+    auto views_per_second = [&](auto&& draw,
+                                const std::vector<FrameUniforms>& views,
+                                const std::vector<glm::vec4>& viewports) {
+        draw(views, viewports);  // compile variants outside the timing
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            draw(views, viewports);
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        return frames * views.size() / seconds;
+    };
+    auto read_pixels = [&]() {
+        std::vector<unsigned char> pixels(size_t(size.x) * size.y * 4);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixels.data());
+        return pixels;
+    };
+
+    fprintf(stdout, "Multiview: %dx%d, %zu submeshes, %s routing\n", size.x,
+            size.y, mesh.submeshes.size(),
+            GLEW_ARB_shader_viewport_layer_array ? "vertex shader"
+                                                 : "geometry shader");
+    fprintf(stdout, "%6s %14s %14s %8s %12s\n", "views", "naive views/s",
+            "multi views/s", "speedup", "differing px");
+    for (int count : {1, 2, 6, 16, 32}) {
+        std::vector<FrameUniforms> views;
+        std::vector<glm::vec4> viewports;
+        make_views(count, views, viewports);
+        double naive = views_per_second(draw_naive, views, viewports);
+        double multi = views_per_second(draw_multiview, views, viewports);
+
+        // Same image either way, up to invariance between the two programs
+        draw_naive(views, viewports);
+        std::vector<unsigned char> expected = read_pixels();
+        draw_multiview(views, viewports);
+        std::vector<unsigned char> actual = read_pixels();
+        size_t differing = 0;
+        for (size_t i = 0; i < expected.size(); i += 4) {
+            for (int c = 0; c < 3; c++) {
+                if (std::abs(expected[i + c] - actual[i + c]) > 2) {
+                    differing++;
+                    break;
+                }
+            }
+        }
+        fprintf(stdout, "%6d %14.0f %14.0f %7.2fx %12zu\n", count, naive,
+                multi, multi / naive, differing);
+    }
+
+    rasterizer->clustered_lighting = clustered;
+    rasterizer->depth_prepass = prepass;
+    rasterizer->occlusion_culler = culler;
+}
+
+// Replays the camera path over every --model in turn with vsync off:
+// warm-up frames first, then the measured ones. Frame time runs from the
+// start of a frame to after its swap; GPU time comes from timer queries
+// read back a few frames late, so measuring doesn't serialize the pipeline.
+int run_render_bench(GLFWwindow* window, AppState* state, AssetManager& assets,
+                     const GPUMesh& first_mesh, ShaderVariants& variants,
+                     const Options& options) {
+    CameraPath path;
+    try {
+        path = options.bench_path ? load_camera_path(options.bench_path)
+                                  : default_camera_path();
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Failed to load camera path: %s", e.what());
+        return -1;
+    }
+    Rasterizer* rasterizer = state->rasterizer;
+    glfwSwapInterval(0);
+
+    BenchInfo info;
+    info.renderer = (const char*)glGetString(GL_RENDERER);
+    info.version = (const char*)glGetString(GL_VERSION);
+    info.path = options.bench_path ? options.bench_path : "";
+    info.width = state->framebuffer_size.x;
+    info.height = state->framebuffer_size.y;
+    info.warmup_frames = std::max(options.bench_warmup, 0);
+    info.frames = options.bench_frames > 0 ? options.bench_frames : path.frames();
+
+    std::vector<BenchRun> runs;
+    for (size_t m = 0; m < options.models.size(); m++) {
+        // The first model is already uploaded and placed by main
+        std::shared_ptr<Mesh> mesh;
+        GPUMesh uploaded;
+        const GPUMesh* gpu_mesh = &first_mesh;
+        size_t triangles = 0;
+        if (m > 0) {
+            try {
+                mesh = assets.mesh(options.models[m]);
+            } catch (const std::runtime_error& e) {
+                fprintf(stderr, "Failed to parse obj file: %s", e.what());
+                return -1;
+            }
+            uploaded = rasterizer->uploadMesh(*mesh);
+            assets.mesh_uploaded(mesh.get());
+            gpu_mesh = &uploaded;
+            state->scene.set_local(state->model_node,
+                                   mesh->center_mesh_transform());
+        }
+        for (auto& submesh : gpu_mesh->submeshes) {
+            if (!variants.get(rasterizer->variantFeatures(submesh.material))) {
+                return -1;
+            }
+            triangles += submesh.index_count / 3;
+        }
+
+        BenchRun run;
+        run.model = options.models[m];
+        run.triangles = triangles;
+        run.frame_ms.resize(info.frames);
+        run.submit_ms.resize(info.frames);
+        run.gpu_ms.resize(info.frames);
+        double warmup_gpu_ms;  // discarded
+
+        GpuFrameTimer gpu_timer;
+        path.reset(state->camera);
+        state->view_dirty = true;
+        for (int frame = 0; frame < info.warmup_frames + info.frames; frame++) {
+            int measured = frame - info.warmup_frames;
+            auto start = std::chrono::steady_clock::now();
+            gpu_timer.begin();
+
+            path.step(frame, state->camera);
+            state->view_dirty = true;
+            state->update_frame();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            rasterizer->drawMesh(*gpu_mesh, variants);
+            auto submitted = std::chrono::steady_clock::now();
+
+            gpu_timer.end(measured >= 0 ? &run.gpu_ms[measured]
+                                        : &warmup_gpu_ms);
+            glfwSwapBuffers(window);
+            rasterizer->endFrame();
+            glfwPollEvents();
+            if (measured >= 0) {
+                run.submit_ms[measured] =
+                    std::chrono::duration<double, std::milli>(submitted - start)
+                        .count();
+                run.frame_ms[measured] =
+                    std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+            }
+        }
+        gpu_timer.finish();
+        print_bench_run(run);
+        runs.push_back(std::move(run));
+
+        if (m > 0) {
+            rasterizer->freeMesh(uploaded);
+        }
+    }
+
+    if (!write_bench_results(options.bench_output, info, runs)) {
+        return -1;
+    }
+    fprintf(stdout, "Wrote %s\n", options.bench_output);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     GLFWwindow* window;
 
+    Options options;
+    if (!parse_options(argc, argv, options)) return -1;
+    if (options.trace) {
+        start_tracing();
+        TRACE_THREAD("main");
+    }
+    if (options.soft_bench) return run_soft_bench(options);
+    if (options.scene_bench) return run_scene_bench();
+    if (options.jobs_bench) return run_jobs_bench(options);
+    if (options.compress_bench) return run_compress_bench(options);
+    if (options.png_bench) return run_png_bench();
+    bool batch_mode = options.batch_poses != nullptr;
+
     // Initialize
+    // Without a display server (build machines), fall back to GLFW's null
+    // platform with an OSMesa software context
+    bool offscreen = batch_mode || options.render_bench ||
+                     options.multiview_bench || options.uniform_bench;
+    bool headless =
+        offscreen && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY");
+    if (headless) {
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+    }
     if (!glfwInit()) return -1;
+    // Declared before anything that owns GL objects, so it terminates GLFW
+    // (and destroys the context) only after they've all been freed
+    struct GlfwSession {
+        ~GlfwSession() { glfwTerminate(); }
+    } glfw_session;
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);  // REQUIRED on macOS
     glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+    if (offscreen) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
+    if (headless) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    }
 
-    window = glfwCreateWindow(640, 480, "Rasterizer", NULL, NULL);
+    window = glfwCreateWindow(options.width, options.height, "Rasterizer",
+                              NULL, NULL);
     if (!window) {
-        glfwTerminate();
         fprintf(stderr, "GLFW context initialization failed\n");
         return -1;
     }
@@ -188,6 +1281,8 @@ int main(int argc, char** argv) {
 
     glfwSetKeyCallback(window, key_callback);
     glfwSetCursorPosCallback(window, cursor_position_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
     GLenum glewErr = glewInit();
     if (glewErr != GLEW_OK) {
@@ -198,78 +1293,135 @@ int main(int argc, char** argv) {
     fprintf(stdout, "OpenGL version: %s\n", glGetString(GL_VERSION));
 
     Rasterizer rasterizer;
+    appState->rasterizer = &rasterizer;
+    // Written on the way out, while the profiler's scope names still exist
+    struct TraceOutput {
+        const char* path;
+        ~TraceOutput() {
+            if (path) write_trace(path);
+        }
+    } trace_output{options.trace};
+
+    // Workers shared by loading, texture compression, culling and light
+    // clustering
+    JobSystem jobs;
+    rasterizer.jobs = &jobs;
+    rasterizer.compress_textures = options.compress_textures;
+    rasterizer.allow_bc7 = options.bc7;
+    rasterizer.normal_maps = options.normal_maps;
+    rasterizer.chunk_meshes = options.chunk_meshes;
     // GLuint vao;
     // glGenVertexArrays(1, &vao);
     // rasterizer.bindVAO(vao);
 
-    ObjLoader objData;
-    try {
-        // objData.parse_obj_file("../teapot/teapot.obj");
-        objData.parse_obj_file("../yoda/yoda.obj");
-    } catch (std::runtime_error e) {
-        fprintf(stderr, "Failed to parse obj file: %s", e.what());
-        return -1;
+    // Meshes, materials and textures are loaded once and shared
+    AssetManager assets(options.asset_budget);
+    assets.jobs = &jobs;
+    rasterizer.setAssetManager(&assets);
+    // Progressive: the model loads in the background, the loop draws
+    // whatever the streamer has so far. Benchmarks and batch renders need
+    // the whole mesh up front.
+    std::unique_ptr<MeshStreamer> streamer;
+    std::shared_ptr<Mesh> mesh_asset;
+    if (options.progressive && !offscreen) {
+        StreamSettings stream_settings;
+        stream_settings.chunked = options.chunk_meshes;
+        streamer = std::make_unique<MeshStreamer>(options.model_path, assets,
+                                                  jobs, stream_settings);
+        appState->streamer = streamer.get();
+    } else {
+        try {
+            TRACE_SCOPE("load model");
+            mesh_asset = assets.mesh(options.model_path);
+        } catch (const std::runtime_error& e) {
+            fprintf(stderr, "Failed to parse obj file: %s", e.what());
+            return -1;
+        }
+        Mesh& mesh = *mesh_asset;
+        fprintf(stdout,
+                "mesh:\n\tvertices: %lu\n\ttextures: %lu\n\tnormals: "
+                "%lu\n\ttriangles: %lu\n",
+                mesh.positions.size(), mesh.texcoords.size(),
+                mesh.normals.size(), mesh.triangles.size());
     }
 
-    Mesh mesh(objData);
-    fprintf(stdout,
-            "objData:\n\tvertices: %lu\n\ttextures: %lu\n\tnormals: "
-            "%lu\n\tfaces: %lu\n",
-            objData.vertices.size(), objData.vertex_textures.size(),
-            objData.vertex_normals.size(), objData.faces.size());
-    fprintf(stdout,
-            "mesh:\n\tvertices: %lu\n\ttextures: %lu\n\tnormals: "
-            "%lu\n\ttriangles: %lu\n",
-            mesh.positions.size(), mesh.texcoords.size(), mesh.normals.size(),
-            mesh.triangles.size());
-
     // GLuint vbo;
     // glGenBuffers(1, &vbo);
     // rasterizer.bindArrayBuffer(vbo);
     // glBufferData(GL_ARRAY_BUFFER);
 
-    GLuint program = glCreateProgram();
+    // Linked programs are cached on disk, keyed by source + driver
+    ProgramCache program_cache;
+    program_cache.enabled = options.shader_cache;
 
-    // Compile vertex shader
-    GLuint vs;
-    if (!compileShader(vs, program, GL_VERTEX_SHADER, "../shader.vert")) {
-        glfwTerminate();
-        return -1;
-    }
+    // One program per combination of material features, built on first use
+    ShaderVariants variants(program_cache, "../shader.vert", "../shader.frag",
+                            "../multiview.geom");
 
-    // Compile fragment shader
-    GLuint fs;
-    if (!compileShader(fs, program, GL_FRAGMENT_SHADER, "../shader.frag")) {
-        glfwTerminate();
-        return -1;
+    GPUMesh gpu_mesh;
+    if (mesh_asset) {
+        gpu_mesh = rasterizer.uploadMesh(*mesh_asset);
+        assets.mesh_uploaded(mesh_asset.get());
+    }
+    if (options.memory_report) {
+        print_memory_report();
+        write_memory_report(options.memory_report);
     }
 
-    // TODO: maybe move into rasterizer?
-    glLinkProgram(program);
-    GLint success;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
-    if (!success) {
-        char log[512];
-        glGetProgramInfoLog(program, 512, nullptr, log);
-        fprintf(stderr, "Program link error:\n%s\n", log);
-        glfwTerminate();
+    // Depth-only program for the pre-pass (position stream, no fragment work)
+    rasterizer.depth_program =
+        program_cache.load_program("../depth.vert", "../depth.frag");
+    if (!rasterizer.depth_program) {
         return -1;
     }
+    rasterizer.depth_prepass = options.depth_prepass;
+    rasterizer.count_shaded_fragments = !offscreen;
 
-    try {
-        rasterizer.bindProgram(program);
-    } catch (std::runtime_error e) {
-        fprintf(stderr, "Program link error:\n%s\n", e.what());
-        glfwTerminate();
-        return -1;
+    // Resolve of the transparency pass; without it transparent materials
+    // are drawn opaque
+    rasterizer.oit_composite_program = program_cache.load_program(
+        "../oit_composite.vert", "../oit_composite.frag");
+
+    // Software occlusion culling of submeshes, workers shared per frame
+    OcclusionCuller occlusion_culler(256, 128, &jobs);
+    appState->occlusion_culler = &occlusion_culler;
+    if (options.occlusion_culling) {
+        rasterizer.occlusion_culler = &occlusion_culler;
     }
 
-    rasterizer.uploadMesh(
-        mesh);  // Here because shaders need to be compiled first
+    // Clustered point lights, assigned to clusters on the same workers
+    LightClusters light_clusters;
+    appState->light_clusters = &light_clusters;
+    appState->jobs = &jobs;
+    glfwGetFramebufferSize(window, &appState->framebuffer_size.x,
+                           &appState->framebuffer_size.y);
+    appState->lights = make_lights(options.num_lights);
+    rasterizer.clustered_lighting = options.num_lights > 0;
+
+    // Build every variant this mesh needs up front, so the first frame
+    // doesn't hitch
+    {
+        TRACE_SCOPE("build variants");
+        for (auto& submesh : gpu_mesh.submeshes) {
+            if (!variants.get(rasterizer.variantFeatures(submesh.material))) {
+                return -1;
+            }
+        }
+    }
+    fprintf(stdout,
+            "Shader programs: %zu variants, %d cached (%.2f ms), %d compiled "
+            "(%.2f ms), %d rejected\n",
+            variants.size(), program_cache.hits, program_cache.load_ms,
+            program_cache.misses, program_cache.compile_ms,
+            program_cache.rejected);
 
     // auto transform = glm::scale(glm::mat4(1.0f), glm::vec3(.05,.05,.05));
 
-    appState->model_matrix = mesh.center_mesh_transform();
+    appState->model_node = appState->scene.add_node(
+        Scene::NO_PARENT,
+        mesh_asset ? mesh_asset->center_mesh_transform() : glm::mat4(1), 0);
+    appState->scene.update_world();
+    appState->model_matrix = appState->scene.world(appState->model_node);
     // model_matrix = glm::rotate(glm::mat4(1.0f), 1.f, glm::vec3(1, 0, 0)) *
     //                mesh.center_mesh_transform();
     // model_matrix = glm::rotate(model_matrix, glm::radians(-90.f),
@@ -278,52 +1430,123 @@ int main(int argc, char** argv) {
     appState->view_matrix = appState->camera.calcViewMatrix();
     // glm::lookAt(glm::vec3(0, 0, 5), glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
     appState->projection_matrix =
-        glm::perspective<float>(glm::radians(60.f), 640.f / 480, 0.1f, 100.f);
+        glm::perspective<float>(glm::radians(60.f),
+                                float(options.width) / options.height, 0.1f,
+                                100.f);
     // glm::mat4 orthographic_projection
 
     // glm::vec4 c = mvp * glm::vec4(mesh.bounds.center(), 1.0f);
     // printf("mvp center: %f %f %f\n", c.x, c.y, c.z);
 
-    appState->mvp_location = glGetUniformLocation(program, "mvp");
-    if (appState->mvp_location == -1) {
-        fprintf(stderr, "ERROR: mvp uniform not found or optimized out\n");
-    }
+    appState->update_shader_inputs();
 
-    appState->mv_location = glGetUniformLocation(program, "mv");
-    if (appState->mv_location == -1) {
-        fprintf(stderr, "ERROR: mv uniform not found or optimized out\n");
+    // Display loop
+    glEnable(GL_DEPTH_TEST);
+
+    if (options.light_bench) {
+        run_light_bench(window, appState, gpu_mesh, variants);
+        return 0;
     }
 
-    appState->normal_mat_location =
-        glGetUniformLocation(program, "normal_matrix");
-    if (appState->normal_mat_location == -1) {
-        fprintf(stderr,
-                "ERROR: normal_matrix uniform not found or optimized out\n");
+    if (options.uniform_bench) {
+        int result = run_uniform_bench(&rasterizer, gpu_mesh, program_cache);
+        return result;
     }
 
-    appState->view_light_pos_location =
-        glGetUniformLocation(program, "view_light_pos");
-    if (appState->view_light_pos_location == -1) {
-        fprintf(stderr,
-                "ERROR: view_light_pos uniform not found or optimized out\n");
+    if (options.multiview_bench) {
+        run_multiview_bench(appState, gpu_mesh, variants);
+        return 0;
     }
 
-    appState->view_camera_pos_location =
-        glGetUniformLocation(program, "view_camera_pos");
-    if (appState->view_camera_pos_location == -1) {
-        fprintf(stderr,
-                "ERROR: view_camera_pos uniform not found or optimized out\n");
+    if (options.render_bench) {
+        int result = run_render_bench(window, appState, assets, gpu_mesh,
+                                      variants, options);
+        return result;
     }
 
-    appState->update_shader_inputs();
+    if (batch_mode) {
+        std::vector<CameraPose> poses;
+        try {
+            poses = load_camera_poses(options.batch_poses);
+        } catch (const std::runtime_error& e) {
+            fprintf(stderr, "Failed to load camera poses: %s", e.what());
+            return -1;
+        }
 
-    // Display loop
-    glEnable(GL_DEPTH_TEST);
+        {
+            OffscreenRenderer offscreen(options.width, options.height,
+                                        options.num_encoders);
+            offscreen.render_poses(
+                poses, options.batch_output, [&](const CameraPose& pose) {
+                    appState->camera.pitch = pose.pitch;
+                    appState->camera.yaw = pose.yaw;
+                    appState->camera.radius = pose.radius;
+                    appState->camera.target = pose.target;
+                    appState->camera.updateBasis();
+                    appState->view_dirty = true;
+                    appState->update_shader_inputs();
+                    if (rasterizer.clustered_lighting) {
+                        appState->update_lights();
+                    }
+
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    rasterizer.drawMesh(gpu_mesh, variants);
+                    rasterizer.endFrame();
+                });
+        }
+        return 0;
+    }
 
+    // Progressive loading: uploads the next slice, and when the streamer
+    // swaps meshes places the model and builds the variants it needs
+    const GPUMesh* draw_mesh = streamer ? nullptr : &gpu_mesh;
+    auto update_stream = [&]() {
+        if (!streamer || !streamer->update(rasterizer)) {
+            return;
+        }
+        if (!draw_mesh) {
+            appState->scene.set_local(appState->model_node,
+                                      streamer->model_transform());
+        }
+        draw_mesh = streamer->mesh();
+        for (auto& submesh : draw_mesh->submeshes) {
+            variants.get(rasterizer.variantFeatures(submesh.material));
+        }
+        appState->redraw = true;
+    };
+
+    // Renders on demand: sleeps in glfwWaitEvents until input or a toggle
+    // changes the image, unless --continuous. While streaming it only
+    // dozes, to keep uploading.
     while (!glfwWindowShouldClose(window)) {
+        // Drain the queue first so all pending input lands in one update
+        glfwPollEvents();
+        update_stream();
+        while (!options.continuous && !appState->needs_redraw() &&
+               !glfwWindowShouldClose(window)) {
+            if (streamer && !streamer->done()) {
+                glfwWaitEventsTimeout(.005);
+                update_stream();
+            } else {
+                glfwWaitEvents();
+            }
+        }
+        if (glfwWindowShouldClose(window)) {
+            break;
+        }
+
+        rasterizer.profiler.begin_frame();
+        {
+            Profiler::Scope scope(rasterizer.profiler, "update");
+            appState->update_frame();
+        }
+        // CPU only, so the passes inside drawMesh get GPU times
+        rasterizer.profiler.begin_scope("draw", false);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glDrawElements(GL_TRIANGLES, mesh.triangles.size() * 3, GL_UNSIGNED_INT,
-                       0);
+        if (draw_mesh) {
+            rasterizer.drawMesh(*draw_mesh, variants);
+        }
+        rasterizer.profiler.end_scope();
         // glDrawArrays(GL_TRIANGLES, 0, mesh.triangles.size() * 3);
         // glm::vec3 rotationAxis(1, 0, 0);
         // appState.view_matrix = glm::rotate(appState.view_matrix,
@@ -331,10 +1554,19 @@ int main(int argc, char** argv) {
         // perspective_projection * appState.view_matrix * model_matrix;
         // glUniformMatrix4fv(location, 1, GL_FALSE, &mvp[0][0]);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        {
+            Profiler::Scope scope(rasterizer.profiler, "swap");
+            glfwSwapBuffers(window);
+        }
+        if (streamer) {
+            streamer->frame_presented();
+        }
+        rasterizer.endFrame();
+        rasterizer.profiler.end_frame();
     }
 
-    glfwTerminate();
+    if (options.memory_report) {
+        write_memory_report(options.memory_report);
+    }
     return 0;
 }
\ No newline at end of file
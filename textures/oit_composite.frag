@@ -0,0 +1,22 @@
+#version 410 core
+
+// Resolves the weighted blended transparency targets (weighted_oit.hpp).
+// Blended with GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA: the opaque color is
+// kept in proportion to how much of it is still revealed.
+layout(location=0) out vec4 color;
+
+uniform sampler2D accum_texture;
+uniform sampler2D revealage_texture;
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float revealage = texelFetch(revealage_texture, pixel, 0).r;
+    if (revealage == 1.0) {
+        discard;  // nothing transparent here
+    }
+    vec4 accum = texelFetch(accum_texture, pixel, 0);
+    // Weighted average color; clamped so huge weights don't overflow
+    vec3 average = accum.rgb / clamp(accum.a, 1e-4, 5e4);
+    color = vec4(average, revealage);
+}
@@ -1,6 +1,16 @@
 #version 410 core
 
+// Permutation defines (injected after #version, see shader_variants.hpp):
+// HAS_DIFFUSE_TEX, HAS_AMBIENT_TEX, HAS_SPECULAR_TEX, HAS_BUMP_TEX,
+// HAS_SPECULAR, CLUSTERED, MULTIVIEW, OIT
+
+#ifdef OIT
+// Weighted blended transparency targets (weighted_oit.hpp)
+layout(location=0) out vec4 accum;
+layout(location=1) out float revealage;
+#else
 layout(location=0) out vec4 color;
+#endif
 
 in vec4 view_pos;
 in vec3 view_normal;
@@ -18,60 +28,172 @@ struct Material {
     float ior;
     float transparency;
     vec3 transmission_color;
-    bool has_diffuse_tex;
-    bool has_ambient_tex;
-    bool has_specular_tex;
-    bool has_bump_tex;
 };
 
-uniform Material material = Material(vec3(.6,.6,.6),vec3(.6,.6,.6),vec3(.7,.7,.7), 20, 0,0,vec3(0,0,0),false,false,false,false);
+uniform Material material = Material(vec3(.6,.6,.6),vec3(.6,.6,.6),vec3(.7,.7,.7), 20, 0,0,vec3(0,0,0));
 
 // Textures
+#ifdef HAS_DIFFUSE_TEX
 uniform sampler2D diffuse_tex;
+#endif
+#ifdef HAS_AMBIENT_TEX
 uniform sampler2D ambient_tex;
+#endif
+#ifdef HAS_SPECULAR_TEX
 uniform sampler2D specular_tex;
+#endif
+#ifdef HAS_BUMP_TEX
+// Bump maps are converted to two channel normal maps on upload (xy, z rebuilt)
 uniform sampler2D bump_tex;
+#endif
 in vec2 txc;
 
 // Lights
 const float I = .4;
-uniform vec4 view_light_pos;
-uniform vec4 view_camera_pos;
+#ifdef MULTIVIEW
+// Per view, for the view this fragment's triangle was routed to
+const int MAX_VIEWS = 16;  // Rasterizer::MAX_VIEWS
+uniform vec4 multiview_light_pos[MAX_VIEWS];
+uniform vec4 multiview_camera_pos[MAX_VIEWS];
+flat in int view_index;
+#define view_light_pos multiview_light_pos[view_index]
+#define view_camera_pos multiview_camera_pos[view_index]
+#else
+// Rasterizer::setFrameUniforms, std140 layout of FrameUniforms
+layout(std140) uniform FrameBlock {
+    mat4 mvp;
+    mat4 mv;
+    mat4 normal_matrix;  // upper 3x3
+    vec4 view_light_pos;
+    vec4 view_camera_pos;
+};
+#endif
+
+#ifdef CLUSTERED
+// Point lights in view space, 2 texels each: position + radius, color
+uniform samplerBuffer light_data;
+// Per cluster: offset and count into light_indices
+uniform usamplerBuffer cluster_ranges;
+uniform usamplerBuffer light_indices;
+uniform vec4 cluster_grid;   // tiles x, tiles y, slices, light count
+uniform vec4 cluster_depth;  // near, slices / log(far / near), tile w, h
+#endif
 
 vec3 diffuse(vec4 dir_to_light, vec3 N) {
+#ifdef HAS_DIFFUSE_TEX
+    vec3 diffuse_color = vec3(texture(diffuse_tex, txc));
+#else
     vec3 diffuse_color = material.diffuse;
-    if (material.has_diffuse_tex) {
-        diffuse_color = vec3(texture(diffuse_tex, txc));
-    }
+#endif
     return diffuse_color * I * dot(N, vec3(dir_to_light));
     //return material.diffuse * I * dot(N, vec3(dir_to_light));
 }
 
 vec3 ambient() {
+#ifdef HAS_AMBIENT_TEX
+    vec3 ambient_color = vec3(texture(ambient_tex, txc));
+#else
     vec3 ambient_color = material.ambient;
-    if (material.has_ambient_tex) {
-        ambient_color = vec3(texture(ambient_tex, txc));
-    }
+#endif
     return ambient_color * I;
     // return material.ambient * I;
 }
 
+#ifdef HAS_SPECULAR
 vec3 specular(vec4 dir_to_light, vec3 N) {
     // vec3 reflection = 2 * dot(vec3(dir_to_light), view_normal) * view_normal - vec3(dir_to_light);
     vec4 dir_to_camera = normalize(view_camera_pos - view_pos);
     vec4 H = normalize(dir_to_camera + dir_to_light);
     float cos_phi = max(dot(N,vec3(H)), 0);//max(dot(vec3(dir_to_camera), reflection), 0);
 
+#ifdef HAS_SPECULAR_TEX
+    vec3 specular_color = vec3(texture(specular_tex, txc));
+#else
     vec3 specular_color = material.specular;
-    if (material.has_specular_tex) {
-        specular_color = vec3(texture(specular_tex, txc));
-    }
-    
+#endif
+
     return specular_color * pow(cos_phi, material.shininess);
 }
+#endif
+
+#ifdef HAS_BUMP_TEX
+// Meshes have no tangents, so the tangent frame comes from screen space
+// derivatives of position and texcoords (a cotangent frame)
+vec3 bumped_normal(vec3 N) {
+    vec3 dp1 = dFdx(view_pos.xyz);
+    vec3 dp2 = dFdy(view_pos.xyz);
+    vec2 duv1 = dFdx(txc);
+    vec2 duv2 = dFdy(txc);
+    vec3 dp2perp = cross(dp2, N);
+    vec3 dp1perp = cross(N, dp1);
+    vec3 T = dp2perp * duv1.x + dp1perp * duv2.x;
+    vec3 B = dp2perp * duv1.y + dp1perp * duv2.y;
+    float scale = inversesqrt(max(max(dot(T, T), dot(B, B)), 1e-20));
+
+    vec2 xy = texture(bump_tex, txc).rg * 2 - 1;
+    vec3 n = vec3(xy, sqrt(max(1 - dot(xy, xy), 0)));
+    return normalize(mat3(T * scale, B * scale, N) * n);
+}
+#endif
+
+#ifdef CLUSTERED
+int cluster_index() {
+    ivec2 tile = ivec2(gl_FragCoord.xy / cluster_depth.zw);
+    tile = clamp(tile, ivec2(0), ivec2(cluster_grid.xy) - 1);
+    // Slices are exponential in view depth
+    int slice = int(log(-view_pos.z / cluster_depth.x) * cluster_depth.y);
+    slice = clamp(slice, 0, int(cluster_grid.z) - 1);
+    return (slice * int(cluster_grid.y) + tile.y) * int(cluster_grid.x) + tile.x;
+}
+
+// Same terms as the single light, scaled by the light color and a smooth
+// falloff that reaches 0 at the light's radius
+vec3 point_light(int light, vec3 N) {
+    vec4 position_radius = texelFetch(light_data, light * 2);
+    vec3 light_color = texelFetch(light_data, light * 2 + 1).rgb;
+
+    vec3 to_light = position_radius.xyz - view_pos.xyz;
+    float dist = length(to_light);
+    float falloff = clamp(1 - (dist * dist) / (position_radius.w * position_radius.w), 0, 1);
+    falloff *= falloff;
+
+    vec4 dir_to_light = vec4(to_light / dist, 0);
+    vec3 result = max(diffuse(dir_to_light, N), vec3(0));
+#ifdef HAS_SPECULAR
+    result += specular(dir_to_light, N);
+#endif
+    return light_color * falloff * result;
+}
+#endif
 
 void main() {
     vec3 N = normalize(view_normal); // Note: when interpolated, no longer normalized
+#ifdef HAS_BUMP_TEX
+    N = bumped_normal(N);
+#endif
+#ifdef CLUSTERED
+    vec3 result = ambient();
+    uvec2 range = texelFetch(cluster_ranges, cluster_index()).xy;
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(light_indices, int(range.x + i)).r);
+        result += point_light(light, N);
+    }
+#else
     vec4 dir_to_light = normalize(view_light_pos - view_pos);
-    color = vec4(specular(dir_to_light, N) + ambient() + diffuse(dir_to_light, N),1);
-}
\ No newline at end of file
+    vec3 result = ambient() + diffuse(dir_to_light, N);
+#ifdef HAS_SPECULAR
+    result += specular(dir_to_light, N);
+#endif
+#endif
+#ifdef OIT
+    // Weight favors nearer and more opaque surfaces (McGuire and Bavoil,
+    // eq. 10), clamped to stay in half float range
+    float alpha = 1 - material.transparency;
+    float weight = clamp(pow(min(1.0, alpha * 10.0) + 0.01, 3.0) * 1e8 *
+                         pow(1.0 - gl_FragCoord.z * 0.9, 3.0), 1e-2, 3e3);
+    accum = vec4(result * alpha, alpha) * weight;
+    revealage = alpha;
+#else
+    color = vec4(result,1);
+#endif
+}
@@ -1,21 +1,63 @@
 #version 410 core
 
+// Permutation defines (injected after #version, see shader_variants.hpp):
+// MULTIVIEW, VS_VIEWPORT_INDEX
+
+#if defined(MULTIVIEW) && defined(VS_VIEWPORT_INDEX)
+#extension GL_ARB_shader_viewport_layer_array : require
+#endif
+
 layout(location=0) in vec3 pos;
 layout(location=1) in vec3 norm;
 layout(location=2) in vec2 texcoord;
 
-uniform mat4 mvp;
-uniform mat4 mv;
-uniform mat3 normal_matrix;
+#ifdef MULTIVIEW
+// One instance per view, transformed by that view's matrices
+const int MAX_VIEWS = 16;  // Rasterizer::MAX_VIEWS
+uniform mat4 multiview_mvp[MAX_VIEWS];
+uniform mat4 multiview_mv[MAX_VIEWS];
+uniform mat4 multiview_normal_matrix[MAX_VIEWS];
+#ifndef VS_VIEWPORT_INDEX
+// Outputs go through multiview.geom, which passes them on under the
+// fragment shader's names
+#define view_pos vs_view_pos
+#define view_normal vs_view_normal
+#define txc vs_txc
+#define view_index vs_view_index
+#endif
+flat out int view_index;
+#else
+// Rasterizer::setFrameUniforms, std140 layout of FrameUniforms
+layout(std140) uniform FrameBlock {
+    mat4 mvp;
+    mat4 mv;
+    mat4 normal_matrix;  // upper 3x3
+    vec4 view_light_pos;
+    vec4 view_camera_pos;
+};
+#endif
 
 out vec4 view_pos;
 out vec3 view_normal;
 out vec2 txc;
 
+// Must match depth.vert for the depth pre-pass
+invariant gl_Position;
+
 void main()
 {
+#ifdef MULTIVIEW
+    view_index = gl_InstanceID;
+    mat4 mvp = multiview_mvp[gl_InstanceID];
+    mat4 mv = multiview_mv[gl_InstanceID];
+    mat4 normal_matrix = multiview_normal_matrix[gl_InstanceID];
+#ifdef VS_VIEWPORT_INDEX
+    gl_ViewportIndex = gl_InstanceID;
+    gl_Layer = gl_InstanceID;
+#endif
+#endif
     gl_Position = mvp * vec4(pos,1);
     view_pos = mv * vec4(pos,1);
-    view_normal = normalize(normal_matrix * norm);
+    view_normal = normalize(mat3(normal_matrix) * norm);
     txc = texcoord;//normalize(texcoord); // TODO: does this need to be transformed?
-}
\ No newline at end of file
+}
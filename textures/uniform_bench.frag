@@ -0,0 +1,9 @@
+#version 410 core
+
+layout(location=0) out vec4 color;
+
+in vec3 shade;
+
+void main() {
+    color = vec4(shade, 1);
+}
@@ -0,0 +1,35 @@
+#version 410 core
+
+// --uniform-bench: every per-draw value is used so none is optimized out.
+// UNIFORM_BLOCK reads them from a ring block instead of plain uniforms.
+
+layout(location=0) in vec3 pos;
+layout(location=1) in vec3 norm;
+
+#ifdef UNIFORM_BLOCK
+layout(std140) uniform ObjectBlock {
+    mat4 mvp;
+    mat4 mv;
+    mat4 normal_matrix;
+    vec4 view_light_pos;
+    vec4 view_camera_pos;
+};
+#else
+uniform mat4 mvp;
+uniform mat4 mv;
+uniform mat3 normal_matrix;
+uniform vec4 view_light_pos;
+uniform vec4 view_camera_pos;
+#endif
+
+out vec3 shade;
+
+void main()
+{
+    gl_Position = mvp * vec4(pos,1);
+    vec4 view_pos = mv * vec4(pos,1);
+    vec3 N = normalize(mat3(normal_matrix) * norm);
+    float diffuse = max(dot(N, normalize(vec3(view_light_pos - view_pos))), 0);
+    float facing = max(dot(N, normalize(vec3(view_camera_pos - view_pos))), 0);
+    shade = vec3(diffuse, facing, 1);
+}
@@ -0,0 +1,180 @@
+#include "trace.hpp"
+
+#ifdef RASTERIZER_TRACING
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "memory_tracker.hpp"
+
+std::atomic<bool> tracing_enabled = false;
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Written only by the owning thread; count is published with release so
+// write_trace can read up to it while the thread keeps appending
+struct Chunk {
+    static const size_t SIZE = 4096;
+    Event events[SIZE];
+    std::atomic<size_t> count = 0;
+    std::atomic<Chunk*> next = nullptr;
+};
+
+struct ThreadBuffer {
+    int tid;
+    std::atomic<const char*> name = nullptr;
+    std::unique_ptr<Chunk> first;  // the rest are owned through next
+    Chunk* last;
+
+    ~ThreadBuffer() {
+        Chunk* chunk = first->next.load();
+        while (chunk) {
+            Chunk* next = chunk->next.load();
+            delete chunk;
+            chunk = next;
+        }
+    }
+};
+
+// Buffers outlive their threads (job workers may exit before the write)
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+ThreadBuffer& thread_buffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer) {
+        MemoryScope memory_scope(MemoryTag::Other);
+        auto created = std::make_unique<ThreadBuffer>();
+        created->first = std::make_unique<Chunk>();
+        created->last = created->first.get();
+        std::lock_guard lock(buffers_mutex);
+        created->tid = int(buffers.size()) + 1;
+        buffer = created.get();
+        buffers.push_back(std::move(created));
+    }
+    return *buffer;
+}
+
+std::string json_string(const char* value) {
+    std::string escaped = "\"";
+    for (const char* c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') escaped += '\\';
+        escaped += *c;
+    }
+    return escaped + "\"";
+}
+
+}  // namespace
+
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void trace_event(const char* name, uint64_t start, uint64_t end) {
+    ThreadBuffer& buffer = thread_buffer();
+    Chunk* chunk = buffer.last;
+    size_t count = chunk->count.load(std::memory_order_relaxed);
+    if (count == Chunk::SIZE) {
+        MemoryScope memory_scope(MemoryTag::Other);
+        Chunk* next = new Chunk();
+        chunk->next.store(next, std::memory_order_release);
+        buffer.last = chunk = next;
+        count = 0;
+    }
+    chunk->events[count] = {name, start, end};
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+void set_trace_thread_name(const char* name) {
+    if (!tracing_enabled.load(std::memory_order_relaxed)) {
+        return;  // no buffer for threads that never record
+    }
+    thread_buffer().name.store(name, std::memory_order_release);
+}
+
+void start_tracing() { tracing_enabled = true; }
+
+bool write_trace(const char* path) {
+    tracing_enabled = false;
+
+    // Complete ("X") events in microseconds, from the earliest one
+    struct Row {
+        int tid;
+        Event event;
+    };
+    std::vector<Row> rows;
+    std::vector<std::pair<int, const char*>> names;
+    {
+        std::lock_guard lock(buffers_mutex);
+        for (auto& buffer : buffers) {
+            if (const char* name = buffer->name.load(std::memory_order_acquire)) {
+                names.emplace_back(buffer->tid, name);
+            }
+            for (Chunk* chunk = buffer->first.get(); chunk;
+                 chunk = chunk->next.load(std::memory_order_acquire)) {
+                size_t count = chunk->count.load(std::memory_order_acquire);
+                for (size_t i = 0; i < count; i++) {
+                    rows.push_back({buffer->tid, chunk->events[i]});
+                }
+            }
+        }
+    }
+    uint64_t origin = UINT64_MAX;
+    for (auto& row : rows) {
+        origin = std::min(origin, row.event.start);
+    }
+
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "ERROR: could not write trace %s\n", path);
+        return false;
+    }
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (auto [tid, name] : names) {
+        file << (first ? "" : ",\n")
+             << std::format("{{\"name\": \"thread_name\", \"ph\": \"M\", "
+                            "\"pid\": 1, \"tid\": {}, \"args\": {{\"name\": "
+                            "{}}}}}",
+                            tid, json_string(name));
+        first = false;
+    }
+    for (auto& [tid, event] : rows) {
+        file << (first ? "" : ",\n")
+             << std::format("{{\"name\": {}, \"ph\": \"X\", \"pid\": 1, "
+                            "\"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+                            json_string(event.name), tid,
+                            (event.start - origin) / 1e3,
+                            (event.end - event.start) / 1e3);
+        first = false;
+    }
+    file << "\n]}\n";
+    fprintf(stdout, "Wrote %zu trace events to %s\n", rows.size(), path);
+    return bool(file);
+}
+
+#else
+
+void start_tracing() {}
+
+bool write_trace(const char* path) {
+    fprintf(stderr, "ERROR: can't write %s, tracing is compiled out "
+            "(RASTERIZER_TRACING)\n", path);
+    return false;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+
+// Scoped CPU tracing, exported as Chrome trace JSON (chrome://tracing or
+// ui.perfetto.dev), for seeing load stages across threads and per-frame
+// work on one timeline.
+//
+//     TRACE_SCOPE("parse_obj_file");  // until the end of the block
+//     TRACE_THREAD("loader");         // names this thread in the viewer
+//
+// Names must outlive the trace (string literals). Each thread appends to
+// its own buffer of fixed-size chunks, so recording takes no locks: only
+// a thread's first event registers its buffer. Nothing is recorded until
+// start_tracing(); after that a scope costs two clock reads.
+//
+// Built without RASTERIZER_TRACING the macros expand to nothing and the
+// functions do nothing.
+
+#ifdef RASTERIZER_TRACING
+
+#include <atomic>
+
+extern std::atomic<bool> tracing_enabled;
+
+// Nanoseconds on a monotonic clock
+uint64_t trace_now();
+void trace_event(const char* name, uint64_t start, uint64_t end);
+void set_trace_thread_name(const char* name);
+
+class TraceScope {
+   public:
+    explicit TraceScope(const char* name)
+        : name(name),
+          start(tracing_enabled.load(std::memory_order_relaxed) ? trace_now()
+                                                                 : 0) {}
+    ~TraceScope() {
+        if (start) trace_event(name, start, trace_now());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+   private:
+    const char* name;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD(name) set_trace_thread_name(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+
+#endif
+
+// Recording is meant to run once per process: start, then write at exit
+void start_tracing();
+// Stops recording and writes everything recorded; false if the file can't
+// be written (or tracing is compiled out)
+bool write_trace(const char* path);
@@ -0,0 +1,147 @@
+#include "uniform_ring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "memory_tracker.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+UniformRing::UniformRing(size_t frame_bytes, int frames_in_flight) {
+    GLint offset_alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+    alignment = std::max<size_t>(offset_alignment, 16);
+    capacity_ = (frame_bytes * std::max(frames_in_flight, 1) + alignment - 1) /
+                alignment * alignment;
+
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+        GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, capacity_, nullptr, flags);
+        mapped = (uint8_t*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, capacity_,
+                                            flags);
+    }
+    if (!mapped) {
+        glBufferData(GL_UNIFORM_BUFFER, capacity_, nullptr, GL_STREAM_DRAW);
+        shadow.resize(capacity_);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    track_gpu_bytes(MemoryTag::Upload, capacity_);
+}
+
+UniformRing::~UniformRing() {
+    for (auto& fence : fences) {
+        glDeleteSync(fence.sync);
+    }
+    if (mapped) {
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &buffer);
+    track_gpu_bytes(MemoryTag::Upload, -int64_t(capacity_));
+}
+
+void UniformRing::wait_until_released(uint64_t position) {
+    if (released >= position) {
+        return;
+    }
+    // Needed data is still in the current frame: fence it now
+    if (fences.empty() || fences.back().position < position) {
+        flush();
+        end_frame();
+    }
+
+    auto start = Clock::now();
+    while (released < position) {
+        Fence fence = fences.front();
+        fences.pop_front();
+        // Flush the first time so the fence is sure to be submitted
+        GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        while (glClientWaitSync(fence.sync, flags, 1000000000) ==
+               GL_TIMEOUT_EXPIRED) {
+            flags = 0;
+        }
+        glDeleteSync(fence.sync);
+        released = fence.position;
+    }
+    wait_ms +=
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    waits++;
+}
+
+UniformRing::Block UniformRing::allocate(size_t size) {
+    size_t padded = (size + alignment - 1) / alignment * alignment;
+    if (padded > capacity_) {
+        throw std::runtime_error("Uniform block larger than the ring\n");
+    }
+
+    // Blocks don't wrap: skip the tail if this one wouldn't fit. Without a
+    // persistent mapping, whatever is unflushed is uploaded first so each
+    // upload stays one contiguous range.
+    size_t offset = head % capacity_;
+    bool wraps = offset + padded > capacity_;
+    if (!mapped && (wraps || offset == 0)) {
+        flush();
+    }
+    if (wraps) {
+        head += capacity_ - offset;
+        offset = 0;
+        flushed = std::max(flushed, head);
+    }
+
+    // Retire fences the GPU has already passed without waiting, then wait
+    // if the space still holds data in flight
+    while (!fences.empty() &&
+           glClientWaitSync(fences.front().sync, 0, 0) != GL_TIMEOUT_EXPIRED) {
+        released = fences.front().position;
+        glDeleteSync(fences.front().sync);
+        fences.pop_front();
+    }
+    // This space last held positions [head, head + padded) - capacity
+    if (head + padded > capacity_) {
+        wait_until_released(head + padded - capacity_);
+    }
+
+    Block block;
+    block.offset = offset;
+    block.size = padded;
+    block.data = (mapped ? mapped : shadow.data()) + offset;
+    head += padded;
+    return block;
+}
+
+void UniformRing::flush() {
+    if (mapped || flushed == head) {
+        return;
+    }
+    // Everything since the last flush is contiguous: allocate flushes
+    // before it wraps
+    size_t offset = flushed % capacity_;
+    size_t size = head - flushed;
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    void* data = glMapBufferRange(
+        GL_UNIFORM_BUFFER, offset, size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+            GL_MAP_UNSYNCHRONIZED_BIT);
+    if (data) {
+        memcpy(data, shadow.data() + offset, size);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+    } else {
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, size, shadow.data() + offset);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    flushed = head;
+}
+
+void UniformRing::end_frame() {
+    if (!fences.empty() && fences.back().position == head) {
+        return;  // nothing new to cover
+    }
+    fences.push_back({glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), head});
+}
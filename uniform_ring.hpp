@@ -0,0 +1,85 @@
+#pragma once
+#include <GL/glew.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Streaming uniform buffer: blocks are written linearly into one buffer
+// sized for a few frames in flight and bound with glBindBufferRange, instead
+// of a glUniform* call per value per program.
+//
+// With GL 4.4 / GL_ARB_buffer_storage the buffer is mapped once, persistent
+// and coherent, and blocks are written straight into it. On plain GL 4.1
+// they're written to a CPU copy and flush() uploads everything written since
+// the last flush with one unsynchronized glMapBufferRange.
+//
+// A fence is placed at the end of every frame. Before reusing space the ring
+// waits for the fence covering the data being overwritten, so the CPU never
+// writes over blocks the GPU may still read; if one frame fills the whole
+// ring it fences and waits on itself.
+class UniformRing {
+   public:
+    struct Block {
+        void* data;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    // frame_bytes per frame in flight
+    explicit UniformRing(size_t frame_bytes, int frames_in_flight = 3);
+    ~UniformRing();
+
+    UniformRing(const UniformRing&) = delete;
+    UniformRing& operator=(const UniformRing&) = delete;
+
+    // size is padded to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    Block allocate(size_t size);
+
+    template <typename T>
+    Block push(const T& value) {
+        Block block = allocate(sizeof(T));
+        *(T*)block.data = value;
+        return block;
+    }
+
+    // Makes blocks allocated so far visible to GL; call before drawing with
+    // them. Free when persistently mapped.
+    void flush();
+
+    void bind(GLuint binding, const Block& block) const {
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, block.offset,
+                          block.size);
+    }
+
+    // Fences everything allocated since the previous call
+    void end_frame();
+
+    bool persistent() const { return mapped != nullptr; }
+    size_t capacity() const { return capacity_; }
+
+    // Time the CPU spent waiting for the GPU to release space
+    double wait_ms = 0;
+    uint64_t waits = 0;
+
+   private:
+    struct Fence {
+        GLsync sync;
+        uint64_t position;  // data written before this was read before it
+    };
+
+    GLuint buffer = 0;
+    size_t capacity_;
+    size_t alignment;
+    uint8_t* mapped = nullptr;     // persistent mapping, or null
+    std::vector<uint8_t> shadow;   // CPU copy without one
+
+    // Positions count bytes ever written; offset = position % capacity
+    uint64_t head = 0;
+    uint64_t released = 0;  // everything before this is safe to overwrite
+    uint64_t flushed = 0;   // fallback: uploaded up to here
+    std::deque<Fence> fences;
+
+    void wait_until_released(uint64_t position);
+};
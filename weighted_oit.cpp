@@ -0,0 +1,171 @@
+#include "weighted_oit.hpp"
+
+#include <stdexcept>
+
+#include "memory_tracker.hpp"
+
+// Accum RGBA16F, revealage R8, depth (4 bytes in practice)
+static int64_t gpu_bytes(int width, int height) {
+    return int64_t(width) * height * (8 + 1 + 4);
+}
+
+// glBlitFramebuffer needs matching depth formats; there's no way to ask
+// for the default framebuffer's internal format, so pick it from the sizes
+static GLenum bound_depth_format() {
+    GLint bound = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &bound);
+    GLenum attachment = bound ? GL_DEPTH_ATTACHMENT : GL_DEPTH;
+    GLint type = GL_NONE;
+    glGetFramebufferAttachmentParameteriv(
+        GL_DRAW_FRAMEBUFFER, attachment,
+        GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &type);
+    if (type == GL_NONE) {
+        return GL_DEPTH_COMPONENT24;  // nothing to copy
+    }
+
+    GLint depth_bits = 0, stencil_bits = 0, component_type = GL_NONE;
+    glGetFramebufferAttachmentParameteriv(
+        GL_DRAW_FRAMEBUFFER, attachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE,
+        &depth_bits);
+    glGetFramebufferAttachmentParameteriv(
+        GL_DRAW_FRAMEBUFFER, bound ? GL_STENCIL_ATTACHMENT : GL_STENCIL,
+        GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencil_bits);
+    glGetFramebufferAttachmentParameteriv(
+        GL_DRAW_FRAMEBUFFER, attachment,
+        GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &component_type);
+
+    bool float_depth = component_type == GL_FLOAT;
+    if (stencil_bits) {
+        return float_depth ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+    }
+    if (float_depth) return GL_DEPTH_COMPONENT32F;
+    if (depth_bits <= 16) return GL_DEPTH_COMPONENT16;
+    if (depth_bits <= 24) return GL_DEPTH_COMPONENT24;
+    return GL_DEPTH_COMPONENT32;
+}
+
+WeightedOit::WeightedOit(GLuint composite_program)
+    : composite_program(composite_program) {
+    glGenFramebuffers(1, &fbo);
+    glGenVertexArrays(1, &empty_vao);
+    glUseProgram(composite_program);
+    glUniform1i(glGetUniformLocation(composite_program, "accum_texture"), 0);
+    glUniform1i(glGetUniformLocation(composite_program, "revealage_texture"),
+                1);
+    glUseProgram(0);
+}
+
+WeightedOit::~WeightedOit() {
+    release();
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteVertexArrays(1, &empty_vao);
+}
+
+void WeightedOit::release() {
+    if (!accum_texture) {
+        return;
+    }
+    glDeleteTextures(1, &accum_texture);
+    glDeleteTextures(1, &revealage_texture);
+    glDeleteRenderbuffers(1, &depth_rb);
+    accum_texture = revealage_texture = depth_rb = 0;
+    track_gpu_bytes(MemoryTag::Other, -gpu_bytes(width, height));
+}
+
+static GLuint make_target(GLenum internal_format, GLenum format, int width,
+                          int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format,
+                 GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+void WeightedOit::resize(int new_width, int new_height,
+                         GLenum new_depth_format) {
+    release();
+    width = new_width;
+    height = new_height;
+    depth_format = new_depth_format;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    accum_texture = make_target(GL_RGBA16F, GL_RGBA, width, height);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           accum_texture, 0);
+    // Revealage is a product of values in [0, 1]: 8 bits is plenty
+    revealage_texture = make_target(GL_R8, GL_RED, width, height);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                           revealage_texture, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &depth_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, depth_format, width, height);
+    bool stencil = depth_format == GL_DEPTH24_STENCIL8 ||
+                   depth_format == GL_DEPTH32F_STENCIL8;
+    glFramebufferRenderbuffer(
+        GL_FRAMEBUFFER,
+        stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+        GL_RENDERBUFFER, depth_rb);
+
+    GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, buffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("OIT framebuffer is incomplete\n");
+    }
+    track_gpu_bytes(MemoryTag::Other, gpu_bytes(width, height));
+}
+
+void WeightedOit::begin() {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+    int target_width = viewport[0] + viewport[2];
+    int target_height = viewport[1] + viewport[3];
+    GLenum format = bound_depth_format();
+    if (target_width != width || target_height != height ||
+        format != depth_format) {
+        resize(target_width, target_height, format);
+    }
+
+    // Opaque depth, so transparent surfaces behind it are rejected
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, previous_fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+    GLfloat zero[] = {0, 0, 0, 0};
+    GLfloat one[] = {1, 1, 1, 1};
+    glClearBufferfv(GL_COLOR, 0, zero);
+    glClearBufferfv(GL_COLOR, 1, one);
+
+    // accum += weighted premultiplied color; revealage *= 1 - alpha
+    glEnable(GL_BLEND);
+    glBlendFunci(0, GL_ONE, GL_ONE);
+    glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+    glDepthMask(GL_FALSE);
+}
+
+void WeightedOit::end() {
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+    glDepthMask(GL_TRUE);
+
+    // Average color over the opaque image, weighted by coverage
+    glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(composite_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, accum_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, revealage_texture);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glActiveTexture(GL_TEXTURE0);
+}
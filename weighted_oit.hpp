@@ -0,0 +1,45 @@
+#pragma once
+#include <GL/glew.h>
+
+// Weighted blended order-independent transparency (McGuire and Bavoil,
+// JCGT 2013): transparent surfaces are drawn once, in any order, into an
+// accumulation target (premultiplied color and alpha, scaled by a depth
+// weight, summed) and a revealage target (product of 1 - alpha). A
+// fullscreen composite then blends the weighted average color over the
+// opaque image by how much of the background is still revealed. No
+// per-frame sorting, at the cost of approximate ordering where transparent
+// surfaces overlap with very different colors.
+//
+// The OIT variant of shader.frag writes both targets. The opaque depth is
+// copied in so transparent fragments behind opaque ones are rejected;
+// transparent surfaces don't write depth.
+class WeightedOit {
+   public:
+    // composite_program: oit_composite.vert/frag
+    explicit WeightedOit(GLuint composite_program);
+    ~WeightedOit();
+
+    WeightedOit(const WeightedOit&) = delete;
+    WeightedOit& operator=(const WeightedOit&) = delete;
+
+    // Redirects drawing to the OIT targets, sized to the current viewport,
+    // with the depth of the bound framebuffer and the blend state set
+    void begin();
+    // Back to the previous framebuffer, composited over it
+    void end();
+
+   private:
+    GLuint composite_program;
+    GLuint fbo = 0;
+    GLuint accum_texture = 0;      // RGBA16F
+    GLuint revealage_texture = 0;  // R8
+    GLuint depth_rb = 0;
+    GLuint empty_vao = 0;  // the composite triangle comes from gl_VertexID
+    GLenum depth_format = 0;
+    int width = 0;
+    int height = 0;
+    GLint previous_fbo = 0;
+
+    void resize(int new_width, int new_height, GLenum new_depth_format);
+    void release();
+};